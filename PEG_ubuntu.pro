@@ -8,6 +8,9 @@ QMAKE_LFLAGS += -fopenmp
 #INCLUDEPATH += /Users/mboots/dev/gsl-install/include
 
 LIBS += -lgsl -lgslcblas
+# To use an optimized BLAS (OpenBLAS, MKL, BLIS...) for the matrix operations, link it instead of -lgslcblas.  Also define PEG_USE_LAPACK to use its LAPACK routines (zgetrf/zgetrs) for the LU solves; add -llapack if your BLAS doesn't include them:
+#LIBS += -lgsl -lopenblas
+#DEFINES += PEG_USE_LAPACK
 GSL_LIB_DIR = /usr/local/lib
 
 QMAKE_LFLAGS_DEBUG += "-Wl,-rpath,$$GSL_LIB_DIR"
@@ -15,9 +18,19 @@ QMAKE_LFLAGS_RELEASE += "-Wl,-rpath,$$GSL_LIB_DIR"
 
 HEADERS += src/PEG.h \
 	src/PESolver.h \
-	src/PEMainSupport.h
+	src/PESolverProfile.h \
+	src/PEResultCache.h \
+	src/PELinearAlgebra.h \
+	src/PEKernels.h \
+	src/PEMainSupport.h \
+	src/PEServer.h
 
 SOURCES += src/PEG.cpp\
 	src/PESolver.cpp \
+	src/PESolverProfile.cpp \
+	src/PEResultCache.cpp \
+	src/PELinearAlgebra.cpp \
+	src/PEKernels.cpp \
 	src/PEMainSupport.cpp \
+	src/PEServer.cpp \
 	src/mainSerial.cpp
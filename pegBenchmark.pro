@@ -0,0 +1,31 @@
+QT     -= gui core
+
+CONFIG -= app_bundle
+TARGET = pegBenchmark
+
+QMAKE_CXXFLAGS += -c -O2 -g -Wall -fopenmp
+QMAKE_LFLAGS += -fopenmp
+
+INCLUDEPATH += /Users/mboots/dev/gsl-install/include
+
+LIBS += -L/Users/mboots/dev/gsl-install/lib -lgsl -lgslcblas
+# To use an optimized BLAS (OpenBLAS, MKL, BLIS...) for the matrix operations, link it instead of -lgslcblas.  Also define PEG_USE_LAPACK to use its LAPACK routines (zgetrf/zgetrs) for the LU solves; add -llapack if your BLAS doesn't include them:
+#LIBS += -lgsl -lopenblas
+#DEFINES += PEG_USE_LAPACK
+
+HEADERS += src/PEG.h \
+	src/PESolver.h \
+	src/PESolverProfile.h \
+	src/PEResultCache.h \
+	src/PELinearAlgebra.h \
+	src/PEKernels.h \
+	src/PEMainSupport.h
+
+SOURCES += src/PEG.cpp\
+	src/PESolver.cpp \
+	src/PESolverProfile.cpp \
+	src/PEResultCache.cpp \
+	src/PELinearAlgebra.cpp \
+	src/PEKernels.cpp \
+	src/PEMainSupport.cpp \
+	src/mainBenchmark.cpp
@@ -1,10 +1,66 @@
 from __future__ import absolute_import
 
+import itertools
 import subprocess
+import threading
 from celery import Celery
 
 celery = Celery()
 
+# Each worker process keeps one "pegSerial --serve" running, and sends it the calculations as requests (see PEServer in src/PEServer.h for the protocol), instead of starting a new pegSerial for every task.
+# Its material data and solver contexts stay loaded between tasks, and with a threaded worker pool (-P threads), it runs several tasks at once.
+SERVER_THREADS = "auto"
+
+_lock = threading.Lock()
+_server = None
+_serverJobs = None	# ids of the jobs sent to _server that haven't been answered yet
+_jobIds = itertools.count()
+_waiting = {}	# job id -> [threading.Event, final status line]
+
+def _readReplies(server, jobs):
+	for line in iter(server.stdout.readline, b""):
+		fields = line.decode().rstrip("\n").split("\t")
+		if len(fields) >= 3 and fields[1] in ("done", "error"):
+			with _lock:
+				jobs.discard(fields[0])
+				job = _waiting.get(fields[0])
+			if job:
+				job[1] = fields
+				job[0].set()
+	# the server exited: fail the tasks still waiting on it, and make sure no more are sent to it. (Tasks sent to a replacement server since then aren't affected.)
+	global _server
+	with _lock:
+		if _server is server:
+			_server = None
+		for jobId in jobs:
+			job = _waiting.get(jobId)
+			if job:
+				job[0].set()
+		jobs.clear()
+
+# Must be called with _lock held. Returns the running server, and the set of job ids sent to it.
+def _getServer():
+	global _server, _serverJobs
+	if _server is None or _server.poll() is not None:
+		_server = subprocess.Popen(["./pegSerial", "--serve", "--threads", SERVER_THREADS], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+		_serverJobs = set()
+		reader = threading.Thread(target=_readReplies, args=(_server, _serverJobs))
+		reader.daemon = True
+		reader.start()
+	return _server, _serverJobs
+
 @celery.task
 def runCalculation(argumentString):
-	return subprocess.call(["./pegSerial"] + argumentString.split())
+	job = [threading.Event(), None]
+	with _lock:
+		jobId = "job%d" % next(_jobIds)
+		_waiting[jobId] = job
+		server, serverJobs = _getServer()
+		serverJobs.add(jobId)
+		server.stdin.write(("%s %s\n" % (jobId, " ".join(argumentString.split()))).encode())
+		server.stdin.flush()
+	job[0].wait()
+	with _lock:
+		del _waiting[jobId]
+	# same as the exit code of a separate pegSerial: 0 if the calculation ran.
+	return 0 if job[1] and job[1][1] == "done" else -1
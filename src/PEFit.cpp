@@ -0,0 +1,484 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "PEFit.h"
+#include "PESolver.h"
+
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+#include <omp.h>
+
+const double PEFit::failurePenalty = 1.0;
+
+/// Names of the geometry parameters for each grating profile, as used in the measurement file. They are in the order of the grating constructors' arguments.
+static std::vector<std::string> peFitGeometryNames(PEGrating::Profile profile) {
+	std::vector<std::string> names;
+	switch(profile) {
+	case PEGrating::BlazedProfile:
+		names.push_back("blazeAngle");
+		names.push_back("antiBlazeAngle");
+		break;
+	case PEGrating::RectangularProfile:
+		names.push_back("height");
+		names.push_back("valleyWidth");
+		break;
+	case PEGrating::SinusoidalProfile:
+		names.push_back("height");
+		break;
+	case PEGrating::TrapezoidalProfile:
+		names.push_back("height");
+		names.push_back("valleyWidth");
+		names.push_back("blazeAngle");
+		names.push_back("antiBlazeAngle");
+		break;
+	default:
+		break;
+	}
+	return names;
+}
+
+/// Parses a comma-separated list of numbers from \c text. Returns false if any of them are not numbers.
+static bool peFitParseList(const std::string& text, std::vector<double>& values) {
+	values.clear();
+	std::stringstream ss(text);
+	std::string item;
+	while(std::getline(ss, item, ',')) {
+		char* end;
+		double value = strtod(item.c_str(), &end);
+		if(end == item.c_str() || *end != 0)
+			return false;
+		values.push_back(value);
+	}
+	return !values.empty();
+}
+
+PEFit::PEFit() {
+	profile_ = PEGrating::InvalidProfile;
+	incidenceDeg_ = 0;
+	N_ = 15;
+	integrationTolerance_ = 1e-5;
+	maxEvaluations_ = 300;
+	tolerance_ = 1e-6;
+}
+
+bool PEFit::loadFromFile(const std::string& fileName) {
+	parameters_.clear();
+	orders_.clear();
+	eV_.clear();
+	measured_.clear();
+
+	std::ifstream file(fileName.c_str());
+	if(file.fail()) {
+		errorMessage_ = "Could not open the file.";
+		return false;
+	}
+
+	try {
+		// Read the settings (key=value lines) and the data lines.
+		std::map<std::string, std::string> settings;
+		std::vector<std::vector<double> > rows;
+		std::string line;
+		while(std::getline(file, line)) {
+			line = line.substr(0, line.find('#'));
+			size_t equals = line.find('=');
+			if(equals != std::string::npos) {
+				std::string key = line.substr(0, equals);
+				key.erase(std::remove(key.begin(), key.end(), ' '), key.end());
+				std::string value = line.substr(equals+1);
+				value.erase(std::remove(value.begin(), value.end(), ' '), value.end());
+				value.erase(std::remove(value.begin(), value.end(), '\t'), value.end());
+				value.erase(std::remove(value.begin(), value.end(), '\r'), value.end());
+				settings[key] = value;
+			}
+			else {
+				std::stringstream ss(line);
+				std::vector<double> row;
+				double value;
+				while(ss >> value)
+					row.push_back(value);
+				if(!row.empty())
+					rows.push_back(row);
+			}
+		}
+
+		std::vector<double> values;
+
+		// Grating type and geometry
+		std::string type = settings["gratingType"];
+		if(type == "blazed") profile_ = PEGrating::BlazedProfile;
+		else if(type == "rectangular") profile_ = PEGrating::RectangularProfile;
+		else if(type == "sinusoidal") profile_ = PEGrating::SinusoidalProfile;
+		else if(type == "trapezoidal") profile_ = PEGrating::TrapezoidalProfile;
+		else throw "The gratingType must be one of: blazed, rectangular, sinusoidal, or trapezoidal.";
+
+		std::vector<std::string> names;
+		names.push_back("gratingPeriod");
+		std::vector<std::string> geometryNames = peFitGeometryNames(profile_);
+		names.insert(names.end(), geometryNames.begin(), geometryNames.end());
+		names.push_back("coatingThickness");
+		names.push_back("rmsRoughnessNm");
+		for(int i=0, cc=names.size(); i<cc; ++i) {
+			std::string text = settings[names[i]];
+			if(text.empty() && i >= cc-2)
+				text = "0";	// no coating or roughness by default.
+			if(!peFitParseList(text, values) || (values.size() != 1 && values.size() != 3)) {
+				errorMessage_ = "The setting " + names[i] + " must be a number, or <start>,<min>,<max> to fit it.";
+				return false;
+			}
+			if(values.size() == 1)
+				parameters_.push_back(PEFitParameter(names[i], values[0], values[0], values[0]));
+			else if(values[1] <= values[0] && values[0] <= values[2])
+				parameters_.push_back(PEFitParameter(names[i], values[0], values[1], values[2]));
+			else {
+				errorMessage_ = "The range for " + names[i] + " must be <start>,<min>,<max>, with min <= start <= max.";
+				return false;
+			}
+		}
+		if(parameters_.front().min <= 0) throw "The gratingPeriod must be larger than 0.";
+		if(parameters_[parameters_.size()-2].min < 0) throw "The coatingThickness must be larger than or equal to 0.";
+		if(parameters_.back().min < 0) throw "The rmsRoughnessNm must be larger than or equal to 0.";
+
+		material_ = settings["gratingMaterial"];
+		coating_ = settings["coatingMaterial"];
+		if(material_.empty()) throw "The gratingMaterial must be provided.";
+		if(coating_.empty() && parameters_[parameters_.size()-2].max > 0) throw "The coatingMaterial must be provided for a non-zero coatingThickness.";
+
+		// Measurement and math options
+		if(!peFitParseList(settings["incidenceAngle"], values) || values.size() != 1) throw "The incidenceAngle must be provided.";
+		incidenceDeg_ = values[0];
+		if(!settings["N"].empty())
+			N_ = atol(settings["N"].c_str());
+		if(N_ < 1) throw "The truncation index N must be at least 1.";
+		if(!settings["integrationTolerance"].empty())
+			integrationTolerance_ = atof(settings["integrationTolerance"].c_str());
+		if(!settings["maxEvaluations"].empty())
+			maxEvaluations_ = atol(settings["maxEvaluations"].c_str());
+		if(maxEvaluations_ < 1) throw "The maxEvaluations must be at least 1.";
+		if(!settings["tolerance"].empty())
+			tolerance_ = atof(settings["tolerance"].c_str());
+
+		if(!peFitParseList(settings["orders"], values)) throw "The measured orders must be provided.";
+		for(int i=0, cc=values.size(); i<cc; ++i) {
+			orders_.push_back(int(values[i]));
+			if(abs(orders_.back()) > N_) throw "The measured orders must be within -N to N.";
+		}
+
+		// Data
+		measured_.resize(orders_.size());
+		for(int i=0, cc=rows.size(); i<cc; ++i) {
+			if(rows[i].size() != orders_.size() + 1) throw "Each data line must have a photon energy (eV), and one measured efficiency for each of the orders.";
+			eV_.push_back(rows[i][0]);
+			for(int k=0, kk=orders_.size(); k<kk; ++k)
+				measured_[k].push_back(rows[i][k+1]);
+		}
+		if(eV_.empty()) throw "The file has no measured data.";
+	}
+
+	catch(const char* errMsg) {
+		errorMessage_ = errMsg;
+		return false;
+	}
+
+	errorMessage_.clear();
+	return true;
+}
+
+PEGrating* PEFit::createGrating(const std::vector<double>& p) const {
+	double period = p[0];
+	double coatingThickness = p[p.size()-2];
+	const double* geo = &p[GeometryIndex];
+
+	switch(profile_) {
+	case PEGrating::BlazedProfile:
+		return new PEBlazedGrating(period, geo[0], geo[1], material_, coating_, coatingThickness);
+	case PEGrating::RectangularProfile:
+		return new PERectangularGrating(period, geo[0], geo[1], material_, coating_, coatingThickness);
+	case PEGrating::SinusoidalProfile:
+		return new PESinusoidalGrating(period, geo[0], material_, coating_, coatingThickness);
+	case PEGrating::TrapezoidalProfile:
+		return new PETrapezoidalGrating(period, geo[0], geo[1], geo[2], geo[3], material_, coating_, coatingThickness);
+	default:
+		return 0;	// never happens: loadFromFile() only accepts the profiles above.
+	}
+}
+
+double PEFit::sseForRoughness(double rmsRoughnessNm, const std::vector<std::vector<double> >& calculated, const std::vector<bool>& failed, const std::string& topMaterial, std::vector<double>& scales) const {
+	int numPoints = eV_.size();
+	std::vector<double> roughness(numPoints, 1.0);
+	if(rmsRoughnessNm > 0)
+		for(int i=0; i<numPoints; ++i)
+			roughness[i] = PEGrating::roughnessFactor(rmsRoughnessNm/1000.0, M_HC/eV_[i], topMaterial, incidenceDeg_);
+
+	double sse = 0;
+	scales.resize(orders_.size());
+	for(int k=0, kk=orders_.size(); k<kk; ++k) {
+		const std::vector<double>& meas = measured_[k];
+		// Least-squares scale: minimizes sum (meas - scale*calc)^2 over the measured points.
+		double mc = 0, cc = 0;
+		for(int i=0; i<numPoints; ++i) {
+			if(meas[i] != 0 && !failed[i]) {
+				double calc = calculated[k][i]*roughness[i];
+				mc += meas[i]*calc;
+				cc += calc*calc;
+			}
+		}
+		scales[k] = cc > 0 ? mc/cc : 0;
+
+		for(int i=0; i<numPoints; ++i) {
+			if(meas[i] != 0 && !failed[i]) {
+				double error = meas[i] - scales[k]*calculated[k][i]*roughness[i];
+				sse += error*error;
+			}
+		}
+	}
+	return sse;
+}
+
+PEFitResult PEFit::evaluate(const std::vector<double>& parameterValues, int numThreads) {
+	PEFitResult result;
+	result.parameters = parameterValues;
+	result.evaluations = 1;
+
+	// Calculate all of the energies at once.
+	PEGrating* grating = createGrating(parameterValues);
+	std::vector<PEScanPoint> points;
+	for(int i=0, cc=eV_.size(); i<cc; ++i)
+		points.push_back(PEScanPoint(incidenceDeg_, M_HC/eV_[i]));
+	std::vector<PEResult> results;
+	{
+		PESolver solver(*grating, PEMathOptions(N_, integrationTolerance_), numThreads);
+		results = solver.getEffBatch(points);
+	}
+
+	// Failed points are left out of the scale factors and squared errors, and penalized instead (see failurePenalty).
+	std::vector<std::vector<double> > calculated(orders_.size(), std::vector<double>(points.size(), 0.0));
+	std::vector<bool> failed(points.size(), false);
+	double penalty = 0;
+	for(int i=0, cc=points.size(); i<cc; ++i) {
+		if(results[i].status != PEResult::Success) {
+			failed[i] = true;
+			++result.failures;
+			for(int k=0, kk=orders_.size(); k<kk; ++k)
+				if(measured_[k][i] != 0)
+					penalty += failurePenalty;
+			continue;
+		}
+		for(int k=0, kk=orders_.size(); k<kk; ++k)
+			calculated[k][i] = results[i].eff.at(N_ + orders_[k]);
+	}
+	std::string topMaterial = grating->coatingThickness() > 0 ? coating_ : material_;
+	delete grating;
+
+	// Roughness: fixed, or the best one in its range by golden-section search. Each try only needs the calculated efficiencies.
+	const PEFitParameter& roughness = parameters_.back();
+	double sigma = parameterValues.back();
+	if(!roughness.isFixed()) {
+		const double ratio = (sqrt(5.0) - 1)/2;
+		double a = roughness.min, b = roughness.max;
+		double c = b - ratio*(b-a), d = a + ratio*(b-a);
+		double fc = sseForRoughness(c, calculated, failed, topMaterial, result.scales);
+		double fd = sseForRoughness(d, calculated, failed, topMaterial, result.scales);
+		while(b - a > 1e-4*(roughness.max - roughness.min)) {
+			if(fc < fd) {
+				b = d; d = c; fd = fc;
+				c = b - ratio*(b-a);
+				fc = sseForRoughness(c, calculated, failed, topMaterial, result.scales);
+			}
+			else {
+				a = c; c = d; fc = fd;
+				d = a + ratio*(b-a);
+				fd = sseForRoughness(d, calculated, failed, topMaterial, result.scales);
+			}
+		}
+		sigma = (a+b)/2;
+	}
+	result.parameters.back() = sigma;
+	result.sse = sseForRoughness(sigma, calculated, failed, topMaterial, result.scales) + penalty;
+	return result;
+}
+
+double PEFit::evaluateUnitPoint(const std::vector<double>& unitPoint, const std::vector<int>& freeParameters, int numThreads, std::ostream* log, int& evaluations, PEFitResult& best) {
+	std::vector<double> values;
+	for(int i=0, cc=parameters_.size(); i<cc; ++i)
+		values.push_back(parameters_[i].start);
+	for(int j=0, cc=freeParameters.size(); j<cc; ++j) {
+		const PEFitParameter& p = parameters_[freeParameters[j]];
+		values[freeParameters[j]] = p.min + unitPoint[j]*(p.max - p.min);
+	}
+
+	PEFitResult result = evaluate(values, numThreads);
+	++evaluations;
+	if(log) {
+		std::ostringstream label;
+		label << "Eval " << evaluations << ":";
+		printResult(*log, label.str(), result);
+	}
+	if(evaluations == 1 || result.sse < best.sse)
+		best = result;
+	return result.sse;
+}
+
+PEFitResult PEFit::run(int numThreads, std::ostream* log) {
+	// The parameters that need a new efficiency calculation. (The roughness is fitted inside evaluate().)
+	std::vector<int> freeParameters;
+	for(int i=0, cc=parameters_.size()-1; i<cc; ++i)
+		if(!parameters_[i].isFixed())
+			freeParameters.push_back(i);
+	int n = freeParameters.size();
+
+	if(log) {
+		*log << "Minimization of SSE over " << eV_.size() << " energy points, fitting:";
+		for(int j=0; j<n; ++j)
+			*log << " " << parameters_[freeParameters[j]].name;
+		if(!parameters_.back().isFixed())
+			*log << " " << parameters_.back().name;
+		*log << std::endl << "Columns:";
+		for(int i=0, cc=parameters_.size(); i<cc; ++i)
+			*log << "\t" << parameters_[i].name;
+		for(int k=0, kk=orders_.size(); k<kk; ++k)
+			*log << "\tscale(" << orders_[k] << ")";
+		*log << "\tSSE" << std::endl;
+	}
+
+	PEFitResult best;
+	int evaluations = 0;
+
+	// Nelder-Mead simplex, in coordinates where each parameter's range is 0..1. Points are kept inside the ranges by clamping.
+	std::vector<std::vector<double> > simplex(n+1, std::vector<double>(n));
+	std::vector<double> f(n+1);
+	for(int j=0; j<n; ++j) {
+		const PEFitParameter& p = parameters_[freeParameters[j]];
+		simplex[0][j] = (p.start - p.min)/(p.max - p.min);
+	}
+	for(int i=1; i<=n; ++i) {
+		simplex[i] = simplex[0];
+		simplex[i][i-1] += simplex[0][i-1] <= 0.75 ? 0.25 : -0.25;
+	}
+	for(int i=0; i<=n && evaluations < maxEvaluations_; ++i)
+		f[i] = evaluateUnitPoint(simplex[i], freeParameters, numThreads, log, evaluations, best);
+
+	while(n > 0 && evaluations < maxEvaluations_) {
+		// Order the vertices from best to worst.
+		for(int i=1; i<=n; ++i)
+			for(int j=i; j>0 && f[j] < f[j-1]; --j) {
+				std::swap(f[j], f[j-1]);
+				std::swap(simplex[j], simplex[j-1]);
+			}
+		if(f[n] - f[0] <= tolerance_*fabs(f[0]))
+			break;
+
+		// Centroid of all but the worst vertex, and trial points along the line from the worst vertex through it.
+		std::vector<double> centroid(n, 0.0);
+		for(int i=0; i<n; ++i)
+			for(int j=0; j<n; ++j)
+				centroid[j] += simplex[i][j]/n;
+		std::vector<double> reflected(n), trial(n);
+		for(int j=0; j<n; ++j)
+			reflected[j] = std::min(1.0, std::max(0.0, 2*centroid[j] - simplex[n][j]));
+		double fr = evaluateUnitPoint(reflected, freeParameters, numThreads, log, evaluations, best);
+
+		if(evaluations >= maxEvaluations_)
+			break;
+
+		if(fr < f[0]) {
+			// Expand
+			for(int j=0; j<n; ++j)
+				trial[j] = std::min(1.0, std::max(0.0, 3*centroid[j] - 2*simplex[n][j]));
+			double fe = evaluateUnitPoint(trial, freeParameters, numThreads, log, evaluations, best);
+			if(fe < fr) { simplex[n] = trial; f[n] = fe; }
+			else { simplex[n] = reflected; f[n] = fr; }
+		}
+		else if(fr < f[n-1]) {
+			simplex[n] = reflected;
+			f[n] = fr;
+		}
+		else {
+			// Contract: outside (towards the reflected point) if it was better than the worst vertex, otherwise inside.
+			bool outside = fr < f[n];
+			for(int j=0; j<n; ++j)
+				trial[j] = outside ? (centroid[j] + reflected[j])/2 : (centroid[j] + simplex[n][j])/2;
+			double fc = evaluateUnitPoint(trial, freeParameters, numThreads, log, evaluations, best);
+			if(fc < (outside ? fr : f[n])) {
+				simplex[n] = trial;
+				f[n] = fc;
+			}
+			else {
+				// Shrink towards the best vertex.
+				for(int i=1; i<=n && evaluations < maxEvaluations_; ++i) {
+					for(int j=0; j<n; ++j)
+						simplex[i][j] = (simplex[0][j] + simplex[i][j])/2;
+					f[i] = evaluateUnitPoint(simplex[i], freeParameters, numThreads, log, evaluations, best);
+				}
+			}
+		}
+	}
+
+	best.evaluations = evaluations;
+	return best;
+}
+
+void PEFit::printResult(std::ostream& os, const std::string& label, const PEFitResult& result) const {
+	os << label;
+	for(int i=0, cc=result.parameters.size(); i<cc; ++i)
+		os << "\t" << result.parameters[i];
+	for(int k=0, kk=result.scales.size(); k<kk; ++k)
+		os << "\t" << result.scales[k];
+	os << "\t" << result.sse;
+	if(result.failures)
+		os << "\t(" << result.failures << " points failed)";
+	os << std::endl;
+}
+
+int PEFit::runProgram(const std::string& gratingName, int argc, char** argv) {
+
+	int numThreads = 1;
+	if(argc >= 2)
+		numThreads = atoi(argv[1]);
+	if(numThreads < 1) {
+		std::cerr << "The numThreads must be at least 1." << std::endl;
+		std::cerr << "usage: " << gratingName << " [numThreads] [measurement file]" << std::endl;
+		return -1;
+	}
+	std::string fileName = argc >= 3 ? argv[2] : "fitData/" + gratingName + ".txt";
+
+	// The fit calculates its points with PESolver::getEffBatch(), which runs the trial solutions in parallel regions nested inside the one over points.
+	omp_set_max_active_levels(2);
+
+	PEFit fit;
+	if(!fit.loadFromFile(fileName)) {
+		std::cerr << "Could not load the fit from " << fileName << ": " << fit.errorMessage() << std::endl;
+		return -1;
+	}
+
+	PEFitResult best = fit.run(numThreads);
+
+	// final results:
+	std::cout << std::endl;
+	fit.printResult(std::cout, "Best:", best);
+	std::cout << "(" << best.evaluations << " grating geometries calculated)" << std::endl;
+	if(best.failures)
+		std::cout << "Warning: " << best.failures << " of the " << fit.numPoints() << " points failed to calculate for the best parameters. Their SSE includes a penalty of " << failurePenalty << " for each of their measured efficiencies." << std::endl;
+
+	return 0;
+}
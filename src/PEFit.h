@@ -0,0 +1,174 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PEFIT_H
+#define PEFIT_H
+
+#include "PEG.h"
+#include <string>
+#include <vector>
+#include <iostream>
+
+/// One parameter of a PEFit: its starting value, and the range it can be varied in.  If min == max, the parameter is fixed.
+class PEFitParameter {
+public:
+	/// Constructor
+	PEFitParameter(const std::string& Name = std::string(), double Start = 0, double Min = 0, double Max = 0) {
+		name = Name;
+		start = Start;
+		min = Min;
+		max = Max;
+	}
+
+	/// Returns true if the parameter is not varied by the fit.
+	bool isFixed() const { return min == max; }
+
+	/// Name, as used in the measurement file (ex: "blazeAngle")
+	std::string name;
+	/// Starting value
+	double start;
+	/// Range of values to search
+	double min, max;
+};
+
+/// The outcome of a PEFit: the best parameters found, and how well they fit.
+class PEFitResult {
+public:
+	/// Constructor
+	PEFitResult() { sse = 0; evaluations = 0; failures = 0; }
+
+	/// Values for all of the parameters of the fit, in the order of PEFit::parameters().
+	std::vector<double> parameters;
+	/// Scale factor for each measured order, in the order of PEFit::orders().  The calculated efficiencies are multiplied by these before comparing to the measurement.
+	std::vector<double> scales;
+	/// The sum of squared errors between the measured and scaled calculated efficiencies, plus PEFit::failurePenalty for each measured efficiency at a point that failed to calculate.
+	double sse;
+	/// Number of grating geometries that were calculated to find this result.
+	int evaluations;
+	/// Number of points that failed to calculate for these parameters.
+	int failures;
+};
+
+/// Fits the grating parameters (geometry, period, coating thickness, and roughness) to measured efficiencies over a range of photon energies.
+/*! The measurement and the parameter space are read from a file with loadFromFile(). It has a "key=value" line for each setting, followed by the measured data: one line for each photon energy (eV), with the measured efficiency of each of the orders().  A measured efficiency of 0 means that order wasn't measured at that energy. Text after '#' is ignored.
+
+\code
+gratingType=blazed
+gratingPeriod=1.686
+gratingMaterial=Au
+incidenceAngle=86
+orders=-1,-2
+# Parameters to fit: <start>,<min>,<max>. A single value is fixed.
+blazeAngle=2.15,1.8,2.5
+antiBlazeAngle=10,3,60
+rmsRoughnessNm=0.15,0.025,0.5
+# eV	order -1	order -2
+60	0.281228	0.016586
+65	0.310422	0.0289956
+...
+\endcode
+
+The settings are:
+- gratingType: blazed, rectangular, sinusoidal, or trapezoidal (required)
+- gratingPeriod: grating period in um (required)
+- the geometry for the gratingType (required): blazeAngle and antiBlazeAngle (deg) for blazed; height (um) and valleyWidth (um) for rectangular; height (um) for sinusoidal; height, valleyWidth, blazeAngle, and antiBlazeAngle for trapezoidal
+- gratingMaterial (required), coatingMaterial, and coatingThickness (um; default 0)
+- rmsRoughnessNm: RMS roughness (nm; default 0), applied as the Sinha factor of the top surface material
+- incidenceAngle: incidence angle in degrees (required)
+- orders: the diffraction orders of the measured columns (required)
+- N and integrationTolerance: math options for the calculation (default 15 and 1e-5)
+- maxEvaluations: the maximum number of grating geometries to calculate, at least 1 (default 300)
+- tolerance: the fit stops when the SSE over the simplex varies by less than this fraction (default 1e-6)
+
+Any of the numeric grating parameters can be fixed (one value) or fitted (<start>,<min>,<max>).
+
+run() searches the parameters that need a new efficiency calculation (everything except the roughness) with a Nelder-Mead simplex, constrained to the given ranges. For each geometry, all of the photon energies are calculated at once with PESolver::getEffBatch(), to use all the threads.  The roughness and the scale factors don't need a new calculation: the best roughness is found by a golden-section search over its range, and for each roughness, the best scale factors follow in closed form from linear least squares.
+
+Points that fail to calculate for a geometry are counted (PEFitResult::failures, reported with each result) and left out of the scale factors and squared errors, since they have no efficiencies to compare.  Instead, each measured efficiency at a failed point adds failurePenalty to the SSE: as much as the largest possible error of an efficiency, so that a geometry can't fit better by failing at the points it would fit badly, and the simplex moves away from geometries that fail.*/
+class PEFit {
+public:
+	/// Constructor. Use loadFromFile() to set up the fit.
+	PEFit();
+
+	/// Squared error added to the SSE for each measured efficiency at a point that failed to calculate: 1, the square of the largest difference between two efficiencies.
+	static const double failurePenalty;
+
+	/// The whole fit program for grating \c gratingName (ex: "legFit"), shared by the legFit, impFit, and megFit programs: reads [numThreads] [measurement file] from the command line (\c argc, \c argv; the default file is fitData/<gratingName>.txt), runs the fit (or prints the usage and returns -1 if numThreads isn't at least 1), and prints the result.  Returns the program's exit code.
+	static int runProgram(const std::string& gratingName, int argc, char** argv);
+
+	/// Reads the settings and the measured data from \c fileName.  Returns false (and sets errorMessage()) if the file could not be read, or was missing required settings.
+	bool loadFromFile(const std::string& fileName);
+	/// Describes the problem, if loadFromFile() returned false.
+	const std::string& errorMessage() const { return errorMessage_; }
+
+	/// Returns all of the parameters of the fit: the period, the geometry, the coating thickness, and the roughness.
+	const std::vector<PEFitParameter>& parameters() const { return parameters_; }
+	/// Returns the diffraction orders that were measured.
+	const std::vector<int>& orders() const { return orders_; }
+	/// Returns the number of measured photon energies.
+	int numPoints() const { return eV_.size(); }
+
+	/// Runs the fit, using \c numThreads threads for the calculations.  Each grating geometry that is calculated is reported as one line to \c log, if provided.
+	PEFitResult run(int numThreads = 1, std::ostream* log = &std::cout);
+
+	/// Calculates the efficiencies for the given values of all the parameters(), and returns the fit with the best roughness and scale factors (unless the roughness is fixed).
+	PEFitResult evaluate(const std::vector<double>& parameterValues, int numThreads = 1);
+
+	/// Writes \c result on one line to \c os: \c label, then each parameter value, each scale factor, and the SSE, separated by tabs.
+	void printResult(std::ostream& os, const std::string& label, const PEFitResult& result) const;
+
+protected:
+	/// Index of the first geometry parameter in parameters_. (The period is first.)
+	enum { GeometryIndex = 1 };
+
+	/// Creates the grating for \c parameterValues.  The caller must delete it.
+	PEGrating* createGrating(const std::vector<double>& parameterValues) const;
+	/// Used by run(): evaluates the parameters with the free (indices \c freeParameters) ones set from \c unitPoint, where 0..1 covers each one's range.  Counts the evaluation, reports it to \c log, and keeps the best result in \c best.  Returns the SSE.
+	double evaluateUnitPoint(const std::vector<double>& unitPoint, const std::vector<int>& freeParameters, int numThreads, std::ostream* log, int& evaluations, PEFitResult& best);
+	/// Sum of squared errors for roughness \c rmsRoughnessNm, given the calculated (unscaled, no roughness) efficiencies \c calculated for each order and point. Points where \c failed is true are left out (see failurePenalty). Fills in the best \c scales.
+	double sseForRoughness(double rmsRoughnessNm, const std::vector<std::vector<double> >& calculated, const std::vector<bool>& failed, const std::string& topMaterial, std::vector<double>& scales) const;
+
+	/// Grating profile
+	PEGrating::Profile profile_;
+	/// Parameters: period, geometry (depends on profile_), coating thickness, roughness.
+	std::vector<PEFitParameter> parameters_;
+	/// Substrate and coating materials
+	std::string material_, coating_;
+	/// Incidence angle (deg)
+	double incidenceDeg_;
+	/// Math options for the calculation
+	int N_;
+	double integrationTolerance_;
+	/// Limits for run()
+	int maxEvaluations_;
+	double tolerance_;
+
+	/// Measured orders
+	std::vector<int> orders_;
+	/// Photon energies (eV) of the measured points
+	std::vector<double> eV_;
+	/// Measured efficiency of each order (outer index) at each point (inner index). 0 if not measured.
+	std::vector<std::vector<double> > measured_;
+
+	/// Set by loadFromFile() on failure
+	std::string errorMessage_;
+};
+
+#endif // PEFIT_H
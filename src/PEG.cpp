@@ -19,41 +19,73 @@ along with PEG.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "PEG.h"
 #include "PESolver.h"
+#include "PEResultCache.h"
 
 #include <gsl/gsl_complex_math.h>
 #include <fstream>
 #include <iostream>
 #include <algorithm>
 #include <vector>
+#include <map>
 #include <string.h>
 
-// This packs the current result into a plain double \c array, for easy communication using standard MPI types.  The array must have pre-allocated room for 2N+1 + 4 elements.
-void PEResult::toDoubleArray(double* array) const {
+// This packs the current result into a plain double \c array, for easy communication using standard MPI types.  The array must have pre-allocated room for recordLength(N, withTM) elements.
+void PEResult::toDoubleArray(double* array, int N, bool withTM) const {
+	std::fill(array, array + recordLength(N, withTM), 0.0);	// failures don't fill in N and the efficiencies.
 	array[0] = double(status);
 	array[1] = wavelength;
 	array[2] = incidenceDeg;
-	if(eff.empty()) {
-		array[3] = 0;
-	}
-	else {
-		array[3] = double((eff.size()-1)/2);	// N
+	if(!eff.empty()) {
+		array[3] = double(N);
 		memcpy(array+4, &(eff.at(0)), eff.size()*sizeof(double));
 	}
+	array[4 + 2*N+1] = double(usedN);
+	array[5 + 2*N+1] = truncationError;
+	if(withTM && !effTM.empty())
+		memcpy(array + 6 + 2*N+1, &(effTM.at(0)), effTM.size()*sizeof(double));
 }
 
 // This unpacks the result from a plain double \c array that was filled by toDoubleArray().
-void PEResult::fromDoubleArray(const double* array) {
+void PEResult::fromDoubleArray(const double* array, int N, bool withTM) {
 	status = Code(int(array[0]));
 	wavelength = array[1];
 	incidenceDeg = array[2];
-	
-	int N = int(array[3]);
-	
-	eff.resize(2*N+1);
-	memcpy(&(eff[0]), array+4, eff.size()*sizeof(double));	
+
+	if(status == Success)
+		eff.assign(array + 4, array + 4 + 2*N+1);
+	else
+		eff.clear();
+	usedN = int(array[4 + 2*N+1]);
+	truncationError = array[5 + 2*N+1];
+	if(withTM && status == Success)
+		effTM.assign(array + 6 + 2*N+1, array + 6 + 2*(2*N+1));
+	else
+		effTM.clear();
+}
+
+static const char* peStepperNames[] = { "msadams", "rk8pd", "rkck", "bsimp", "rk4fixed" };
+
+const char* PEMathOptions::stepperName(Stepper stepper) {
+	return peStepperNames[stepper];
+}
+
+bool PEMathOptions::stepperFromName(const std::string& name, Stepper& stepper) {
+	for(int i=0; i<=FixedRK4Stepper; ++i) {
+		if(name == peStepperNames[i]) {
+			stepper = Stepper(i);
+			return true;
+		}
+	}
+	return false;
 }
 
 PEResult PEGrating::getEff(double incidenceDeg, double wl, double rmsRoughnessNm, const PEMathOptions& mo, bool printDebugOutput, int numThreads, bool measureTiming) const {
+	// Check the result cache before creating a solver context. (On a miss, PESolver::getEff() looks again, which costs nothing compared to the calculation.)
+	PEResultCache* cache = (printDebugOutput || measureTiming) ? 0 : PEResultCache::global();
+	PEResult cachedResult;
+	if(cache && cache->lookup(PEResultCache::key(*this, mo, incidenceDeg, wl, rmsRoughnessNm), cachedResult))
+		return cachedResult;
+
 	PESolver s(*this, mo, numThreads, measureTiming);
 	return s.getEff(incidenceDeg, wl, rmsRoughnessNm, printDebugOutput);
 }
@@ -64,31 +96,39 @@ gsl_complex PEGrating::refractiveIndex(double wl, const std::string& material) {
 //	return gsl_complex_rect(1.4, -0.);	// plain glass in visible range.
 //	return gsl_complex_rect(0.993, 0);
 
-	// Attempt to open the material database file.
-	std::string fileName = std::string(PEG_MATERIALS_DB_PATH) + std::string("/") + material + std::string(".idx");
+	return PEMaterialDatabase::table(material).refractiveIndex(wl);
+}
+
+bool PEMaterialTable::loadFromFile(const std::string& fileName) {
+	wl_nm_.clear();
+	delta_.clear();
+	beta_.clear();
 
+	// Attempt to open the material database file.
 	std::ifstream matFile;
 	matFile.open(fileName.c_str());
 	if(matFile.fail())
-		return gsl_complex_rect(0,0);
-
-	std::vector<double> wl_nm, delta, beta;
-	wl_nm.reserve(3120);	// my standard files have 3111 lines. This avoids vector re-sizing for performance.
-	delta.reserve(3120);
-	beta.reserve(3120);
-
-	// read whole file intp vectors for fast searching.
-	while(!matFile.eof()) {
-		double wl_nmIn, deltaIn, betaIn;
-		matFile >> wl_nmIn >> deltaIn >> betaIn;
-
-		wl_nm.push_back(wl_nmIn);
-		delta.push_back(deltaIn);
-		beta.push_back(betaIn);
+		return false;
+
+	wl_nm_.reserve(3120);	// my standard files have 3111 lines. This avoids vector re-sizing for performance.
+	delta_.reserve(3120);
+	beta_.reserve(3120);
+
+	// read whole file into vectors for fast searching.
+	double wl_nmIn, deltaIn, betaIn;
+	while(matFile >> wl_nmIn >> deltaIn >> betaIn) {
+		wl_nm_.push_back(wl_nmIn);
+		delta_.push_back(deltaIn);
+		beta_.push_back(betaIn);
 	}
 	matFile.close();
 
-	if(wl_nm.empty())
+	return !wl_nm_.empty();
+}
+
+gsl_complex PEMaterialTable::refractiveIndex(double wl) const {
+
+	if(wl_nm_.empty())
 		return gsl_complex_rect(0,0);	// the database is empty.
 
 	// Need to convert wavelength from um to nm, since our data files are in the format:
@@ -101,41 +141,77 @@ gsl_complex PEGrating::refractiveIndex(double wl, const std::string& material) {
 	////////////////////////
 
 	// 'larger' is an iterator to one entry higher (or possibly equal) to the target wl.
-	std::vector<double>::const_iterator larger = std::lower_bound(wl_nm.begin(), wl_nm.end(), wl);
+	std::vector<double>::const_iterator larger = std::lower_bound(wl_nm_.begin(), wl_nm_.end(), wl);
 
 	// Not found? This wl is larger than any we have in the database.
-	if(larger == wl_nm.end())
+	if(larger == wl_nm_.end())
 		return gsl_complex_rect(0,0);
 
 	// Did this return the first entry?
-	if(larger == wl_nm.begin()) {
+	if(larger == wl_nm_.begin()) {
 		// if equal to wl, then we've found it at the first entry.
 		if(*larger == wl)
-			return gsl_complex_rect(1-delta[0], beta[0]);
+			return gsl_complex_rect(1-delta_[0], beta_[0]);
 		else
 			return gsl_complex_rect(0,0); // otherwise, it's too low a wavelength for us to have in the database.
 	}
 
 
 	// Not the first entry... So we can also grab the preceeding entry (at lowerIndex), and interpolate between them.
-	size_t upperIndex = larger - wl_nm.begin();
+	size_t upperIndex = larger - wl_nm_.begin();
 	size_t lowerIndex = upperIndex - 1;
 
-	double upperWl = wl_nm[upperIndex];
-	double lowerWl = wl_nm[lowerIndex];
+	double upperWl = wl_nm_[upperIndex];
+	double lowerWl = wl_nm_[lowerIndex];
 	double interp = (wl - lowerWl)/(upperWl - lowerWl);
 
-	double upperDelta = delta[upperIndex];
-	double lowerDelta = delta[lowerIndex];
+	double upperDelta = delta_[upperIndex];
+	double lowerDelta = delta_[lowerIndex];
 	double interpDelta = lowerDelta + interp*(upperDelta-lowerDelta);
 
-	double upperBeta = beta[upperIndex];
-	double lowerBeta = beta[lowerIndex];
+	double upperBeta = beta_[upperIndex];
+	double lowerBeta = beta_[lowerIndex];
 	double interpBeta = lowerBeta + interp*(upperBeta - lowerBeta);
 
 	return gsl_complex_rect(1-interpDelta, 0.9*interpBeta);
 }
 
+/// Storage for all loaded material tables, indexed by material name.  std::map never moves its elements on insertion, so references handed out by PEMaterialDatabase::table() stay valid.  Only accessed inside the PEMaterialDatabase critical section.
+static std::map<std::string, PEMaterialTable>& peMaterialTables() {
+	static std::map<std::string, PEMaterialTable> tables;
+	return tables;
+}
+
+const PEMaterialTable& PEMaterialDatabase::table(const std::string& material) {
+	const PEMaterialTable* rv;
+
+#pragma omp critical(PEMaterialDatabase)
+	{
+		std::map<std::string, PEMaterialTable>& tables = peMaterialTables();
+		std::map<std::string, PEMaterialTable>::iterator it = tables.find(material);
+		if(it != tables.end()) {
+			rv = &(it->second);
+		}
+		else {
+			// First use: parse the file once. If it's missing, we still keep the (empty) table, so that we don't try to open the file again on every lookup.
+			PEMaterialTable& t = tables[material];
+			t.loadFromFile(std::string(PEG_MATERIALS_DB_PATH) + std::string("/") + material + std::string(".idx"));
+			rv = &t;
+		}
+	}
+
+	return *rv;
+}
+
+int PEMaterialDatabase::preload(const std::vector<std::string>& materials) {
+	int numFound = 0;
+	for(int i=0,cc=materials.size(); i<cc; ++i) {
+		if(!table(materials.at(i)).isEmpty())
+			++numFound;
+	}
+	return numFound;
+}
+
 
 std::ostream& operator<<(std::ostream& os, const PEResult& result) {
 	int N = (result.eff.size()-1)/2;
@@ -187,6 +263,54 @@ int PEGrating::computeK2StepsAtY(double y, gsl_complex k2_vaccuum, gsl_complex k
 		return computeK2StepsAtY_thickCoating(y, k2_vaccuum, k2_substrate, k2_coating, stepsX, stepsK2);
 }
 
+std::vector<double> PEGrating::featureHeights() const
+{
+	double h = profileHeight();
+	double c = coatingThickness_;
+	std::vector<double> heights;
+
+	// the same regions as in k2StepsAreYInvariant(). Without a coating, the apex of the profile is the top of the structure.
+	if(c > 0) {
+		heights.push_back(std::min(c, h));
+		if(c != h)
+			heights.push_back(std::max(c, h));
+	}
+	return heights;
+}
+
+bool PEGrating::k2StepsAreYInvariant(double yStart, double yEnd) const
+{
+	double h = profileHeight();
+	double c = coatingThickness_;
+
+	// the boundaries between regions where computeK2StepsAtY() switches between different cases.  Every region is y-invariant if the bare profile is; otherwise only the homogeneous region inside a thick coating is.
+	double boundaries[2];
+	int numBoundaries = 0;
+	bool homogeneousRegion = false;
+
+	if(c <= 0) {
+		// one region, from 0 to h.
+	}
+	else if(c < h) {
+		// interpenetrating coating: [0,c], [c,h], [h,h+c]
+		boundaries[numBoundaries++] = c;
+		boundaries[numBoundaries++] = h;
+	}
+	else {
+		// thick coating: [0,h], [h,c] (homogeneous), [c,h+c]
+		boundaries[numBoundaries++] = h;
+		boundaries[numBoundaries++] = c;
+		homogeneousRegion = (yStart >= h && yEnd <= c);
+	}
+
+	// a layer crossing a boundary is never y-invariant.
+	for(int i=0; i<numBoundaries; ++i)
+		if(yStart < boundaries[i] && yEnd > boundaries[i])
+			return false;
+
+	return homogeneousRegion || profileIsYInvariant();
+}
+
 int PEGrating::computeK2StepsAtY_noCoating(double y, gsl_complex k2_vaccuum, gsl_complex k2_substrate, gsl_complex k2_coating, double *stepsX, gsl_complex *stepsK2) const {
 
 	(void)k2_coating;	// unused.
@@ -324,48 +448,155 @@ int PEGrating::computeK2StepsAtY_thickCoating(double y, gsl_complex k2_vaccuum,
 	}
 }
 
-int PECustomProfileGrating::computeK2StepsAtY(double y, gsl_complex k2_vaccuum, gsl_complex k2_substrate, gsl_complex k2_coating, double *stepsX, gsl_complex *stepsK2) const
+std::vector<double> PECustomProfileGrating::featureHeights() const
 {
-	// coatings are not supported.
-	(void)k2_coating;
-	if(coatingThickness_ != 0)
-		return -1;
-
-	if(!isValid())
-		return -1;
+	// the slice boundaries are all the distinct vertex heights, of both surfaces.
+	std::vector<double> heights;
+	double top = totalHeight();
+	for(int k=0, cc=sliceY_.size(); k<cc; ++k)
+		if(sliceY_[k] > 0 && sliceY_[k] < top)
+			heights.push_back(sliceY_[k]);
+	return heights;
+}
 
-	int numCrossings = 0;
+bool PECustomProfileGrating::k2StepsAreYInvariant(double yStart, double yEnd) const
+{
+	int k = int(std::upper_bound(sliceY_.begin(), sliceY_.end(), yStart) - sliceY_.begin()) - 1;
+	if(k < 0)
+		return false;
+	if(k+1 < int(sliceY_.size()) && yEnd > sliceY_[k+1])
+		return false;	// crosses into the next slice.
+	return sliceStart_[k+1] == sliceStart_[k];
+}
 
-	// move along points until y_i > y if searching for an entering point, or y_i <= y if searching for an exit point.
-	for(int i=0,cc=y_.size(); i<cc; ++i) {
+void PECustomProfileGrating::buildCrossingTable()
+{
+	sliceY_.clear();
+	sliceStart_.clear();
+	sliceCrossings_.clear();
+	sliceIsValid_.clear();
+	slope_.clear();
+	maxCrossings_ = 1;
+	if(!isValid() || x_.size() != y_.size())
+		return;
+
+	// the substrate surface, and the coating surface on top of it:
+	std::vector<double> yOffsets(1, 0.0);
+	if(coatingThickness_ > 0)
+		yOffsets.push_back(coatingThickness_);
+	int numSurfaces = yOffsets.size();
+
+	int numPoints = y_.size();
+	for(int s=0; s<numSurfaces; ++s)
+		for(int i=0; i<numPoints; ++i)
+			sliceY_.push_back(y_[i] + yOffsets[s]);
+	std::sort(sliceY_.begin(), sliceY_.end());
+	sliceY_.erase(std::unique(sliceY_.begin(), sliceY_.end()), sliceY_.end());
+	int numSlices = sliceY_.size();
+
+	slope_.resize(numPoints, 0);
+	for(int i=1; i<numPoints; ++i)
+		if(y_[i] != y_[i-1])
+			slope_[i] = (x_[i] - x_[i-1])/(y_[i]-y_[i-1]);
+
+	// segment i of a surface spans the slices from the one starting at its lower vertex, up to (not including) the one starting at its upper vertex.
+	std::vector<int> firstSlice(numSurfaces*numPoints, 0), lastSlice(numSurfaces*numPoints, 0);
+	std::vector<int> count(numSlices + 1, 0);
+	for(int s=0; s<numSurfaces; ++s) {
+		for(int i=1; i<numPoints; ++i) {
+			if(y_[i] == y_[i-1])
+				continue;
+			int j = s*numPoints + i;
+			firstSlice[j] = std::lower_bound(sliceY_.begin(), sliceY_.end(), std::min(y_[i-1], y_[i]) + yOffsets[s]) - sliceY_.begin();
+			lastSlice[j] = std::lower_bound(sliceY_.begin(), sliceY_.end(), std::max(y_[i-1], y_[i]) + yOffsets[s]) - sliceY_.begin();
+			for(int k=firstSlice[j]; k<lastSlice[j]; ++k)
+				++count[k+1];
+		}
+	}
 
-		if(numCrossings%2 == 0) {	// looking for an entry point.
-			if(y_[i] > y) {	// found it
-				double slope = (x_[i] - x_[i-1])/(y_[i]-y_[i-1]);
-				double x = x_[i-1] + slope*(y - y_[i-1]);
+	sliceStart_.resize(numSlices + 1, 0);
+	for(int k=0; k<numSlices; ++k) {
+		sliceStart_[k+1] = sliceStart_[k] + count[k+1];
+		maxCrossings_ = std::max(maxCrossings_, count[k+1]);
+	}
 
-				stepsK2[numCrossings] = k2_vaccuum;
-				stepsX[numCrossings++] = x;
+	// fill in each surface in segment order, so each slice's list is in order along the substrate surface, followed by the coating surface. At a crossing going up (entering the material), the medium on the left is above that surface: coating (or vacuum, without one) for the substrate surface, and vacuum for the coating surface. Going down, it is below: substrate, or coating.
+	sliceCrossings_.resize(sliceStart_[numSlices]);
+	sliceIsValid_.resize(numSlices, 1);
+	std::vector<int> next(sliceStart_.begin(), sliceStart_.end() - 1);
+	for(int s=0; s<numSurfaces; ++s) {
+		std::vector<int> sliceStartForSurface(next);
+		for(int i=1; i<numPoints; ++i) {
+			int j = s*numPoints + i;
+			bool entering = y_[i] > y_[i-1];
+			for(int k=firstSlice[j]; k<lastSlice[j]; ++k) {
+				// on each surface, the crossings must alternate: entering, leaving, entering...
+				if(entering != ((next[k] - sliceStartForSurface[k])%2 == 0))
+					sliceIsValid_[k] = 0;
+
+				SliceCrossing& c = sliceCrossings_[next[k]++];
+				c.segment = i;
+				c.yOffset = yOffsets[s];
+				if(s == 0)
+					c.leftMedium = entering ? (numSurfaces > 1 ? CoatingMedium : VacuumMedium) : SubstrateMedium;
+				else
+					c.leftMedium = entering ? VacuumMedium : CoatingMedium;
 			}
 		}
-		else {// looking for an exit point.
-			if(y_[i] <= y) {	// found it
-				double slope = (x_[i] - x_[i-1])/(y_[i]-y_[i-1]);
-				double x = x_[i-1] + slope*(y - y_[i-1]);
+		for(int k=0; k<numSlices; ++k)
+			if((next[k] - sliceStartForSurface[k])%2 != 0)
+				sliceIsValid_[k] = 0;	// there must be an even number of crossings: none, in-out, in-out-in-out, etc.
+	}
 
-				stepsK2[numCrossings] = k2_substrate;
-				stepsX[numCrossings++] = x;
+	// With a coating, merge the two surfaces from left to right. The surfaces never touch each other, so the order is the same everywhere in a slice; use the middle.
+	if(numSurfaces > 1) {
+		for(int k=0; k<numSlices-1; ++k) {
+			int start = sliceStart_[k], end = sliceStart_[k+1];
+			double y = 0.5*(sliceY_[k] + sliceY_[k+1]);
+			std::vector<std::pair<double, int> > order;
+			for(int j=start; j<end; ++j) {
+				const SliceCrossing& c = sliceCrossings_[j];
+				order.push_back(std::make_pair(x_[c.segment-1] + slope_[c.segment]*(y - c.yOffset - y_[c.segment-1]), j));
 			}
+			std::sort(order.begin(), order.end());
+			std::vector<SliceCrossing> sorted;
+			for(int j=0, cj=order.size(); j<cj; ++j)
+				sorted.push_back(sliceCrossings_[order[j].second]);
+			std::copy(sorted.begin(), sorted.end(), sliceCrossings_.begin() + start);
 		}
 	}
+}
+
+int PECustomProfileGrating::computeK2StepsAtY(double y, gsl_complex k2_vaccuum, gsl_complex k2_substrate, gsl_complex k2_coating, double *stepsX, gsl_complex *stepsK2) const
+{
+	if(!isValid())
+		return -1;
+
+	int numCrossings = 0;
+
+	// find the slice containing y: the last one starting at or below y. Above the top vertex, or below the bottom one, there are no crossings.
+	int k = int(std::upper_bound(sliceY_.begin(), sliceY_.end(), y) - sliceY_.begin()) - 1;
+	if(k >= 0 && k < int(sliceY_.size()) - 1) {
+		if(!sliceIsValid_[k])
+			return -1;
 
-	if(numCrossings%2 != 0)
-		return -1;	// there must be an even number of crossings: none, in-out, in-out-in-out, etc.
+		gsl_complex media[3];
+		media[VacuumMedium] = k2_vaccuum;
+		media[SubstrateMedium] = k2_substrate;
+		media[CoatingMedium] = k2_coating;
 
-	// No crossing: we are above the grating. Homogeneous vacuum.
+		for(int j=sliceStart_[k], cj=sliceStart_[k+1]; j<cj; ++j) {
+			const SliceCrossing& c = sliceCrossings_[j];
+			int i = c.segment;
+			stepsK2[numCrossings] = media[c.leftMedium];
+			stepsX[numCrossings++] = x_[i-1] + slope_[i]*(y - c.yOffset - y_[i-1]);
+		}
+	}
+
+	// No crossing: homogeneous coating (inside a thick one), or vacuum (above the grating).
 	if(numCrossings == 0) {
 		numCrossings = 1;
-		stepsK2[0] = k2_vaccuum;
+		stepsK2[0] = (k >= 0 && sliceY_[k] < coatingThickness_) ? k2_coating : k2_vaccuum;
 		stepsX[0] = 0;
 	}
 
@@ -34,7 +34,7 @@ along with PEG.  If not, see <http://www.gnu.org/licenses/>.
 /// Path to materials database (folder)
 #define PEG_MATERIALS_DB_PATH "materialDatabase"
 
-/// Maximum supported number of interfaces crossed in a horizontal slice through the grating; determines the size of arrays in computeK2StepsAtY().
+/// Number of interfaces crossed in a horizontal slice through the grating that the solver provides storage for on the stack in computeK2StepsAtY(). Gratings that can have more (see PEGrating::maxK2Steps()) get dynamically-allocated storage instead.
 #define PEG_MAX_PROFILE_CROSSINGS 60
 
 // Common definitions for the PEG parallel grating efficiency library
@@ -45,10 +45,16 @@ public:
 	enum Code { Success, InvalidGratingFailure, ConvergenceFailure, InsufficientCoefficientsFailure, AlgebraFailure, MissingRefractiveDataFailure, OtherFailure, InactiveCalculation };
 	
 	/// Constructs an empty result with the given \c statusCode
-	PEResult(Code statusCode = OtherFailure) { status = statusCode; }
+	PEResult(Code statusCode = OtherFailure) {
+		status = statusCode;
+		usedN = 0;
+		truncationError = -1;
+	}
 	/// Constructs a successful result, where the eff array has size \c 2*N+1.
 	PEResult(int N) : eff(2*N+1) {
 		status = Success;
+		usedN = N;
+		truncationError = -1;
 	}
 	
 	/// Result of the calculation: Success, InvalidGratingFailure, ConvergenceFailure, InsufficientCoefficientsFailure, AlgebraError, or OtherFailure
@@ -57,13 +63,21 @@ public:
 	double wavelength;
 	/// Incidence angle for this calculation
 	double incidenceDeg;
-	/// Array of efficiencies, going from -N order up to N.  Size is 2N+1; the 0-order efficiency can be found at eff[N].
+	/// Array of efficiencies, going from -N order up to N.  Size is 2N+1; the 0-order efficiency can be found at eff[N].  These are the TE efficiencies.
 	std::vector<double> eff;
+	/// With PEMathOptions::TEAndTMPolarization, the TM efficiencies, in the same order as eff.  Empty otherwise.
+	std::vector<double> effTM;
+	/// The truncation index that the efficiencies were actually calculated with. This is the N of the eff array, unless the calculation used PEMathOptions::adaptiveNTolerance and stopped at a smaller N; the efficiencies of the orders beyond usedN are then 0.
+	int usedN;
+	/// Estimate of the error from truncating the Fourier expansion at usedN, in units of efficiency, or -1 if it wasn't estimated. With PEMathOptions::adaptiveNTolerance, this includes the change from the last, smaller N; otherwise, it only includes what can be estimated from a single N (see PESolver::estimateTruncationError()).
+	double truncationError;
 	
-	/// This packs the current result into a plain double \c array, for easy communication using standard MPI types.  The array must have pre-allocated room for 2N+1 + 4 elements.
-	void toDoubleArray(double* array) const;
-	/// This unpacks the result from a plain double \c array that was filled by toDoubleArray().
-	void fromDoubleArray(const double* array);
+	/// Returns the number of doubles used by toDoubleArray() for a result with truncation index \c N: 2N+1 + 6, and another 2N+1 \c withTM efficiencies.
+	static int recordLength(int N, bool withTM = false) { return 2*N+1 + 6 + (withTM ? 2*N+1 : 0); }
+	/// This packs the current result into a plain double \c array, for easy communication using standard MPI types: status, wavelength, incidenceDeg, N, the 2N+1 efficiencies, usedN, and truncationError, followed by the 2N+1 TM efficiencies \c withTM (effTM).  \c N is the truncation index of the calculation, which sets the layout: every record with the same N has the same length, and its fields in the same places.  Failed results (with no efficiencies) have 0 for N and the efficiencies.  The array must have pre-allocated room for recordLength(N, withTM) elements; all of them are written.
+	void toDoubleArray(double* array, int N, bool withTM = false) const;
+	/// This unpacks the result from a plain double \c array that was filled by toDoubleArray() with the same \c N and \c withTM.  Failed results get no efficiencies.
+	void fromDoubleArray(const double* array, int N, bool withTM = false);
 	
 	/// Prints the output efficiencies in a table, to standard output.
 	friend std::ostream& operator<<(std::ostream& os, const PEResult& result);
@@ -71,21 +85,116 @@ public:
 
 std::ostream& operator<<(std::ostream& os, const PEResult& result);
 
+/// A single point in a scan: an incidence angle \c incidenceDeg (degrees) and wavelength \c wavelength (um).  Used by PESolver::getEffBatch().
+class PEScanPoint {
+public:
+	/// Constructor
+	PEScanPoint(double IncidenceDeg = 0, double Wavelength = 0) {
+		incidenceDeg = IncidenceDeg;
+		wavelength = Wavelength;
+	}
+
+	/// Incidence angle, in degrees
+	double incidenceDeg;
+	/// Wavelength, in um
+	double wavelength;
+};
+
 /// Represents the numerical options to be used for a single grating calculation.
 class PEMathOptions {
 public:
+	/// Methods available to integrate the trial solutions across each layer.
+	enum Stepper {
+		MSAdamsStepper,	///< Variable-coefficient linear multistep Adams method (gsl_odeiv2_step_msadams) with adaptive steps. The default.
+		RK8PDStepper,	///< Explicit embedded Runge-Kutta Prince-Dormand (8, 9) method (gsl_odeiv2_step_rk8pd) with adaptive steps.
+		RKCKStepper,	///< Explicit embedded Runge-Kutta Cash-Karp (4, 5) method (gsl_odeiv2_step_rkck) with adaptive steps.
+		BSimpStepper,	///< Implicit Bulirsch-Stoer method of Bader and Deuflhard (gsl_odeiv2_step_bsimp) with adaptive steps. Uses the ODE Jacobian.
+		FixedRK4Stepper	///< Explicit 4th-order Runge-Kutta (gsl_odeiv2_step_rk4) with fixedStepsPerLayer equal steps in each layer, and no error control.
+	};
+	/// Polarizations to calculate.
+	enum Polarization {
+		TEPolarization,	///< Only TE (electric field parallel to the grooves). The default.
+		TEAndTMPolarization	///< TE, and also TM (magnetic field parallel to the grooves), in the same pass: the TM fields are integrated together with the TE ones, so both share the refractive indices, the layers, the integration steps, and one grating expansion per step.  The step-size control covers both, so the TE results can differ from those with TEPolarization within the integration tolerance (and PEMathOptions::adaptiveNTolerance chooses N for both).  The TM efficiencies are returned in PEResult::effTM.
+	};
+	/// Returns the short name of a \c stepper, as used on the command line: msadams, rk8pd, rkck, bsimp, or rk4fixed.
+	static const char* stepperName(Stepper stepper);
+	/// Finds the Stepper for a short \c name (see stepperName()), and sets \c stepper to it. Returns false if there is no stepper with that name.
+	static bool stepperFromName(const std::string& name, Stepper& stepper);
+
 	/// Fourier truncation index N. Should be a positive number; Fourier components from [-N, N].
 	int N;
-	/// Tolerance required (eps) in the numerical integration process at each step
+	/// Tolerance required (eps) in the numerical integration process at each step. This is the relative tolerance, and also the absolute tolerance unless integrationAbsTolerance is given.
 	double integrationTolerance;
+	/// Absolute tolerance for the numerical integration, if >= 0. If < 0 (the default), integrationTolerance is used.
+	double integrationAbsTolerance;
+	/// The method used to integrate the trial solutions. MSAdamsStepper by default.
+	Stepper stepper;
+	/// For FixedRK4Stepper: the number of equal steps in each layer. 200 by default.
+	int fixedStepsPerLayer;
+	/// If > 0, the grating expansion k^2_n(y) is tabulated at this many evenly-spaced y values in each layer (minimum 4), and the ODE right-hand side interpolates from the table instead of re-computing the expansion at every step. In layers where the interpolation error exceeds integrationTolerance, the expansion is still computed directly. 0 (the default) computes the expansion directly at every step.
+	int expansionTablePoints;
+	/// If true, the layers of the S-matrix recursion are placed adaptively: their boundaries fall on PEGrating::featureHeights(), and their thickness is limited by the growth of the evanescent orders across each layer, instead of using uniform layers with a fixed growth limit. Homogeneous parts of the structure stay separate (so they can use the layer propagator), and neighbouring parts are merged when the merged layer is still well-conditioned. False by default.
+	bool adaptiveLayers;
+	/// If true, a solver context (PESolver) carries the integration step sizes from one calculation to the next: each trial solution in each layer starts with the average step size it needed in the matching layer of the last calculation, instead of a fixed fraction of the layer thickness. For scans over neighbouring wavelengths or angles, this saves most of the adaptive step-size search at the start of every integration. The results differ from a cold start only within the integration tolerance, and depend on the order of the calculations. False by default.
+	bool warmStart;
+	/// If true, all 4N+2 trial solutions of a layer are integrated together as one matrix ODE U'' = M(y) U, where the columns of the (2N+1) x (4N+2) matrix U are the trial solutions. Each evaluation of the right-hand side then computes the grating expansion and forms M(y) once, and multiplies it with all the trial solutions in a single complex matrix-matrix product (BLAS zgemm), instead of a separate matrix-vector product for each trial solution. This is much faster with an optimized BLAS library. All the trial solutions share the same adaptive steps, so the results differ from separate integration within the integration tolerance. Not used with BSimpStepper, which would need the Jacobian of the whole matrix system. False by default.
+	bool matrixIntegration;
+	/// If > 0, N is the largest truncation index to use, and each calculation starts with a smaller one: it is first done at about N/4, and then at N increased by about 1.5 times each step, until the estimated truncation error (the largest change in any efficiency from the last step, or in the part of the power in the outermost orders; see PESolver::estimateTruncationError()) is below this tolerance, or N is reached.  The N and error estimate used are reported in PEResult::usedN and PEResult::truncationError. 0 (the default) always uses N.
+	double adaptiveNTolerance;
+	/// If true (the default), layers where the grating doesn't change with y (see PEGrating::k2StepsAreYInvariant()) are crossed using a matrix-exponential propagator instead of numerically integrating the trial solutions.
+	bool useLayerPropagator;
+	/// Which polarizations to calculate. TEPolarization by default.
+	Polarization polarization;
 	
 	/// Constructor
-	PEMathOptions(int FourierN = 15, double IntegrationTolerance = 1e-5) {
+	PEMathOptions(int FourierN = 15, double IntegrationTolerance = 1e-5, int ExpansionTablePoints = 0, bool UseLayerPropagator = true, bool AdaptiveLayers = false, bool WarmStart = false) {
 		N = FourierN;
 		integrationTolerance = IntegrationTolerance;
+		expansionTablePoints = ExpansionTablePoints;
+		useLayerPropagator = UseLayerPropagator;
+		adaptiveLayers = AdaptiveLayers;
+		warmStart = WarmStart;
+		integrationAbsTolerance = -1;
+		stepper = MSAdamsStepper;
+		fixedStepsPerLayer = 200;
+		matrixIntegration = false;
+		adaptiveNTolerance = 0;
+		polarization = TEPolarization;
 	}
 };
 
+/// Holds the refractive index data for a single material, parsed from its materials database file.  The wavelength, delta, and beta columns are kept in contiguous arrays (sorted by wavelength), so that lookups can be served from memory.
+class PEMaterialTable {
+public:
+	/// Constructs an empty table. Use loadFromFile() to fill it.
+	PEMaterialTable() {}
+
+	/// Reads the table from the database file \c fileName, which has lines in the format: wl(nm) delta beta.  Returns false if the file could not be opened or contained no data.
+	bool loadFromFile(const std::string& fileName);
+
+	/// Returns true if the table has no data (for example, if the material's database file was not found).
+	bool isEmpty() const { return wl_nm_.empty(); }
+	/// Returns the number of entries in the table.
+	int size() const { return wl_nm_.size(); }
+
+	/// Interpolates the complex refractive index at a given wavelength \c wl in um.  Returns gsl_complex_rect(0,0) if the table is empty or \c wl is outside of its range.
+	gsl_complex refractiveIndex(double wl) const;
+
+protected:
+	/// Wavelength (nm), delta, and beta columns. The refractive index is v = 1 - delta + i*beta.
+	std::vector<double> wl_nm_, delta_, beta_;
+};
+
+/// Process-wide registry of material refractive index tables.  Each database file in PEG_MATERIALS_DB_PATH is parsed only once: either the first time the material is requested, or up front using preload(). All functions are thread-safe.
+class PEMaterialDatabase {
+public:
+	/// Returns the table for \c material (ex: "Au", "SiO2", etc.), loading it from the database on first use.  If the database file was not found, the returned table isEmpty(). The reference remains valid for the lifetime of the program.
+	static const PEMaterialTable& table(const std::string& material);
+
+	/// Loads the tables for all of the given \c materials, so that later lookups don't touch the file system.  Returns the number of materials whose data was found.
+	static int preload(const std::vector<std::string>& materials);
+};
+
 
 /// Represents the parameters and geometry of a grating. Subclassed as required for different profiles.
 class PEGrating {
@@ -114,6 +223,8 @@ public:
 	double period() const { return period_; }
 	/// Returns profile-dependent geometry parameters
 	double geo(int parameterIndex) const { return geo_.at(parameterIndex); }
+	/// Returns all of the profile-dependent geometry parameters
+	const std::vector<double>& geometry() const { return geo_; }
 	/// Returns the height from the substrate surface (y=0) to the highest feature. If the grating has a coating, this should include the coating.
 	/*! This is shape-dependent, but the base class implementation handles the default rectangular, blazed, sinusoidal, and trapezoidal profiles. Re-implement for custom profiles.*/
 	virtual double totalHeight() const { return profileHeight() + coatingThickness_; }
@@ -130,7 +241,7 @@ public:
 	/// Returns the complex refractive index of the coating at a given wavelength \c wl in um.  Returns gsl_complex_rect(0,0) if the coating material's database was not found.
 	gsl_complex coatingRefractiveIndex(double wl) const { return refractiveIndex(wl, coatingMaterial_); }
 
-	/// Looks up the complex refractive index of \c material at a given wavelength \c wl in um.  Returns gsl_complex_rect(0,0) if the  material's database was not found.
+	/// Looks up the complex refractive index of \c material at a given wavelength \c wl in um.  Returns gsl_complex_rect(0,0) if the  material's database was not found.  The database file is only parsed on the first lookup; see PEMaterialDatabase.
 	static gsl_complex refractiveIndex(double wl, const std::string& material);
 
 	/// Returns the roughness correction using the Sinha factor (Reference: http://dx.doi.org/10.1103/PhysRevB.38.2297  (Equation 4.34)).  The RMS roughness \c sigma is in um. (Actual roughnesses are typically in the order of a couple nm, however.) The incidence angle \c incidence is in deg, measured from surface normal.
@@ -153,11 +264,20 @@ public:
 	- Profiles with multiple local maxima could have more steps at some \c y values, from entering and exiting the material multiple times.
 	- Within a homogeneous layer, there is only "one" step, with \c stepsX[0] = 0, \c stepsK2[0] = <the layer impedance>.
 
-	This function is called at each integration step, so we avoid dynamic memory for performance here. Note that \c stepsX and \c stepsK2 only have storage for a maximum of PEG_MAX_PROFILE_CROSSINGS.
+	This function is called at each integration step, so we avoid dynamic memory for performance here. Note that \c stepsX and \c stepsK2 only have storage for a maximum of maxK2Steps() steps.
 
 	The base class implementation handles simple profile shapes (those with a single local maximum), with or without an interpenetrating or thick coating. For this to work, the subclass must implement xIntersection1() and xIntersection2().
 	*/
 	virtual int computeK2StepsAtY(double y, gsl_complex k2_vaccuum, gsl_complex k2_substrate, gsl_complex k2_coating, double* stepsX, gsl_complex* stepsK2) const;
+	/// Returns the maximum number of steps that computeK2StepsAtY() can return, which is the storage that callers must provide in \c stepsX and \c stepsK2. The base class implementation returns PEG_MAX_PROFILE_CROSSINGS, which is plenty for the standard profiles (they have at most 4).
+	virtual int maxK2Steps() const { return PEG_MAX_PROFILE_CROSSINGS; }
+
+	/// Returns true if computeK2StepsAtY() gives the same steps for every \c y in the open interval (\c yStart, \c yEnd). The solver uses this to compute the grating expansion only once for a layer, instead of at every integration step.
+	/*! The base class implementation matches the base class computeK2StepsAtY(): it divides the structure into the regions separated by the coating and profile heights. Regions inside homogeneous coating are always y-invariant, and regions crossing the bare profile are y-invariant if profileIsYInvariant(). Subclasses that re-implement computeK2StepsAtY() should re-implement this too.*/
+	virtual bool k2StepsAreYInvariant(double yStart, double yEnd) const;
+	/// Returns the heights between 0 and totalHeight() (exclusive, in increasing order) where the structure changes character, for example at a coating interface or the apex of the bare profile. Used by PEMathOptions::adaptiveLayers to put layer boundaries there.
+	/*! The base class implementation returns the boundaries between the regions of the base class computeK2StepsAtY(): the coating and profile heights. Subclasses that re-implement computeK2StepsAtY() should re-implement this too.*/
+	virtual std::vector<double> featureHeights() const;
 
 
 	// Computational Geometry. The following geometry functions describe the basic, bare profile, assuming there is no coating.
@@ -182,6 +302,8 @@ public:
 	Base class returns negative number to indicate geometry failure; must re-implement.
 */
 	virtual double xIntersection2(double y) const { (void)y; return -1; }
+	/// Returns true if the bare profile is the same at all heights from 0 to profileHeight(), ie: xIntersection1() and xIntersection2() don't depend on \c y.  Used by k2StepsAreYInvariant(). The base class returns false.
+	virtual bool profileIsYInvariant() const { return false; }
 
 	////////////////////////////
 	
@@ -233,6 +355,8 @@ public:
 	virtual double xIntersection1(double y) const { (void)y; return geo(1); }
 	/// Returns the x-coordinate of the second intersection with the surface at \c y. Simple, because the grating doesn't change with height.
 	virtual double xIntersection2(double y) const { (void)y; return period(); }
+	/// A rectangular profile doesn't change with height.
+	virtual bool profileIsYInvariant() const { return true; }
 };
 
 /// Blazed grating subclass
@@ -314,10 +438,11 @@ public:
 };
 
 /// Custom grating subclass: profile is defined pointwise with a series of (x,y) points.
+/*! An optional coating is the profile translated vertically by \c coatingThickness, as for the standard profiles. It can be thick or interpenetrating, and the profile can have any number of bumps.*/
 class PECustomProfileGrating : public PEGrating {
 public:
 	/// Constructs a grating with a custom profile. The required geometry parameters \c geometry are a maximum height, followed by a vector of points (x_i followed by y_i) which must go from (x_0, y_0) = (0,0) to (x_I, y_I) = (1,0).  The \c points are scaled so that (0,0)->(1,1) maps to (0,0)->(period,maxHeight).
-	PECustomProfileGrating(double period = 1.0, const std::vector<double>& geometry = std::vector<double>(), const std::string& material = "Au") {
+	PECustomProfileGrating(double period = 1.0, const std::vector<double>& geometry = std::vector<double>(), const std::string& material = "Au", const std::string& coating = "Au", double coatingThickness = 0) {
 		profile_ = CustomProfile;
 		period_ = period;
 		geo_ = geometry;
@@ -331,11 +456,13 @@ public:
 		}
 
 		substrateMaterial_ = material;
-		coatingThickness_ = 0;
+		coatingMaterial_ = coating;
+		coatingThickness_ = coatingThickness;
+		buildCrossingTable();
 	}
 
 	/// Constructs a grating with a custom profile. The required geometry parameters are a \c maxHeight in um, followed by a vector of \c xPoints and \c yPoints from (x_0, y_0) = (0,0) to (x_I, y_I) = (1,0).  The \c points are scaled so that (0,0)->(1,1) maps to (0,0)->(period,maxHeight).
-	PECustomProfileGrating(double period, double maxHeight, const std::vector<double>& xPoints, const std::vector<double>& yPoints,const std::string& material = "Au") {
+	PECustomProfileGrating(double period, double maxHeight, const std::vector<double>& xPoints, const std::vector<double>& yPoints,const std::string& material = "Au", const std::string& coating = "Au", double coatingThickness = 0) {
 		profile_ = CustomProfile;
 		period_ = period;
 		maxHeight_ = -1;
@@ -347,10 +474,19 @@ public:
 				x_.push_back(xPoints.at(i)*period_);
 			for(int i=0,cc=yPoints.size(); i<cc; ++i)
 				y_.push_back(yPoints.at(i)*maxHeight_);
+
+			// the same geometry parameters as the other constructor takes, so that geometry() (ex: in the result cache key) describes the profile.
+			geo_.push_back(maxHeight);
+			for(int i=0,cc=xPoints.size(); i<cc; ++i) {
+				geo_.push_back(xPoints.at(i));
+				geo_.push_back(yPoints.at(i));
+			}
 		}
 
 		substrateMaterial_ = material;
-		coatingThickness_ = 0;
+		coatingMaterial_ = coating;
+		coatingThickness_ = coatingThickness;
+		buildCrossingTable();
 	}
 
 	bool isValid() const { return maxHeight_ >= 0; }
@@ -358,13 +494,45 @@ public:
 	/// Depth / height.
 	virtual double profileHeight() const { return maxHeight_; }
 
-	/// Implements computing the K2 step values (intersections) for the custom profile at height \c y. \note Coatings are not supported!
+	/// Implements computing the K2 step values (intersections) for the custom profile, with or without a coating, at height \c y.
+	/*! Uses the crossing table built by buildCrossingTable(): finding the slice containing \c y is a binary search, and then only the surface segments crossing that slice are visited, in their precomputed order and with their precomputed media. The cost is O(log(vertices) + crossings) instead of O(vertices), and a coating costs no more than its extra crossings.*/
 	virtual int computeK2StepsAtY(double y, gsl_complex k2_vaccuum, gsl_complex k2_substrate, gsl_complex k2_coating, double* stepsX, gsl_complex* stepsK2) const;
+	/// The largest number of crossings in any slice of the profile, or 1 for the homogeneous regions.
+	virtual int maxK2Steps() const { return maxCrossings_; }
+	/// Custom profiles are y-invariant only within a homogeneous slice, with no crossings: inside a thick coating, or above the profile.
+	virtual bool k2StepsAreYInvariant(double yStart, double yEnd) const;
+	/// The heights of all the profile's vertices, and of the coating surface's vertices, are features.
+	virtual std::vector<double> featureHeights() const;
 
 protected:
 	double maxHeight_;
 	std::vector<double> x_;
 	std::vector<double> y_;
+
+	/// The media on either side of a crossing.
+	enum Medium { VacuumMedium = 0, SubstrateMedium, CoatingMedium };
+	/// One crossing in the table built by buildCrossingTable(): the profile \c segment crossed (from vertex \c segment - 1 to \c segment), how far that surface is translated up (0 for the substrate surface, coatingThickness_ for the coating surface), and the medium immediately to the left of the crossing.
+	struct SliceCrossing {
+		int segment;
+		double yOffset;
+		Medium leftMedium;
+	};
+
+	/// Builds the crossing table used by computeK2StepsAtY(). The distinct heights of the vertices of the substrate surface (the profile) and of the coating surface (the profile translated up by coatingThickness_) divide the structure into horizontal slices [sliceY_[k], sliceY_[k+1]), and the same surface segments cross every height within a slice, in the same order. For each slice, this stores those crossings from left to right in sliceCrossings_, from sliceCrossings_[sliceStart_[k]] to sliceCrossings_[sliceStart_[k+1]-1]. A segment of a surface translated by yOffset crosses y if min(y_[i-1], y_[i]) <= y - yOffset < max(y_[i-1], y_[i]).
+	/*! Storage is the total number of crossings over all slices: for V vertices, between V and V^2/2 in the worst case, but only about V * (average crossings) for measured profiles.*/
+	void buildCrossingTable();
+	/// The distinct vertex heights, in increasing order: the bottoms of the slices.
+	std::vector<double> sliceY_;
+	/// The start of each slice's list in sliceCrossings_; one more entry than sliceY_.
+	std::vector<int> sliceStart_;
+	/// The crossings in each slice, from left to right.
+	std::vector<SliceCrossing> sliceCrossings_;
+	/// Whether the crossings in each slice are valid: on each surface, they must alternate between entering and leaving the material below it. This fails if the profile does not start and end at y = 0.
+	std::vector<char> sliceIsValid_;
+	/// The inverse slope dx/dy of each segment (0 for horizontal segments, which never cross).
+	std::vector<double> slope_;
+	/// The largest number of crossings in any slice (at least 1).
+	int maxCrossings_;
 };
 
 #endif
@@ -0,0 +1,243 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "PEIncidenceSearch.h"
+#include "PESolver.h"
+
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+
+double peMinimize1D(PEObjective1D& f, double min, double max, double start, double step, double tolerance, double& fBest) {
+	const double goldenRatio = (1 + sqrt(5.0))/2;
+
+	// 1. Bracket the minimum: walk downhill from the start, with steps growing by the golden ratio, until the function goes up again (or we reach a limit) at c.
+	double a = std::min(max, std::max(min, start));
+	double fa = f.value(a);
+	double b = a + step <= max ? a + step : a - step;
+	b = std::min(max, std::max(min, b));
+	if(b == a) {	// the range is narrower than the tolerance.
+		fBest = fa;
+		return a;
+	}
+	double fb = f.value(b);
+	if(fb > fa) {
+		std::swap(a, b);
+		std::swap(fa, fb);
+	}
+	double c;
+	while(true) {
+		c = std::min(max, std::max(min, b + goldenRatio*(b - a)));
+		if(c == b)
+			break;	// reached a limit; the minimum is between a and the limit.
+		double fc = f.value(c);
+		if(fc >= fb)
+			break;
+		a = b; fa = fb;
+		b = c; fb = fc;
+	}
+
+	// 2. Brent's method on [lo, hi], starting from the best point so far, b. (Brent, "Algorithms for Minimization without Derivatives", 1973, procedure localmin.)
+	const double cGolden = (3 - sqrt(5.0))/2;
+	const double eps = sqrt(DBL_EPSILON);
+	double lo = std::min(a, c), hi = std::max(a, c);
+	double x = b, w = b, v = b;
+	double fx = fb, fw = fb, fv = fb;
+	double d = 0, e = 0;
+
+	while(true) {
+		double m = (lo + hi)/2;
+		double tol1 = eps*fabs(x) + tolerance/3;
+		double tol2 = 2*tol1;
+		if(fabs(x - m) <= tol2 - (hi - lo)/2)
+			break;
+
+		bool golden = true;
+		if(fabs(e) > tol1) {
+			// Try a parabola through x, w, and v.
+			double r = (x - w)*(fx - fv);
+			double q = (x - v)*(fx - fw);
+			double p = (x - v)*q - (x - w)*r;
+			q = 2*(q - r);
+			if(q > 0)
+				p = -p;
+			else
+				q = -q;
+			r = e;
+			e = d;
+			if(fabs(p) < fabs(q*r/2) && p > q*(lo - x) && p < q*(hi - x)) {
+				d = p/q;
+				double u = x + d;
+				if(u - lo < tol2 || hi - u < tol2)
+					d = x < m ? tol1 : -tol1;
+				golden = false;
+			}
+		}
+		if(golden) {
+			e = (x < m ? hi : lo) - x;
+			d = cGolden*e;
+		}
+
+		double u = x + (fabs(d) >= tol1 ? d : (d > 0 ? tol1 : -tol1));
+		double fu = f.value(u);
+
+		if(fu <= fx) {
+			if(u < x) hi = x; else lo = x;
+			v = w; fv = fw;
+			w = x; fw = fx;
+			x = u; fx = fu;
+		}
+		else {
+			if(u < x) lo = u; else hi = u;
+			if(fu <= fw || w == x) {
+				v = w; fv = fw;
+				w = u; fw = fu;
+			}
+			else if(fu <= fv || v == x || v == w) {
+				v = u; fv = fu;
+			}
+		}
+	}
+
+	fBest = fx;
+	return x;
+}
+
+/// Objective for an incidence search: minus the efficiency of one order, as a function of the incidence angle.
+class PEIncidenceObjective : public PEObjective1D {
+public:
+	PEIncidenceObjective(PESolver& solver, int effIndex, double wl) : solver_(solver) {
+		effIndex_ = effIndex;
+		wl_ = wl;
+		evaluations = 0;
+	}
+
+	virtual double value(double incidenceDeg) {
+		++evaluations;
+		PEResult r = solver_.getEff(incidenceDeg, wl_);
+		return r.status == PEResult::Success ? -r.eff.at(effIndex_) : 1;
+	}
+
+	int evaluations;
+
+protected:
+	PESolver& solver_;
+	int effIndex_;
+	double wl_;
+};
+
+/// Objective for a geometry and incidence search: minus the efficiency at the optimal incidence angle, as a function of the geometry parameter. Keeps the best optimum found.
+class PEGeometryObjective : public PEObjective1D {
+public:
+	PEGeometryObjective(const PEIncidenceSearch& search, const PEGrating& grating, int geometryIndex, double wl, double startIncidenceDeg) : search_(search), grating_(grating) {
+		geometryIndex_ = geometryIndex;
+		wl_ = wl;
+		incidenceDeg_ = startIncidenceDeg;
+		evaluations = 0;
+	}
+
+	virtual double value(double geometryValue) {
+		PEGrating* g = PEIncidenceSearch::createGratingWithGeometry(grating_, geometryIndex_, geometryValue);
+		PEIncidenceOptimum optimum = search_.findOptimalIncidence(*g, wl_, incidenceDeg_);
+		delete g;
+
+		evaluations += optimum.evaluations;
+		incidenceDeg_ = optimum.incidenceDeg;	// warm start for the next one.
+		optimum.geometryValue = geometryValue;
+		if(optimum.eff > best.eff)
+			best = optimum;
+		return -optimum.eff;
+	}
+
+	int evaluations;
+	PEIncidenceOptimum best;
+
+protected:
+	const PEIncidenceSearch& search_;
+	const PEGrating& grating_;
+	int geometryIndex_;
+	double wl_;
+	double incidenceDeg_;
+};
+
+PEIncidenceSearch::PEIncidenceSearch(int order, double minIncidenceDeg, double maxIncidenceDeg, const PEMathOptions& mo, int numThreads) : mathOptions_(mo) {
+	order_ = order;
+	minIncidenceDeg_ = minIncidenceDeg;
+	maxIncidenceDeg_ = maxIncidenceDeg;
+	numThreads_ = numThreads;
+	toleranceDeg_ = 0.01;
+	initialStepDeg_ = 0.5;
+}
+
+PEIncidenceOptimum PEIncidenceSearch::findOptimalIncidence(PESolver& solver, double wl, double startIncidenceDeg) const {
+	PEIncidenceObjective objective(solver, mathOptions_.N + order_, wl);
+	double minusEff;
+	PEIncidenceOptimum optimum;
+	optimum.incidenceDeg = peMinimize1D(objective, minIncidenceDeg_, maxIncidenceDeg_, startIncidenceDeg, initialStepDeg_, toleranceDeg_, minusEff);
+	optimum.wavelength = wl;
+	optimum.eff = -minusEff;
+	optimum.evaluations = objective.evaluations;
+	return optimum;
+}
+
+PEIncidenceOptimum PEIncidenceSearch::findOptimalIncidence(const PEGrating& grating, double wl, double startIncidenceDeg) const {
+	PESolver solver(grating, mathOptions_, numThreads_);
+	return findOptimalIncidence(solver, wl, startIncidenceDeg);
+}
+
+std::vector<PEIncidenceOptimum> PEIncidenceSearch::findOptimalIncidences(const PEGrating& grating, const std::vector<double>& wavelengths, double startIncidenceDeg) const {
+	PESolver solver(grating, mathOptions_, numThreads_);
+	std::vector<PEIncidenceOptimum> optima;
+	double incidenceDeg = startIncidenceDeg;
+	for(int i=0, cc=wavelengths.size(); i<cc; ++i) {
+		optima.push_back(findOptimalIncidence(solver, wavelengths[i], incidenceDeg));
+		incidenceDeg = optima.back().incidenceDeg;
+	}
+	return optima;
+}
+
+PEIncidenceOptimum PEIncidenceSearch::findOptimalGeometryAndIncidence(const PEGrating& grating, int geometryIndex, double minValue, double maxValue, double toleranceValue, double wl, double startIncidenceDeg) const {
+	PEGeometryObjective objective(*this, grating, geometryIndex, wl, startIncidenceDeg);
+	double minusEff;
+	peMinimize1D(objective, minValue, maxValue, grating.geo(geometryIndex), (maxValue - minValue)/10, toleranceValue, minusEff);
+	PEIncidenceOptimum optimum = objective.best;
+	optimum.evaluations = objective.evaluations;
+	return optimum;
+}
+
+PEGrating* PEIncidenceSearch::createGratingWithGeometry(const PEGrating& g, int geometryIndex, double value) {
+	std::vector<double> geo = g.geometry();
+	geo.at(geometryIndex) = value;
+
+	switch(g.profile()) {
+	case PEGrating::RectangularProfile:
+		return new PERectangularGrating(g.period(), geo[0], geo[1], g.substrateMaterial(), g.coatingMaterial(), g.coatingThickness());
+	case PEGrating::BlazedProfile:
+		return new PEBlazedGrating(g.period(), geo[0], geo[1], g.substrateMaterial(), g.coatingMaterial(), g.coatingThickness());
+	case PEGrating::SinusoidalProfile:
+		return new PESinusoidalGrating(g.period(), geo[0], g.substrateMaterial(), g.coatingMaterial(), g.coatingThickness());
+	case PEGrating::TrapezoidalProfile:
+		return new PETrapezoidalGrating(g.period(), geo[0], geo[1], geo[2], geo[3], g.substrateMaterial(), g.coatingMaterial(), g.coatingThickness());
+	case PEGrating::CustomProfile:
+		return new PECustomProfileGrating(g.period(), geo, g.substrateMaterial(), g.coatingMaterial(), g.coatingThickness());
+	default:
+		return new PEGrating();
+	}
+}
@@ -0,0 +1,105 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PEINCIDENCESEARCH_H
+#define PEINCIDENCESEARCH_H
+
+#include "PEG.h"
+#include <vector>
+
+class PESolver;
+
+/// The outcome of a PEIncidenceSearch: the best incidence angle (and geometry parameter, if it was searched too), and the efficiency there.
+class PEIncidenceOptimum {
+public:
+	/// Constructor
+	PEIncidenceOptimum() { incidenceDeg = 0; geometryValue = 0; wavelength = 0; eff = -1; evaluations = 0; }
+
+	/// Optimal incidence angle (deg)
+	double incidenceDeg;
+	/// Optimal value of the geometry parameter, for findOptimalGeometryAndIncidence(). Otherwise 0.
+	double geometryValue;
+	/// Wavelength (um)
+	double wavelength;
+	/// Efficiency of the order at the optimum. -1 if no point could be calculated.
+	double eff;
+	/// Number of efficiency calculations used to find it.
+	int evaluations;
+};
+
+/// Finds the incidence angle that gives the highest efficiency in one diffraction order, instead of scanning a grid of angles.
+/*! The search starts at a given incidence angle (ex: the optimum for a neighbouring wavelength), and takes growing steps uphill until the efficiency drops again, to bracket the maximum. Brent's method (parabolic interpolation, with golden-section steps as a fallback) then narrows it down to within the tolerance.  Typically this takes 10 to 15 calculations.  The search stays within [minIncidence, maxIncidence]; if the efficiency keeps rising up to a limit, the limit is returned.
+
+The search finds a local maximum: if the efficiency has several peaks over the incidence range, it finds the one uphill from the starting angle.  Points that fail to calculate count as an efficiency of -1.
+
+\code
+PEIncidenceSearch search(-1, 80, 89.5, PEMathOptions(15), numThreads);
+std::vector<PEIncidenceOptimum> optima = search.findOptimalIncidences(grating, wavelengths, 87);	// each one warm-started from the last
+\endcode*/
+class PEIncidenceSearch {
+public:
+	/// Creates a search for the best efficiency in diffraction \c order, with incidence angles from \c minIncidenceDeg to \c maxIncidenceDeg. The calculations use math options \c mo and \c numThreads threads.
+	PEIncidenceSearch(int order, double minIncidenceDeg, double maxIncidenceDeg, const PEMathOptions& mo = PEMathOptions(), int numThreads = 1);
+
+	/// Sets how precisely the incidence angle is found (deg). Default 0.01.
+	void setTolerance(double toleranceDeg) { toleranceDeg_ = toleranceDeg; }
+	/// Sets the first step from the starting angle (deg) when bracketing the maximum. Default 0.5.
+	void setInitialStep(double stepDeg) { initialStepDeg_ = stepDeg; }
+
+	/// Finds the optimal incidence angle for \c grating at wavelength \c wl (um), starting the search from \c startIncidenceDeg.
+	PEIncidenceOptimum findOptimalIncidence(const PEGrating& grating, double wl, double startIncidenceDeg) const;
+	/// Finds the optimal incidence angle for \c grating at each of the \c wavelengths (um). The first search starts from \c startIncidenceDeg, and each of the others from the optimum at the wavelength before it. One solver context is used for all of them.
+	std::vector<PEIncidenceOptimum> findOptimalIncidences(const PEGrating& grating, const std::vector<double>& wavelengths, double startIncidenceDeg) const;
+
+	/// Finds the value of the geometry parameter \c geometryIndex (see PEGrating::geometry(); ex: 0 for the blaze angle of a PEBlazedGrating) from \c minValue to \c maxValue, together with its optimal incidence angle, that gives the highest efficiency at wavelength \c wl.  The geometry parameter is found to within \c toleranceValue by the same bracketing and Brent search, starting from the grating's own value.  Each incidence search starts from the optimum of the last one.
+	PEIncidenceOptimum findOptimalGeometryAndIncidence(const PEGrating& grating, int geometryIndex, double minValue, double maxValue, double toleranceValue, double wl, double startIncidenceDeg) const;
+
+	/// Returns a copy of \c grating with its geometry parameter \c geometryIndex set to \c value. The caller must delete it.
+	static PEGrating* createGratingWithGeometry(const PEGrating& grating, int geometryIndex, double value);
+
+protected:
+	/// Implements findOptimalIncidence(), using \c solver for the calculations.
+	PEIncidenceOptimum findOptimalIncidence(PESolver& solver, double wl, double startIncidenceDeg) const;
+
+	/// Diffraction order to optimize
+	int order_;
+	/// Range of incidence angles (deg)
+	double minIncidenceDeg_, maxIncidenceDeg_;
+	/// Math options and number of threads for the calculations
+	PEMathOptions mathOptions_;
+	int numThreads_;
+	/// How precisely the incidence angle is found (deg)
+	double toleranceDeg_;
+	/// First step when bracketing (deg)
+	double initialStepDeg_;
+};
+
+/// A function of one variable, to be minimized by peMinimize1D().
+class PEObjective1D {
+public:
+	virtual ~PEObjective1D() {}
+	/// Returns the value of the function at \c x.
+	virtual double value(double x) = 0;
+};
+
+/// Minimizes \c f over [\c min, \c max]: from \c start, brackets the minimum by taking growing steps downhill (starting with \c step), and then narrows it to within \c tolerance using Brent's method.  Returns the best x, and sets \c fBest to the value there.
+double peMinimize1D(PEObjective1D& f, double min, double max, double start, double step, double tolerance, double& fBest);
+
+#endif // PEINCIDENCESEARCH_H
@@ -0,0 +1,84 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "PEIncidenceSearchMPI.h"
+#include "mpi.h"
+
+/// MPI message tags: process 0 sends the index of a search to do (PESearchWorkTag, -1 to stop), and gets back [index, incidenceDeg, eff, evaluations] (PESearchResultTag).
+enum { PESearchWorkTag = 1, PESearchResultTag = 2 };
+
+std::vector<PEIncidenceOptimum> peFindOptimalIncidencesMPI(const PEIncidenceSearch& search, const std::vector<PEGrating*>& gratings, double wl, double startIncidenceDeg) {
+	int rank, commSize;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &commSize);
+	int numSearches = gratings.size();
+	std::vector<PEIncidenceOptimum> optima;
+
+	if(commSize == 1) {
+		double incidenceDeg = startIncidenceDeg;
+		for(int i=0; i<numSearches; ++i) {
+			optima.push_back(search.findOptimalIncidence(*gratings[i], wl, incidenceDeg));
+			incidenceDeg = optima.back().incidenceDeg;
+		}
+		return optima;
+	}
+
+	if(rank == 0) {
+		optima.resize(numSearches);
+		// Start every process on one search, then hand out the next one to each process that returns a result.
+		int next = 0, active = 0;
+		for(int p=1; p<commSize; ++p) {
+			int work = next < numSearches ? next++ : -1;
+			MPI_Send(&work, 1, MPI_INT, p, PESearchWorkTag, MPI_COMM_WORLD);
+			if(work >= 0)
+				++active;
+		}
+		while(active > 0) {
+			double result[4];
+			MPI_Status status;
+			MPI_Recv(result, 4, MPI_DOUBLE, MPI_ANY_SOURCE, PESearchResultTag, MPI_COMM_WORLD, &status);
+			int index = int(result[0]);
+			optima[index].incidenceDeg = result[1];
+			optima[index].eff = result[2];
+			optima[index].evaluations = int(result[3]);
+			optima[index].wavelength = wl;
+
+			int work = next < numSearches ? next++ : -1;
+			MPI_Send(&work, 1, MPI_INT, status.MPI_SOURCE, PESearchWorkTag, MPI_COMM_WORLD);
+			if(work < 0)
+				--active;
+		}
+	}
+	else {
+		double incidenceDeg = startIncidenceDeg;
+		while(true) {
+			int work;
+			MPI_Recv(&work, 1, MPI_INT, 0, PESearchWorkTag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+			if(work < 0)
+				break;
+			PEIncidenceOptimum optimum = search.findOptimalIncidence(*gratings[work], wl, incidenceDeg);
+			incidenceDeg = optimum.incidenceDeg;
+			double result[4] = { double(work), optimum.incidenceDeg, optimum.eff, double(optimum.evaluations) };
+			MPI_Send(result, 4, MPI_DOUBLE, 0, PESearchResultTag, MPI_COMM_WORLD);
+		}
+	}
+
+	return optima;
+}
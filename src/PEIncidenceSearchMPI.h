@@ -0,0 +1,33 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PEINCIDENCESEARCHMPI_H
+#define PEINCIDENCESEARCHMPI_H
+
+#include "PEIncidenceSearch.h"
+#include <vector>
+
+/// Finds the optimal incidence angle for each of the \c gratings at wavelength \c wl, with the searches distributed over all the processes in MPI_COMM_WORLD.  Must be called by all processes (with the same arguments).
+/*! Process 0 hands out the searches one at a time, to whichever process is ready for the next one, so that it doesn't matter how long each one takes or how many processes there are.  Each process starts its searches from the optimal incidence angle of its last one (the first from \c startIncidenceDeg), so neighbouring gratings in the list make good warm starts.  With only one process, it does all the searches itself.
+
+Returns the optima (in the order of \c gratings) on process 0; other processes get an empty vector.*/
+std::vector<PEIncidenceOptimum> peFindOptimalIncidencesMPI(const PEIncidenceSearch& search, const std::vector<PEGrating*>& gratings, double wl, double startIncidenceDeg);
+
+#endif // PEINCIDENCESEARCHMPI_H
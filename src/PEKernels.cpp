@@ -0,0 +1,695 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "PEKernels.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+// Every implementation must round exactly like multiplyRowsByM(), so no fused multiply-adds anywhere in this file, whatever the build flags: with -march=native or -mfma, the compiler would otherwise contract the multiplies and adds of the scalar kernels and of the AVX2 intrinsics.  GCC's SLP vectorizer also turns the complex products of the scalar kernels into fused multiply-add/subtract instructions, even with fp-contract off, so it's switched off here too.
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off", "no-tree-slp-vectorize")
+#endif
+
+// SIMD implementations are only built for x86 with GCC or clang, which let us compile individual functions for a specific instruction set (and check the CPU at runtime) without special build flags.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PEKERNELS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// Computes rows [iStart, iEnd] of Mu = M u.  This is the reference implementation: all the other implementations must do the same operations in the same order for each row.
+static void multiplyRowsByM(int N, int iStart, int iEnd, const double* k2, const double* alpha2, const double* u, double* Mu)
+{
+	for(int i=iStart; i<=iEnd; ++i) {
+		// row i only needs the band of columns k within N of i.
+		int kStart = std::max(0, i - N), kEnd = std::min(2*N, i + N);
+
+		double sumRe = 0, sumIm = 0;
+		for(int k=kStart; k<=kEnd; ++k) {
+			double MRe = -k2[2*(i-k+N)];
+			double MIm = -k2[2*(i-k+N)+1];
+			if(k == i)
+				MRe += alpha2[i];
+
+			double uRe = u[2*k], uIm = u[2*k+1];
+			sumRe += MRe*uRe - MIm*uIm;
+			sumIm += MRe*uIm + MIm*uRe;
+		}
+
+		Mu[2*i] = sumRe;
+		Mu[2*i+1] = sumIm;
+	}
+}
+
+// Used by the SIMD implementations: fills \c M with the negated k^2_{n-m} values for W consecutive rows i..i+W-1 at column k (one complex value per row), and adds the diagonal alpha^2 for the row where k = i+l.  Rows where k is outside the band get 0, which adds exactly nothing to their sums.
+static inline void loadBandColumn(int N, int W, int i, int k, const double* k2, const double* alpha2, double* M)
+{
+	int base = i - k + N;	// index into k2 for row i; row i+l uses base+l.
+	for(int l=0; l<W; ++l) {
+		int idx = base + l;
+		if(idx >= 0 && idx <= 2*N) {
+			M[2*l] = -k2[2*idx];
+			M[2*l+1] = -k2[2*idx+1];
+		}
+		else
+			M[2*l] = M[2*l+1] = 0;
+	}
+	if(k >= i && k < i+W)
+		M[2*(k-i)] += alpha2[k];
+}
+
+// Used by the kernels specialized for a fixed N: fills \c band with the negated k^2 coefficients, padded with \c R zero values on each side, so that band + 2*(idx+R) is -k^2_{idx-N} for 0 <= idx <= 2N, and 0 for -R <= idx < 0 and 2N < idx < 2N+1+R.  A block of R rows can then load its coefficients at any column without checking the band edges: rows outside the band get 0, which adds exactly nothing to their sums.
+static inline void fillPaddedBand(int N, int R, const double* k2, double* band)
+{
+	memset(band, 0, 2*R*sizeof(double));
+	for(int i=0; i<2*(2*N+1); ++i)
+		band[2*R+i] = -k2[i];
+	memset(band + 2*R + 2*(2*N+1), 0, 2*R*sizeof(double));
+}
+
+// Used by multiplyByMFixed_scalar(): adds column \c k of M u to the sums for \c row, exactly as multiplyRowsByM() does, with the coefficients from the padded band (R = 4).
+static inline void addBandColumn(int N, int row, int k, const double* band, const double* alpha2, double uRe, double uIm, double& sumRe, double& sumIm)
+{
+	const double* M = band + 2*(row-k+N+4);
+	double MRe = M[0], MIm = M[1];
+	if(k == row)
+		MRe += alpha2[k];
+	sumRe += MRe*uRe - MIm*uIm;
+	sumIm += MRe*uIm + MIm*uRe;
+}
+
+// Scalar kernel specialized for truncation index N. Computes blocks of four rows at once (with four independent sums, instead of one long chain of dependent additions), using the padded band from fillPaddedBand() on the stack.  The last block is written to a temporary, since it goes past row 2N.
+template<int N>
+static void multiplyByMFixed_scalar(const double* k2, const double* alpha2, const double* u, double* Mu)
+{
+	const int R = 4;
+	const int twoNp1 = 2*N + 1;
+	double band[2*(twoNp1 + 2*R)];
+	double lastBlock[2*R];
+	fillPaddedBand(N, R, k2, band);
+
+	for(int i=0; i<twoNp1; i+=R) {
+		int kStart = std::max(0, i - N), kEnd = std::min(2*N, i + R-1 + N);
+		double re0 = 0, im0 = 0, re1 = 0, im1 = 0, re2 = 0, im2 = 0, re3 = 0, im3 = 0;
+
+		for(int k=kStart; k<=kEnd; ++k) {
+			double uRe = u[2*k], uIm = u[2*k+1];
+			addBandColumn(N, i, k, band, alpha2, uRe, uIm, re0, im0);
+			addBandColumn(N, i+1, k, band, alpha2, uRe, uIm, re1, im1);
+			addBandColumn(N, i+2, k, band, alpha2, uRe, uIm, re2, im2);
+			addBandColumn(N, i+3, k, band, alpha2, uRe, uIm, re3, im3);
+		}
+
+		double* out = i+R <= twoNp1 ? Mu + 2*i : lastBlock;
+		out[0] = re0; out[1] = im0;
+		out[2] = re1; out[3] = im1;
+		out[4] = re2; out[5] = im2;
+		out[6] = re3; out[7] = im3;
+		if(out == lastBlock)
+			memcpy(Mu + 2*i, lastBlock, 2*(twoNp1-i)*sizeof(double));
+	}
+}
+
+void PEKernels::multiplyByM_scalar(int N, const double* k2, const double* alpha2, const double* u, double* Mu)
+{
+	multiplyRowsByM(N, 0, 2*N, k2, alpha2, u, Mu);
+}
+
+#ifdef PEKERNELS_X86_SIMD
+
+__attribute__((target("avx2")))
+void PEKernels::multiplyByM_avx2(int N, const double* k2, const double* alpha2, const double* u, double* Mu)
+{
+	// two rows (complex values) at once, in [re,im,re,im] order.
+	const int W = 2;
+	int twoNp1 = 2*N + 1;
+	int i = 0;
+	double M[2*W];
+
+	for(; i+W-1 < twoNp1; i+=W) {
+		int kStart = std::max(0, i - N), kEnd = std::min(2*N, i + W-1 + N);
+		__m256d sum = _mm256_setzero_pd();
+
+		for(int k=kStart; k<=kEnd; ++k) {
+			__m256d Mv;
+			int base = i - k + N;
+			if(base >= 0 && base + W-1 <= 2*N && (k < i || k >= i+W)) {
+				// the common case: all rows in the band, and not on the diagonal. Load directly and negate by flipping the sign bit.
+				Mv = _mm256_xor_pd(_mm256_loadu_pd(k2 + 2*base), _mm256_set1_pd(-0.0));
+			}
+			else {
+				loadBandColumn(N, W, i, k, k2, alpha2, M);
+				Mv = _mm256_loadu_pd(M);
+			}
+
+			// complex multiply M*u_k for both rows: [MRe uRe - MIm uIm, MIm uRe + MRe uIm]
+			__m256d t1 = _mm256_mul_pd(Mv, _mm256_set1_pd(u[2*k]));
+			__m256d t2 = _mm256_mul_pd(_mm256_shuffle_pd(Mv, Mv, 0x5), _mm256_set1_pd(u[2*k+1]));
+			sum = _mm256_add_pd(sum, _mm256_addsub_pd(t1, t2));
+		}
+
+		_mm256_storeu_pd(Mu + 2*i, sum);
+	}
+
+	// leftover rows
+	if(i < twoNp1)
+		multiplyRowsByM(N, i, 2*N, k2, alpha2, u, Mu);
+}
+
+__attribute__((target("avx512f")))
+void PEKernels::multiplyByM_avx512(int N, const double* k2, const double* alpha2, const double* u, double* Mu)
+{
+	// four rows (complex values) at once.
+	const int W = 4;
+	int twoNp1 = 2*N + 1;
+	int i = 0;
+	double M[2*W];
+	const __m512i signBits = _mm512_set1_epi64((long long)0x8000000000000000ULL);
+
+	for(; i+W-1 < twoNp1; i+=W) {
+		int kStart = std::max(0, i - N), kEnd = std::min(2*N, i + W-1 + N);
+		__m512d sum = _mm512_setzero_pd();
+
+		for(int k=kStart; k<=kEnd; ++k) {
+			__m512d Mv;
+			int base = i - k + N;
+			if(base >= 0 && base + W-1 <= 2*N && (k < i || k >= i+W)) {
+				Mv = _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(_mm512_loadu_pd(k2 + 2*base)), signBits));
+			}
+			else {
+				loadBandColumn(N, W, i, k, k2, alpha2, M);
+				Mv = _mm512_loadu_pd(M);
+			}
+
+			__m512d t1 = _mm512_mul_pd(Mv, _mm512_set1_pd(u[2*k]));
+			__m512d t2 = _mm512_mul_pd(_mm512_shuffle_pd(Mv, Mv, 0x55), _mm512_set1_pd(u[2*k+1]));
+			// no addsub in AVX-512: add everywhere, then subtract in the real (even) positions.
+			__m512d prod = _mm512_mask_sub_pd(_mm512_add_pd(t1, t2), 0x55, t1, t2);
+			sum = _mm512_add_pd(sum, prod);
+		}
+
+		_mm512_storeu_pd(Mu + 2*i, sum);
+	}
+
+	if(i < twoNp1)
+		multiplyRowsByM(N, i, 2*N, k2, alpha2, u, Mu);
+}
+
+// Used by the fixed-N AVX2 kernels: returns the coefficients \c M for rows row and row+1 with \c a added to the real part of row row+l, as multiplyRowsByM() adds the diagonal.  The other elements get -0.0 added, which leaves every double (even -0.0) exactly as it was.  This keeps it in registers: going through memory to change one element stalls the load.
+__attribute__((target("avx2")))
+static inline __m256d addToDiagonal_avx2(__m256d M, int l, double a)
+{
+	return _mm256_add_pd(M, l == 0 ? _mm256_set_pd(-0.0, -0.0, -0.0, a) : _mm256_set_pd(-0.0, a, -0.0, -0.0));
+}
+
+// Used by multiplyByMFixed_avx2(): returns the products M_{row+l,k} u_k for rows row and row+1, with the coefficients from the padded band (R = 8).
+__attribute__((target("avx2")))
+static inline __m256d bandColumnProduct_avx2(int N, int row, int k, const double* band, const double* alpha2, __m256d uRe, __m256d uIm)
+{
+	const int W = 2;
+	__m256d Mv = _mm256_loadu_pd(band + 2*(row-k+N+8));
+	if(k >= row && k < row+W)	// on the diagonal.
+		Mv = addToDiagonal_avx2(Mv, k-row, alpha2[k]);
+	__m256d t1 = _mm256_mul_pd(Mv, uRe);
+	__m256d t2 = _mm256_mul_pd(_mm256_shuffle_pd(Mv, Mv, 0x5), uIm);
+	return _mm256_addsub_pd(t1, t2);
+}
+
+// AVX2 kernel specialized for truncation index N: like multiplyByMFixed_scalar(), with blocks of eight rows (four vectors).
+template<int N>
+__attribute__((target("avx2")))
+static void multiplyByMFixed_avx2(const double* k2, const double* alpha2, const double* u, double* Mu)
+{
+	const int R = 8;
+	const int twoNp1 = 2*N + 1;
+	double band[2*(twoNp1 + 2*R)];
+	double lastBlock[2*R];
+	fillPaddedBand(N, R, k2, band);
+
+	for(int i=0; i<twoNp1; i+=R) {
+		int kStart = std::max(0, i - N), kEnd = std::min(2*N, i + R-1 + N);
+		__m256d sum0 = _mm256_setzero_pd(), sum1 = sum0, sum2 = sum0, sum3 = sum0;
+
+		for(int k=kStart; k<=kEnd; ++k) {
+			__m256d uRe = _mm256_set1_pd(u[2*k]), uIm = _mm256_set1_pd(u[2*k+1]);
+			sum0 = _mm256_add_pd(sum0, bandColumnProduct_avx2(N, i, k, band, alpha2, uRe, uIm));
+			sum1 = _mm256_add_pd(sum1, bandColumnProduct_avx2(N, i+2, k, band, alpha2, uRe, uIm));
+			sum2 = _mm256_add_pd(sum2, bandColumnProduct_avx2(N, i+4, k, band, alpha2, uRe, uIm));
+			sum3 = _mm256_add_pd(sum3, bandColumnProduct_avx2(N, i+6, k, band, alpha2, uRe, uIm));
+		}
+
+		double* out = i+R <= twoNp1 ? Mu + 2*i : lastBlock;
+		_mm256_storeu_pd(out, sum0);
+		_mm256_storeu_pd(out + 4, sum1);
+		_mm256_storeu_pd(out + 8, sum2);
+		_mm256_storeu_pd(out + 12, sum3);
+		if(out == lastBlock)
+			memcpy(Mu + 2*i, lastBlock, 2*(twoNp1-i)*sizeof(double));
+	}
+}
+
+// Used by multiplyByMPairFixed_avx2(): the products of bandColumnProduct_avx2() for u (with diagonal alpha2) and v (with diagonal alpha2v).  Off the diagonal both matrices have the same coefficients, so they're loaded and shuffled once.
+__attribute__((target("avx2")))
+static inline void bandColumnProductPair_avx2(int N, int row, int k, const double* band, const double* alpha2, const double* alpha2v, __m256d uRe, __m256d uIm, __m256d vRe, __m256d vIm, __m256d& Mu, __m256d& Mv)
+{
+	const int W = 2;
+	__m256d B = _mm256_loadu_pd(band + 2*(row-k+N+8));
+	__m256d Bswap = _mm256_shuffle_pd(B, B, 0x5);
+	if(k >= row && k < row+W) {
+		// on the diagonal, the two matrices differ.
+		__m256d Bv = addToDiagonal_avx2(B, k-row, alpha2v[k]);
+		Mv = _mm256_addsub_pd(_mm256_mul_pd(Bv, vRe), _mm256_mul_pd(_mm256_shuffle_pd(Bv, Bv, 0x5), vIm));
+		B = addToDiagonal_avx2(B, k-row, alpha2[k]);
+		Bswap = _mm256_shuffle_pd(B, B, 0x5);
+	}
+	else
+		Mv = _mm256_addsub_pd(_mm256_mul_pd(B, vRe), _mm256_mul_pd(Bswap, vIm));
+	Mu = _mm256_addsub_pd(_mm256_mul_pd(B, uRe), _mm256_mul_pd(Bswap, uIm));
+}
+
+// AVX2 kernel for multiplyByMPair() specialized for truncation index N: multiplyByMFixed_avx2() for both vectors in the same loop.
+template<int N>
+__attribute__((target("avx2")))
+static void multiplyByMPairFixed_avx2(const double* k2, const double* alpha2, const double* u, double* Mu, const double* alpha2v, const double* v, double* Mv)
+{
+	const int R = 8;
+	const int twoNp1 = 2*N + 1;
+	double band[2*(twoNp1 + 2*R)];
+	double lastBlockU[2*R], lastBlockV[2*R];
+	fillPaddedBand(N, R, k2, band);
+
+	for(int i=0; i<twoNp1; i+=R) {
+		int kStart = std::max(0, i - N), kEnd = std::min(2*N, i + R-1 + N);
+		__m256d sumU0 = _mm256_setzero_pd(), sumU1 = sumU0, sumU2 = sumU0, sumU3 = sumU0;
+		__m256d sumV0 = sumU0, sumV1 = sumU0, sumV2 = sumU0, sumV3 = sumU0;
+
+		for(int k=kStart; k<=kEnd; ++k) {
+			__m256d uRe = _mm256_set1_pd(u[2*k]), uIm = _mm256_set1_pd(u[2*k+1]);
+			__m256d vRe = _mm256_set1_pd(v[2*k]), vIm = _mm256_set1_pd(v[2*k+1]);
+			__m256d productU, productV;
+			bandColumnProductPair_avx2(N, i, k, band, alpha2, alpha2v, uRe, uIm, vRe, vIm, productU, productV);
+			sumU0 = _mm256_add_pd(sumU0, productU);
+			sumV0 = _mm256_add_pd(sumV0, productV);
+			bandColumnProductPair_avx2(N, i+2, k, band, alpha2, alpha2v, uRe, uIm, vRe, vIm, productU, productV);
+			sumU1 = _mm256_add_pd(sumU1, productU);
+			sumV1 = _mm256_add_pd(sumV1, productV);
+			bandColumnProductPair_avx2(N, i+4, k, band, alpha2, alpha2v, uRe, uIm, vRe, vIm, productU, productV);
+			sumU2 = _mm256_add_pd(sumU2, productU);
+			sumV2 = _mm256_add_pd(sumV2, productV);
+			bandColumnProductPair_avx2(N, i+6, k, band, alpha2, alpha2v, uRe, uIm, vRe, vIm, productU, productV);
+			sumU3 = _mm256_add_pd(sumU3, productU);
+			sumV3 = _mm256_add_pd(sumV3, productV);
+		}
+
+		bool last = i+R > twoNp1;
+		double* outU = last ? lastBlockU : Mu + 2*i;
+		double* outV = last ? lastBlockV : Mv + 2*i;
+		_mm256_storeu_pd(outU, sumU0);
+		_mm256_storeu_pd(outU + 4, sumU1);
+		_mm256_storeu_pd(outU + 8, sumU2);
+		_mm256_storeu_pd(outU + 12, sumU3);
+		_mm256_storeu_pd(outV, sumV0);
+		_mm256_storeu_pd(outV + 4, sumV1);
+		_mm256_storeu_pd(outV + 8, sumV2);
+		_mm256_storeu_pd(outV + 12, sumV3);
+		if(last) {
+			memcpy(Mu + 2*i, lastBlockU, 2*(twoNp1-i)*sizeof(double));
+			memcpy(Mv + 2*i, lastBlockV, 2*(twoNp1-i)*sizeof(double));
+		}
+	}
+}
+
+// Used by multiplyByMFixed_avx512(): returns the products M_{row+l,k} u_k for rows row to row+3, with the coefficients from the padded band (R = 8).
+__attribute__((target("avx512f")))
+static inline __m512d bandColumnProduct_avx512(int N, int row, int k, const double* band, const double* alpha2, __m512d uRe, __m512d uIm)
+{
+	const int W = 4;
+	__m512d Mv = _mm512_loadu_pd(band + 2*(row-k+N+8));
+	if(k >= row && k < row+W)	// on the diagonal: add alpha^2 to the real part of row k only (in registers, like addToDiagonal_avx2()).
+		Mv = _mm512_mask_add_pd(Mv, (__mmask8)(1 << 2*(k-row)), Mv, _mm512_set1_pd(alpha2[k]));
+	__m512d t1 = _mm512_mul_pd(Mv, uRe);
+	__m512d t2 = _mm512_mul_pd(_mm512_shuffle_pd(Mv, Mv, 0x55), uIm);
+	return _mm512_mask_sub_pd(_mm512_add_pd(t1, t2), 0x55, t1, t2);
+}
+
+// AVX-512 kernel specialized for truncation index N, with blocks of eight rows (two vectors).
+template<int N>
+__attribute__((target("avx512f")))
+static void multiplyByMFixed_avx512(const double* k2, const double* alpha2, const double* u, double* Mu)
+{
+	const int R = 8;
+	const int twoNp1 = 2*N + 1;
+	double band[2*(twoNp1 + 2*R)];
+	double lastBlock[2*R];
+	fillPaddedBand(N, R, k2, band);
+
+	for(int i=0; i<twoNp1; i+=R) {
+		int kStart = std::max(0, i - N), kEnd = std::min(2*N, i + R-1 + N);
+		__m512d sum0 = _mm512_setzero_pd(), sum1 = sum0;
+
+		for(int k=kStart; k<=kEnd; ++k) {
+			__m512d uRe = _mm512_set1_pd(u[2*k]), uIm = _mm512_set1_pd(u[2*k+1]);
+			sum0 = _mm512_add_pd(sum0, bandColumnProduct_avx512(N, i, k, band, alpha2, uRe, uIm));
+			sum1 = _mm512_add_pd(sum1, bandColumnProduct_avx512(N, i+4, k, band, alpha2, uRe, uIm));
+		}
+
+		double* out = i+R <= twoNp1 ? Mu + 2*i : lastBlock;
+		_mm512_storeu_pd(out, sum0);
+		_mm512_storeu_pd(out + 8, sum1);
+		if(out == lastBlock)
+			memcpy(Mu + 2*i, lastBlock, 2*(twoNp1-i)*sizeof(double));
+	}
+}
+
+// Used by multiplyByMPairFixed_avx512(): like bandColumnProductPair_avx2(), for rows row to row+3.
+__attribute__((target("avx512f")))
+static inline void bandColumnProductPair_avx512(int N, int row, int k, const double* band, const double* alpha2, const double* alpha2v, __m512d uRe, __m512d uIm, __m512d vRe, __m512d vIm, __m512d& Mu, __m512d& Mv)
+{
+	const int W = 4;
+	if(k >= row && k < row+W) {
+		Mu = bandColumnProduct_avx512(N, row, k, band, alpha2, uRe, uIm);
+		Mv = bandColumnProduct_avx512(N, row, k, band, alpha2v, vRe, vIm);
+		return;
+	}
+	__m512d B = _mm512_loadu_pd(band + 2*(row-k+N+8));
+	__m512d Bswap = _mm512_shuffle_pd(B, B, 0x55);
+	__m512d t1 = _mm512_mul_pd(B, uRe), t2 = _mm512_mul_pd(Bswap, uIm);
+	Mu = _mm512_mask_sub_pd(_mm512_add_pd(t1, t2), 0x55, t1, t2);
+	t1 = _mm512_mul_pd(B, vRe);
+	t2 = _mm512_mul_pd(Bswap, vIm);
+	Mv = _mm512_mask_sub_pd(_mm512_add_pd(t1, t2), 0x55, t1, t2);
+}
+
+// AVX-512 kernel for multiplyByMPair() specialized for truncation index N: multiplyByMFixed_avx512() for both vectors in the same loop.
+template<int N>
+__attribute__((target("avx512f")))
+static void multiplyByMPairFixed_avx512(const double* k2, const double* alpha2, const double* u, double* Mu, const double* alpha2v, const double* v, double* Mv)
+{
+	const int R = 8;
+	const int twoNp1 = 2*N + 1;
+	double band[2*(twoNp1 + 2*R)];
+	double lastBlockU[2*R], lastBlockV[2*R];
+	fillPaddedBand(N, R, k2, band);
+
+	for(int i=0; i<twoNp1; i+=R) {
+		int kStart = std::max(0, i - N), kEnd = std::min(2*N, i + R-1 + N);
+		__m512d sumU0 = _mm512_setzero_pd(), sumU1 = sumU0, sumV0 = sumU0, sumV1 = sumU0;
+
+		for(int k=kStart; k<=kEnd; ++k) {
+			__m512d uRe = _mm512_set1_pd(u[2*k]), uIm = _mm512_set1_pd(u[2*k+1]);
+			__m512d vRe = _mm512_set1_pd(v[2*k]), vIm = _mm512_set1_pd(v[2*k+1]);
+			__m512d productU, productV;
+			bandColumnProductPair_avx512(N, i, k, band, alpha2, alpha2v, uRe, uIm, vRe, vIm, productU, productV);
+			sumU0 = _mm512_add_pd(sumU0, productU);
+			sumV0 = _mm512_add_pd(sumV0, productV);
+			bandColumnProductPair_avx512(N, i+4, k, band, alpha2, alpha2v, uRe, uIm, vRe, vIm, productU, productV);
+			sumU1 = _mm512_add_pd(sumU1, productU);
+			sumV1 = _mm512_add_pd(sumV1, productV);
+		}
+
+		bool last = i+R > twoNp1;
+		double* outU = last ? lastBlockU : Mu + 2*i;
+		double* outV = last ? lastBlockV : Mv + 2*i;
+		_mm512_storeu_pd(outU, sumU0);
+		_mm512_storeu_pd(outU + 8, sumU1);
+		_mm512_storeu_pd(outV, sumV0);
+		_mm512_storeu_pd(outV + 8, sumV1);
+		if(last) {
+			memcpy(Mu + 2*i, lastBlockU, 2*(twoNp1-i)*sizeof(double));
+			memcpy(Mv + 2*i, lastBlockV, 2*(twoNp1-i)*sizeof(double));
+		}
+	}
+}
+
+bool PEKernels::isSupported(Implementation impl)
+{
+	switch(impl) {
+	case AVX2:
+		return __builtin_cpu_supports("avx2");
+	case AVX512:
+		return __builtin_cpu_supports("avx512f");
+	default:
+		return true;
+	}
+}
+
+#else
+
+// No SIMD implementations on this platform.
+void PEKernels::multiplyByM_avx2(int N, const double* k2, const double* alpha2, const double* u, double* Mu) { multiplyByM_scalar(N, k2, alpha2, u, Mu); }
+void PEKernels::multiplyByM_avx512(int N, const double* k2, const double* alpha2, const double* u, double* Mu) { multiplyByM_scalar(N, k2, alpha2, u, Mu); }
+template<int N>
+static void multiplyByMFixed_avx2(const double* k2, const double* alpha2, const double* u, double* Mu) { multiplyByMFixed_scalar<N>(k2, alpha2, u, Mu); }
+template<int N>
+static void multiplyByMFixed_avx512(const double* k2, const double* alpha2, const double* u, double* Mu) { multiplyByMFixed_scalar<N>(k2, alpha2, u, Mu); }
+template<int N>
+static void multiplyByMPairFixed_avx2(const double* k2, const double* alpha2, const double* u, double* Mu, const double* alpha2v, const double* v, double* Mv) { multiplyByMFixed_scalar<N>(k2, alpha2, u, Mu); multiplyByMFixed_scalar<N>(k2, alpha2v, v, Mv); }
+template<int N>
+static void multiplyByMPairFixed_avx512(const double* k2, const double* alpha2, const double* u, double* Mu, const double* alpha2v, const double* v, double* Mv) { multiplyByMFixed_scalar<N>(k2, alpha2, u, Mu); multiplyByMFixed_scalar<N>(k2, alpha2v, v, Mv); }
+bool PEKernels::isSupported(Implementation impl) { return impl == Scalar; }
+
+#endif
+
+PEKernels::Implementation PEKernels::best()
+{
+	// Determined once. (Static initialization of a local is not guaranteed thread-safe in C++98, but every thread would compute the same value.)
+	static int bestImplementation = -1;
+	if(bestImplementation < 0) {
+		if(isSupported(AVX512))
+			bestImplementation = AVX512;
+		else if(isSupported(AVX2))
+			bestImplementation = AVX2;
+		else
+			bestImplementation = Scalar;
+	}
+	return Implementation(bestImplementation);
+}
+
+const char* PEKernels::name(Implementation impl)
+{
+	switch(impl) {
+	case AVX2:
+		return "avx2";
+	case AVX512:
+		return "avx512";
+	default:
+		return "scalar";
+	}
+}
+
+PEKernels::Implementation PEKernels::bestFor(int N)
+{
+	Implementation impl = best();
+	if(impl == AVX512 && N < 32)
+		impl = AVX2;
+	if(N < 8)
+		impl = Scalar;
+	return impl;
+}
+
+void PEKernels::multiplyByM(Implementation impl, int N, const double* k2, const double* alpha2, const double* u, double* Mu)
+{
+	run(isSupported(impl) ? impl : Scalar, N, k2, alpha2, u, Mu);
+}
+
+void PEKernels::multiplyByMPair(Implementation impl, int N, const double* k2, const double* alpha2, const double* u, double* Mu, const double* alpha2v, const double* v, double* Mv)
+{
+	runPair(isSupported(impl) ? impl : Scalar, N, k2, alpha2, u, Mu, alpha2v, v, Mv);
+}
+
+// Calls implementation \c impl of the kernels specialized for truncation index N.
+template<int N>
+static void multiplyByMFixed(PEKernels::Implementation impl, const double* k2, const double* alpha2, const double* u, double* Mu)
+{
+	switch(impl) {
+	case PEKernels::AVX2:
+		multiplyByMFixed_avx2<N>(k2, alpha2, u, Mu);
+		break;
+	case PEKernels::AVX512:
+		multiplyByMFixed_avx512<N>(k2, alpha2, u, Mu);
+		break;
+	default:
+		multiplyByMFixed_scalar<N>(k2, alpha2, u, Mu);
+		break;
+	}
+}
+
+// Calls implementation \c impl of the multiplyByMPair() kernels specialized for truncation index N.  The scalar kernel has nothing to share between the vectors, so it's just called twice.
+template<int N>
+static void multiplyByMPairFixed(PEKernels::Implementation impl, const double* k2, const double* alpha2, const double* u, double* Mu, const double* alpha2v, const double* v, double* Mv)
+{
+	switch(impl) {
+	case PEKernels::AVX2:
+		multiplyByMPairFixed_avx2<N>(k2, alpha2, u, Mu, alpha2v, v, Mv);
+		break;
+	case PEKernels::AVX512:
+		multiplyByMPairFixed_avx512<N>(k2, alpha2, u, Mu, alpha2v, v, Mv);
+		break;
+	default:
+		multiplyByMFixed_scalar<N>(k2, alpha2, u, Mu);
+		multiplyByMFixed_scalar<N>(k2, alpha2v, v, Mv);
+		break;
+	}
+}
+
+bool PEKernels::isSpecialized(int N)
+{
+	switch(N) {
+	case 5:
+	case 10:
+	case 15:
+	case 20:
+	case 30:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void PEKernels::run(Implementation impl, int N, const double* k2, const double* alpha2, const double* u, double* Mu)
+{
+	// the truncation indexes in common use have their own compiled kernels. Keep this in sync with isSpecialized().
+	switch(N) {
+	case 5:
+		multiplyByMFixed<5>(impl, k2, alpha2, u, Mu);
+		return;
+	case 10:
+		multiplyByMFixed<10>(impl, k2, alpha2, u, Mu);
+		return;
+	case 15:
+		multiplyByMFixed<15>(impl, k2, alpha2, u, Mu);
+		return;
+	case 20:
+		multiplyByMFixed<20>(impl, k2, alpha2, u, Mu);
+		return;
+	case 30:
+		multiplyByMFixed<30>(impl, k2, alpha2, u, Mu);
+		return;
+	default:
+		runGeneric(impl, N, k2, alpha2, u, Mu);
+		return;
+	}
+}
+
+void PEKernels::runPair(Implementation impl, int N, const double* k2, const double* alpha2, const double* u, double* Mu, const double* alpha2v, const double* v, double* Mv)
+{
+	// Keep this in sync with isSpecialized() too.
+	switch(N) {
+	case 5:
+		multiplyByMPairFixed<5>(impl, k2, alpha2, u, Mu, alpha2v, v, Mv);
+		return;
+	case 10:
+		multiplyByMPairFixed<10>(impl, k2, alpha2, u, Mu, alpha2v, v, Mv);
+		return;
+	case 15:
+		multiplyByMPairFixed<15>(impl, k2, alpha2, u, Mu, alpha2v, v, Mv);
+		return;
+	case 20:
+		multiplyByMPairFixed<20>(impl, k2, alpha2, u, Mu, alpha2v, v, Mv);
+		return;
+	case 30:
+		multiplyByMPairFixed<30>(impl, k2, alpha2, u, Mu, alpha2v, v, Mv);
+		return;
+	default:
+		runGeneric(impl, N, k2, alpha2, u, Mu);
+		runGeneric(impl, N, k2, alpha2v, v, Mv);
+		return;
+	}
+}
+
+void PEKernels::runGeneric(Implementation impl, int N, const double* k2, const double* alpha2, const double* u, double* Mu)
+{
+	switch(impl) {
+	case AVX2:
+		multiplyByM_avx2(N, k2, alpha2, u, Mu);
+		break;
+	case AVX512:
+		multiplyByM_avx512(N, k2, alpha2, u, Mu);
+		break;
+	default:
+		multiplyByM_scalar(N, k2, alpha2, u, Mu);
+		break;
+	}
+}
+
+double PEKernels::verify(int N)
+{
+	int twoNp1 = 2*N + 1;
+	// one buffer for the inputs and outputs: k2, u, Mu1, Mu2, v, Mv1, Mv2 (2N+1 complex each), alpha2, and alpha2v (for multiplyByMPair()).
+	std::vector<double> buffer(16*twoNp1);
+	double* k2 = &buffer[0];
+	double* u = k2 + 2*twoNp1;
+	double* Mu1 = u + 2*twoNp1;
+	double* Mu2 = Mu1 + 2*twoNp1;
+	double* v = Mu2 + 2*twoNp1;
+	double* Mv1 = v + 2*twoNp1;
+	double* Mv2 = Mv1 + 2*twoNp1;
+	double* alpha2 = Mv2 + 2*twoNp1;
+	double* alpha2v = alpha2 + twoNp1;
+
+	// pseudo-random inputs in [-0.5, 0.5), from a local linear congruential generator, so that every call checks the same inputs and doesn't touch the global rand() state.
+	unsigned int state = 12345u;
+	for(int i=0; i<2*twoNp1; ++i) {
+		state = 1664525u*state + 1013904223u;
+		k2[i] = state/4294967296.0 - 0.5;
+		state = 1664525u*state + 1013904223u;
+		u[i] = state/4294967296.0 - 0.5;
+		state = 1664525u*state + 1013904223u;
+		v[i] = state/4294967296.0 - 0.5;
+	}
+	for(int i=0; i<twoNp1; ++i) {
+		state = 1664525u*state + 1013904223u;
+		alpha2[i] = state/4294967296.0;
+		state = 1664525u*state + 1013904223u;
+		alpha2v[i] = state/4294967296.0;
+	}
+
+	multiplyByM_scalar(N, k2, alpha2, u, Mu2);
+	multiplyByM_scalar(N, k2, alpha2v, v, Mv2);
+
+	// check every implementation this CPU supports, not just the one bestFor(N) would use: the version specialized for N (if there is one), and the generic version, and multiplyByMPair().
+	double maxDifference = 0;
+	const Implementation impls[] = { Scalar, AVX2, AVX512 };
+	for(int m=0; m<3; ++m) {
+		if(!isSupported(impls[m]))
+			continue;
+		for(int specialized=0; specialized<2; ++specialized) {
+			if(specialized)
+				run(impls[m], N, k2, alpha2, u, Mu1);
+			else if(impls[m] != Scalar)
+				runGeneric(impls[m], N, k2, alpha2, u, Mu1);
+			else
+				continue;
+			for(int i=0; i<2*twoNp1; ++i)
+				maxDifference = std::max(maxDifference, fabs(Mu1[i] - Mu2[i]));
+		}
+
+		runPair(impls[m], N, k2, alpha2, u, Mu1, alpha2v, v, Mv1);
+		for(int i=0; i<2*twoNp1; ++i)
+			maxDifference = std::max(maxDifference, std::max(fabs(Mu1[i] - Mu2[i]), fabs(Mv1[i] - Mv2[i])));
+	}
+
+	return maxDifference;
+}
@@ -0,0 +1,75 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PEKERNELS_H
+#define PEKERNELS_H
+
+/// Low-level numerical kernels for the innermost loops of PESolver, with SIMD implementations that are selected at runtime depending on what the CPU supports.
+/*! All implementations of a kernel do exactly the same floating-point operations in the same order for each output value (no fused multiply-adds, no re-ordered sums), so they give bit-identical results; the SIMD versions just compute several outputs at once. PEKernels.cpp switches off floating-point contraction (and GCC's SLP vectorizer, which fuses the scalar complex products) for itself, so this holds whatever the build flags. verify() checks this at runtime against the scalar implementation.
+
+Each implementation also has versions compiled for a fixed truncation index N, for the values in common use (see isSpecialized()). With N known at compile time, the coefficients go into a zero-padded array on the stack, and blocks of rows are computed with several independent sums, so the band edges need no special cases and the additions don't wait on each other. They are used automatically; other values of N use the generic versions.  They do the same operations in the same order for each output value as the generic versions, so their results are identical too.*/
+class PEKernels {
+public:
+	/// Available kernel implementations.
+	enum Implementation { Scalar, AVX2, AVX512 };
+
+	/// Returns the fastest implementation supported by this CPU (and by the compiler this was built with). Determined once, on first use.
+	static Implementation best();
+	/// Returns the fastest supported implementation for size \c N.  For small N, the band edges (which need special handling) are a large part of the work, so narrower vectors or the scalar version can be faster.
+	static Implementation bestFor(int N);
+	/// Returns the name of an implementation, ex: "avx2".
+	static const char* name(Implementation impl);
+
+	/// Computes \c Mu = M \c u, where M_nm = -k^2_{n-m} + \c alpha2_n delta_nm for n,m in [-N, N], and k^2_{n-m} is taken as zero outside |n-m| <= N.  This is the banded Toeplitz-plus-diagonal product in the grating ODE u'' = M u.
+	/*! \c k2 holds the 2N+1 complex coefficients k^2_{-N}...k^2_{N}, and \c u and \c Mu hold 2N+1 complex values, all in {re,im} order. \c alpha2 holds the 2N+1 real diagonal values. Uses the implementation from bestFor(N).*/
+	static void multiplyByM(int N, const double* k2, const double* alpha2, const double* u, double* Mu) {
+		run(bestFor(N), N, k2, alpha2, u, Mu);
+	}
+	/// Computes multiplyByM() using a specific implementation \c impl.  If \c impl isn't supported on this machine, uses Scalar instead.
+	static void multiplyByM(Implementation impl, int N, const double* k2, const double* alpha2, const double* u, double* Mu);
+
+	/// Computes two products with the same k^2 band at once: \c Mu = M \c u as in multiplyByM(), and \c Mv = M' \c v, where M' has the diagonal \c alpha2v instead of \c alpha2.  The results are identical to two calls of multiplyByM(), but the SIMD versions specialized for N load and shuffle each coefficient once for both vectors.  (PESolver uses this for the TE u'' = M u and the TM H' = [[epsilon]] v, which share the k^2 expansion.)
+	static void multiplyByMPair(int N, const double* k2, const double* alpha2, const double* u, double* Mu, const double* alpha2v, const double* v, double* Mv) {
+		runPair(bestFor(N), N, k2, alpha2, u, Mu, alpha2v, v, Mv);
+	}
+	/// Computes multiplyByMPair() using a specific implementation \c impl.  If \c impl isn't supported on this machine, uses Scalar instead.
+	static void multiplyByMPair(Implementation impl, int N, const double* k2, const double* alpha2, const double* u, double* Mu, const double* alpha2v, const double* v, double* Mv);
+
+	/// Returns true if there are kernels compiled specially for truncation index \c N: currently N = 5, 10, 15, 20, and 30.
+	static bool isSpecialized(int N);
+
+	/// Accuracy check: runs multiplyByM() and multiplyByMPair() with fixed pseudo-random inputs of size \c N, using every implementation this CPU supports (both the version specialized for N, if there is one, and the generic version), and the generic scalar implementation, and returns the largest absolute difference between them. This should be exactly 0.
+	static double verify(int N);
+
+protected:
+	/// Calls the multiplyByM() implementation \c impl, without checking if it's supported. Uses the version specialized for \c N if there is one, or runGeneric() otherwise.
+	static void run(Implementation impl, int N, const double* k2, const double* alpha2, const double* u, double* Mu);
+	/// Calls the multiplyByMPair() implementation \c impl, without checking if it's supported: the version specialized for \c N if there is one, or two calls of runGeneric() otherwise.
+	static void runPair(Implementation impl, int N, const double* k2, const double* alpha2, const double* u, double* Mu, const double* alpha2v, const double* v, double* Mv);
+	/// Calls the generic (any N) version of implementation \c impl.
+	static void runGeneric(Implementation impl, int N, const double* k2, const double* alpha2, const double* u, double* Mu);
+	static void multiplyByM_scalar(int N, const double* k2, const double* alpha2, const double* u, double* Mu);
+	static void multiplyByM_avx2(int N, const double* k2, const double* alpha2, const double* u, double* Mu);
+	static void multiplyByM_avx512(int N, const double* k2, const double* alpha2, const double* u, double* Mu);
+	/// Returns true if \c impl is supported by this CPU and compiler.
+	static bool isSupported(Implementation impl);
+};
+
+#endif // PEKERNELS_H
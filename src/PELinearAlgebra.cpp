@@ -0,0 +1,144 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "PELinearAlgebra.h"
+
+#include <string.h>
+#include <gsl/gsl_complex_math.h>
+#include <gsl/gsl_errno.h>
+
+#ifdef PEG_USE_LAPACK
+
+// LAPACK (Fortran) interface. Works with the reference LAPACK, OpenBLAS, MKL (LP64 interface), and anything else that uses 32-bit integers.
+extern "C" {
+	void zgetrf_(const int* m, const int* n, double* a, const int* lda, int* ipiv, int* info);
+	void zgetrs_(const char* trans, const int* n, const int* nrhs, const double* a, const int* lda, const int* ipiv, double* b, const int* ldb, int* info);
+}
+
+PELUFactorization::PELUFactorization(int n)
+{
+	n_ = n;
+	LU_ = 0;
+	ipiv_ = new int[n_];
+}
+
+PELUFactorization::~PELUFactorization()
+{
+	delete [] ipiv_;
+}
+
+// LAPACK uses column-major storage, so it sees our row-major matrices transposed. We factor A^T = P L U, and then X A = B is the same as A^T X^T = B^T, which zgetrs solves directly with B's storage as B^T.
+bool PELUFactorization::decompose(gsl_matrix_complex *A)
+{
+	int lda = A->tda;
+	int info;
+	zgetrf_(&n_, &n_, A->data, &lda, ipiv_, &info);
+	LU_ = A;
+	return info == 0;
+}
+
+bool PELUFactorization::solveRight(gsl_matrix_complex *B)
+{
+	if(!LU_ || (int)B->size2 != n_)
+		return false;
+
+	const char trans = 'N';
+	int nrhs = B->size1;
+	int lda = LU_->tda, ldb = B->tda;
+	int info;
+	zgetrs_(&trans, &n_, &nrhs, LU_->data, &lda, ipiv_, B->data, &ldb, &info);
+	return info == 0;
+}
+
+const char * PELUFactorization::backendName()
+{
+	return "LAPACK";
+}
+
+#else
+
+#include <gsl/gsl_linalg.h>
+#include <gsl/gsl_blas.h>
+
+PELUFactorization::PELUFactorization(int n)
+{
+	n_ = n;
+	LU_ = 0;
+	permutation_ = gsl_permutation_alloc(n_);
+	rowWork_ = new double[2*n_];
+}
+
+PELUFactorization::~PELUFactorization()
+{
+	gsl_permutation_free(permutation_);
+	delete [] rowWork_;
+}
+
+bool PELUFactorization::decompose(gsl_matrix_complex *A)
+{
+	LU_ = 0;
+	int signum;
+	if(gsl_linalg_complex_LU_decomp(A, permutation_, &signum) != GSL_SUCCESS)
+		return false;
+
+	// gsl_linalg_complex_LU_decomp() doesn't report singular matrices; check the diagonal of U.
+	for(int i=0; i<n_; ++i) {
+		gsl_complex d = gsl_matrix_complex_get(A, i, i);
+		if(GSL_REAL(d) == 0 && GSL_IMAG(d) == 0)
+			return false;
+	}
+
+	LU_ = A;
+	return true;
+}
+
+// We have P A = L U, so X A = B means (X P^T) L U = B.  Solve for Y = X P^T with two triangular solves from the right, and then X = Y P.
+bool PELUFactorization::solveRight(gsl_matrix_complex *B)
+{
+	if(!LU_ || (int)B->size2 != n_)
+		return false;
+
+	gsl_complex one = gsl_complex_rect(1,0);
+	// B := B U^{-1}
+	if(gsl_blas_ztrsm(CblasRight, CblasUpper, CblasNoTrans, CblasNonUnit, one, LU_, B) != GSL_SUCCESS)
+		return false;
+	// B := B L^{-1}
+	if(gsl_blas_ztrsm(CblasRight, CblasLower, CblasNoTrans, CblasUnit, one, LU_, B) != GSL_SUCCESS)
+		return false;
+
+	// X = Y P: row i of P A is row p[i] of A, so column p[i] of X is column i of Y.
+	const size_t* p = permutation_->data;
+	for(size_t r=0, rows=B->size1; r<rows; ++r) {
+		double* row = B->data + 2*r*B->tda;
+		memcpy(rowWork_, row, 2*n_*sizeof(double));
+		for(int i=0; i<n_; ++i) {
+			row[2*p[i]] = rowWork_[2*i];
+			row[2*p[i]+1] = rowWork_[2*i+1];
+		}
+	}
+	return true;
+}
+
+const char * PELUFactorization::backendName()
+{
+	return "GSL";
+}
+
+#endif
@@ -0,0 +1,74 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PELINEARALGEBRA_H
+#define PELINEARALGEBRA_H
+
+#include <gsl/gsl_matrix_complex_double.h>
+#include <gsl/gsl_permutation.h>
+
+/// LU factorization of a square complex matrix, used to solve the linear systems in the S-matrix recursion without forming any inverses.
+/*! The matrix products in PESolver go through gsl_blas_zgemm(), which calls whichever CBLAS library is linked (GSL's reference gslcblas, or an optimized one like OpenBLAS, MKL or BLIS).  The factorization and solves are done here: by default with GSL (gsl_linalg_complex_LU_decomp() and gsl_blas_ztrsm(), so they also use the linked CBLAS), or, when built with PEG_USE_LAPACK defined, with LAPACK's zgetrf and zgetrs.
+
+\code
+PELUFactorization lu(n);
+if(!lu.decompose(A) || !lu.solveRight(B))	// B := B A^{-1}
+	return PEResult(PEResult::AlgebraFailure);
+\endcode
+
+All storage is allocated once in the constructor, so one object can be re-used for many factorizations of the same size.*/
+class PELUFactorization {
+public:
+	/// Allocate storage for factorizing \c n x \c n matrices.
+	PELUFactorization(int n);
+	/// Release storage.
+	~PELUFactorization();
+
+	/// Computes the LU decomposition of \c A, overwriting \c A with the factors.  \c A must not be modified until you are done calling solveRight(). Returns false if \c A is singular.
+	bool decompose(gsl_matrix_complex* A);
+	/// Solves X A = B for X, where A is the last matrix given to decompose().  Overwrites \c B (which must have n columns, and any number of rows) with X = B A^{-1}. Returns false on failure.
+	bool solveRight(gsl_matrix_complex* B);
+
+	/// Returns the name of the linear algebra backend this was built with: "GSL" or "LAPACK".
+	static const char* backendName();
+
+protected:
+	/// Size of the matrices.
+	int n_;
+	/// The last decomposed matrix, holding the L and U factors.
+	gsl_matrix_complex* LU_;
+
+#ifdef PEG_USE_LAPACK
+	/// Pivot indices from zgetrf.
+	int* ipiv_;
+#else
+	/// Row permutation from gsl_linalg_complex_LU_decomp().
+	gsl_permutation* permutation_;
+	/// Work space for one row (n complex values), used to apply the permutation.
+	double* rowWork_;
+#endif
+
+private:
+	// Not copyable.
+	PELUFactorization(const PELUFactorization&);
+	PELUFactorization& operator=(const PELUFactorization&);
+};
+
+#endif // PELINEARALGEBRA_H
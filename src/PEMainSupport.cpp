@@ -20,6 +20,12 @@ along with PEG.  If not, see <http://www.gnu.org/licenses/>.
 #include "PEMainSupport.h"
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
 
 void PECommandLineOptions::init() {
 	mode = InvalidMode;
@@ -33,14 +39,33 @@ void PECommandLineOptions::init() {
 
 	eV = false;
 	printDebugOutput = false;
-	threads = 1;	// by default, just one thread.
+	threads = 1;	// by default, just one thread. 0 means auto (decided by the program).
 	measureTiming = false;
+	profileFormat = NoProfile;	// default: no profile file.
+	schedule = DynamicSchedule;	// default: hand out steps on demand (pegMPI only).
+	chunkSize = 0;	// default: auto (see autoChunkSize()).
+	outputFormat = TextFormat;	// default: text output file.
+	cacheSizeMB = 1024;	// default: the result cache (if --cacheDir is given) can use up to 1 GB.
+	flushInterval = 1;	// default: flush the output file (and update the progress) at most once per second.
 	integrationTolerance = 1e-5;	// default: 1e-5 if not provided.
+	integrationAbsTolerance = -1;	// default: same as integrationTolerance.
+	odeStepper = PEMathOptions::MSAdamsStepper;
+	fixedSteps = 200;	// default: 200 steps per layer, for the rk4fixed stepper.
+	benchmarkSteppers = false;
+	expansionTablePoints = 0;	// default: compute the grating expansion directly at every step.
+	adaptiveLayers = false;	// default: uniform layers.
+	warmStart = false;	// default: every calculation starts from scratch.
+	matrixIntegration = false;	// default: integrate each trial solution separately.
+	adaptiveNTolerance = 0;	// default: always use N.
+	polarization = PEMathOptions::TEPolarization;	// default: TE only.
 	coatingThickness = 0;	// default: 0 (no coating) if not provided.
 
 	rmsRoughnessNm = 0;
 
 	showLegal = false;
+
+	serve = false;
+	serveRequest = false;
 }
 
 // Sets options based on command-line input arguments. Returns isValid().
@@ -75,6 +100,25 @@ bool PECommandLineOptions::parseFromCommandLine(int argc, char** argv) {
 				{"coatingThickness", required_argument, 0, 22},
 				{"showLegal", no_argument, 0, 23},
 				{"rmsRoughnessNm", required_argument, 0, 24},
+				{"expansionTablePoints", required_argument, 0, 25},
+				{"schedule", required_argument, 0, 26},
+				{"chunkSize", required_argument, 0, 27},
+				{"flushInterval", required_argument, 0, 28},
+				{"outputFormat", required_argument, 0, 29},
+				{"checkpointFile", required_argument, 0, 30},
+				{"cacheDir", required_argument, 0, 31},
+				{"cacheSize", required_argument, 0, 32},
+				{"adaptiveLayers", no_argument, 0, 33},
+				{"warmStart", no_argument, 0, 34},
+				{"odeStepper", required_argument, 0, 35},
+				{"fixedSteps", required_argument, 0, 36},
+				{"integrationAbsTolerance", required_argument, 0, 37},
+				{"benchmarkSteppers", no_argument, 0, 38},
+				{"profile", required_argument, 0, 39},
+				{"matrixIntegration", no_argument, 0, 40},
+				{"serve", no_argument, 0, 41},
+				{"adaptiveN", required_argument, 0, 42},
+				{"polarization", required_argument, 0, 43},
 				{0, 0, 0, 0}
 			};
 				
@@ -180,7 +224,9 @@ bool PECommandLineOptions::parseFromCommandLine(int argc, char** argv) {
 				printDebugOutput = true;
 				break;
 			case 18: // number of threads to use for fine parallelization
-				threads = atol(optarg);
+				if(strcmp(optarg, "auto") == 0) threads = 0;
+				else if(atol(optarg) < 1) throw "The number of --threads to use for fine parallelization must be a positive number, at least 1, or auto.";
+				else threads = atol(optarg);
 				break;
 			case 19: // measure timing
 				measureTiming = true;
@@ -200,6 +246,75 @@ bool PECommandLineOptions::parseFromCommandLine(int argc, char** argv) {
 			case 24: // rmsRoughnessNm
 				rmsRoughnessNm = atof(optarg);
 				break;
+			case 25: // expansionTablePoints
+				expansionTablePoints = atol(optarg);
+				break;
+			case 26: // schedule (pegMPI only)
+				if(strcmp(optarg, "dynamic") == 0) schedule = DynamicSchedule;
+				else if(strcmp(optarg, "cyclic") == 0) schedule = CyclicSchedule;
+				else throw "The argument to --schedule must be one of: dynamic, or cyclic.";
+				break;
+			case 27: // chunkSize (pegMPI only)
+				if(strcmp(optarg, "auto") == 0) chunkSize = 0;
+				else if(atol(optarg) < 1) throw "The --chunkSize must be a positive number of steps, at least 1, or auto.";
+				else chunkSize = atol(optarg);
+				break;
+			case 28: // flushInterval
+				flushInterval = atof(optarg);
+				break;
+			case 29: // outputFormat
+				if(strcmp(optarg, "text") == 0) outputFormat = TextFormat;
+				else if(strcmp(optarg, "binary") == 0) outputFormat = BinaryFormat;
+				else throw "The argument to --outputFormat must be one of: text, or binary.";
+				break;
+			case 30: // checkpointFile
+				checkpointFile = optarg;
+				break;
+			case 31: // cacheDir
+				cacheDir = optarg;
+				break;
+			case 32: // cacheSize
+				cacheSizeMB = atof(optarg);
+				break;
+			case 33: // adaptiveLayers
+				adaptiveLayers = true;
+				break;
+			case 34: // warmStart
+				warmStart = true;
+				break;
+			case 35: // odeStepper
+				if(!PEMathOptions::stepperFromName(optarg, odeStepper)) throw "The argument to --odeStepper must be one of: msadams, rk8pd, rkck, bsimp, or rk4fixed.";
+				break;
+			case 36: // fixedSteps
+				fixedSteps = atol(optarg);
+				break;
+			case 37: // integrationAbsTolerance
+				integrationAbsTolerance = atof(optarg);
+				if(integrationAbsTolerance < 0) throw "The --integrationAbsTolerance must be larger than or equal to 0.";
+				break;
+			case 38: // benchmarkSteppers (pegSerial only)
+				benchmarkSteppers = true;
+				break;
+			case 39: // profile
+				if(strcmp(optarg, "json") == 0) profileFormat = JSONProfile;
+				else if(strcmp(optarg, "csv") == 0) profileFormat = CSVProfile;
+				else throw "The argument to --profile must be one of: json, or csv.";
+				break;
+			case 40: // matrixIntegration
+				matrixIntegration = true;
+				break;
+			case 41: // serve (pegSerial only)
+				serve = true;
+				break;
+			case 42: // adaptiveN
+				adaptiveNTolerance = atof(optarg);
+				if(adaptiveNTolerance <= 0) throw "The argument to --adaptiveN must be a tolerance (in efficiency) larger than 0.";
+				break;
+			case 43: // polarization
+				if(strcmp(optarg, "te") == 0) polarization = PEMathOptions::TEPolarization;
+				else if(strcmp(optarg, "both") == 0) polarization = PEMathOptions::TEAndTMPolarization;
+				else throw "The argument to --polarization must be one of: te, or both.";
+				break;
 			}
 		} // end of loop over input options.
 				
@@ -216,6 +331,15 @@ bool PECommandLineOptions::parseFromCommandLine(int argc, char** argv) {
 // Returns true if all required input options have been provided correctly.
 bool PECommandLineOptions::isValid() {
 	try {
+		// A server only needs its own options; each request brings the rest.
+		if(serve) {
+			if(threads < 0) throw "The number of --threads to use for serving requests must be a positive number, at least 1, or auto.";
+			if(flushInterval < 0) throw "The --flushInterval must be a time in seconds, larger than or equal to 0.";
+			if(cacheSizeMB <= 0) throw "The --cacheSize must be a size in MB, larger than 0.";
+			firstErrorMessage_ = "No errors.";
+			return true;
+		}
+
 		// Check for missing/invalid input
 		if(mode == InvalidMode) throw "The operating mode --mode must be provided: constantIncidence, constantIncludedAngle, or constantWavelength";
 		if(min == DBL_MAX) throw "The minimum range --min must be provided.";
@@ -227,7 +351,7 @@ bool PECommandLineOptions::isValid() {
 		if(mode == ConstantIncludedAngle && toOrder == INT_MAX) throw "In constant included angle mode, the operating order --toOrder must be provided.";
 		if(mode == ConstantWavelength && wavelength == DBL_MAX) throw "In constant wavelength mode, the wavelength --wavelength must be provided.";
 		
-		if(outputFile.empty()) throw "The output data file --outputFile must be provided.";
+		if(outputFile.empty() && !serveRequest) throw "The output data file --outputFile must be provided.";
 		
 		if(profile == PEGrating::InvalidProfile) throw "The grating profile --gratingType must be provided.";
 		if(material.empty()) throw "The grating material --gratingMaterial must be provided.";
@@ -242,11 +366,13 @@ bool PECommandLineOptions::isValid() {
 		if(profile == PEGrating::SinusoidalProfile && geometry.size() != 1) throw "The sinusoidal profile requires one arguments to --gratingGeometry <depth>.";
 		if(profile == PEGrating::TrapezoidalProfile && geometry.size() != 4) throw "The trapezoidal profile requires four arguments to --gratingGeometry <depth>,<valleyWidth>,<blazeAngle>,<antiBlazeAngle>.";
 		if(profile == PEGrating::CustomProfile && (geometry.size() < 7 || geometry.size()%2 != 1)) throw "The custom (point-wise) profile requires arguments to --gratingGeometry: a maximum height (um), followed by a sequence of (x,y) points along the profile going from (0,0) to (1,0). They will be scaled so that (0,0)->(1,1) maps to (0,0)->(period,maxHeight).";
-
-		if(profile == PEGrating::CustomProfile && coatingThickness != 0) throw "The custom profile does not yet support coatings.";
 		
 		if(N == INT_MAX) throw "The truncation index --N must be provided.";
-		if(threads < 1) throw "The number of --threads to use for fine parallelization must be a positive number, at least 1.";
+		if(threads < 0) throw "The number of --threads to use for fine parallelization must be a positive number, at least 1, or auto.";
+		if(fixedSteps < 1) throw "The number of --fixedSteps per layer must be at least 1.";
+		if(chunkSize < 0) throw "The --chunkSize must be a positive number of steps, at least 1, or auto.";
+		if(flushInterval < 0) throw "The --flushInterval must be a time in seconds, larger than or equal to 0.";
+		if(cacheSizeMB <= 0) throw "The --cacheSize must be a size in MB, larger than 0.";
 
 		if(rmsRoughnessNm < 0) throw "The RMS roughness must be in nm, larger than or equal to 0.";
 	}
@@ -261,6 +387,76 @@ bool PECommandLineOptions::isValid() {
 }
 
 
+int PECommandLineOptions::autoChunkSize(int numThreads) const {
+	if(numThreads <= 1)
+		return 1;
+	// Each thread should get at least this many of the 4N+2 trial solutions in a point; otherwise, it's better to calculate several points at once with fewer threads each.
+	const int trialSolutionsPerThread = 16;
+	int threadsPerPoint = std::max(1, std::min(numThreads, (4*N+2)/trialSolutionsPerThread));
+	return std::max(1, numThreads / threadsPerPoint);
+}
+
+PEScanPoint PECommandLineOptions::scanPoint(int i) const {
+
+	double currentValue = min + increment*i;
+
+	// determine wavelength (um): depends on mode and eV/um setting.
+	double wl = (mode == ConstantWavelength) ? wavelength : currentValue;
+	if(eV)
+		wl = M_HC / wl;	// interpret input wavelength as eV instead, and convert to actual wavelength.  Formula: wavelength = hc / eV.     hc = 1.23984172 eV * um.
+
+	// determine incidence angle: depends on mode and possibly wavelength.
+	double incidence;
+	switch(mode) {
+	case ConstantIncidence:
+		incidence = incidenceAngle;
+		break;
+	case ConstantIncludedAngle: {
+		double ciaRad = includedAngle * M_PI / 180;
+		incidence = (asin(-toOrder*wl/2/period/cos(ciaRad/2)) + ciaRad/2) * 180 / M_PI;	// formula for constant included angle: satisfies alpha + beta = cia, and grating equation toOrder*wavelength/d = sin(beta) - sin(alpha).
+		break;
+		}
+	case ConstantWavelength:
+		incidence = currentValue;
+		break;
+	default:
+		incidence = 0; // never happens: input validation assures valid mode.
+		break;
+	}
+
+	return PEScanPoint(incidence, wl);
+}
+
+// This helper function creates the grating specified in \c io.
+PEGrating* createGrating(const PECommandLineOptions& io) {
+	switch(io.profile) {
+	case PEGrating::RectangularProfile:
+		return new PERectangularGrating(io.period, io.geometry[0], io.geometry[1], io.material, io.coating, io.coatingThickness);
+	case PEGrating::BlazedProfile:
+		return new PEBlazedGrating(io.period, io.geometry[0], io.geometry[1], io.material, io.coating, io.coatingThickness);
+	case PEGrating::SinusoidalProfile:
+		return new PESinusoidalGrating(io.period, io.geometry[0], io.material, io.coating, io.coatingThickness);
+	case PEGrating::TrapezoidalProfile:
+		return new PETrapezoidalGrating(io.period, io.geometry[0], io.geometry[1], io.geometry[2], io.geometry[3], io.material, io.coating, io.coatingThickness);
+	case PEGrating::CustomProfile:
+		return new PECustomProfileGrating(io.period, io.geometry, io.material, io.coating, io.coatingThickness);
+	default:
+		return 0;	// this will never happen; input validation assures one of the valid grating types.
+	}
+}
+
+// This helper function returns the math options specified in \c io.
+PEMathOptions createMathOptions(const PECommandLineOptions& io) {
+	PEMathOptions mathOptions(io.N, io.integrationTolerance, io.expansionTablePoints, true, io.adaptiveLayers, io.warmStart);
+	mathOptions.integrationAbsTolerance = io.integrationAbsTolerance;
+	mathOptions.stepper = io.odeStepper;
+	mathOptions.fixedStepsPerLayer = io.fixedSteps;
+	mathOptions.matrixIntegration = io.matrixIntegration;
+	mathOptions.adaptiveNTolerance = io.adaptiveNTolerance;
+	mathOptions.polarization = io.polarization;
+	return mathOptions;
+}
+
 /// This helper function writes the header to the output file stream
 void writeOutputFileHeader(std::ostream& of, const PECommandLineOptions& io) {
 	of << "# Input" << std::endl;
@@ -336,26 +532,56 @@ void writeOutputFileHeader(std::ostream& of, const PECommandLineOptions& io) {
 	
 	of << "N=" << io.N << std::endl;
 	of << "integrationTolerance=" << io.integrationTolerance << std::endl;
+	if(io.integrationAbsTolerance >= 0)
+		of << "integrationAbsTolerance=" << io.integrationAbsTolerance << std::endl;
+	if(io.odeStepper != PEMathOptions::MSAdamsStepper)
+		of << "odeStepper=" << PEMathOptions::stepperName(io.odeStepper) << std::endl;
+	if(io.odeStepper == PEMathOptions::FixedRK4Stepper)
+		of << "fixedSteps=" << io.fixedSteps << std::endl;
+	if(io.expansionTablePoints > 0)
+		of << "expansionTablePoints=" << io.expansionTablePoints << std::endl;
+	if(io.adaptiveLayers)
+		of << "adaptiveLayers=true" << std::endl;
+	if(io.warmStart)
+		of << "warmStart=true" << std::endl;
+	if(io.matrixIntegration)
+		of << "matrixIntegration=true" << std::endl;
+	if(io.adaptiveNTolerance > 0)
+		of << "adaptiveN=" << io.adaptiveNTolerance << std::endl;
+	if(io.polarization == PEMathOptions::TEAndTMPolarization)
+		of << "polarization=both" << std::endl;
 }
 
 // This helper function appends the progress to the given output stream
-void writeOutputFileProgress(std::ostream& of, int completedSteps, int totalSteps, bool anySuccesses, bool anyFailures) {
-	of << "# Progress" << std::endl;
+void writeOutputFileProgress(std::ostream& of, int completedSteps, int totalSteps, bool anySuccesses, bool anyFailures, bool fixedWidth) {
+	const char* status;
 	// not done yet:
 	if(completedSteps < totalSteps) {
-		of << "status=inProgress" << std::endl;
+		status = "inProgress";
 	}
 	// or all done:
 	else {
 		if(anySuccesses && anyFailures)
-			of << "status=someFailed" << std::endl;
+			status = "someFailed";
 		else if(anyFailures)
-			of << "status=allFailed" << std::endl;
+			status = "allFailed";
 		else
-			of << "status=succeeded" << std::endl;
+			status = "succeeded";
+	}
+
+	of << "# Progress" << std::endl;
+	if(fixedWidth) {
+		// pad completedSteps with leading zeros to the number of digits in totalSteps, plus one more for each character the status is shorter than the longest one ("inProgress"), so that the length never changes.
+		std::ostringstream total;
+		total << totalSteps;
+		int width = total.str().length() + 10 - strlen(status);
+		of << "status=" << status << std::endl;
+		of << "completedSteps=" << std::setw(width) << std::setfill('0') << completedSteps << std::setfill(' ') << std::endl;
+	}
+	else {
+		of << "status=" << status << std::endl;
+		of << "completedSteps=" << completedSteps << std::endl;
 	}
-	
-	of << "completedSteps=" << completedSteps << std::endl;
 	of << "totalSteps=" << totalSteps << std::endl;
 }
 
@@ -398,7 +624,301 @@ void writeOutputFileResult(std::ostream& of, const PEResult& result, const PECom
 				of << "\t";
 			of << result.eff.at(i);
 		}
+		// With --polarization both, the TM efficiencies follow, in the same order.
+		for(int i=0, cc=result.effTM.size(); i<cc; ++i)
+			of << "\t" << result.effTM.at(i);
+		// With --adaptiveN, also the N that was used, and the estimated truncation error.
+		if(io.adaptiveNTolerance > 0)
+			of << "\tN=" << result.usedN << "\terror=" << result.truncationError;
 		of << std::endl;
 		break;
 	}
 }
+
+
+PEOutputFileWriter::PEOutputFileWriter(const PECommandLineOptions& io) : io_(io) {
+	totalSteps_ = io_.totalSteps();
+	completedSteps_ = resultsWritten_ = 0;
+	anySuccesses_ = anyFailures_ = false;
+	lastFlushTime_ = 0;
+	recordLength_ = io_.recordLength();
+}
+
+PEOutputFileWriter::~PEOutputFileWriter() {
+	if(file_.is_open())
+		close();
+}
+
+// Returns the current time in seconds.
+static double currentTimeSeconds() {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+bool PEOutputFileWriter::open() {
+	bool binary = (io_.outputFormat == PECommandLineOptions::BinaryFormat);
+	file_.open(io_.outputFile.c_str(), binary ? (std::ios::out | std::ios::trunc | std::ios::binary) : (std::ios::out | std::ios::trunc));
+	if(!file_.is_open())
+		return false;
+
+	// Check that we can open the progress file, if provided:
+	if(!io_.progressFile.empty()) {
+		std::ofstream progressFile(io_.progressFile.c_str(), std::ios::out | std::ios::trunc);
+		if(!progressFile.is_open())
+			return false;
+		writeOutputFileProgress(progressFile, 0, totalSteps_, false, false);
+	}
+
+	if(binary) {
+		std::ostringstream header;
+		writeOutputFileHeader(header, io_);
+		std::string text = header.str();
+		text.resize((text.length() + 7)/8*8, ' ');	// pad so that the records are aligned.
+
+		char magic[8] = {'P','E','G','B','I','N','2',0};
+		uint32_t byteOrder = 0x01020304, textLength = text.length();
+		int64_t fields[2] = { totalSteps_, recordLength_ };
+		file_.write(magic, 8);
+		file_.write((const char*)&byteOrder, sizeof(byteOrder));
+		file_.write((const char*)&textLength, sizeof(textLength));
+		file_.write((const char*)fields, sizeof(fields));
+		progressPosition_ = file_.tellp();
+		writeBinaryProgress();
+		file_.write(text.data(), text.length());
+		record_.resize(recordLength_);
+	}
+	else {
+		writeOutputFileHeader(file_, io_);
+		// Remember this position in the output file; it is where we will over-write the progress
+		progressPosition_ = file_.tellp();
+		writeOutputFileProgress(file_, 0, totalSteps_, false, false, true);
+		file_ << "# Output" << std::endl;
+	}
+	file_.flush();
+	lastFlushTime_ = currentTimeSeconds();
+	return true;
+}
+
+void PEOutputFileWriter::writeResult(const PEResult& result) {
+	if(io_.outputFormat == PECommandLineOptions::BinaryFormat) {
+		result.toDoubleArray(&record_[0], io_.N, io_.withTM());
+		appendRecords(&record_[0], 1);
+	}
+	else
+		appendResult(result);
+	++completedSteps_;
+}
+
+void PEOutputFileWriter::writeRecords(const double* records, int count) {
+	appendRecords(records, count);
+	completedSteps_ += count;
+}
+
+void PEOutputFileWriter::writeRecordsAt(int firstStep, const double* records, int count) {
+	completedSteps_ += count;
+	if(firstStep != resultsWritten_) {
+		waitingRecords_[firstStep].assign(records, records + count*recordLength_);
+		return;
+	}
+
+	appendRecords(records, count);
+	// other results that have been waiting on this one:
+	while(!waitingRecords_.empty() && waitingRecords_.begin()->first == resultsWritten_) {
+		std::vector<double>& waiting = waitingRecords_.begin()->second;
+		appendRecords(&waiting[0], waiting.size() / recordLength_);
+		waitingRecords_.erase(waitingRecords_.begin());
+	}
+}
+
+PEResultArena::PEResultArena(int recordLength, int numSteps)
+	: recordLength_(recordLength), records_(size_t(numSteps)*recordLength, 0.0), completed_(numSteps, false), nextToWrite_(0) {
+}
+
+void PEResultArena::completed(int firstStep, int count, PEOutputFileWriter& writer) {
+	for(int i=firstStep; i<firstStep+count; ++i)
+		completed_[i] = true;
+	writer.countCompletedSteps(count);
+
+	// write the run of completed records that is now next in the output, if any, in one go.
+	int first = nextToWrite_;
+	while(nextToWrite_ < int(completed_.size()) && completed_[nextToWrite_])
+		++nextToWrite_;
+	if(nextToWrite_ > first)
+		writer.writeCountedRecords(record(first), nextToWrite_ - first);
+}
+
+void PEOutputFileWriter::appendResult(const PEResult& result) {
+	// results are written with '\n' instead of std::endl, so they are only flushed with flush().
+	std::ostringstream line;
+	writeOutputFileResult(line, result, io_);
+	file_ << line.str();
+
+	if(result.status == PEResult::Success)
+		anySuccesses_ = true;
+	else
+		anyFailures_ = true;
+	++resultsWritten_;
+}
+
+void PEOutputFileWriter::appendRecords(const double* records, int count) {
+	if(io_.outputFormat != PECommandLineOptions::BinaryFormat) {
+		PEResult result;
+		for(int i=0; i<count; ++i) {
+			result.fromDoubleArray(records + i*recordLength_, io_.N, io_.withTM());
+			appendResult(result);
+		}
+		return;
+	}
+
+	file_.write((const char*)records, count*recordLength_*sizeof(double));
+	for(int i=0; i<count; ++i) {
+		if(PEResult::Code(int(records[i*recordLength_])) == PEResult::Success)
+			anySuccesses_ = true;
+		else
+			anyFailures_ = true;
+	}
+	resultsWritten_ += count;
+}
+
+void PEOutputFileWriter::flushIfDue() {
+	if(currentTimeSeconds() - lastFlushTime_ >= io_.flushInterval)
+		flush();
+}
+
+void PEOutputFileWriter::flush() {
+	// The progress is fixed-width, so it can be over-written in place without touching the results after it.
+	std::streampos endPosition = file_.tellp();
+	file_.seekp(progressPosition_);
+	if(io_.outputFormat == PECommandLineOptions::BinaryFormat)
+		writeBinaryProgress();
+	else
+		writeOutputFileProgress(file_, completedSteps_, totalSteps_, anySuccesses_, anyFailures_, true);
+	file_.seekp(endPosition);
+	file_.flush();
+
+	// Update progress in progressFile, if provided.
+	if(!io_.progressFile.empty()) {
+		std::ofstream progressFile(io_.progressFile.c_str(), std::ios::out | std::ios::trunc);
+		writeOutputFileProgress(progressFile, completedSteps_, totalSteps_, anySuccesses_, anyFailures_);
+	}
+	lastFlushTime_ = currentTimeSeconds();
+}
+
+void PEOutputFileWriter::writeBinaryProgress() {
+	// status: same meaning as in writeOutputFileProgress().
+	int64_t status;
+	if(completedSteps_ < totalSteps_)
+		status = 0;	// inProgress
+	else if(anySuccesses_ && anyFailures_)
+		status = 2;	// someFailed
+	else if(anyFailures_)
+		status = 3;	// allFailed
+	else
+		status = 1;	// succeeded
+
+	int64_t fields[2] = { completedSteps_, status };
+	file_.write((const char*)fields, sizeof(fields));
+}
+
+void PEOutputFileWriter::close() {
+	flush();
+	file_.close();
+}
+
+
+PECheckpointFile::PECheckpointFile(const PECommandLineOptions& io) : io_(io) {
+	recordLength_ = io_.recordLength();
+	lastFlushTime_ = 0;
+}
+
+PECheckpointFile::~PECheckpointFile() {
+	if(file_.is_open())
+		file_.close();
+}
+
+std::string PECheckpointFile::identifyingText() const {
+	std::ostringstream text;
+	// at full precision: scans that differ only beyond the default 6 digits must not share a checkpoint.
+	text << std::setprecision(17);
+	writeOutputFileHeader(text, io_);
+	text << "rmsRoughnessNm=" << io_.rmsRoughnessNm << std::endl;
+	return text.str();
+}
+
+bool PECheckpointFile::open() {
+	const char magic[8] = {'P','E','G','C','K','P','T','1'};
+	std::string text = identifyingText();
+	int entryLength = recordLength_ + 1;
+
+	// Load the entries from an earlier run, if the file is for this calculation.
+	off_t validLength = 0;
+	std::ifstream in(io_.checkpointFile.c_str(), std::ios::in | std::ios::binary);
+	if(in.is_open() && in.peek() != std::ifstream::traits_type::eof()) {
+		char fileMagic[8];
+		uint32_t textLength = 0, recordLength = 0;
+		in.read(fileMagic, 8);
+		in.read((char*)&textLength, sizeof(textLength));
+		in.read((char*)&recordLength, sizeof(recordLength));
+		std::string fileText;
+		if(in && textLength == text.length()) {
+			fileText.resize(textLength);
+			in.read(&fileText[0], textLength);
+		}
+
+		if(in && memcmp(fileMagic, magic, 8) == 0 && int(recordLength) == recordLength_ && fileText == text) {
+			validLength = in.tellg();
+			int totalSteps = io_.totalSteps();
+			std::vector<double> entry(entryLength);
+			while(in.read((char*)&entry[0], entryLength*sizeof(double))) {
+				int step = int(entry[0]);
+				if(step >= 0 && step < totalSteps)
+					loaded_[step].assign(entry.begin() + 1, entry.end());
+				validLength += entryLength*sizeof(double);
+			}
+		}
+		else
+			std::cerr << "Warning: The checkpoint file " << io_.checkpointFile << " is not for this calculation. Starting over." << std::endl;
+	}
+	in.close();
+
+	if(validLength > 0) {
+		// Discard any incomplete entry at the end, and append after the last complete one.
+		if(truncate(io_.checkpointFile.c_str(), validLength) != 0)
+			return false;
+		file_.open(io_.checkpointFile.c_str(), std::ios::out | std::ios::app | std::ios::binary);
+		if(!file_.is_open())
+			return false;
+	}
+	else {
+		file_.open(io_.checkpointFile.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+		if(!file_.is_open())
+			return false;
+		uint32_t textLength = text.length(), recordLength = recordLength_;
+		file_.write(magic, 8);
+		file_.write((const char*)&textLength, sizeof(textLength));
+		file_.write((const char*)&recordLength, sizeof(recordLength));
+		file_.write(text.data(), text.length());
+		file_.flush();
+	}
+	lastFlushTime_ = currentTimeSeconds();
+	return true;
+}
+
+void PECheckpointFile::save(int firstStep, const double* records, int count) {
+	if(!file_.is_open())
+		return;
+
+	for(int i=0; i<count; ++i) {
+		double step = firstStep + i;
+		file_.write((const char*)&step, sizeof(double));
+		file_.write((const char*)(records + i*recordLength_), recordLength_*sizeof(double));
+	}
+	if(currentTimeSeconds() - lastFlushTime_ >= io_.flushInterval)
+		flush();
+}
+
+void PECheckpointFile::flush() {
+	file_.flush();
+	lastFlushTime_ = currentTimeSeconds();
+}
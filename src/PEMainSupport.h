@@ -28,6 +28,7 @@ along with PEG.  If not, see <http://www.gnu.org/licenses/>.
 #include <cfloat>
 #include <climits>
 #include <vector>
+#include <map>
 #include <cmath>
 
 /// This file contains common support routines for both the parallel and sequential versions of the PEG command-line app, related to input and output handling.
@@ -36,6 +37,12 @@ along with PEG.  If not, see <http://www.gnu.org/licenses/>.
 class PECommandLineOptions {
 public:
 	enum Mode {InvalidMode, ConstantIncidence, ConstantIncludedAngle, ConstantWavelength};
+	/// How pegMPI distributes the calculation steps over its processes.
+	enum Schedule {DynamicSchedule, CyclicSchedule};
+	/// Format of the output file.
+	enum OutputFormat {TextFormat, BinaryFormat};
+	/// Format of the --profile file, if any.
+	enum ProfileFormat {NoProfile, JSONProfile, CSVProfile};
 	
 	// Input variables:
 	////////////////////////////////
@@ -46,6 +53,16 @@ public:
 
 	int N;
 	double integrationTolerance;
+	double integrationAbsTolerance;
+	PEMathOptions::Stepper odeStepper;
+	int fixedSteps;
+	bool benchmarkSteppers;
+	int expansionTablePoints;
+	bool adaptiveLayers;
+	bool warmStart;
+	bool matrixIntegration;
+	double adaptiveNTolerance;
+	PEMathOptions::Polarization polarization;
 
 	PEGrating::Profile profile;
 	double period;
@@ -53,15 +70,30 @@ public:
 	std::string material, coating;
 	double coatingThickness;
 
-	std::string outputFile, progressFile;
+	std::string outputFile, progressFile, checkpointFile;
+	OutputFormat outputFormat;
 
 	bool eV;
 	bool printDebugOutput;
 	int threads;
 	bool measureTiming;
+	ProfileFormat profileFormat;
+
+	Schedule schedule;
+	int chunkSize;
+
+	double flushInterval;
+
+	std::string cacheDir;
+	double cacheSizeMB;
 
 	bool showLegal;
 
+	/// pegSerial --serve: run as a long-lived server for calculation requests (see PEServer), instead of a single calculation.
+	bool serve;
+	/// Set (not from the command line) by PEServer for the options of each request: the --outputFile is optional, since the results are also streamed back to the client.
+	bool serveRequest;
+
 	double rmsRoughnessNm;
 
 	////////////////////////////////
@@ -76,6 +108,9 @@ public:
 		init();
 		parseFromCommandLine(argc, argv);
 	}
+
+	/// Returns the name of the --profile file: the output file name with ".profile.json" or ".profile.csv" added.
+	std::string profileFile() const { return outputFile + (profileFormat == CSVProfile ? ".profile.csv" : ".profile.json"); }
 	
 	/// Sets options based on command-line input arguments. Returns isValid().
 	bool parseFromCommandLine(int argc, char** argv);
@@ -85,6 +120,17 @@ public:
 	
 	/// If !isValid(), returns a description of the first error found during validation.
 	std::string firstErrorMessage() const { return firstErrorMessage_; }
+
+	/// Returns the number of calculation steps from min to max, in steps of increment.
+	int totalSteps() const { return int((max - min)/increment) + 1; }
+	/// Returns the number of steps to calculate at once with \c numThreads threads, when --chunkSize is auto.  For large N there are enough trial solutions (4N+2) to keep all the threads busy on one step, so this is 1. For small N, the threads are shared across several steps at once (see PESolver::getEffBatch()), with fewer threads on each.
+	int autoChunkSize(int numThreads) const;
+	/// Returns the incidence angle (deg) and wavelength (um) for calculation step \c i, from [0, totalSteps()-1].  These depend on the mode and the eV/um setting.
+	PEScanPoint scanPoint(int i) const;
+	/// Returns the number of doubles in each result record (see PEResult::toDoubleArray()), for the output, checkpoint, and MPI messages: 2N+7, and 2N+1 more with --polarization both.
+	int recordLength() const { return PEResult::recordLength(N, withTM()); }
+	/// Returns true if the result records include the TM efficiencies (--polarization both).
+	bool withTM() const { return polarization == PEMathOptions::TEAndTMPolarization; }
 	
 protected:
 	/// Initializes all input variables to recognizable values. Doubles are set to DBL_MAX, and integers are set to INT_MAX.
@@ -94,13 +140,171 @@ protected:
 };
 
 
+/// This helper function creates the grating specified by the --gratingType, --gratingPeriod, --gratingGeometry, --gratingMaterial, and coating options in \c io.  The caller owns the new grating, and must delete it.
+PEGrating* createGrating(const PECommandLineOptions& io);
+
+/// This helper function returns the math options (truncation index, tolerances, integration method, etc.) specified in \c io.
+PEMathOptions createMathOptions(const PECommandLineOptions& io);
+
 /// This helper function writes the header to the output file stream
 void writeOutputFileHeader(std::ostream& outputFileStream, const PECommandLineOptions& io);
 
 /// This helper function appends a single efficiency result to the output file stream
 void writeOutputFileResult(std::ostream& outputFileStream, const PEResult& result, const PECommandLineOptions& io);
 
-/// This helper function appends the progress description to the given output stream
-void writeOutputFileProgress(std::ostream& outputFileStream, int completedSteps, int totalSteps, bool anySuccesses, bool anyFailures);
+/// This helper function appends the progress description to the given output stream.  If \c fixedWidth, the completedSteps value is padded with leading zeros so that the description always has the same length for the same \c totalSteps, and can be over-written in place.
+void writeOutputFileProgress(std::ostream& outputFileStream, int completedSteps, int totalSteps, bool anySuccesses, bool anyFailures, bool fixedWidth = false);
+
+
+/// Writes the output file (and the --progressFile, if provided) as a calculation proceeds.
+/*! The header and progress are written once when opening the file, followed by the "# Output" line. Each result is then appended exactly once with writeResult() or writeRecords(), in the order they are given. The progress section is written with a fixed width, and is updated in place (along with the --progressFile) each time the file is flushed, which happens at most every --flushInterval seconds, and when closing.
+
+With --outputFormat binary, the output file is instead written in this layout (native byte order, normally little-endian), which can be memory-mapped for analysis:
+
+<table>
+<tr><td>Offset (bytes)</td><td>Type</td><td>Contents</td></tr>
+<tr><td>0</td><td>char[8]</td><td>"PEGBIN2" and a terminating 0. (PEGBIN1 files, from before usedN and truncationError were added to the records, had records of 2N+7 doubles.)</td></tr>
+<tr><td>8</td><td>uint32</td><td>0x01020304, to check the byte order</td></tr>
+<tr><td>12</td><td>uint32</td><td>Length L of the text header, in bytes (a multiple of 8)</td></tr>
+<tr><td>16</td><td>int64</td><td>totalSteps</td></tr>
+<tr><td>24</td><td>int64</td><td>Record length R, in doubles: 2N+7, or 4N+8 with --polarization both</td></tr>
+<tr><td>32</td><td>int64</td><td>completedSteps (updated as the calculation proceeds)</td></tr>
+<tr><td>40</td><td>int64</td><td>status: 0 = inProgress, 1 = succeeded, 2 = someFailed, 3 = allFailed (updated as the calculation proceeds)</td></tr>
+<tr><td>48</td><td>char[L]</td><td>The same "# Input" section as in the text format, padded with spaces</td></tr>
+<tr><td>48 + L</td><td>double[R] per result</td><td>One record per step, in order, as written by PEResult::toDoubleArray(): status code (PEResult::Code), wavelength (um), incidence angle (deg), N, the 2N+1 efficiencies from -N to N, the N actually used (PEResult::usedN; smaller than N only with --adaptiveN), and the estimated truncation error (PEResult::truncationError, or -1), followed by the 2N+1 TM efficiencies (PEResult::effTM) with --polarization both.  For failed steps, N and the efficiencies are 0.</td></tr>
+</table>
+
+The number of records in the file is the number of results written so far, which is given by the file size.
+
+\code
+PEOutputFileWriter writer(io);
+if(!writer.open()) ...
+for(...) {
+	writer.writeResult(result);
+	writer.flushIfDue();
+}
+writer.close();
+\endcode
+*/
+class PEOutputFileWriter {
+public:
+	/// Prepare to write the output for a calculation with options \c io, which must remain valid for the lifetime of this object.
+	PEOutputFileWriter(const PECommandLineOptions& io);
+	/// Closes the output file, if still open.
+	~PEOutputFileWriter();
+
+	/// Opens and truncates the output file (and the --progressFile, if provided), and writes the header, the initial progress, and the "# Output" line. Returns false if a file could not be opened.
+	bool open();
+	/// Appends \c result to the output, and counts it as a completed step.
+	void writeResult(const PEResult& result);
+	/// Appends \c count results packed with PEResult::toDoubleArray() in \c records (PECommandLineOptions::recordLength() doubles each, with 0 efficiencies for failures), and counts them as completed steps.  In the binary format, they are written as-is.
+	void writeRecords(const double* records, int count);
+	/// Adds \c count results packed like in writeRecords(), for the steps starting at \c firstStep, and counts them as completed steps.  Results can be added in any order: if they are next in the output, they are written right away (along with any waiting results that follow them), otherwise a copy waits until the results before them are written.
+	void writeRecordsAt(int firstStep, const double* records, int count);
+	/// Counts \c count steps as completed, without writing them yet: for results that are kept elsewhere until the results before them have been written with writeCountedRecords() (see PEResultArena).
+	void countCompletedSteps(int count) { completedSteps_ += count; }
+	/// Appends \c count results packed like in writeRecords(), which were already counted with countCompletedSteps().
+	void writeCountedRecords(const double* records, int count) { appendRecords(records, count); }
+	/// Calls flush() if it has been at least --flushInterval seconds since the last flush.
+	void flushIfDue();
+	/// Updates the progress (in place in the output file, and in the --progressFile) and flushes the output file to disk.
+	void flush();
+	/// Flushes and closes the output file.
+	void close();
+
+	/// Returns the number of results written so far. (Results that are waiting for earlier steps in writeRecordsAt() aren't written yet.)
+	int resultsWritten() const { return resultsWritten_; }
+
+protected:
+	const PECommandLineOptions& io_;
+	std::ofstream file_;
+	/// Position of the progress section in file_
+	std::streampos progressPosition_;
+	int totalSteps_, completedSteps_, resultsWritten_;
+	bool anySuccesses_, anyFailures_;
+	/// Time (in seconds since the epoch) of the last flush()
+	double lastFlushTime_;
+	/// Number of doubles in each binary record: PECommandLineOptions::recordLength()
+	int recordLength_;
+	/// Buffer for packing a single record, in the binary format.
+	std::vector<double> record_;
+	/// Results added with writeRecordsAt() that are waiting for earlier steps, by their first step.
+	std::map<int, std::vector<double> > waitingRecords_;
+
+	/// Updates the binary header with the current progress.
+	void writeBinaryProgress();
+	/// Writes \c result to the end of the file, without counting it as a completed step.  (Text format only.)
+	void appendResult(const PEResult& result);
+	/// Writes \c count result \c records to the end of the file, without counting them as completed steps.
+	void appendRecords(const double* records, int count);
+};
+
+/// Holds the result records for every step of a calculation in one contiguous array, in scan order, so that results can be packed or received (for example, with MPI) directly into their final place, and written to the output from there.
+/*! Records for consecutive steps are contiguous, and all records start out filled with 0, so only the parts of a record that aren't 0 need to be filled in.  When records are completed(), every record that is now next in the output is written to a PEOutputFileWriter, straight from the arena; results that arrive before the ones ahead of them simply wait in place, instead of being copied like in PEOutputFileWriter::writeRecordsAt().
+
+The arena takes numSteps*PECommandLineOptions::recordLength() doubles: for example, 78 MB for 100000 steps at N=45.*/
+class PEResultArena {
+public:
+	/// Allocates room for \c numSteps records of \c recordLength doubles each, filled with 0.
+	PEResultArena(int recordLength, int numSteps);
+
+	/// Returns the record for step \c step.
+	double* record(int step) { return &records_[size_t(step)*recordLength_]; }
+	/// Returns the number of doubles in each record.
+	int recordLength() const { return recordLength_; }
+
+	/// Marks the \c count records starting at \c firstStep as filled in, and counts them as completed steps in \c writer.  Every record that is now next in the output is written to \c writer.
+	void completed(int firstStep, int count, PEOutputFileWriter& writer);
+
+protected:
+	int recordLength_;
+	std::vector<double> records_;
+	/// Which records have been filled in.
+	std::vector<bool> completed_;
+	/// The first step that hasn't been written to the output yet.
+	int nextToWrite_;
+};
+
+/// Saves completed steps to the --checkpointFile as a calculation proceeds, so that an interrupted calculation can be resumed.
+/*! When opened, all the steps saved in the file by an earlier run of the same calculation are loaded; they don't need to be calculated again. The calculation is identified by the "# Input" section of the output file header, plus the RMS roughness: if these don't match, the file is started over.
+
+The file is binary, in native byte order: "PEGCKPT1" (8 bytes), the length L of the identifying text (uint32), the length R of each result record in doubles (uint32, PECommandLineOptions::recordLength()), L bytes of text, and then one entry of R+1 doubles for each completed step, in the order they were completed: the step index, followed by the result record from PEResult::toDoubleArray(). An incomplete last entry (for example, if the program was killed while writing it) is discarded.*/
+class PECheckpointFile {
+public:
+	/// Prepare to save the steps for a calculation with options \c io, which must remain valid for the lifetime of this object.
+	PECheckpointFile(const PECommandLineOptions& io);
+	/// Closes the file, if open.
+	~PECheckpointFile();
+
+	/// Opens the --checkpointFile, loads any steps saved there for this calculation, and prepares to append more. Returns false if the file could not be opened.
+	bool open();
+	/// Returns true if open() was successful.
+	bool isOpen() const { return file_.is_open(); }
+
+	/// Returns the number of steps loaded from the file.
+	int numLoaded() const { return loaded_.size(); }
+	/// Returns true if step \c step was loaded from the file.
+	bool isLoaded(int step) const { return loaded_.count(step) != 0; }
+	/// Returns the steps loaded from the file, and their result records.
+	const std::map<int, std::vector<double> >& loaded() const { return loaded_; }
+
+	/// Saves \c count completed steps starting at \c firstStep, with their result \c records (PECommandLineOptions::recordLength() doubles each, from PEResult::toDoubleArray()).  The file is flushed at most every --flushInterval seconds.
+	void save(int firstStep, const double* records, int count);
+	/// Flushes the file to disk.
+	void flush();
+
+protected:
+	const PECommandLineOptions& io_;
+	std::ofstream file_;
+	/// Number of doubles in each result record: PECommandLineOptions::recordLength()
+	int recordLength_;
+	/// Steps loaded by open()
+	std::map<int, std::vector<double> > loaded_;
+	/// Time (in seconds since the epoch) of the last flush()
+	double lastFlushTime_;
+
+	/// Returns the text identifying this calculation: the output file header and the roughness, with every number at full (17-digit) precision.
+	std::string identifyingText() const;
+};
 
 #endif
@@ -0,0 +1,292 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "PEResultCache.h"
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <utime.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <omp.h>
+
+/// Identifies a cache entry file.
+static const char peResultCacheMagic[8] = {'P','E','G','C','A','C','H','1'};
+
+PEResultCache::PEResultCache(const std::string& directory, long long maxBytes) {
+	directory_ = directory;
+	maxBytes_ = maxBytes;
+	bytesSinceEvict_ = maxBytes_/16;
+	hits_ = misses_ = stores_ = 0;
+}
+
+bool PEResultCache::createDirectory() const {
+	if(mkdir(directory_.c_str(), 0777) == 0 || errno == EEXIST) {
+		struct stat s;
+		return stat(directory_.c_str(), &s) == 0 && S_ISDIR(s.st_mode);
+	}
+	return false;
+}
+
+std::string PEResultCache::key(const PEGrating& grating, const PEMathOptions& mo, double incidenceDeg, double wl, double rmsRoughnessNm) {
+	std::ostringstream ss;
+	ss << std::setprecision(17);
+	// Increase the version whenever a change to the solver changes its results, so that old entries are no longer found.
+	ss << "version=1\n";
+	ss << "profile=" << int(grating.profile()) << "\n";
+	ss << "period=" << grating.period() << "\n";
+	ss << "geometry=";
+	for(int i=0, cc=grating.geometry().size(); i<cc; ++i)
+		ss << (i ? "," : "") << grating.geometry().at(i);
+	ss << "\n";
+	ss << "material=" << grating.substrateMaterial() << "\n";
+	ss << "coating=" << grating.coatingMaterial() << "\n";
+	ss << "coatingThickness=" << grating.coatingThickness() << "\n";
+	ss << "N=" << mo.N << "\n";
+	ss << "integrationTolerance=" << mo.integrationTolerance << "\n";
+	ss << "expansionTablePoints=" << mo.expansionTablePoints << "\n";
+	ss << "useLayerPropagator=" << int(mo.useLayerPropagator) << "\n";
+	ss << "adaptiveLayers=" << int(mo.adaptiveLayers) << "\n";
+	ss << "warmStart=" << int(mo.warmStart) << "\n";
+	ss << "integrationAbsTolerance=" << mo.integrationAbsTolerance << "\n";
+	ss << "stepper=" << PEMathOptions::stepperName(mo.stepper) << "\n";
+	if(mo.stepper == PEMathOptions::FixedRK4Stepper)
+		ss << "fixedStepsPerLayer=" << mo.fixedStepsPerLayer << "\n";
+	if(mo.matrixIntegration)
+		ss << "matrixIntegration=1\n";
+	if(mo.adaptiveNTolerance > 0)
+		ss << "adaptiveNTolerance=" << mo.adaptiveNTolerance << "\n";
+	if(mo.polarization == PEMathOptions::TEAndTMPolarization)
+		ss << "polarization=both\n";
+	ss << "incidenceAngle=" << incidenceDeg << "\n";
+	ss << "wavelength=" << wl << "\n";
+	ss << "rmsRoughness=" << rmsRoughnessNm << "\n";
+	return ss.str();
+}
+
+std::string PEResultCache::hash(const std::string& key) {
+	uint64_t h = 14695981039346656037ULL;	// FNV-1a 64-bit offset basis and prime.
+	for(int i=0, cc=key.size(); i<cc; ++i) {
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ULL;
+	}
+	char hex[17];
+	for(int i=15; i>=0; --i) {
+		hex[i] = "0123456789abcdef"[h & 0xf];
+		h >>= 4;
+	}
+	hex[16] = 0;
+	return std::string(hex);
+}
+
+std::string PEResultCache::fileName(const std::string& key) const {
+	std::string h = hash(key);
+	return directory_ + "/" + h.substr(0, 2) + "/" + h + ".pegc";
+}
+
+bool PEResultCache::lookup(const std::string& key, PEResult& result) {
+	std::string name = fileName(key);
+	bool found = false;
+
+	// Entry file: magic (8 bytes), key length (uint32), record length (uint32), key, record (doubles; see PEResult::toDoubleArray()).
+	std::ifstream in(name.c_str(), std::ios::in | std::ios::binary);
+	if(in.is_open()) {
+		char magic[8];
+		uint32_t lengths[2];
+		if(in.read(magic, 8) && memcmp(magic, peResultCacheMagic, 8) == 0 && in.read((char*)lengths, sizeof(lengths)) && lengths[0] == key.size() && lengths[1] >= 4) {
+			std::string storedKey(lengths[0], '\0');
+			std::vector<double> record(lengths[1]);
+			if(in.read(&storedKey[0], lengths[0]) && storedKey == key && in.read((char*)&record[0], lengths[1]*sizeof(double))) {
+				int N = int(record[3]);
+				// With TM (see the key), the TM efficiencies follow.
+				bool withTM = int(record.size()) == PEResult::recordLength(N, true);
+				if(withTM || int(record.size()) == PEResult::recordLength(N)) {
+					result.fromDoubleArray(&record[0], N, withTM);
+					found = true;
+				}
+			}
+		}
+		in.close();
+	}
+
+	// Mark it as recently used. (This fails harmlessly on a read-only cache.)
+	if(found)
+		utime(name.c_str(), 0);
+
+#pragma omp critical(PEResultCache)
+	{
+		if(found)
+			++hits_;
+		else
+			++misses_;
+	}
+	return found;
+}
+
+void PEResultCache::store(const std::string& key, const PEResult& result) {
+	if(result.eff.empty())
+		return;
+
+	int N = (result.eff.size()-1)/2;
+	bool withTM = !result.effTM.empty();
+	std::vector<double> record(PEResult::recordLength(N, withTM));
+	result.toDoubleArray(&record[0], N, withTM);
+	uint32_t lengths[2] = { uint32_t(key.size()), uint32_t(record.size()) };
+
+	std::string name = fileName(key);
+	std::string subdirectory = name.substr(0, name.rfind('/'));
+
+	// A name for the temporary file that no other thread, process, or node will use.
+	long long serial;
+#pragma omp critical(PEResultCache)
+	serial = stores_++;
+	char host[256] = "";
+	gethostname(host, sizeof(host)-1);
+	std::ostringstream tempName;
+	tempName << subdirectory << "/." << hash(key) << "." << host << "." << getpid() << "." << serial << ".tmp";
+
+	// Write the whole entry, then put it in place. rename() replaces any existing entry atomically, so concurrent readers see either the old or the new one.
+	mkdir(directory_.c_str(), 0777);
+	mkdir(subdirectory.c_str(), 0777);
+	std::ofstream out(tempName.str().c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+	if(!out.is_open())
+		return;
+	out.write(peResultCacheMagic, 8);
+	out.write((const char*)lengths, sizeof(lengths));
+	out.write(key.data(), key.size());
+	out.write((const char*)&record[0], record.size()*sizeof(double));
+	out.close();
+	if(out.fail() || rename(tempName.str().c_str(), name.c_str()) != 0) {
+		unlink(tempName.str().c_str());
+		return;
+	}
+
+	bool evictNow = false;
+#pragma omp critical(PEResultCache)
+	{
+		bytesSinceEvict_ += 16 + key.size() + record.size()*sizeof(double);
+		if(bytesSinceEvict_ >= maxBytes_/16) {
+			bytesSinceEvict_ = 0;
+			evictNow = true;
+		}
+	}
+	if(evictNow)
+		evict();
+}
+
+/// An entry file found by PEResultCache::evict().
+struct PEResultCacheEntry {
+	std::string fileName;
+	time_t lastUsed;
+	long long bytes;
+
+	bool operator<(const PEResultCacheEntry& other) const { return lastUsed < other.lastUsed; }
+};
+
+void PEResultCache::evict() {
+	std::vector<PEResultCacheEntry> entries;
+	long long totalBytes = 0;
+	time_t now = time(0);
+
+	DIR* top = opendir(directory_.c_str());
+	if(!top)
+		return;
+	struct dirent* d;
+	while((d = readdir(top))) {
+		if(strlen(d->d_name) != 2 || d->d_name[0] == '.')
+			continue;
+		std::string subdirectory = directory_ + "/" + d->d_name;
+		DIR* sub = opendir(subdirectory.c_str());
+		if(!sub)
+			continue;
+		struct dirent* f;
+		while((f = readdir(sub))) {
+			std::string name(f->d_name);
+			std::string path = subdirectory + "/" + name;
+			struct stat s;
+			if(name.size() > 5 && name.compare(name.size()-5, 5, ".pegc") == 0) {
+				if(stat(path.c_str(), &s) != 0)
+					continue;	// deleted by another process in the meantime.
+				PEResultCacheEntry entry;
+				entry.fileName = path;
+				entry.lastUsed = s.st_mtime;
+				entry.bytes = s.st_size;
+				entries.push_back(entry);
+				totalBytes += s.st_size;
+			}
+			// Temporary files left behind by processes that were killed while writing.
+			else if(name.size() > 4 && name.compare(name.size()-4, 4, ".tmp") == 0 && stat(path.c_str(), &s) == 0 && now - s.st_mtime > 3600) {
+				unlink(path.c_str());
+			}
+		}
+		closedir(sub);
+	}
+	closedir(top);
+
+	if(totalBytes <= maxBytes_)
+		return;
+
+	// Delete the least-recently-used entries first. It doesn't matter if another process is doing the same: unlinking an entry twice just fails, and readers that have it open already can still finish reading it.
+	std::sort(entries.begin(), entries.end());
+	long long targetBytes = maxBytes_ - maxBytes_/10;
+	for(int i=0, cc=entries.size(); i<cc && totalBytes > targetBytes; ++i) {
+		unlink(entries[i].fileName.c_str());
+		totalBytes -= entries[i].bytes;
+	}
+}
+
+/// The global cache, and whether it has been set up yet. Only accessed inside the PEResultCacheGlobal critical section.
+static PEResultCache* peGlobalResultCache = 0;
+static bool peGlobalResultCacheInitialized = false;
+
+PEResultCache* PEResultCache::global() {
+	PEResultCache* rv;
+#pragma omp critical(PEResultCacheGlobal)
+	{
+		if(!peGlobalResultCacheInitialized) {
+			const char* directory = getenv("PEG_CACHE_DIR");
+			const char* sizeMB = getenv("PEG_CACHE_SIZE_MB");
+			if(directory && directory[0])
+				peGlobalResultCache = new PEResultCache(directory, (sizeMB && atof(sizeMB) > 0) ? (long long)(atof(sizeMB)*1024*1024) : 1024LL*1024*1024);
+			peGlobalResultCacheInitialized = true;
+		}
+		rv = peGlobalResultCache;
+	}
+	return rv;
+}
+
+void PEResultCache::setGlobal(const std::string& directory, long long maxBytes) {
+#pragma omp critical(PEResultCacheGlobal)
+	{
+		delete peGlobalResultCache;
+		peGlobalResultCache = directory.empty() ? 0 : new PEResultCache(directory, maxBytes);
+		peGlobalResultCacheInitialized = true;
+	}
+}
@@ -0,0 +1,91 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef PERESULTCACHE_H
+#define PERESULTCACHE_H
+
+#include "PEG.h"
+#include <string>
+
+/// A persistent, size-limited store of calculated results, shared between runs (and between processes) through a directory on disk.
+/*! Each result is kept in its own file, named by a 64-bit hash of everything that determines it: the grating (profile, period, geometry, materials, and coating thickness), the math options (N, tolerance, etc.), the incidence angle, the wavelength, and the roughness.  See key().  The full key is stored in the file as well, so a hash collision is just a miss.
+
+The files are written to a temporary name and then renamed into place, so readers never see a partly-written entry.  That makes one cache directory safe to share between any number of concurrent processes, including across the nodes of a cluster on a shared file system.
+
+The cache is limited to maxBytes() on disk.  Each lookup that finds an entry updates its modification time, and when the cache grows past its limit, the least-recently-used entries are deleted until it is back under 90% of the limit.
+
+Results depend on the refractive index database only by material name; if you change a database file, clear the cache directory.
+
+PESolver::getEff() and PEGrating::getEff() use the global() cache automatically, if one is set up (with setGlobal(), or the PEG_CACHE_DIR environment variable).  Only successful results are stored.  Calculations with debug output or timing measurement always run, and are never stored.*/
+class PEResultCache {
+public:
+	/// Creates a cache in \c directory, limited to \c maxBytes on disk.  Nothing is touched on disk until the first store(); call createDirectory() to check the directory first.
+	PEResultCache(const std::string& directory, long long maxBytes = 1024LL*1024*1024);
+
+	/// Returns the cache directory.
+	const std::string& directory() const { return directory_; }
+	/// Returns the size limit of the cache on disk, in bytes.
+	long long maxBytes() const { return maxBytes_; }
+
+	/// Creates the cache directory, if it doesn't exist already.  Returns false if it could not be created.
+	bool createDirectory() const;
+
+	/// Returns the key for the result of \c grating at incidence angle \c incidenceDeg (degrees) and wavelength \c wl (um), calculated with math options \c mo and roughness \c rmsRoughnessNm.  All numbers are written with full precision, so only identical inputs share a key.
+	static std::string key(const PEGrating& grating, const PEMathOptions& mo, double incidenceDeg, double wl, double rmsRoughnessNm);
+
+	/// Looks for the result with \c key.  Returns true and fills \c result if it was found.
+	bool lookup(const std::string& key, PEResult& result);
+	/// Stores \c result under \c key, replacing any stored result.  Any failure (ex: a read-only directory) simply leaves the result out of the cache.
+	void store(const std::string& key, const PEResult& result);
+
+	/// Deletes the least-recently-used entries, if the cache is larger than maxBytes(), until it is under 90% of maxBytes().  This is called by store() as the cache grows.
+	void evict();
+
+	/// Number of lookup() calls that found a result.
+	long long hits() const { return hits_; }
+	/// Number of lookup() calls that did not find a result.
+	long long misses() const { return misses_; }
+	/// Number of results stored.
+	long long stores() const { return stores_; }
+
+	/// Returns the cache used by PESolver::getEff() and PEGrating::getEff(), or 0 if there isn't one.  Unless setGlobal() was called first, this is set up on first use from the environment variables PEG_CACHE_DIR (the directory) and PEG_CACHE_SIZE_MB (the size limit, in MB; default 1024).
+	static PEResultCache* global();
+	/// Sets the cache used by PESolver::getEff() and PEGrating::getEff() to one in \c directory, limited to \c maxBytes on disk.  An empty \c directory turns off caching.  Call this before starting any calculations.
+	static void setGlobal(const std::string& directory, long long maxBytes = 1024LL*1024*1024);
+
+protected:
+	/// Returns the file name for \c key: <directory>/<first 2 hash digits>/<hash>.pegc
+	std::string fileName(const std::string& key) const;
+	/// Returns the 64-bit FNV-1a hash of \c key, as 16 hex digits.
+	static std::string hash(const std::string& key);
+
+	/// The cache directory.
+	std::string directory_;
+	/// The size limit on disk (bytes).
+	long long maxBytes_;
+
+	/// Bytes stored by this process since the last evict().  Once this reaches a sixteenth of maxBytes_, store() calls evict() again.  It starts out at the trigger value, so that the first store() checks the size of the cache.
+	long long bytesSinceEvict_;
+	/// Counters for hits(), misses(), and stores().
+	long long hits_, misses_, stores_;
+};
+
+#endif // PERESULTCACHE_H
@@ -0,0 +1,302 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "PEServer.h"
+#include "PEResultCache.h"
+#include "PESolverProfile.h"
+
+#include <algorithm>
+#include <sstream>
+#include <omp.h>
+
+PEServer::PEServer(const PECommandLineOptions& io, std::istream& in, std::ostream& out) : io_(io), in_(in), out_(out) {
+	numSlots_ = std::max(1, io_.threads);
+	useCounter_ = 0;
+}
+
+PEServer::~PEServer() {
+	for(int i=0, cc=idleContexts_.size(); i<cc; ++i) {
+		delete idleContexts_[i].solver;
+		delete idleContexts_[i].grating;
+	}
+}
+
+int PEServer::run() {
+
+	int numJobs = 0;
+
+	// One thread reads the requests and hands them out as tasks; the other numSlots_ threads run them.
+#pragma omp parallel num_threads(numSlots_ + 1)
+	{
+#pragma omp single
+		{
+			std::string line;
+			while(std::getline(in_, line)) {
+				std::istringstream ls(line);
+				std::string firstWord;
+				if(!(ls >> firstWord) || firstWord[0] == '#')
+					continue;
+				if(firstWord == "quit")
+					break;
+
+				Job* job = new Job;
+				std::string errorMessage;
+				if(!parseRequest(line, *job, errorMessage)) {
+					send(job->id, "error", errorMessage);
+					delete job;
+					continue;
+				}
+
+				std::ostringstream totalSteps;
+				totalSteps << job->io.totalSteps();
+				send(job->id, "accepted", totalSteps.str());
+				++numJobs;
+
+#pragma omp task firstprivate(job)
+				{
+					runJob(*job);
+					delete job;
+				}
+			}
+		}
+	} // the end of the parallel region waits for all the requests to finish.
+
+	return numJobs;
+}
+
+bool PEServer::parseRequest(const std::string& line, Job& job, std::string& errorMessage) const {
+
+	// Split into words, like the shell would for a command line without quotes.
+	std::istringstream ls(line);
+	ls >> job.id;
+	std::vector<std::string> words;
+	std::string word;
+	words.push_back("pegSerial");
+	while(ls >> word)
+		words.push_back(word);
+
+	// getopt_long() may re-order the arguments, so it needs its own copies.
+	std::vector<std::vector<char> > buffers(words.size());
+	std::vector<char*> argv(words.size() + 1, (char*)0);
+	for(int i=0, cc=words.size(); i<cc; ++i) {
+		buffers[i].assign(words[i].begin(), words[i].end());
+		buffers[i].push_back(0);
+		argv[i] = &buffers[i][0];
+	}
+
+	optind = 0;	// start over, for a new set of arguments.
+	job.io.serveRequest = true;
+	if(!job.io.parseFromCommandLine(words.size(), &argv[0])) {
+		errorMessage = "Invalid options: " + job.io.firstErrorMessage();
+		return false;
+	}
+
+	if(job.io.serve || !job.io.cacheDir.empty() || job.io.showLegal || job.io.benchmarkSteppers) {
+		errorMessage = "The options --serve, --cacheDir, --cacheSize, --showLegal, and --benchmarkSteppers apply to the whole server; they can only be given on the --serve command line.";
+		return false;
+	}
+	if(job.io.printDebugOutput || job.io.measureTiming) {
+		errorMessage = "The options --printDebugOutput and --measureTiming are not available in --serve mode.";
+		return false;
+	}
+	if(job.io.profileFormat != PECommandLineOptions::NoProfile && job.io.outputFile.empty()) {
+		errorMessage = "The --profile file is named after the --outputFile, so it requires one.";
+		return false;
+	}
+
+	// --threads auto: share the processors between the requests that can run at once.
+	if(job.io.threads == 0)
+		job.io.threads = std::max(1, omp_get_num_procs() / numSlots_);
+
+	return true;
+}
+
+void PEServer::runJob(const Job& job) {
+
+	double startTime = omp_get_wtime();
+	const PECommandLineOptions& io = job.io;
+	int totalSteps = io.totalSteps();
+
+	// The output file (and progress and checkpoint files) are only written if requested.
+	PEOutputFileWriter outputWriter(io);
+	bool writeOutput = !io.outputFile.empty();
+	if(writeOutput && !outputWriter.open()) {
+		send(job.id, "error", "Could not open output file " + io.outputFile + (io.progressFile.empty() ? "" : " or progress file " + io.progressFile));
+		return;
+	}
+	PECheckpointFile checkpoint(io);
+	if(!io.checkpointFile.empty() && !checkpoint.open()) {
+		send(job.id, "error", "Could not open checkpoint file " + io.checkpointFile);
+		return;
+	}
+
+	// After the first request for a material, this doesn't touch the file system again.
+	std::vector<std::string> materials;
+	materials.push_back(io.material);
+	if(io.coatingThickness != 0)
+		materials.push_back(io.coating);
+	if(PEMaterialDatabase::preload(materials) != int(materials.size()))
+		std::cerr << "Warning: Could not find refractive index data for all materials in " << PEG_MATERIALS_DB_PATH << std::endl;
+
+	SolverContext context = checkOutContext(io);
+
+	// Each result is packed into a record (see PEResult::toDoubleArray()) for the output and checkpoint files.
+	std::vector<double> record(io.recordLength());
+	bool anySuccesses = false, anyFailures = false;
+	int completedSteps = 0;
+	PEResult result;
+	std::ostringstream ss;
+
+	// Steps loaded from the checkpoint file are sent first.
+	std::vector<int> steps;
+	for(int i=0; i<totalSteps; ++i)
+		if(!checkpoint.isLoaded(i))
+			steps.push_back(i);
+	for(std::map<int, std::vector<double> >::const_iterator it = checkpoint.loaded().begin(); it != checkpoint.loaded().end(); ++it) {
+		if(writeOutput)
+			outputWriter.writeRecordsAt(it->first, &(it->second[0]), 1);
+		result.fromDoubleArray(&(it->second[0]), io.N, io.withTM());
+		if(result.status == PEResult::Success) anySuccesses = true;
+		else anyFailures = true;
+		ss.str("");
+		ss << it->first << "\t";
+		writeOutputFileResult(ss, result, io);
+		send(job.id, "result", ss.str().substr(0, ss.str().length()-1));	// without the newline
+		++completedSteps;
+	}
+
+	PEProfileLog profileLog;
+	std::vector<PESolverProfile> batchProfiles;
+	bool profiling = (io.profileFormat != PECommandLineOptions::NoProfile);
+
+	// Loop over calculation steps, in batches like pegSerial.
+	int batchSize = (io.threads == 1) ? 1 : 4*io.threads;
+	for(int i=0, numSteps=steps.size(); i<numSteps; i+=batchSize) {
+
+		std::vector<PEScanPoint> points;
+		for(int j=i; j<std::min(i+batchSize, numSteps); ++j)
+			points.push_back(io.scanPoint(steps[j]));
+
+		std::vector<PEResult> batchResults;
+		if(batchSize == 1) {
+			result = context.solver->getEff(points[0].incidenceDeg, points[0].wavelength, io.rmsRoughnessNm);
+			result.incidenceDeg = points[0].incidenceDeg;	// failures don't fill in the point they were calculated for.
+			result.wavelength = points[0].wavelength;
+			batchResults.push_back(result);
+			batchProfiles.assign(1, context.solver->lastProfile());
+		}
+		else
+			batchResults = context.solver->getEffBatch(points, io.rmsRoughnessNm, &batchProfiles);
+
+		for(int j=0, cc=batchResults.size(); j<cc; ++j) {
+			const PEResult& stepResult = batchResults.at(j);
+			if(stepResult.status == PEResult::Success) anySuccesses = true;
+			else anyFailures = true;
+			ss.str("");
+			ss << steps[i+j] << "\t";
+			writeOutputFileResult(ss, stepResult, io);
+			send(job.id, "result", ss.str().substr(0, ss.str().length()-1));
+
+			stepResult.toDoubleArray(&record[0], io.N, io.withTM());
+			checkpoint.save(steps[i+j], &record[0], 1);
+			if(writeOutput)
+				outputWriter.writeRecordsAt(steps[i+j], &record[0], 1);
+			if(profiling)
+				profileLog.record(steps[i+j], 0, batchProfiles.at(j));
+		}
+		completedSteps += batchResults.size();
+		if(writeOutput)
+			outputWriter.flushIfDue();
+
+		ss.str("");
+		ss << completedSteps << "\t" << totalSteps;
+		send(job.id, "progress", ss.str());
+	}
+
+	checkInContext(context);
+
+	if(writeOutput)
+		outputWriter.close();
+	if(checkpoint.isOpen())
+		checkpoint.flush();
+	if(profiling && !profileLog.write(io.profileFile(), io.profileFormat == PECommandLineOptions::CSVProfile ? PEProfileLog::CSVFormat : PEProfileLog::JSONFormat, 1, omp_get_wtime() - startTime))
+		std::cerr << "Warning: Could not write the profile file " << io.profileFile() << std::endl;
+
+	send(job.id, "done", (anySuccesses && anyFailures) ? "someFailed" : (anyFailures ? "allFailed" : "succeeded"));
+}
+
+PEServer::SolverContext PEServer::checkOutContext(const PECommandLineOptions& io) {
+
+	SolverContext context;
+	context.grating = createGrating(io);
+	PEMathOptions mathOptions = createMathOptions(io);
+	std::ostringstream key;
+	key << PEResultCache::key(*context.grating, mathOptions, 0, 0, 0) << "threads=" << io.threads << "\n";
+	context.key = key.str();
+
+	bool found = false;
+#pragma omp critical(PEServerContexts)
+	{
+		for(int i=0, cc=idleContexts_.size(); i<cc; ++i) {
+			if(idleContexts_[i].key == context.key) {
+				delete context.grating;
+				context = idleContexts_[i];
+				idleContexts_.erase(idleContexts_.begin() + i);
+				found = true;
+				break;
+			}
+		}
+	}
+
+	// Allocating a new solver can take a while, so it's done outside the critical section.
+	if(!found)
+		context.solver = new PESolver(*context.grating, mathOptions, io.threads);
+	return context;
+}
+
+void PEServer::checkInContext(SolverContext context) {
+
+	std::vector<SolverContext> evicted;
+#pragma omp critical(PEServerContexts)
+	{
+		context.lastUsed = ++useCounter_;
+		idleContexts_.push_back(context);
+		while(int(idleContexts_.size()) > 2*numSlots_) {
+			int oldest = 0;
+			for(int i=1, cc=idleContexts_.size(); i<cc; ++i)
+				if(idleContexts_[i].lastUsed < idleContexts_[oldest].lastUsed)
+					oldest = i;
+			evicted.push_back(idleContexts_[oldest]);
+			idleContexts_.erase(idleContexts_.begin() + oldest);
+		}
+	}
+
+	for(int i=0, cc=evicted.size(); i<cc; ++i) {
+		delete evicted[i].solver;
+		delete evicted[i].grating;
+	}
+}
+
+void PEServer::send(const std::string& id, const char* kind, const std::string& message) {
+#pragma omp critical(PEServerOutput)
+	{
+		out_ << id << "\t" << kind << "\t" << message << std::endl;
+	}
+}
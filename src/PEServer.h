@@ -0,0 +1,106 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef PESERVER_H
+#define PESERVER_H
+
+#include "PEMainSupport.h"
+#include "PESolver.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+/// Runs pegSerial as a long-lived server (pegSerial --serve), which reads calculation requests from an input stream and streams the results back over an output stream.
+/*! Starting a new pegSerial for every calculation costs the process start-up, loading the refractive index data, and allocating a solver, which dominates the time for small scans.  The server pays for these once: the refractive index data stays loaded, and the solver contexts (see PESolver) of finished requests are kept for re-use by later requests with the same grating and math options.
+
+<b>Protocol</b>
+
+Each line of input is one request: a job id (any word, chosen by the client), followed by the same options that would be given to pegSerial on the command line.  --outputFile is optional: if it is provided, the output file (and --progressFile, and --checkpointFile) are written just like pegSerial does.  Options that only make sense for a whole process (--cacheDir, --cacheSize, --showLegal, --benchmarkSteppers) or that print to the standard output (--printDebugOutput, --measureTiming) are not accepted.  Blank lines and lines starting with # are ignored, and a line with just "quit" stops reading requests, like the end of the input.
+
+\code
+job1 --mode constantIncidence --min 100 --max 120 --increment 5 --incidenceAngle 88 --gratingType blazed --gratingPeriod 1 --gratingMaterial Au --N 15 --gratingGeometry 2.5,30 --eV
+\endcode
+
+Every line of output is tab-separated, starting with the job id and the kind of message:
+
+<table>
+<tr><td>id accepted totalSteps</td><td>The request is valid, and waiting to run.</td></tr>
+<tr><td>id error message</td><td>The request could not be run (ex: invalid options, or the output file could not be opened). This is the last message for the job.</td></tr>
+<tr><td>id result step x efficiencies</td><td>The result for calculation step \c step (from 0 to totalSteps-1), in the same format as a line in the # Output section of the output file.  Results come in the order they are finished, which is not necessarily the order of the steps.</td></tr>
+<tr><td>id progress completedSteps totalSteps</td><td>Sent after each batch of results.</td></tr>
+<tr><td>id done status</td><td>All the steps are done. The status is the same as in the output file's # Progress section: succeeded, someFailed, or allFailed. This is the last message for the job.</td></tr>
+</table>
+
+Requests are run concurrently, on up to --threads (of the --serve command line) at once; each request's own --threads (default 1) is the number of threads its solver uses.  Requests are started in the order they are received.  The server exits once the input has ended and all the requests have finished.*/
+class PEServer {
+public:
+	/// Creates a server with the options \c io from the --serve command line, which reads requests from \c in and writes the results to \c out.
+	PEServer(const PECommandLineOptions& io, std::istream& in, std::ostream& out);
+	/// Deletes the kept solver contexts.
+	~PEServer();
+
+	/// Reads and runs requests until the end of the input (or a "quit" line), and returns once they have all finished.  Returns the number of requests that were run.  Each request's batches run in PESolver::getEffBatch() inside the server's own parallel region, so the program should enable 3 active levels of parallelism (omp_set_max_active_levels(3)) at startup.
+	int run();
+
+protected:
+	/// A request to run, with its parsed options.
+	struct Job {
+		std::string id;
+		PECommandLineOptions io;
+	};
+
+	/// A solver context, and the grating it was created for.
+	struct SolverContext {
+		/// Identifies the grating, math options, and number of threads: the PEResultCache::key() without a calculation point, plus the number of threads.
+		std::string key;
+		PEGrating* grating;
+		PESolver* solver;
+		/// Value of useCounter_ when this context was last returned.
+		long long lastUsed;
+	};
+
+	/// The options from the --serve command line.
+	PECommandLineOptions io_;
+	std::istream& in_;
+	std::ostream& out_;
+	/// Number of requests that can run at once.
+	int numSlots_;
+	/// Solver contexts that aren't in use, kept for re-use by later requests.  At most 2*numSlots_ are kept; the least recently used are deleted after that.
+	std::vector<SolverContext> idleContexts_;
+	/// Counts returned contexts, to find the least recently used.
+	long long useCounter_;
+
+	/// Parses the request \c line into \c job.  Returns false and sets \c errorMessage if it is not a valid request.
+	bool parseRequest(const std::string& line, Job& job, std::string& errorMessage) const;
+	/// Runs the calculation for \c job, and sends its results.
+	void runJob(const Job& job);
+
+	/// Returns a solver context for the options \c io: a kept one if there is one with the same solverKey(), otherwise a new one.
+	SolverContext checkOutContext(const PECommandLineOptions& io);
+	/// Returns \c context to be kept for later requests.
+	void checkInContext(SolverContext context);
+
+	/// Sends one line of output, starting with the job \c id and the message \c kind.  Safe to call from any thread; lines from different jobs are never mixed.
+	void send(const std::string& id, const char* kind, const std::string& message);
+};
+
+#endif // PESERVER_H
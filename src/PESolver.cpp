@@ -18,6 +18,8 @@ along with PEG.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "PESolver.h"
+#include "PEKernels.h"
+#include "PEResultCache.h"
 
 #include <math.h>
 #include <gsl/gsl_complex_math.h>
@@ -27,6 +29,9 @@ along with PEG.  If not, see <http://www.gnu.org/licenses/>.
 #include <gsl/gsl_blas.h>
 #include <omp.h>
 #include <string.h>
+#include <float.h>
+#include <algorithm>
+#include <numeric>
 
 // For debug output only:
 #include <iostream>
@@ -34,12 +39,41 @@ along with PEG.  If not, see <http://www.gnu.org/licenses/>.
 /// Speed of light in um/s.
 #define M_c 2.99792458e14
 
+/// The largest growth (as a power of e) of the trial solutions across one layer that is known to be stable, used to choose the number of layers. It should be ln(1e15). However, emperically this is not enough to maintain stability (ex: REIXS LEG).  7 = ln(1e3) seems stable for all tests so far.
+static const double peMaxLayerGrowth = 3;
+
+PESolver::PolarizationMatrices::PolarizationMatrices(int twoNp1) {
+	T11 = gsl_matrix_complex_alloc(twoNp1, twoNp1);
+	T12 = gsl_matrix_complex_alloc(twoNp1, twoNp1);
+	T21 = gsl_matrix_complex_alloc(twoNp1, twoNp1);
+	T22 = gsl_matrix_complex_alloc(twoNp1, twoNp1);
+	S12 = gsl_matrix_complex_alloc(twoNp1, twoNp1);
+	S22 = gsl_matrix_complex_alloc(twoNp1, twoNp1);
+	Zinv = gsl_matrix_complex_alloc(twoNp1, twoNp1);
+	work = gsl_matrix_complex_alloc(twoNp1, twoNp1);
+	lu = new PELUFactorization(twoNp1);
+	BM = new gsl_complex[twoNp1];
+}
+
+PESolver::PolarizationMatrices::~PolarizationMatrices() {
+	gsl_matrix_complex_free(T11);
+	gsl_matrix_complex_free(T12);
+	gsl_matrix_complex_free(T21);
+	gsl_matrix_complex_free(T22);
+	gsl_matrix_complex_free(S12);
+	gsl_matrix_complex_free(S22);
+	gsl_matrix_complex_free(Zinv);
+	gsl_matrix_complex_free(work);
+	delete lu;
+	delete [] BM;
+}
+
 PESolver::PESolver(const PEGrating& grating, const PEMathOptions& mo, int numThreads, bool measureTiming)
-	: g_(grating)
+	: mathOptions_(mo), te_(2*mo.N + 1), g_(grating)
 {
 	numThreads_ = numThreads;
 	measureTiming_ = measureTiming;
-	time_ = omp_get_wtime();
+	double startTime = omp_get_wtime();
 	
 	// set math options.
 	N_ = mo.N;
@@ -47,85 +81,401 @@ PESolver::PESolver(const PEGrating& grating, const PEMathOptions& mo, int numThr
 	twoNp1_ = 2*N_ + 1;
 	fourNp2_ = 4*N_ + 2;
 	eightNp4_ = 8*N_ + 4;
+
+	// With TM, the TM system [H, v] follows the TE system [u, uprime] in each trial solution, and the 1/epsilon coefficients follow the k^2 ones in each grating expansion.
+	bool withTM = mo.polarization == PEMathOptions::TEAndTMPolarization;
+	stateSize_ = withTM ? 2*eightNp4_ : eightNp4_;
+	expansionSize_ = withTM ? 2*twoNp1_ : twoNp1_;
+	kM2_ = 0;
 	
 	// allocate matrices and vectors
-	wVectors_ = new double[eightNp4_ * fourNp2_];	// size: (2N_+1) orders * 2(for re,im) * 2(for u,uprime) * 2(2N_+1) trial solutions.
-	T11_ = gsl_matrix_complex_alloc(twoNp1_, twoNp1_);
-	T12_ = gsl_matrix_complex_alloc(twoNp1_, twoNp1_);
-	T21_ = gsl_matrix_complex_alloc(twoNp1_, twoNp1_);
-	T22_ = gsl_matrix_complex_alloc(twoNp1_, twoNp1_);
-	S12_ = gsl_matrix_complex_alloc(twoNp1_, twoNp1_);
-	S22_ = gsl_matrix_complex_alloc(twoNp1_, twoNp1_);
-	Zinv_ = gsl_matrix_complex_alloc(twoNp1_, twoNp1_);
-	Z_ = gsl_matrix_complex_alloc(twoNp1_, twoNp1_);
-	workMatrix_ = gsl_matrix_complex_alloc(twoNp1_, twoNp1_);
-	permutation_ = gsl_permutation_alloc(twoNp1_);
+	wVectors_ = new double[stateSize_ * fourNp2_];	// size: (2N_+1) orders * 2(for re,im) * 2(for u,uprime) [* 2 for H,v] * 2(2N_+1) trial solutions.
+	tm_ = withTM ? new PolarizationMatrices(twoNp1_) : 0;
+	tmWork_ = 0;
+	zeros_ = 0;
+	if(withTM) {
+		tmWork_ = new double*[numThreads_];
+		for(int i=0; i<numThreads_; ++i)
+			tmWork_[i] = new double[2*fourNp2_];
+		zeros_ = new double[twoNp1_];
+		std::fill(zeros_, zeros_+twoNp1_, 0.0);
+	}
 	
 	alpha_ = new double[twoNp1_];
+	alpha2_ = new double[twoNp1_];
 	betaM_ = new gsl_complex[twoNp1_];
 	beta1_ = new gsl_complex[twoNp1_];
-	BM_ = new gsl_complex[twoNp1_];
 	
 	// we need one k2_ array for each thread, since they will be used simultaneously.
 	k2_ = new gsl_complex*[numThreads_];
 	for(int i=0; i<numThreads_; ++i)
-		k2_[i] = new gsl_complex[twoNp1_];
+		k2_[i] = new gsl_complex[expansionSize_];
+
+	// the expansion table is shared by all threads.  We need at least 4 points for cubic interpolation.
+	k2TablePoints_ = mo.expansionTablePoints > 0 ? std::max(mo.expansionTablePoints, 4) : 0;
+	k2Table_ = k2TablePoints_ ? new gsl_complex[k2TablePoints_*expansionSize_] : 0;
+	k2TableYStart_ = k2TableDy_ = 0;
+	k2TableActive_ = false;
+
+	layerK2_ = new gsl_complex[expansionSize_];
+	layerIsYInvariant_ = false;
+
+	// allocated on first use by computeLayerPropagator().
+	propagator_ = propagatorTM_ = 0;
+	for(int i=0; i<7; ++i)
+		propagatorWork_[i] = 0;
+	propagatedW_ = 0;
+	propagatorK2_ = new gsl_complex[expansionSize_];
+	propagatorH_ = -1;
+
+	// define ode solving system, with our function to evaluate dw/dy, the Jacobian, and 8*N_+4 (or 16*N_+8 with TM) components.
+	odeSystem_.function = odeFunctionCB;
+	odeSystem_.jacobian = odeJacobianCB;
+	odeSystem_.dimension = stateSize_;
+	odeSystem_.params = this;
+
+	// one integration driver for each thread, since they will be used simultaneously. The starting step is set for each integration in integrateTrialSolutionAlongY().
+	const gsl_odeiv2_step_type* stepType;
+	switch(mo.stepper) {
+	case PEMathOptions::RK8PDStepper:
+		stepType = gsl_odeiv2_step_rk8pd;
+		break;
+	case PEMathOptions::RKCKStepper:
+		stepType = gsl_odeiv2_step_rkck;
+		break;
+	case PEMathOptions::BSimpStepper:
+		stepType = gsl_odeiv2_step_bsimp;
+		break;
+	case PEMathOptions::FixedRK4Stepper:
+		stepType = gsl_odeiv2_step_rk4;
+		break;
+	default:
+		stepType = gsl_odeiv2_step_msadams;	// Variable-coefficient linear multistep Adams method in Nordsieck form. Uses explicit Adams-Bashforth (predictor) and implicit Adams-Moulton (corrector) methods in P(EC)^m functional iteration mode.
+		break;
+	}
+	double absTolerance = mo.integrationAbsTolerance < 0 ? integrationTolerance_ : mo.integrationAbsTolerance;
+	drivers_ = new gsl_odeiv2_driver*[numThreads_];
+	for(int i=0; i<numThreads_; ++i)
+		drivers_[i] = gsl_odeiv2_driver_alloc_standard_new (&odeSystem_, stepType, 1e-6, absTolerance, integrationTolerance_, 0.5, 0.5);
+
+	// The matrix integration integrates all the trial solutions as one big system, so it needs just one driver.
+	matrixDriver_ = 0;
+	matrixW_ = 0;
+	matrixM_ = matrixE_ = matrixB_ = 0;
+	if(mo.matrixIntegration && mo.stepper != PEMathOptions::BSimpStepper) {
+		matrixSystem_.function = matrixODEFunctionCB;
+		matrixSystem_.jacobian = 0;
+		matrixSystem_.dimension = stateSize_*fourNp2_;
+		matrixSystem_.params = this;
+		matrixDriver_ = gsl_odeiv2_driver_alloc_standard_new (&matrixSystem_, stepType, 1e-6, absTolerance, integrationTolerance_, 0.5, 0.5);
+		matrixW_ = new double[stateSize_*fourNp2_];
+		matrixM_ = gsl_matrix_complex_alloc(twoNp1_, twoNp1_);
+		if(withTM) {
+			matrixE_ = gsl_matrix_complex_alloc(twoNp1_, twoNp1_);
+			matrixB_ = gsl_matrix_complex_alloc(twoNp1_, twoNp1_);
+		}
+	}
+
+	odeFunctionCalls_.assign(numThreads_, 0);
+	odeJacobianCalls_.assign(numThreads_, 0);
+	odeSteps_.assign(numThreads_, 0);
+	threadBusyTime_.assign(numThreads_, 0);
 
 	y_ = 0;
-	timing_[0] = omp_get_wtime() - time_;		// time to allocate memory.
+	yCapacity_ = 0;
+	indexWl_ = -1;
+
+	// With an adaptive N, create the contexts for the smaller N's first tried: going down from N by about 1.5 times each step, as long as they are at least N/4 (and 4).
+	if(mo.adaptiveNTolerance > 0) {
+		PEMathOptions smallerOptions = mo;
+		smallerOptions.adaptiveNTolerance = 0;
+		int minN = std::max(4, N_/4);
+		for(int n = 2*N_/3; n >= minN; n = 2*n/3) {
+			smallerOptions.N = n;
+			adaptiveNSolvers_.insert(adaptiveNSolvers_.begin(), new PESolver(g_, smallerOptions, numThreads_));
+		}
+	}
+	allocationTime_ = omp_get_wtime() - startTime;		// time to allocate memory. (Counted in the profile of the first calculation.)
+
+	// The kernel check for the timing report only needs to be done once.
+	kernelDifference_ = measureTiming_ ? PEKernels::verify(N_) : 0;
 }
 
 
 PESolver::~PESolver() {
 
-	gsl_matrix_complex_free(T11_);
-	gsl_matrix_complex_free(T12_);
-	gsl_matrix_complex_free(T21_);
-	gsl_matrix_complex_free(T22_);
-	gsl_matrix_complex_free(S12_);
-	gsl_matrix_complex_free(S22_);
-	gsl_matrix_complex_free(Zinv_);
-	gsl_matrix_complex_free(Z_);
-	gsl_matrix_complex_free(workMatrix_);
-	gsl_permutation_free(permutation_);
+	delete tm_;
+	if(tmWork_) {
+		for(int i=0; i<numThreads_; ++i)
+			delete [] tmWork_[i];
+		delete [] tmWork_;
+	}
+	delete [] zeros_;
 	
 	delete [] alpha_;
+	delete [] alpha2_;
 	delete [] betaM_;
 	delete [] beta1_;
 	delete [] wVectors_;
 	delete [] y_;
-	delete [] BM_;
 
 	for(int i=0; i<numThreads_; ++i)
 		delete [] k2_[i];
 	delete [] k2_;
+	delete [] k2Table_;
+	delete [] layerK2_;
+
+	if(propagator_) {
+		gsl_matrix_complex_free(propagator_);
+		for(int i=0; i<4; ++i)
+			gsl_matrix_complex_free(propagatorWork_[i]);
+		delete [] propagatedW_;
+	}
+	if(propagatorTM_) {
+		gsl_matrix_complex_free(propagatorTM_);
+		for(int i=4; i<7; ++i)
+			gsl_matrix_complex_free(propagatorWork_[i]);
+	}
+	delete [] propagatorK2_;
+
+	for(int i=0; i<numThreads_; ++i)
+		gsl_odeiv2_driver_free(drivers_[i]);
+	delete [] drivers_;
+	if(matrixDriver_) {
+		gsl_odeiv2_driver_free(matrixDriver_);
+		delete [] matrixW_;
+		gsl_matrix_complex_free(matrixM_);
+		if(matrixE_) {
+			gsl_matrix_complex_free(matrixE_);
+			gsl_matrix_complex_free(matrixB_);
+		}
+	}
+
+	clearBatchWorkers();
+	for(int i=0,cc=adaptiveNSolvers_.size(); i<cc; ++i)
+		delete adaptiveNSolvers_[i];
+}
+
+void PESolver::clearBatchWorkers() {
+	for(int i=0,cc=batchWorkers_.size(); i<cc; ++i)
+		delete batchWorkers_[i];
+	batchWorkers_.clear();
+}
+
+std::vector<PEResult> PESolver::getEffBatch(const std::vector<PEScanPoint>& points, double rmsRoughnessNm, std::vector<PESolverProfile>* profiles) {
+
+	int numPoints = points.size();
+	std::vector<PEResult> results(numPoints);
+	if(profiles)
+		profiles->resize(numPoints);
+	if(numPoints == 0)
+		return results;
+
+	// Divide our threads between points: as many concurrent points as we have threads (or points), and the rest of the threads for the trial solutions within each point.  If they don't divide evenly, the first workers get one more thread each, so that none are left idle.
+	int numWorkers = std::min(numThreads_, numPoints);
+
+	// The worker contexts are kept from the largest batch so far. Smaller batches (like the last one of a scan) use the first numWorkers of them, instead of re-creating them all with more threads each. Only a larger batch needs more, and smaller, workers.
+	if(int(batchWorkers_.size()) < numWorkers) {
+		clearBatchWorkers();
+		int threadsPerWorker = numThreads_ / numWorkers, extraThreads = numThreads_ % numWorkers;
+		for(int i=0; i<numWorkers; ++i)
+			batchWorkers_.push_back(new PESolver(g_, mathOptions_, threadsPerWorker + (i < extraThreads ? 1 : 0)));
+	}
+
+	// One parallel region for the whole batch. Points can take very different amounts of time (ex: near absorption edges), so they are handed out dynamically.
+#pragma omp parallel for num_threads(numWorkers) schedule(dynamic)
+	for(int i=0; i<numPoints; ++i) {
+		PESolver* worker = batchWorkers_[omp_get_thread_num()];
+		results[i] = worker->getEff(points[i].incidenceDeg, points[i].wavelength, rmsRoughnessNm);
+		// failures don't fill in the point they were calculated for:
+		results[i].incidenceDeg = points[i].incidenceDeg;
+		results[i].wavelength = points[i].wavelength;
+		if(profiles)
+			(*profiles)[i] = worker->lastProfile();
+	}
+
+	return results;
 }
 
-/// \todo Imp.
 PEResult PESolver::getEff(double incidenceDeg, double wl, double rmsRoughnessNm, bool printDebugOutput) {
+	beginProfile(incidenceDeg, wl);
+
+	// Cached results skip the calculation, so they can't provide debug output or timing.
+	PEResultCache* cache = (printDebugOutput || measureTiming_) ? 0 : PEResultCache::global();
+	std::string key;
+	PEResult result;
+	if(cache) {
+		key = PEResultCache::key(g_, mathOptions_, incidenceDeg, wl, rmsRoughnessNm);
+		if(cache->lookup(key, result)) {
+			profile_.cacheHits = 1;
+			endProfile(result);
+			return result;
+		}
+	}
+
+	if(mathOptions_.adaptiveNTolerance > 0)
+		result = computeEffAdaptiveN(incidenceDeg, wl, rmsRoughnessNm, printDebugOutput);
+	else
+		result = computeEff(incidenceDeg, wl, rmsRoughnessNm, printDebugOutput);
+	if(cache && result.status == PEResult::Success)
+		cache->store(key, result);
+	endProfile(result);
+	return result;
+}
+
+PEResult PESolver::computeEffAdaptiveN(double incidenceDeg, double wl, double rmsRoughnessNm, bool printDebugOutput) {
+
+	PEResult result, last;
+	for(int k=0, numSmaller=adaptiveNSolvers_.size(); k<=numSmaller; ++k) {
+
+		// The smaller N's have their own contexts; their work is added to the profile of this calculation. The last step is N, with this context.
+		if(k < numSmaller) {
+			PESolver* smaller = adaptiveNSolvers_[k];
+			smaller->beginProfile(incidenceDeg, wl);
+			result = smaller->computeEff(incidenceDeg, wl, rmsRoughnessNm, printDebugOutput);
+			smaller->endProfile(result);
+			PESolverProfile smallerProfile = smaller->lastProfile();
+			smallerProfile.points = smallerProfile.failures = smallerProfile.totalTime = 0;
+			profile_.add(smallerProfile);
+		}
+		else
+			result = computeEff(incidenceDeg, wl, rmsRoughnessNm, printDebugOutput);
+
+		if(result.status != PEResult::Success) {
+			last.status = result.status;	// nothing to compare the next N with.
+			continue;
+		}
+
+		// Compare with the last N: orders beyond the smaller N count as 0 there.
+		if(last.status == PEResult::Success) {
+			int n = result.usedN, lastN = last.usedN;
+			for(int i=-n; i<=n; ++i) {
+				double lastEff = (i >= -lastN && i <= lastN) ? last.eff[i+lastN] : 0;
+				result.truncationError = std::max(result.truncationError, std::fabs(result.eff[i+n] - lastEff));
+				if(!result.effTM.empty()) {
+					double lastEffTM = (i >= -lastN && i <= lastN) ? last.effTM[i+lastN] : 0;
+					result.truncationError = std::max(result.truncationError, std::fabs(result.effTM[i+n] - lastEffTM));
+				}
+			}
+			if(result.truncationError <= mathOptions_.adaptiveNTolerance)
+				break;
+		}
+
+		if(printDebugOutput)
+			std::cout << "Truncation error estimate at N=" << result.usedN << ": " << result.truncationError << std::endl;
+		last = result;
+	}
+
+	if(result.status != PEResult::Success || result.usedN == N_)
+		return result;
+
+	// Fill in 0 for the orders beyond the N that was used.
+	PEResult padded(N_);
+	padded.wavelength = result.wavelength;
+	padded.incidenceDeg = result.incidenceDeg;
+	padded.usedN = result.usedN;
+	padded.truncationError = result.truncationError;
+	std::copy(result.eff.begin(), result.eff.end(), padded.eff.begin() + (N_ - result.usedN));
+	if(!result.effTM.empty()) {
+		padded.effTM.assign(twoNp1_, 0.0);
+		std::copy(result.effTM.begin(), result.effTM.end(), padded.effTM.begin() + (N_ - result.usedN));
+	}
+	return padded;
+}
+
+void PESolver::beginProfile(double incidenceDeg, double wl) {
+	profile_.clear();
+	profile_.wavelength = wl;
+	profile_.incidenceDeg = incidenceDeg;
+	profile_.threads = numThreads_;
+	profile_.points = 1;
+	// Memory is only allocated once, in the constructor. All subsequent calculations with this context re-use it.
+	profile_.phaseTime[PESolverProfile::AllocationPhase] = allocationTime_;
+	allocationTime_ = 0;
+
+	for(int i=0; i<numThreads_; ++i) {
+		profile_.odeFunctionCalls -= odeFunctionCalls_[i];
+		profile_.odeJacobianCalls -= odeJacobianCalls_[i];
+		profile_.odeSteps -= odeSteps_[i];
+	}
+	profileStartTime_ = phaseStartTime_ = omp_get_wtime();
+}
+
+void PESolver::endProfile(const PEResult& result) {
+	profile_.totalTime = omp_get_wtime() - profileStartTime_ + profile_.phaseTime[PESolverProfile::AllocationPhase];
+	profile_.status = result.status;
+	profile_.failures = (result.status == PEResult::Success) ? 0 : 1;
+	for(int i=0; i<numThreads_; ++i) {
+		profile_.odeFunctionCalls += odeFunctionCalls_[i];
+		profile_.odeJacobianCalls += odeJacobianCalls_[i];
+		profile_.odeSteps += odeSteps_[i];
+	}
+
+	if(measureTiming_) {
+		std::cout << "Timing Profile:" << std::endl;
+		std::cout << "   Allocate Memory: " << profile_.phaseTime[PESolverProfile::AllocationPhase] << std::endl;
+		std::cout << "   Look up refractive index: " << profile_.phaseTime[PESolverProfile::RefractiveIndexPhase] << std::endl;
+		std::cout << "   Compute alpha, beta values and layers: " << profile_.phaseTime[PESolverProfile::LayersPhase] << std::endl;
+		std::cout << "   Numerically integrating trial solutions: " << profile_.phaseTime[PESolverProfile::IntegrationPhase] << std::endl;
+		std::cout << "   Matrix operations: " << profile_.phaseTime[PESolverProfile::MatrixPhase] << std::endl;
+		std::cout << "   Computing Rayleigh coefficients and efficiencies: " << profile_.phaseTime[PESolverProfile::EfficiencyPhase] << std::endl;
+		std::cout << "   Total (solver) time: " << profile_.totalTime << std::endl;
+		std::cout << "   Layers: " << profile_.layers << " (" << profile_.integratedLayers << " integrated, " << profile_.propagatedLayers << " propagated)" << std::endl;
+		std::cout << "   ODE function / Jacobian calls, steps: " << profile_.odeFunctionCalls << " / " << profile_.odeJacobianCalls << ", " << profile_.odeSteps << std::endl;
+		std::cout << "   Thread load imbalance (busiest / average): " << profile_.loadImbalance() << std::endl;
+		std::cout << "   Linear algebra: " << PELUFactorization::backendName() << std::endl;
+		std::cout << "   M*u kernel: " << PEKernels::name(PEKernels::bestFor(N_)) << (PEKernels::isSpecialized(N_) ? ", specialized for this N" : "") << " (max. difference from scalar: " << kernelDifference_ << ")" << std::endl << std::endl;
+	}
+}
+
+void PESolver::endPhase(PESolverProfile::Phase phase) {
+	double now = omp_get_wtime();
+	profile_.phaseTime[phase] += now - phaseStartTime_;
+	phaseStartTime_ = now;
+}
+
+PEResult::Code PESolver::setUpCalculation(double incidenceDeg, double wl) {
 
-	time_ = omp_get_wtime();
-	
 	// 1. Setup incidence variables and constants
 	/////////////////////////////////////////
 	
 	// Set this as the current wavelength
 	wl_ = wl;
-	// get material refractive index at wavelength
-	v_1_ = g_.substrateRefractiveIndex(wl_);
-	if(GSL_REAL(v_1_) == 0.0 && GSL_IMAG(v_1_) == 0.0) {
-		return PEResult::MissingRefractiveDataFailure;
-	}
-	if(g_.coatingThickness() > 0) {
-		v_c_ = g_.coatingRefractiveIndex(wl_);
-		if(GSL_REAL(v_c_) == 0.0 && GSL_IMAG(v_c_) == 0.0) {
+	// get material refractive index at wavelength (unless we still have it from the last calculation)
+	if(wl_ != indexWl_) {
+		indexWl_ = -1;
+		v_1_ = g_.substrateRefractiveIndex(wl_);
+		if(GSL_REAL(v_1_) == 0.0 && GSL_IMAG(v_1_) == 0.0) {
 			return PEResult::MissingRefractiveDataFailure;
 		}
+		if(g_.coatingThickness() > 0) {
+			v_c_ = g_.coatingRefractiveIndex(wl_);
+			if(GSL_REAL(v_c_) == 0.0 && GSL_IMAG(v_c_) == 0.0) {
+				return PEResult::MissingRefractiveDataFailure;
+			}
+		}
+		indexWl_ = wl_;
 	}
 
-	timing_[1] = time_;
-	time_ = omp_get_wtime();
-	timing_[1] = time_ - timing_[1];	// time to look up refractive index.
+	// k^2 of the media, for every computeGratingExpansion() at this wavelength:
+	// wave number in free space: k_2 = v_2 * w / c.  v_2 = 1 in empty space, so k_2 = 2pi / wl.
+	gsl_complex k_M = gsl_complex_rect(2 * M_PI / wl_, 0);
+	// wave number in the substrate: k_1 = v_1 * w / c = v_1 * 2pi / wl = v_1 * k_2.
+	gsl_complex k_1 = gsl_complex_mul(v_1_, k_M);
+	// wave number in the coating layer:
+	gsl_complex k_c = gsl_complex_mul(v_c_, k_M);
+	// square them to get k^2_M, k^2_1 and k^2_c:
+	mediaK2_[0] = gsl_complex_mul(k_M, k_M);
+	mediaK2_[1] = gsl_complex_mul(k_1, k_1);
+	mediaK2_[2] = gsl_complex_mul(k_c, k_c);
+	// For TM, the steps of 1/epsilon = k^2_M / k^2 are at the same crossings, and they are the 1/epsilon of the same media.
+	if(tm_) {
+		mediaInvEps_[0] = gsl_complex_rect(1,0);
+		mediaInvEps_[1] = gsl_complex_div(mediaK2_[0], mediaK2_[1]);
+		mediaInvEps_[2] = gsl_complex_div(mediaK2_[0], mediaK2_[2]);
+	}
+
+	endPhase(PESolverProfile::RefractiveIndexPhase);
 	
 	// 2. compute all alpha_n and beta1_n, betaM_n.
 	///////////////////////////////////
@@ -134,10 +484,32 @@ PEResult PESolver::getEff(double incidenceDeg, double wl, double rmsRoughnessNm,
 
 	// Calculates how many vertical layers we need, and the division into slices at y_.
 	computeLayers();
+	if(mathOptions_.warmStart)
+		warmStartStepSizes();
+	// alpha and beta have changed, so any layer propagator from the last calculation is out of date.
+	propagatorH_ = -1;
+
+	profile_.layers = numLayers_;
+	endPhase(PESolverProfile::LayersPhase);
+
+	return PEResult::Success;
+}
 
-	timing_[2] = time_;
-	time_ = omp_get_wtime();
-	timing_[2] = time_ - timing_[2];	// time to calculate alpha, beta, and layers.
+PEResult::Code PESolver::prepareForLayer(double incidenceDeg, double wl, int m) {
+	PEResult::Code status = setUpCalculation(incidenceDeg, wl);
+	if(status != PEResult::Success)
+		return status;
+	if(m < 2 || m >= M_)
+		return PEResult::InvalidGratingFailure;
+	return prepareLayer(m);
+}
+
+/// \todo Imp.
+PEResult PESolver::computeEff(double incidenceDeg, double wl, double rmsRoughnessNm, bool printDebugOutput) {
+
+	PEResult::Code setUpStatus = setUpCalculation(incidenceDeg, wl);
+	if(setUpStatus != PEResult::Success)
+		return setUpStatus;
 
 	if(printDebugOutput) {
 		std::cout << "\nWavelength wl (um): " << wl_ << std::endl;
@@ -163,86 +535,47 @@ PEResult PESolver::getEff(double incidenceDeg, double wl, double rmsRoughnessNm,
 	// 3. Recursive computation of S-matrix below each layer.
 	/////////////////////////////////////////////////////////////
 
-	gsl_complex one = gsl_complex_rect(1,0);
-	gsl_complex zero = gsl_complex_rect(0,0);
-
 	// Handle first layer separately, as a special case.
 	PEResult::Code status = computeTMatrixBelowLayer(2, printDebugOutput);
 	if(status != PEResult::Success)
 		return status;
 
-	timing_[3] = time_;
-	time_ = omp_get_wtime();
-	timing_[3] = time_ - timing_[3];	// timing_[3]: numerical integration.
-
-	// For the first layer, we have Zinv_ = T11_.
-	// S12_ = T21_ Zinv_^{-1}
-	// S22_ = Zinv_^{-1}
-	///////////////
-	gsl_matrix_complex_memcpy(Zinv_, T11_);
-	int signnum;
-	if(gsl_linalg_complex_LU_decomp(Zinv_, permutation_, &signnum) != GSL_SUCCESS)
-		return PEResult(PEResult::AlgebraFailure);
-	// S22_ = Zinv_^{-1}, ie, Z.
-	if(gsl_linalg_complex_LU_invert(Zinv_, permutation_, S22_) != GSL_SUCCESS)
-		return PEResult(PEResult::AlgebraFailure);
-	// S12_ = T21_ Zinv_^{-1} = T21_ S22_.
-	if(gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, one, T21_, S22_, zero, S12_) != GSL_SUCCESS)
-		return PEResult(PEResult::AlgebraFailure);
-
-	timing_[4] = time_;
-	time_ = omp_get_wtime();
-	timing_[4] = time_ - timing_[4];	// timing_[4]: matrix calcs.
+	endPhase(PESolverProfile::IntegrationPhase);
+
+	if((status = updateSMatrix(te_, 2)) != PEResult::Success)
+		return status;
+	if(tm_ && (status = updateSMatrix(*tm_, 2)) != PEResult::Success)
+		return status;
+
+	endPhase(PESolverProfile::MatrixPhase);
 
 
 	// First layer done. Handle subsequent layers
 	for(int m=3; m<M_; ++m) {
 
-		time_ = omp_get_wtime();
-
 		status = computeTMatrixBelowLayer(m, printDebugOutput);
 		if(status != PEResult::Success) return status;
 
-		timing_[3] += omp_get_wtime() - time_;
-
-		time_ = omp_get_wtime();
+		endPhase(PESolverProfile::IntegrationPhase);
 
-		// Compute Zinv_ = T11_ + T12_ S12_.
-		gsl_matrix_complex_memcpy(Zinv_, T11_);
-		gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, one, T12_, S12_, one, Zinv_);
-
-		// Invert Zinv_...
-		if(gsl_linalg_complex_LU_decomp(Zinv_, permutation_, &signnum) != GSL_SUCCESS) return PEResult(PEResult::AlgebraFailure);
-		if(gsl_linalg_complex_LU_invert(Zinv_, permutation_, Z_) != GSL_SUCCESS) return PEResult(PEResult::AlgebraFailure);
-
-		// S12 = (T21 + T22 S12) Z
-		gsl_matrix_complex_memcpy(workMatrix_, T21_);
-		if(gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, one, T22_, S12_, one, workMatrix_) != GSL_SUCCESS)
-			return PEResult(PEResult::AlgebraFailure);
-		if(gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, one, workMatrix_, Z_, zero, S12_) != GSL_SUCCESS)
-			return PEResult(PEResult::AlgebraFailure);
-		// S22 = S22 Z
-		gsl_matrix_complex_memcpy(workMatrix_, S22_);
-		if(gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, one, workMatrix_, Z_, zero, S22_) != GSL_SUCCESS)
-			return PEResult(PEResult::AlgebraFailure);
+		if((status = updateSMatrix(te_, m)) != PEResult::Success)
+			return status;
+		if(tm_ && (status = updateSMatrix(*tm_, m)) != PEResult::Success)
+			return status;
 
-		timing_[4] += omp_get_wtime() - time_;
+		endPhase(PESolverProfile::MatrixPhase);
 	}
 
 	// 4.  Calculate B_n^M from center column of S matrix * exp(...).
 	//////////////////////////////////////////////
-	time_ = omp_get_wtime();
-
-	computeBMFromSMatrix();
-
-	timing_[5] = time_;
-	time_ = omp_get_wtime();
-	timing_[5] = time_ - timing_[5];	// timing_[5]: compute BM_ from S-matrix.
+	computeBMFromSMatrix(te_);
+	if(tm_)
+		computeBMFromSMatrix(*tm_);
 
 	if(printDebugOutput) {
 		std::cout << "\nBM_:" << std::endl;
 		for(int i=0; i<twoNp1_; ++i) {
-			std::cout << i - N_ << ":\t" << GSL_REAL(BM_[i]) << "\t\t" << GSL_IMAG(BM_[i]) << std::endl;
+			std::cout << i - N_ << ":\t" << GSL_REAL(te_.BM[i]) << "\t\t" << GSL_IMAG(te_.BM[i]) << std::endl;
 		}
 	}
 
@@ -253,60 +586,131 @@ PEResult PESolver::getEff(double incidenceDeg, double wl, double rmsRoughnessNm,
 	result.wavelength = wl_;
 	result.incidenceDeg = incidenceDeg;
 	
-	double effSum = 0;
-	for(int i=0; i<twoNp1_; ++i) {
-		// int n = i - N_;
-		result.eff[i] =  gsl_complex_abs2(BM_[i])*GSL_REAL(betaM_[i])/GSL_REAL(betaM_[N_]);
-		// is this a non-propagating order?  Then the real part of beta2_n will be exactly 0, so the efficiency will come out as 0.
-		effSum += result.eff[i];
-	}
-	
-	timing_[6] = time_;
-	time_ = omp_get_wtime();
-	timing_[6] = time_ - timing_[6];	// timing_[6]: calculate efficiencies from BM_
-	
-	if(measureTiming_) {
-		std::cout << "Timing Profile:" << std::endl;
-		std::cout << "   Allocate Memory: " << timing_[0] << std::endl;
-		std::cout << "   Look up refractive index: " << timing_[1] << std::endl;
-		std::cout << "   Compute alpha, beta values and layers: " << timing_[2] << std::endl;
-		std::cout << "   Numerically integrating trial solutions: " << timing_[3] << std::endl;
-		std::cout << "   Matrix operations: " << timing_[4] << std::endl;
-		std::cout << "   Computing Rayleigh coeffients B_n: " << timing_[5] << std::endl;
-		std::cout << "   Compute and package efficiencies: " << timing_[6] << std::endl;
-		time_ = timing_[0] + timing_[1] + timing_[2] + timing_[3] + timing_[4] + timing_[5] + timing_[6];
-		std::cout << "   Total (solver) time: " << time_ << std::endl << std::endl;
+	double effSum = computeEfficiencies(te_, result.eff);
+	result.truncationError = estimateTruncationError(te_, effSum);
+
+	double effSumTM = 0;
+	if(tm_) {
+		result.effTM.resize(twoNp1_);
+		effSumTM = computeEfficiencies(*tm_, result.effTM);
+		result.truncationError = std::max(result.truncationError, estimateTruncationError(*tm_, effSumTM, true));
 	}
 
+	endPhase(PESolverProfile::EfficiencyPhase);
+
 	if(printDebugOutput) {
 		std::cout << "Sum of reflected efficiencies: " << effSum << std::endl;
 
 		// in debugging, let's also compute and sum the transmitted efficiencies:
-		double a = g_.totalHeight();
-		std::vector<gsl_complex> A1(twoNp1_);
-		std::vector<double> e_t(twoNp1_);
 		double sumTransmitted = 0;
-		for(int i=0; i<twoNp1_; i++) {
-			A1[i] = gsl_complex_mul(
-						gsl_matrix_complex_get(S22_, i, N_),
-						gsl_complex_exp(gsl_complex_mul_imag(betaM_[N_],
-															 -a)));
-			e_t[i] = gsl_complex_abs2(A1[i])*GSL_REAL(beta1_[i])/GSL_REAL(betaM_[N_]);
-			sumTransmitted += e_t[i];
-		}
+		for(int i=0; i<twoNp1_; i++)
+			sumTransmitted += transmittedEfficiency(te_, i, false);
 		std::cout << "Sum of transmitted efficiencies: " << sumTransmitted << std::endl;
 		std::cout << "Total efficiency (should be <= 1): " << sumTransmitted + effSum << std::endl;
+
+		if(tm_) {
+			double sumTransmittedTM = 0;
+			for(int i=0; i<twoNp1_; i++)
+				sumTransmittedTM += transmittedEfficiency(*tm_, i, true);
+			std::cout << "TM: Sum of reflected efficiencies: " << effSumTM << std::endl;
+			std::cout << "TM: Sum of transmitted efficiencies: " << sumTransmittedTM << std::endl;
+			std::cout << "TM: Total efficiency (should be <= 1): " << sumTransmittedTM + effSumTM << std::endl;
+		}
 	}
 
 	if(rmsRoughnessNm > 0) {
 		double roughnessFactor = g_.roughnessFactor(rmsRoughnessNm/1000., wl, g_.coatingThickness() > 0 ? v_c_ : v_1_, incidenceDeg);
 		for(int i=0; i<twoNp1_; ++i)
 			result.eff[i] = roughnessFactor*result.eff.at(i);
+		for(int i=0, cc=result.effTM.size(); i<cc; ++i)
+			result.effTM[i] = roughnessFactor*result.effTM[i];
 	}
 	
 	return result;
 }
 
+PEResult::Code PESolver::updateSMatrix(PolarizationMatrices& pm, int m) {
+
+	gsl_complex one = gsl_complex_rect(1,0);
+
+	if(m == 2) {
+		// For the first layer, we have Zinv = T11.
+		// S12 = T21 Zinv^{-1}
+		// S22 = Zinv^{-1}
+		// Both are found by solving from the right with the LU decomposition of Zinv.
+		///////////////
+		gsl_matrix_complex_memcpy(pm.Zinv, pm.T11);
+		if(!pm.lu->decompose(pm.Zinv))
+			return PEResult::AlgebraFailure;
+		// S22 Zinv = I
+		gsl_matrix_complex_set_identity(pm.S22);
+		if(!pm.lu->solveRight(pm.S22))
+			return PEResult::AlgebraFailure;
+		// S12 Zinv = T21
+		gsl_matrix_complex_memcpy(pm.S12, pm.T21);
+		if(!pm.lu->solveRight(pm.S12))
+			return PEResult::AlgebraFailure;
+		return PEResult::Success;
+	}
+
+	// Compute Zinv = T11 + T12 S12.
+	gsl_matrix_complex_memcpy(pm.Zinv, pm.T11);
+	gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, one, pm.T12, pm.S12, one, pm.Zinv);
+
+	// Factor Zinv, instead of inverting it...
+	if(!pm.lu->decompose(pm.Zinv)) return PEResult::AlgebraFailure;
+
+	// S12 = (T21 + T22 S12) Z, ie: S12 Zinv = T21 + T22 S12
+	gsl_matrix_complex_memcpy(pm.work, pm.T21);
+	if(gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, one, pm.T22, pm.S12, one, pm.work) != GSL_SUCCESS)
+		return PEResult::AlgebraFailure;
+	if(!pm.lu->solveRight(pm.work))
+		return PEResult::AlgebraFailure;
+	std::swap(pm.S12, pm.work);
+	// S22 = S22 Z, ie: S22 Zinv = S22
+	if(!pm.lu->solveRight(pm.S22))
+		return PEResult::AlgebraFailure;
+	return PEResult::Success;
+}
+
+double PESolver::computeEfficiencies(const PolarizationMatrices& pm, std::vector<double>& eff) const {
+	double effSum = 0;
+	for(int i=0; i<twoNp1_; ++i) {
+		// int n = i - N_;
+		eff[i] =  gsl_complex_abs2(pm.BM[i])*GSL_REAL(betaM_[i])/GSL_REAL(betaM_[N_]);
+		// is this a non-propagating order?  Then the real part of beta2_n will be exactly 0, so the efficiency will come out as 0.
+		effSum += eff[i];
+	}
+	return effSum;
+}
+
+double PESolver::transmittedEfficiency(const PolarizationMatrices& pm, int i, bool tm) const {
+	double a = g_.totalHeight();
+	gsl_complex A1 = gsl_complex_mul(gsl_matrix_complex_get(pm.S22, i, N_), gsl_complex_exp(gsl_complex_mul_imag(betaM_[N_], -a)));
+	// For TM, the power flux in the substrate is weighted by beta / epsilon_1, where epsilon_1 = v_1^2.
+	double weight = tm ? GSL_REAL(gsl_complex_div(beta1_[i], gsl_complex_mul(v_1_, v_1_))) : GSL_REAL(beta1_[i]);
+	return gsl_complex_abs2(A1)*weight/GSL_REAL(betaM_[N_]);
+}
+
+double PESolver::estimateTruncationError(const PolarizationMatrices& pm, double reflectedSum, bool tm) const {
+
+	// The outermost orders that the expansion still includes: if they carry a significant part of the reflected power, the orders just beyond them (that were truncated) would too.
+	double tail = 0;
+	int numEdgeOrders = std::min(2, N_);
+	for(int k=0; k<numEdgeOrders; ++k) {
+		tail += gsl_complex_abs2(pm.BM[k])*GSL_REAL(betaM_[k])/GSL_REAL(betaM_[N_]);
+		tail += gsl_complex_abs2(pm.BM[twoNp1_-1-k])*GSL_REAL(betaM_[twoNp1_-1-k])/GSL_REAL(betaM_[N_]);
+	}
+
+	// Power balance: the reflected and transmitted efficiencies can't add up to more than 1.  (With absorbing materials they add up to less, so this only catches some errors.)
+	double transmittedSum = 0;
+	for(int i=0; i<twoNp1_; ++i)
+		transmittedSum += transmittedEfficiency(pm, i, tm);
+	double excess = std::max(0.0, reflectedSum + transmittedSum - 1);
+
+	return std::max(tail, excess);
+}
+
 gsl_complex PESolver::complex_sqrt_upperComplexPlane(gsl_complex z) {
 
 	gsl_complex w = gsl_complex_sqrt(z); // returns w in the right half of complex plane.
@@ -320,37 +724,154 @@ gsl_complex PESolver::complex_sqrt_upperComplexPlane(gsl_complex z) {
 }
 
 PEResult::Code PESolver::computeGratingExpansion(double y, gsl_complex* k2) const {
-	
-	// wave number in free space: k_2 = v_2 * w / c.  v_2 = 1 in empty space, so k_2 = 2pi / wl.
-	gsl_complex k_M = gsl_complex_rect(2 * M_PI / wl_, 0);
-	// wave number in the substrate: k_1 = v_1 * w / c = v_1 * 2pi / wl = v_1 * k_2.
-	gsl_complex k_1 = gsl_complex_mul(v_1_, k_M);
-	// wave number in the coating layer:
-	gsl_complex k_c = gsl_complex_mul(v_c_, k_M);
-	
-	// square them to get k^2_M, k^2_1 and k^2_c:
-	gsl_complex k2_M = gsl_complex_mul(k_M, k_M);
-	gsl_complex k2_1 = gsl_complex_mul(k_1, k_1);
-	gsl_complex k2_c = gsl_complex_mul(k_c, k_c);
 
-	double stepsX[PEG_MAX_PROFILE_CROSSINGS];
-	gsl_complex stepsK2[PEG_MAX_PROFILE_CROSSINGS];
+	// k^2_M, k^2_1 and k^2_c, from setUpCalculation():
+	const gsl_complex& k2_M = mediaK2_[0];
+	const gsl_complex& k2_1 = mediaK2_[1];
+	const gsl_complex& k2_c = mediaK2_[2];
+
+	// Storage for the steps: on the stack, unless the grating can have more than PEG_MAX_PROFILE_CROSSINGS (ex: measured custom profiles). Then the allocation is small compared to computing the expansion.
+	double stackStepsX[PEG_MAX_PROFILE_CROSSINGS];
+	gsl_complex stackStepsK2[PEG_MAX_PROFILE_CROSSINGS];
+	std::vector<double> heapStepsX;
+	std::vector<gsl_complex> heapStepsK2;
+	double* stepsX = stackStepsX;
+	gsl_complex* stepsK2 = stackStepsK2;
+	int maxSteps = g_.maxK2Steps();
+	if(maxSteps > PEG_MAX_PROFILE_CROSSINGS) {
+		heapStepsX.resize(maxSteps);
+		heapStepsK2.resize(maxSteps);
+		stepsX = &heapStepsX[0];
+		stepsK2 = &heapStepsK2[0];
+	}
 
 	// Compute multistep function from grating:
 	int numSteps = g_.computeK2StepsAtY(y, k2_M, k2_1, k2_c, stepsX, stepsK2);
 	if(numSteps < 1)
 		return PEResult::InvalidGratingFailure;
 
-	computeGratingExpansion(stepsX, stepsK2, numSteps, k2);
+	if(!tm_) {
+		computeGratingExpansion(stepsX, stepsK2, numSteps, k2);
+		return PEResult::Success;
+	}
+
+	// For TM, the steps of 1/epsilon = k^2_M / k^2 are at the same crossings.
+	gsl_complex stackStepsInvEps[PEG_MAX_PROFILE_CROSSINGS];
+	std::vector<gsl_complex> heapStepsInvEps;
+	gsl_complex* stepsInvEps = stackStepsInvEps;
+	if(maxSteps > PEG_MAX_PROFILE_CROSSINGS) {
+		heapStepsInvEps.resize(maxSteps);
+		stepsInvEps = &heapStepsInvEps[0];
+	}
+	// The steps are the k^2 of the media, whose 1/epsilon we have already.
+	for(int p=0; p<numSteps; ++p) {
+		int m = 0;
+		while(m < 3 && !GSL_COMPLEX_EQ(mediaK2_[m], stepsK2[p]))
+			++m;
+		stepsInvEps[p] = m < 3 ? mediaInvEps_[m] : gsl_complex_div(k2_M, stepsK2[p]);
+	}
+
+	computeGratingExpansion(stepsX, stepsK2, numSteps, k2, stepsInvEps, k2 + twoNp1_);
 	
 	return PEResult::Success;
 }
 
+const gsl_complex* PESolver::gratingExpansionForODE(double y, gsl_complex* k2) {
+	// y-invariant layer: computed already, for the whole layer.
+	if(layerIsYInvariant_)
+		return layerK2_;
+
+	if(k2TableActive_) {
+		interpolateGratingExpansion(y, k2);
+		return k2;
+	}
+	if(computeGratingExpansion(y, k2) != PEResult::Success)
+		return 0;
+	return k2;
+}
+
+PEResult::Code PESolver::computeExpansionTable(double yStart, double yEnd) {
+
+	k2TableYStart_ = yStart;
+	k2TableDy_ = (yEnd - yStart)/(k2TablePoints_ - 1);
+
+	bool failureOccurred = false;
+
+#pragma omp parallel for num_threads(numThreads_)
+	for(int k=0; k<k2TablePoints_; ++k) {
+		if(computeGratingExpansion(yStart + k*k2TableDy_, k2Table_ + k*expansionSize_) != PEResult::Success)
+			failureOccurred = true;
+	}
+
+	return failureOccurred ? PEResult::InvalidGratingFailure : PEResult::Success;
+}
+
+void PESolver::interpolateGratingExpansion(double y, gsl_complex* k2) const {
+
+	// find the table interval [k, k+1] containing y, and use points k-1, k, k+1, k+2 for cubic interpolation. Near the ends of the layer, shift the 4 points inwards (ie: extrapolate slightly).  The integrator can also step a tiny bit outside the layer; this is handled the same way.
+	double t = (y - k2TableYStart_)/k2TableDy_;
+	int k = int(floor(t));
+	if(k < 1)
+		k = 1;
+	if(k > k2TablePoints_-3)
+		k = k2TablePoints_-3;
+	double u = t - k;
+
+	// 4-point Lagrange weights for nodes at u = -1, 0, 1, 2.
+	double w0 = -u*(u-1)*(u-2)/6;
+	double w1 = (u+1)*(u-1)*(u-2)/2;
+	double w2 = -(u+1)*u*(u-2)/2;
+	double w3 = (u+1)*u*(u-1)/6;
+
+	const double* f0 = (const double*)(k2Table_ + (k-1)*expansionSize_);
+	const double* f1 = f0 + 2*expansionSize_;
+	const double* f2 = f1 + 2*expansionSize_;
+	const double* f3 = f2 + 2*expansionSize_;
+	double* out = (double*)k2;
+
+	// going over {re,im} for each n at once.
+	for(int i=0; i<2*expansionSize_; ++i)
+		out[i] = w0*f0[i] + w1*f1[i] + w2*f2[i] + w3*f3[i];
+}
+
+double PESolver::expansionTableError() const {
+
+	std::vector<gsl_complex> direct(expansionSize_), interpolated(expansionSize_);
+	// relative to the largest coefficient of each expansion: k^2, and 1/epsilon with TM.
+	double maxError[2] = {0, 0}, maxCoefficient[2] = {0, 0};
+
+	for(int k=0; k<k2TablePoints_-1; ++k) {
+		double y = k2TableYStart_ + (k+0.5)*k2TableDy_;
+		if(computeGratingExpansion(y, &direct[0]) != PEResult::Success)
+			continue;
+		interpolateGratingExpansion(y, &interpolated[0]);
+
+		for(int i=0; i<expansionSize_; ++i) {
+			int part = i / twoNp1_;
+			maxError[part] = std::max(maxError[part], gsl_complex_abs(gsl_complex_sub(direct[i], interpolated[i])));
+			maxCoefficient[part] = std::max(maxCoefficient[part], gsl_complex_abs(direct[i]));
+		}
+	}
+
+	double error = 0;
+	for(int part=0; part<2; ++part)
+		if(maxCoefficient[part] > 0)
+			error = std::max(error, maxError[part]/maxCoefficient[part]);
+	return error;
+}
+
+void PESolver::multiplyByM(const gsl_complex* k2, const double* u, double* Mu) const
+{
+	// M_nm = -k^2_{n-m} + alpha_n^2 delta_nm.  Since we only have k^2_{n-m} for |n-m| <= N, each row n only needs the band of columns m within N of n; the rest of the row is zero.  The SIMD kernels give bit-identical results to the scalar one.
+	PEKernels::multiplyByM(N_, (const double*)k2, alpha2_, u, Mu);
+}
+
 // Now unused:
 PEResult::Code PESolver::integrateTrialSolutionAlongY(gsl_vector_complex* u, gsl_vector_complex* uprime, double yStart, double yEnd) {
 
 	// fill starting conditions from u, uprime
-	double* w = new double[eightNp4_];
+	double* w = new double[stateSize_];
+	std::fill(w, w + stateSize_, 0.0);	// (the TM part, if any, isn't used.)
 
 	for(int i=0; i<twoNp1_; ++i) {
 		gsl_complex u_n = gsl_vector_complex_get(u, i);
@@ -375,24 +896,40 @@ PEResult::Code PESolver::integrateTrialSolutionAlongY(gsl_vector_complex* u, gsl
 	return status;
 }
 
-PEResult::Code PESolver::integrateTrialSolutionAlongY(double *w, double yStart, double yEnd) {
-	// define ode solving system, with our function to evaluate dw/dy, the Jacobian, and 8*N_+4 components.
-	gsl_odeiv2_system odeSys = {odeFunctionCB, odeJacobianCB, eightNp4_, this};
+PEResult::Code PESolver::integrateTrialSolutionAlongY(double *w, double yStart, double yEnd, double* step) {
 
-	// initial starting step in y: choose grating height / 200.
-	double hStart = (yEnd - yStart)/200;
+	// use this thread's pre-allocated driver.
+	gsl_odeiv2_driver * d = drivers_[omp_get_thread_num()];
+	double y = yStart;
+	int status;
+
+	if(mathOptions_.stepper == PEMathOptions::FixedRK4Stepper) {
+		// fixed steps: no step size to carry over.
+		gsl_odeiv2_driver_reset(d);
+		status = gsl_odeiv2_driver_apply_fixed_step(d, &y, (yEnd - yStart)/mathOptions_.fixedStepsPerLayer, mathOptions_.fixedStepsPerLayer, w);
+		odeSteps_[omp_get_thread_num()] += mathOptions_.fixedStepsPerLayer;
+		return integrationStatus(status);
+	}
 
-	// setup driver
-	gsl_odeiv2_driver * d = gsl_odeiv2_driver_alloc_standard_new (&odeSys, gsl_odeiv2_step_msadams, hStart, integrationTolerance_, integrationTolerance_, 0.5, 0.5);	// Variable-coefficient linear multistep Adams method in Nordsieck form. Uses explicit Adams-Bashforth (predictor) and implicit Adams-Moulton (corrector) methods in P(EC)^m functional iteration mode.
-	//	gsl_odeiv2_driver * d = gsl_odeiv2_driver_alloc_standard_new (&odeSys, gsl_odeiv2_step_rkf45, hStart, integrationTolerance_, integrationTolerance_, 0.5, 0.5); // Explicit embedded Runge-Kutta-Fehlberg (4, 5) method.
+	// initial starting step in y: choose grating height / 200, unless we've been given one.
+	double hStart = (step && *step > 0) ? *step : (yEnd - yStart)/200;
+
+	// Resetting the driver clears the stepper's history from the last trial solution.
+	gsl_odeiv2_driver_reset_hstart(d, hStart);
 
 	// run it: integrate from y = yStart to y=yEnd.
-	double y = yStart;
-	int status = gsl_odeiv2_driver_apply (d, &y, yEnd, w);
-	//	int status = gsl_odeiv2_driver_apply_fixed_step(d, &y, hStart, 200, w);
+	status = gsl_odeiv2_driver_apply (d, &y, yEnd, w);
+	// (apply() restarts its step counter d->n at 0 on every call.)
+	odeSteps_[omp_get_thread_num()] += d->n;
 
-	gsl_odeiv2_driver_free(d);
+	// The last step is usually cut short to land on yEnd, so report the average step instead.
+	if(status == GSL_SUCCESS && step && d->n > 0)
+		*step = (yEnd - yStart)/d->n;
 
+	return integrationStatus(status);
+}
+
+PEResult::Code PESolver::integrationStatus(int status) {
 	if (status != GSL_SUCCESS) {
 		if(status == GSL_EBADFUNC)
 			std::cout << "ODE: Integration failure: Invalid Geometry. Check your grating geometry specification." << std::endl;
@@ -402,56 +939,61 @@ PEResult::Code PESolver::integrateTrialSolutionAlongY(double *w, double yStart,
 			std::cout << "ODE: Integration failure: Code: " << status << std::endl;
 		return PEResult::ConvergenceFailure;
 	}
-
 	return PEResult::Success;
 }
 
+unsigned long PESolver::odeFunctionCalls() const {
+	unsigned long calls = 0;
+	for(int i=0; i<numThreads_; ++i)
+		calls += odeFunctionCalls_[i];
+	for(int i=0, cc=batchWorkers_.size(); i<cc; ++i)
+		calls += batchWorkers_[i]->odeFunctionCalls();
+	return calls;
+}
+
+unsigned long PESolver::odeJacobianCalls() const {
+	unsigned long calls = 0;
+	for(int i=0; i<numThreads_; ++i)
+		calls += odeJacobianCalls_[i];
+	for(int i=0, cc=batchWorkers_.size(); i<cc; ++i)
+		calls += batchWorkers_[i]->odeJacobianCalls();
+	return calls;
+}
+
+unsigned long PESolver::odeSteps() const {
+	unsigned long steps = 0;
+	for(int i=0; i<numThreads_; ++i)
+		steps += odeSteps_[i];
+	for(int i=0, cc=batchWorkers_.size(); i<cc; ++i)
+		steps += batchWorkers_[i]->odeSteps();
+	return steps;
+}
+
 int PESolver::odeFunction(double y, const double w[], double dwdy[]) {
 	
 	// w contains the last values of u_n{re, im} and u'_n{re, im}, in that order.
 	// need to compute f = dw/dy = u'_n{re, im} followed by u''_n{re, im}
+
+	++odeFunctionCalls_[omp_get_thread_num()];
 	
 	// get k2_n at this y value.
-	gsl_complex* localK2 = k2ForCurrentThread();
-	if(computeGratingExpansion(y, localK2) != PEResult::Success) {
+	const gsl_complex* localK2 = gratingExpansionForODE(y);
+	if(!localK2) {
 		std::cout << "ODE: Function Error: Cannot compute grating expansion at y = " << y << std::endl;
 		return GSL_EBADFUNC;	// can't calculate here. Invalid profile? y above the profile height?
 	}
 	
 	// fourNp2 divides the top and bottom of the arrays w, dwdy.  Top of w is u; bottom of w is u' = v.   Top of dwdy is u';  bottom of dwdy is u''.
 	// total size is (2N+1)x2x2, ie: 8N+4.
-	for(int i=0; i<fourNp2_; ++i) {
-		// working on computing u'_n [top of dwdy array]. Just copy from u' = [bottom half of w array]
-		dwdy[i] = w[i + fourNp2_];
-	}
-
-	for(int i=fourNp2_; i<eightNp4_; i+=2) {
-		// working on computing u''_n [bottom of f array].  We'll handle real and imaginary components at once.
-		int n = (i - fourNp2_)/2 - N_;
-		gsl_complex upp_n = gsl_complex_rect(0,0);	// initialize sum to 0.
-
-		// alpha^2_n:
-		double alpha2 = alpha_[n + N_];
-		alpha2 *= alpha2;
 
-		// loop over m.  Retrieving u_n values from top of array.
-		for(int j=0; j<fourNp2_; j+=2) { // also handling real and imaginary components at once.
-			int m = j/2 - N_;
+	// working on computing u'_n [top of dwdy array]. Just copy from u' = [bottom half of w array]
+	memcpy(dwdy, w + fourNp2_, fourNp2_*sizeof(double));
 
-			gsl_complex u_m = gsl_complex_rect(w[j], w[j+1]);
-
-			gsl_complex M_nm = gsl_complex_rect(0,0);
-			if(n-m >= -N_ && n-m <= N_)
-				M_nm = gsl_complex_mul_real(localK2[n-m + N_], -1.0);	// -k^2_{n-m}
-			if(n == m)
-				M_nm = gsl_complex_add_real(M_nm, alpha2);
-
-			upp_n = gsl_complex_add(upp_n, gsl_complex_mul(M_nm, u_m));
-		}
-
-		dwdy[i] = GSL_REAL(upp_n);
-		dwdy[i+1] = GSL_IMAG(upp_n);
-	}
+	// working on computing u''_n = sum_m M_nm u_m [bottom of dwdy array].  The TM system [H, v] follows; computeTMDerivatives() does this product too, together with H'.
+	if(tm_)
+		computeTMDerivatives(localK2, w + eightNp4_, dwdy + eightNp4_, w, dwdy + fourNp2_);
+	else
+		multiplyByM(localK2, w, dwdy + fourNp2_);
 
 	// Debugging output:
 	//////////////////////
@@ -468,16 +1010,16 @@ int PESolver::odeFunction(double y, const double w[], double dwdy[]) {
 
 int PESolver::odeJacobian(double y, const double w[], double *dfdw, double dfdy[])
 {
-	(void)w;
-
 	// y is the indep. variable.
 	// u[] contains the current solution u(y): contains u1=u followed by u2=u'.
 	// dfdw is the Jacobian; in row-major order.
-	// dfdy is the partial time deriv; no idea how to calc.
+	// dfdy is the partial derivative of f with respect to y.
+
+	++odeJacobianCalls_[omp_get_thread_num()];
 
 	// get k2_n at this y value.
-	gsl_complex* localK2 = k2ForCurrentThread();
-	if(computeGratingExpansion(y, localK2) != PEResult::Success) {
+	const gsl_complex* localK2 = gratingExpansionForODE(y);
+	if(!localK2) {
 		std::cout << "ODE: Jacobian Error: Cannot compute grating expansion at y = " << y << std::endl;
 		return GSL_EBADFUNC;	// can't calculate here. Invalid profile? y above the profile height?
 	}
@@ -485,47 +1027,158 @@ int PESolver::odeJacobian(double y, const double w[], double *dfdw, double dfdy[
 	// fourNp2 divides the top and bottom of the arrays w, f.  Top of w is u; bottom of w is u' = v.   Top of f is u' = v;  bottom of f is v' = u''.
 	// total size is (2N+1)x2x2, ie: 8N+4.
 
-	// clear the jacobian
-	memset(dfdw, 0, eightNp4_*eightNp4_*sizeof(double));
-	memset(dfdy, 0, eightNp4_*sizeof(double));
+	// clear the jacobian. (Its rows are stateSize_ long; with TM, the TM system [H, v] has its own block on the diagonal.)
+	int stride = stateSize_;
+	memset(dfdw, 0, stride*stride*sizeof(double));
+	memset(dfdy, 0, stride*sizeof(double));
 
 	// go through top rows of jac [i=0,fourNp2]. Set ident. matrix in upper right-hand block.
 	for(int i=0; i<fourNp2_; ++i) {
-		dfdw[i*eightNp4_+fourNp2_+i] = 1.0;		// set at index dfdw(i, fourNp2+i).
+		dfdw[i*stride+fourNp2_+i] = 1.0;		// set at index dfdw(i, fourNp2+i).
 	}
 
-	// go throgh lower rows of jac [i=fourNp2, eightNp4]. In lower left-hand block, set 4x4 submatrices at once, so go by i+=2.
+	// go throgh lower rows of jac [i=fourNp2, eightNp4]. In lower left-hand block, set 2x2 real submatrices for each complex M_nm at once, so go by i+=2.  M is Toeplitz-plus-diagonal, and only the band |n-m| <= N is non-zero (see multiplyByM()), so we only need to fill that band.
 	for(int i=fourNp2_; i<eightNp4_; i+=2) {
-		int n = (i - fourNp2_)/2 - N_;	// n index [row] from -N to N.
+		int row = (i - fourNp2_)/2;	// n index [row] from 0 to 2N.
 
 		// alpha^2_n:
-		double alpha2 = alpha_[n + N_];
+		double alpha2 = alpha_[row];
 		alpha2 *= alpha2;
 
-		// loop over m [col].
-		for(int j=0; j<fourNp2_; j+=2) { // also handling real and imaginary components at once.
-			int m = j/2 - N_;	// m index [col] from -N to N.
-
+		// loop over m [col] in the band.
+		int colStart = std::max(0, row - N_), colEnd = std::min(2*N_, row + N_);
+		for(int col=colStart; col<=colEnd; ++col) {
 			// get M_{nm}: -(k^2)_{n-m}(y) + alpha^2_n \delta_{nm}
-			gsl_complex M_nm = gsl_complex_rect(0,0);
-			if(n-m >= -N_ && n-m <= N_)
-				M_nm = gsl_complex_mul_real(localK2[n-m + N_], -1.0);	// k2_ ranges from -N to N.
-			if(n == m)
-				M_nm = gsl_complex_add_real(M_nm, alpha2);
+			double MRe = -GSL_REAL(localK2[row-col + N_]);
+			double MIm = -GSL_IMAG(localK2[row-col + N_]);
+			if(row == col)
+				MRe += alpha2;
+
+			// set 2x2 matrix here: [M_re, -M_im; M_im, M_re] at (i,j), (i, j+1); (i+1, j), (i+1, j+1)
+			int j = 2*col;
+			dfdw[i*stride + j] = MRe;
+			dfdw[i*stride + j + 1] = -MIm;
+			dfdw[(i+1)*stride + j] = MIm;
+			dfdw[(i+1)*stride + j + 1] = MRe;
+		}
+	}
 
-			// set 4x4 matrix here: [M_re, -M_im; M_im, M_re] at (i,j), (i, j+1); (i+1, j), (i+1, j+1)
-			dfdw[i*eightNp4_ + j] = GSL_REAL(M_nm);
-			dfdw[i*eightNp4_ + j + 1] = -GSL_IMAG(M_nm);
-			dfdw[(i+1)*eightNp4_ + j] = GSL_IMAG(M_nm);
-			dfdw[(i+1)*eightNp4_ + j + 1] = GSL_REAL(M_nm);
+	// TM: dH'/dv = [[epsilon]], with [[epsilon]]_nm = (k^2)_{n-m} / k^2_M, and dv'/dH = alpha_n [[1/epsilon]]_nm alpha_m - k^2_M delta_nm, in the same band.
+	if(tm_) {
+		const gsl_complex* invEps = localK2 + twoNp1_;
+		for(int row=0; row<twoNp1_; ++row) {
+			int iH = eightNp4_ + 2*row, iV = iH + fourNp2_;
+			int colStart = std::max(0, row - N_), colEnd = std::min(2*N_, row + N_);
+			for(int col=colStart; col<=colEnd; ++col) {
+				int k = row-col + N_;
+				double ERe = GSL_REAL(localK2[k])/kM2_, EIm = GSL_IMAG(localK2[k])/kM2_;
+				double BRe = alpha_[row]*alpha_[col]*GSL_REAL(invEps[k]), BIm = alpha_[row]*alpha_[col]*GSL_IMAG(invEps[k]);
+				if(row == col)
+					BRe -= kM2_;
+
+				int jH = eightNp4_ + 2*col, jV = jH + fourNp2_;
+				dfdw[iH*stride + jV] = ERe;
+				dfdw[iH*stride + jV + 1] = -EIm;
+				dfdw[(iH+1)*stride + jV] = EIm;
+				dfdw[(iH+1)*stride + jV + 1] = ERe;
+				dfdw[iV*stride + jH] = BRe;
+				dfdw[iV*stride + jH + 1] = -BIm;
+				dfdw[(iV+1)*stride + jH] = BIm;
+				dfdw[(iV+1)*stride + jH + 1] = BRe;
+			}
 		}
 	}
 
-	/// \todo IMPORTANT! Leaving dfdy = 0 for now. This is only true in case of rectangular grating...
+	// dfdy: the top half (d/dy of u') is 0, and the bottom half is (dM/dy) u, where dM_nm/dy = -d(k^2)_{n-m}/dy.  In y-invariant layers (and where the expansion table is used, which is smooth enough anyway) this is taken as 0. Otherwise, estimate d(k^2)/dy with a central difference, using the (still unused) top half of dfdy to hold k^2 at the upper point.
+	if(layerIsYInvariant_ || k2TableActive_)
+		return GSL_SUCCESS;
+
+	double a = g_.totalHeight();
+	double dy = 1e-6*a;
+	double yLow = std::max(0.0, y - dy), yHigh = std::min(a, y + dy);
+	// (With TM, both expansions don't fit in the top of dfdy; use the TM workspace instead.)
+	gsl_complex* k2High = tm_ ? (gsl_complex*)tmWork_[omp_get_thread_num()] : (gsl_complex*)dfdy;
+	const gsl_complex* k2 = gratingExpansionForODE(yHigh);
+	if(!k2)
+		return GSL_EBADFUNC;
+	memcpy(k2High, k2, expansionSize_*sizeof(gsl_complex));
+	const gsl_complex* k2Low = gratingExpansionForODE(yLow);
+	if(!k2Low)
+		return GSL_EBADFUNC;
+
+	double* dMu = dfdy + fourNp2_;
+	for(int row=0; row<twoNp1_; ++row) {
+		double re = 0, im = 0;
+		int colStart = std::max(0, row - N_), colEnd = std::min(2*N_, row + N_);
+		for(int col=colStart; col<=colEnd; ++col) {
+			int k = row-col + N_;
+			double dRe = -(GSL_REAL(k2High[k]) - GSL_REAL(k2Low[k]))/(yHigh - yLow);
+			double dIm = -(GSL_IMAG(k2High[k]) - GSL_IMAG(k2Low[k]))/(yHigh - yLow);
+			re += dRe*w[2*col] - dIm*w[2*col+1];
+			im += dRe*w[2*col+1] + dIm*w[2*col];
+		}
+		dMu[2*row] = re;
+		dMu[2*row+1] = im;
+	}
+	memset(dfdy, 0, fourNp2_*sizeof(double));
+
+	// TM: d(H')/dy = d[[epsilon]]/dy v, and d(v')/dy = alpha d[[1/epsilon]]/dy alpha H.
+	if(tm_) {
+		const double* H = w + eightNp4_;
+		const double* v = H + fourNp2_;
+		double* dH = dfdy + eightNp4_;
+		double* dV = dH + fourNp2_;
+		for(int row=0; row<twoNp1_; ++row) {
+			double hRe = 0, hIm = 0, vRe = 0, vIm = 0;
+			int colStart = std::max(0, row - N_), colEnd = std::min(2*N_, row + N_);
+			for(int col=colStart; col<=colEnd; ++col) {
+				int k = row-col + N_;
+				double dERe = (GSL_REAL(k2High[k]) - GSL_REAL(k2Low[k]))/(yHigh - yLow)/kM2_;
+				double dEIm = (GSL_IMAG(k2High[k]) - GSL_IMAG(k2Low[k]))/(yHigh - yLow)/kM2_;
+				hRe += dERe*v[2*col] - dEIm*v[2*col+1];
+				hIm += dERe*v[2*col+1] + dEIm*v[2*col];
+				double scale = alpha_[row]*alpha_[col]/(yHigh - yLow);
+				double dBRe = (GSL_REAL(k2High[twoNp1_+k]) - GSL_REAL(k2Low[twoNp1_+k]))*scale;
+				double dBIm = (GSL_IMAG(k2High[twoNp1_+k]) - GSL_IMAG(k2Low[twoNp1_+k]))*scale;
+				vRe += dBRe*H[2*col] - dBIm*H[2*col+1];
+				vIm += dBRe*H[2*col+1] + dBIm*H[2*col];
+			}
+			dH[2*row] = hRe;
+			dH[2*row+1] = hIm;
+			dV[2*row] = vRe;
+			dV[2*row+1] = vIm;
+		}
+	}
 
 	return GSL_SUCCESS;
 }
 
+void PESolver::computeTMDerivatives(const gsl_complex* expansion, const double* Hv, double* dHvdy, const double* u, double* Mu)
+{
+	const double* H = Hv;
+	const double* v = Hv + fourNp2_;
+	double* dH = dHvdy;
+	double* dv = dHvdy + fourNp2_;
+
+	// H' = [[epsilon]] v = [[k^2]] v / k^2_M.  The band kernel computes (alpha^2 - [[f]]) x, so with zeros for alpha^2 it gives -[[f]] x.  It's the same band as in M u, so both go through the kernel together.
+	PEKernels::multiplyByMPair(N_, (const double*)expansion, alpha2_, u, Mu, zeros_, v, dH);
+	double scale = -1.0/kM2_;
+	for(int i=0; i<fourNp2_; ++i)
+		dH[i] *= scale;
+
+	// v' = alpha [[1/epsilon]] alpha H - k^2_M H.
+	double* alphaH = tmWork_[omp_get_thread_num()];
+	for(int n=0; n<twoNp1_; ++n) {
+		alphaH[2*n] = alpha_[n]*H[2*n];
+		alphaH[2*n+1] = alpha_[n]*H[2*n+1];
+	}
+	PEKernels::multiplyByM(N_, (const double*)(expansion + twoNp1_), zeros_, alphaH, dv);
+	for(int n=0; n<twoNp1_; ++n) {
+		dv[2*n] = -alpha_[n]*dv[2*n] - kM2_*H[2*n];
+		dv[2*n+1] = -alpha_[n]*dv[2*n+1] - kM2_*H[2*n+1];
+	}
+}
+
 gsl_complex* PESolver::k2ForCurrentThread() {
 	/// Return based on OpenMP current thread.
 	return k2_[omp_get_thread_num()];
@@ -584,7 +1237,7 @@ int PESolver::linalg_LU_complex_solve(const gsl_matrix_complex *LU, const gsl_pe
 void PESolver::setIntegrationStartingValues(double *w, int j, int m)
 {
 	// set all to 0
-	memset(w, 0, (eightNp4_)*sizeof(double));
+	memset(w, 0, stateSize_*sizeof(double));
 
 	bool secondRound = false;
 	if(j >= twoNp1_) {
@@ -598,6 +1251,15 @@ void PESolver::setIntegrationStartingValues(double *w, int j, int m)
 	gsl_complex uprime = gsl_complex_mul_imag(m == 1 ? beta1_[j] : betaM_[j], secondRound ? 1 : -1);
 	w[fourNp2_ + 2*j] = GSL_REAL(uprime);
 	w[fourNp2_ + 2*j+1] = GSL_IMAG(uprime);
+
+	// TM: H[j] = 1, and v = H' / epsilon, where epsilon is 1 except in the substrate.
+	if(tm_) {
+		double* Hv = w + eightNp4_;
+		Hv[2*j] = 1.0;
+		gsl_complex v = m == 1 ? gsl_complex_div(uprime, gsl_complex_mul(v_1_, v_1_)) : uprime;
+		Hv[fourNp2_ + 2*j] = GSL_REAL(v);
+		Hv[fourNp2_ + 2*j+1] = GSL_IMAG(v);
+	}
 }
 
 void PESolver::computeAlphaAndBeta(double incidenceDeg)
@@ -615,6 +1277,8 @@ void PESolver::computeAlphaAndBeta(double incidenceDeg)
 	// Grating period:
 	double d = g_.period();
 
+	// k^2 in the vacuum, for the TM system.
+	kM2_ = k_2*k_2;
 
 #pragma omp parallel for num_threads(numThreads_)
 	for(int i=0; i<twoNp1_; i++) {
@@ -622,6 +1286,7 @@ void PESolver::computeAlphaAndBeta(double incidenceDeg)
 
 		double alpha = k_2 * sin(theta_2) + 2 * M_PI * n / d;
 		alpha_[i] = alpha;
+		alpha2_[i] = alpha*alpha;
 
 		// beta2_: rayleigh expansion above grating.
 		double k22minusAn2 = k_2*k_2 - alpha*alpha;
@@ -645,10 +1310,15 @@ void PESolver::computeAlphaAndBeta(double incidenceDeg)
 
 void PESolver::computeLayers()
 {
+	if(mathOptions_.adaptiveLayers) {
+		computeAdaptiveLayers();
+		return;
+	}
+
 	// How many layers do we need?
 	double a = g_.totalHeight();
 
-	double magicNumber = 3;	// should be ln(1e15). However, emperically this is not enough to maintain stability (ex: REIXS LEG).  7 = ln(1e3) seems stable for all tests so far.
+	double magicNumber = peMaxLayerGrowth;
 
 	// How many layers to use? In order to keep size of exp(i betaM_{±N}) < 1e15 to avoid losing precision in double values compared with unity-size numbers.
 	numLayers_ = std::max( gsl_complex_abs(betaM_[0])*a/magicNumber, gsl_complex_abs(betaM_[2*N_])*a/magicNumber );
@@ -657,34 +1327,160 @@ void PESolver::computeLayers()
 
 	M_ = numLayers_+2;
 
-	y_ = new double[M_];	// To be consistent with the text, we number the lowest layer as 1.  y_[0] is therefore unused, so that we can use y_m = y_[m], with lowest m=1, highest m=M-1.
+	// To be consistent with the text, we number the lowest layer as 1.  y_[0] is therefore unused, so that we can use y_m = y_[m], with lowest m=1, highest m=M-1.
+	// Only re-allocate if this calculation needs more layers than we've had room for so far.
+	if(M_ > yCapacity_) {
+		delete [] y_;
+		y_ = new double[M_];
+		yCapacity_ = M_;
+	}
 
 	for(int m=1; m<M_; ++m) {
 		y_[m] = double(m-1)/numLayers_*a;
 	}
 }
 
-void PESolver::computeBMFromSMatrix()
+void PESolver::computeAdaptiveLayers()
+{
+	double a = g_.totalHeight();
+
+	// Conditioning estimate: across a layer of thickness h, the trial solutions of an evanescent order grow (and decay) by up to exp(gamma h), where gamma is the largest Im(beta_n) in any of the media. The linear systems for the S-matrix then have a condition number of roughly exp(2 gamma h). Keep that below what the integration tolerance leaves of double precision (with a safety factor of 100).
+	double gamma = 0;
+	double k_2 = 2 * M_PI / wl_;
+	gsl_complex k2_c = gsl_complex_mul_real(gsl_complex_mul(v_c_, v_c_), k_2*k_2);
+	for(int i=0; i<twoNp1_; ++i) {
+		gamma = std::max(gamma, std::max(GSL_IMAG(betaM_[i]), GSL_IMAG(beta1_[i])));
+		if(g_.coatingThickness() > 0)
+			gamma = std::max(gamma, GSL_IMAG(complex_sqrt_upperComplexPlane(gsl_complex_add_real(k2_c, -alpha2_[i]))));
+	}
+	double maxGrowth = 0.5*log(integrationTolerance_/(100*DBL_EPSILON));
+	if(maxGrowth < 1)
+		maxGrowth = 1;	// very tight tolerances: don't end up with an unreasonable number of layers.
+	// The estimate allows about 10 at the default tolerance, but the uniform layers (see computeLayers()) needed a growth of at most peMaxLayerGrowth per layer to be stable in practice, so don't go beyond that.
+	if(maxGrowth > peMaxLayerGrowth)
+		maxGrowth = peMaxLayerGrowth;
+
+	// Divide the structure at its features, and merge neighbouring parts that change with y while the merged part stays within maxGrowth. Homogeneous (y-invariant) parts are kept separate, so that they can use the layer propagator.
+	std::vector<double> edges;
+	edges.push_back(0);
+	std::vector<double> features = g_.featureHeights();
+	for(int i=0, cc=features.size(); i<cc; ++i)
+		if(features[i] > edges.back() && features[i] < a)
+			edges.push_back(features[i]);
+	edges.push_back(a);
+
+	std::vector<double> parts(1, 0.);	// bottom of each merged part, then the top.
+	bool lastIsInvariant = g_.k2StepsAreYInvariant(edges[0], edges[1]);
+	for(int i=1, cc=edges.size()-1; i<cc; ++i) {
+		bool isInvariant = g_.k2StepsAreYInvariant(edges[i], edges[i+1]);
+		if(isInvariant || lastIsInvariant || gamma*(edges[i+1] - parts.back()) > maxGrowth)
+			parts.push_back(edges[i]);
+		lastIsInvariant = isInvariant;
+	}
+	parts.push_back(a);
+
+	// Split each part into as many equal layers as its growth requires.
+	std::vector<int> partLayers;
+	numLayers_ = 0;
+	for(int p=0, cc=parts.size()-1; p<cc; ++p) {
+		partLayers.push_back(std::max(1, int(ceil(gamma*(parts[p+1] - parts[p])/maxGrowth))));
+		numLayers_ += partLayers.back();
+	}
+
+	M_ = numLayers_+2;
+	if(M_ > yCapacity_) {
+		delete [] y_;
+		y_ = new double[M_];
+		yCapacity_ = M_;
+	}
+
+	int m = 1;
+	for(int p=0, cc=parts.size()-1; p<cc; ++p)
+		for(int l=0; l<partLayers[p]; ++l)
+			y_[m++] = parts[p] + (parts[p+1] - parts[p])*l/partLayers[p];
+	y_[m] = a;
+}
+
+void PESolver::warmStartStepSizes()
+{
+	std::vector<double> steps((M_-2)*fourNp2_, 0.);	// 0: use the default starting step.
+
+	// Match each new layer with the old layer containing its middle. (When the layers haven't changed, that's the same layer.)
+	int oldLayers = int(stepSizesY_.size()) - 1;
+	int old = 0;
+	for(int m=2; m<M_ && old<oldLayers; ++m) {
+		double yMiddle = 0.5*(y_[m-1] + y_[m]);
+		while(old < oldLayers-1 && stepSizesY_[old+1] < yMiddle)
+			++old;
+		memcpy(&steps[(m-2)*fourNp2_], &stepSizes_[old*fourNp2_], fourNp2_*sizeof(double));
+	}
+
+	stepSizes_.swap(steps);
+	stepSizesY_.assign(y_+1, y_+M_);
+}
+
+void PESolver::computeBMFromSMatrix(PolarizationMatrices& pm)
 {
 	double a = g_.totalHeight();
 
 #pragma omp parallel for num_threads(numThreads_)
 	for(int i=0; i<twoNp1_; i++) {
-		BM_[i] = gsl_complex_mul(
-					gsl_matrix_complex_get(S12_, i, N_),
+		pm.BM[i] = gsl_complex_mul(
+					gsl_matrix_complex_get(pm.S12, i, N_),
 					gsl_complex_exp(gsl_complex_mul_imag(gsl_complex_add(betaM_[i],
 																		 betaM_[N_]),
 														 -a)));
 	}
 }
 
+PEResult::Code PESolver::prepareLayer(int m, bool printDebugOutput)
+{
+	// If the grating doesn't change within this layer (ex: rectangular profiles, or inside a thick coating), we only need to compute the expansion once for the whole layer.
+	layerIsYInvariant_ = g_.k2StepsAreYInvariant(y_[m-1], y_[m]);
+	if(layerIsYInvariant_ && computeGratingExpansion(0.5*(y_[m-1] + y_[m]), layerK2_) != PEResult::Success)
+		return PEResult::InvalidGratingFailure;
+	if(printDebugOutput && layerIsYInvariant_)
+		std::cout << "Layer " << m << " is y-invariant; using a single grating expansion." << std::endl;
+
+	// If enabled, tabulate the grating expansion over this layer once, instead of in every ODE function call for every trial solution.  If the expansion isn't smooth enough within this layer to interpolate accurately (for ex: the layer contains a horizontal edge of the profile or coating), fall back to computing it directly.
+	k2TableActive_ = false;
+	if(k2TablePoints_ && !layerIsYInvariant_) {
+		if(computeExpansionTable(y_[m-1], y_[m]) != PEResult::Success)
+			return PEResult::InvalidGratingFailure;
+		double tableError = expansionTableError();
+		k2TableActive_ = (tableError <= integrationTolerance_);
+		if(printDebugOutput)
+			std::cout << "Expansion table for layer " << m << ": maximum relative interpolation error: " << tableError << (k2TableActive_ ? "" : ". Too large; computing expansion directly.") << std::endl;
+	}
+
+	return PEResult::Success;
+}
+
 PEResult::Code PESolver::computeTMatrixBelowLayer(int m, bool printDebugOutput)
 {
 	bool integrationFailureOccurred = false;
 
-	// We now need 2*(2N+1) trial solutions.  j will be the loop index over p, but ranging from [0,4*N+1].
+	PEResult::Code layerStatus = prepareLayer(m, printDebugOutput);
+	if(layerStatus != PEResult::Success)
+		return layerStatus;
+
+	// If the layer is y-invariant, the ODE has constant coefficients, and we can propagate all the trial solutions across the layer analytically instead of integrating them.
+	if(layerIsYInvariant_ && mathOptions_.useLayerPropagator) {
+		profile_.propagatedLayers += 1;
+		return propagateTrialSolutionsAcrossLayer(m);
+	}
+
+	if(matrixDriver_) {
+		profile_.integratedLayers += 1;
+		return integrateTrialSolutionsAsMatrix(m, printDebugOutput);
+	}
+
+	// We now need 2*(2N+1) trial solutions.  j will be the loop index over p, but ranging from [0,4*N+1].  For the profile, measure how long each thread is busy with them.
+	std::fill(threadBusyTime_.begin(), threadBusyTime_.end(), 0.0);
+	double loopStartTime = omp_get_wtime();
 #pragma omp parallel for num_threads(numThreads_) schedule(dynamic)
 	for(int j=0; j<fourNp2_; ++j) {
+		double trialStartTime = omp_get_wtime();
 
 		// Get a [u,uprime] vector to work with for this trial solution.
 		double* w = wVectorForP(j);
@@ -709,7 +1505,7 @@ PEResult::Code PESolver::computeTMatrixBelowLayer(int m, bool printDebugOutput)
 		//////////////////////////
 
 		// Integrate from y_[m-1] to y_[m].
-		PEResult::Code status = integrateTrialSolutionAlongY(w, y_[m-1], y_[m]);
+		PEResult::Code status = integrateTrialSolutionAlongY(w, y_[m-1], y_[m], mathOptions_.warmStart ? &stepSizes_[(m-2)*fourNp2_ + j] : 0);
 
 		////////////////////////////
 		if(printDebugOutput && omp_get_thread_num() == 0) {
@@ -730,88 +1526,551 @@ PEResult::Code PESolver::computeTMatrixBelowLayer(int m, bool printDebugOutput)
 
 		if(status != PEResult::Success)
 			integrationFailureOccurred = true;
-		else {
-			// Fill T-matrix at this column. If j >= 2*N+1, we're dealing with the right-side blocks T12_, T22_.
-			if(j >= twoNp1_) {
-				int jj = j - twoNp1_;
-
-				// loop over orders (n). i is the loop index, ranging from [0, 2*N_]
-				for(int i=0; i<twoNp1_; ++i) {
-					gsl_complex* u_ij = (gsl_complex*)(w + 2*i);
-					gsl_complex* uprime_ij = (gsl_complex*)(w + fourNp2_ + 2*i);
-					gsl_complex temp = gsl_complex_div(*uprime_ij, gsl_complex_mul_imag(betaM_[i], 1)); // = u'_ij / (i*betaM_n)
-
-					// T12_ij = 0.5(u_ij - u'_ij / (i*betaM_n) )
-					// T22_ij = 0.5(u_ij + u'_ij / (i*betaM_n) )
-					gsl_matrix_complex_set(T12_, i, jj, gsl_complex_mul_real(gsl_complex_sub(*u_ij, temp), 0.5));
-					gsl_matrix_complex_set(T22_, i, jj, gsl_complex_mul_real(gsl_complex_add(*u_ij, temp), 0.5));
+		else
+			fillTMatrixColumn(j, w);
+
+		threadBusyTime_[omp_get_thread_num()] += omp_get_wtime() - trialStartTime;
+	}
+
+	profile_.integratedLayers += 1;
+	profile_.trialLoopTime += omp_get_wtime() - loopStartTime;
+	profile_.trialMeanThreadTime += std::accumulate(threadBusyTime_.begin(), threadBusyTime_.end(), 0.0)/numThreads_;
+	profile_.trialMaxThreadTime += *std::max_element(threadBusyTime_.begin(), threadBusyTime_.end());
+
+	if(integrationFailureOccurred)
+		return PEResult::ConvergenceFailure;
+	else
+		return PEResult::Success;
+}
+
+PEResult::Code PESolver::integrateTrialSolutionsAsMatrix(int m, bool printDebugOutput)
+{
+	double loopStartTime = omp_get_wtime();
+
+	// Set up the starting values for each trial solution as usual, and copy them into column j of U and U'.  Row n of U is at matrixW_ + n*2*fourNp2_, and U' follows U.  With TM, H and V follow the same way, from the TM part of each w vector.
+	int numBlocks = stateSize_/fourNp2_;	// U, U' [, H, V]
+#pragma omp parallel for num_threads(numThreads_)
+	for(int j=0; j<fourNp2_; ++j) {
+		double* w = wVectorForP(j);
+		setIntegrationStartingValues(w, j, m-1);
+		for(int b=0; b<numBlocks; ++b) {
+			double* Ub = matrixW_ + b*fourNp2_*fourNp2_;
+			const double* wb = w + b*fourNp2_;
+			for(int n=0; n<twoNp1_; ++n) {
+				Ub[2*(n*fourNp2_ + j)] = wb[2*n];
+				Ub[2*(n*fourNp2_ + j) + 1] = wb[2*n + 1];
+			}
+		}
+	}
+
+	// Integrate from y_[m-1] to y_[m]. All the trial solutions share the steps; with warmStart, start with the smallest step any of them needed last time.
+	double yStart = y_[m-1], yEnd = y_[m];
+	double y = yStart;
+	int status;
+	if(mathOptions_.stepper == PEMathOptions::FixedRK4Stepper) {
+		gsl_odeiv2_driver_reset(matrixDriver_);
+		status = gsl_odeiv2_driver_apply_fixed_step(matrixDriver_, &y, (yEnd - yStart)/mathOptions_.fixedStepsPerLayer, mathOptions_.fixedStepsPerLayer, matrixW_);
+		odeSteps_[0] += mathOptions_.fixedStepsPerLayer;
+	}
+	else {
+		double* steps = mathOptions_.warmStart ? &stepSizes_[(m-2)*fourNp2_] : 0;
+		double hStart = (yEnd - yStart)/200;
+		if(steps && *std::min_element(steps, steps + fourNp2_) > 0)
+			hStart = *std::min_element(steps, steps + fourNp2_);
+
+		gsl_odeiv2_driver_reset_hstart(matrixDriver_, hStart);
+		status = gsl_odeiv2_driver_apply(matrixDriver_, &y, yEnd, matrixW_);
+		odeSteps_[0] += matrixDriver_->n;
+
+		if(status == GSL_SUCCESS && steps && matrixDriver_->n > 0)
+			std::fill(steps, steps + fourNp2_, (yEnd - yStart)/matrixDriver_->n);
+	}
+
+	PEResult::Code result = integrationStatus(status);
+	if(result == PEResult::Success) {
+		// copy the results back into the w vectors, and fill in the T matrix.
+#pragma omp parallel for num_threads(numThreads_)
+		for(int j=0; j<fourNp2_; ++j) {
+			double* w = wVectorForP(j);
+			for(int b=0; b<numBlocks; ++b) {
+				const double* Ub = matrixW_ + b*fourNp2_*fourNp2_;
+				double* wb = w + b*fourNp2_;
+				for(int n=0; n<twoNp1_; ++n) {
+					wb[2*n] = Ub[2*(n*fourNp2_ + j)];
+					wb[2*n + 1] = Ub[2*(n*fourNp2_ + j) + 1];
 				}
 			}
-			// Otherwise we're filling T11, T21. (left-side blocks).
-			else {
-				// loop over orders (n). i is the loop index, ranging from [0, 2*N_]
-				for(int i=0; i<twoNp1_; ++i) {
-					gsl_complex* u_ij = (gsl_complex*)(w + 2*i);
-					gsl_complex* uprime_ij = (gsl_complex*)(w + fourNp2_ + 2*i);
-					gsl_complex temp = gsl_complex_div(*uprime_ij, gsl_complex_mul_imag(betaM_[i], 1)); // = u'_ij / (i*betaM_n)
-
-					// T12_ij = 0.5(u_ij - u'_ij / (i*betaM_n) )
-					// T22_ij = 0.5(u_ij + u'_ij / (i*betaM_n) )
-					gsl_matrix_complex_set(T11_, i, j, gsl_complex_mul_real(gsl_complex_sub(*u_ij, temp), 0.5));
-					gsl_matrix_complex_set(T21_, i, j, gsl_complex_mul_real(gsl_complex_add(*u_ij, temp), 0.5));
+			fillTMatrixColumn(j, w);
+		}
+		if(printDebugOutput)
+			std::cout << "Layer " << m << ": integrated all trial solutions as a matrix ODE, in " << matrixDriver_->n << " steps." << std::endl;
+	}
+
+	// The work is shared evenly between the threads, inside each right-hand side evaluation.
+	double loopTime = omp_get_wtime() - loopStartTime;
+	profile_.trialLoopTime += loopTime;
+	profile_.trialMeanThreadTime += loopTime;
+	profile_.trialMaxThreadTime += loopTime;
+
+	return result;
+}
+
+int PESolver::matrixODEFunction(double y, const double W[], double F[])
+{
+	// W contains U followed by U'; we need F = U' followed by U''.  With TM, H and V follow, and F has E V and B H after them.  This is only called from outside our threads' parallel regions, so it uses the first thread's storage.
+	++odeFunctionCalls_[0];
+
+	const gsl_complex* localK2 = gratingExpansionForODE(y, k2_[0]);
+	if(!localK2) {
+		std::cout << "ODE: Function Error: Cannot compute grating expansion at y = " << y << std::endl;
+		return GSL_EBADFUNC;
+	}
+
+	int halfSize = fourNp2_*fourNp2_;	// doubles in U: (2N+1) x (4N+2) complex values.
+	memcpy(F, W + halfSize, halfSize*sizeof(double));
+
+	// form M_nm = -k^2_{n-m} + alpha_n^2 delta_nm, which is zero outside the band |n-m| <= N.
+	for(int n=0; n<twoNp1_; ++n) {
+		gsl_complex* row = gsl_matrix_complex_ptr(matrixM_, n, 0);
+		for(int col=0; col<twoNp1_; ++col) {
+			int diff = n - col;
+			if(diff > N_ || diff < -N_)
+				row[col] = gsl_complex_rect(0,0);
+			else
+				row[col] = gsl_complex_negative(localK2[N_ + diff]);
+		}
+		row[n] = gsl_complex_add_real(row[n], alpha2_[n]);
+	}
+
+	// U'' = M U, as one matrix-matrix product.
+	bool failureOccurred = !multiplyTrialSolutions(matrixM_, W, F + halfSize);
+
+	// TM: H' = E V and V' = B H, with E = [[epsilon]] and B = alpha [[1/epsilon]] alpha - k^2_M (see odeFunction()).
+	if(tm_) {
+		const gsl_complex* invEps = localK2 + twoNp1_;
+		for(int n=0; n<twoNp1_; ++n) {
+			gsl_complex* rowE = gsl_matrix_complex_ptr(matrixE_, n, 0);
+			gsl_complex* rowB = gsl_matrix_complex_ptr(matrixB_, n, 0);
+			for(int col=0; col<twoNp1_; ++col) {
+				int diff = n - col;
+				if(diff > N_ || diff < -N_)
+					rowE[col] = rowB[col] = gsl_complex_rect(0,0);
+				else {
+					rowE[col] = gsl_complex_div_real(localK2[N_ + diff], kM2_);
+					rowB[col] = gsl_complex_mul_real(invEps[N_ + diff], alpha_[n]*alpha_[col]);
 				}
 			}
+			rowB[n] = gsl_complex_sub_real(rowB[n], kM2_);
 		}
+		const double* H = W + 2*halfSize;
+		const double* V = H + halfSize;
+		if(!multiplyTrialSolutions(matrixE_, V, F + 2*halfSize) || !multiplyTrialSolutions(matrixB_, H, F + 3*halfSize))
+			failureOccurred = true;
 	}
 
-	if(integrationFailureOccurred)
+	return failureOccurred ? GSL_EBADFUNC : GSL_SUCCESS;
+}
+
+bool PESolver::multiplyTrialSolutions(const gsl_matrix_complex* A, const double* X, double* Y)
+{
+	// With more than one thread, each multiplies a block of the columns (trial solutions).
+	gsl_matrix_complex_const_view Xview = gsl_matrix_complex_const_view_array(X, twoNp1_, fourNp2_);
+	gsl_matrix_complex_view Yview = gsl_matrix_complex_view_array(Y, twoNp1_, fourNp2_);
+	int numBlocks = std::min(numThreads_, fourNp2_);
+	bool failureOccurred = false;
+#pragma omp parallel for num_threads(numBlocks)
+	for(int b=0; b<numBlocks; ++b) {
+		int colStart = b*fourNp2_/numBlocks, colEnd = (b+1)*fourNp2_/numBlocks;
+		gsl_matrix_complex_const_view Xblock = gsl_matrix_complex_const_submatrix(&Xview.matrix, 0, colStart, twoNp1_, colEnd - colStart);
+		gsl_matrix_complex_view Yblock = gsl_matrix_complex_submatrix(&Yview.matrix, 0, colStart, twoNp1_, colEnd - colStart);
+		if(gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, gsl_complex_rect(1,0), A, &Xblock.matrix, gsl_complex_rect(0,0), &Yblock.matrix) != GSL_SUCCESS)
+			failureOccurred = true;
+	}
+	return !failureOccurred;
+}
+
+PEResult::Code PESolver::propagateTrialSolutionsAcrossLayer(int m)
+{
+	if(computeLayerPropagator(y_[m] - y_[m-1]) != PEResult::Success)
 		return PEResult::ConvergenceFailure;
-	else
+
+#pragma omp parallel for num_threads(numThreads_)
+	for(int j=0; j<fourNp2_; ++j) {
+		double* w = wVectorForP(j);
+		setIntegrationStartingValues(w, j, m-1);
+
+		// w(y_m) = P w(y_{m-1}).  The starting values only have two non-zero components (u_p and u'_p), so instead of a full matrix-vector product, we just add up the columns of P for the non-zero components.
+		const gsl_complex* wStart = (const gsl_complex*)w;
+		gsl_complex* wEnd = propagatedW_ + omp_get_thread_num()*fourNp2_;
+		std::fill(wEnd, wEnd + fourNp2_, gsl_complex_rect(0,0));
+		for(int l=0; l<fourNp2_; ++l) {
+			if(GSL_REAL(wStart[l]) == 0.0 && GSL_IMAG(wStart[l]) == 0.0)
+				continue;
+			for(int k=0; k<fourNp2_; ++k)
+				wEnd[k] = gsl_complex_add(wEnd[k], gsl_complex_mul(gsl_matrix_complex_get(propagator_, k, l), wStart[l]));
+		}
+		memcpy(w, wEnd, fourNp2_*sizeof(gsl_complex));
+
+		// The same for the TM part [H, v], with its own propagator.
+		if(tm_) {
+			const gsl_complex* wStartTM = wStart + fourNp2_;
+			std::fill(wEnd, wEnd + fourNp2_, gsl_complex_rect(0,0));
+			for(int l=0; l<fourNp2_; ++l) {
+				if(GSL_REAL(wStartTM[l]) == 0.0 && GSL_IMAG(wStartTM[l]) == 0.0)
+					continue;
+				for(int k=0; k<fourNp2_; ++k)
+					wEnd[k] = gsl_complex_add(wEnd[k], gsl_complex_mul(gsl_matrix_complex_get(propagatorTM_, k, l), wStartTM[l]));
+			}
+			memcpy(w + eightNp4_, wEnd, fourNp2_*sizeof(gsl_complex));
+		}
+
+		fillTMatrixColumn(j, w);
+	}
+
+	return PEResult::Success;
+}
+
+PEResult::Code PESolver::computeLayerPropagator(double h)
+{
+	// For layers with the same thickness and expansion (ex: the evenly-spaced layers of a rectangular grating) the propagator is the same; no need to compute it again.  The thicknesses are differences of the layer edges, so even layers that are meant to be the same can differ in the last bit or so.
+	if(fabs(h - propagatorH_) <= 1e-12*h && memcmp(propagatorK2_, layerK2_, expansionSize_*sizeof(gsl_complex)) == 0)
 		return PEResult::Success;
+	propagatorH_ = -1;
+
+	// allocate the workspace the first time we need it. Gratings without any y-invariant layers never use it.
+	if(!propagator_) {
+		propagator_ = gsl_matrix_complex_alloc(fourNp2_, fourNp2_);
+		for(int i=0; i<4; ++i)
+			propagatorWork_[i] = gsl_matrix_complex_alloc(twoNp1_, twoNp1_);
+		propagatedW_ = new gsl_complex[numThreads_*fourNp2_];
+	}
+	if(tm_ && !propagatorTM_) {
+		propagatorTM_ = gsl_matrix_complex_alloc(fourNp2_, fourNp2_);
+		for(int i=4; i<7; ++i)
+			propagatorWork_[i] = gsl_matrix_complex_alloc(twoNp1_, twoNp1_);
+	}
+
+	// exp(h [[0, I], [M, 0]]) = [[C, S], [M S, C]], where C = cosh(h sqrt(M)) and S = sinh(h sqrt(M)) / sqrt(M).  Both are power series in M, so we only need (2N+1) x (2N+1) matrices, with no square roots.
+	gsl_matrix_complex* X = propagatorWork_[0];
+	gsl_matrix_complex* Xk = propagatorWork_[1];
+	gsl_matrix_complex* C = propagatorWork_[2];
+	gsl_matrix_complex* S = propagatorWork_[3];
+	// The upper blocks of propagator_ are free to use as temporaries until we assemble the result.
+	gsl_matrix_complex_view P11 = gsl_matrix_complex_submatrix(propagator_, 0, 0, twoNp1_, twoNp1_);
+	gsl_matrix_complex_view P12 = gsl_matrix_complex_submatrix(propagator_, 0, twoNp1_, twoNp1_, twoNp1_);
+
+	// Build M, where M_nm = -k^2_{n-m} + alpha_n^2 delta_nm is the matrix in u'' = M u (see odeFunction()). Keep it in Xk, since we need it for the lower-left block.
+	for(int i=0; i<twoNp1_; ++i) {
+		int n = i - N_;
+		for(int k=0; k<twoNp1_; ++k) {
+			int mm = k - N_;
+			gsl_complex M_nm = gsl_complex_rect(0,0);
+			if(n-mm >= -N_ && n-mm <= N_)
+				M_nm = gsl_complex_mul_real(layerK2_[n-mm + N_], -1.0);
+			if(n == mm)
+				M_nm = gsl_complex_add_real(M_nm, alpha_[i]*alpha_[i]);
+			gsl_matrix_complex_set(Xk, i, k, M_nm);
+		}
+	}
+	computeCoshSinh(Xk, h, C, S, X, &P11.matrix, &P12.matrix);
+
+	// Assemble P = [[C, S], [M S, C]]
+	gsl_matrix_complex_view P21 = gsl_matrix_complex_submatrix(propagator_, twoNp1_, 0, twoNp1_, twoNp1_);
+	gsl_matrix_complex_view P22 = gsl_matrix_complex_submatrix(propagator_, twoNp1_, twoNp1_, twoNp1_, twoNp1_);
+	gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, gsl_complex_rect(1,0), Xk, S, gsl_complex_rect(0,0), &P21.matrix);
+	gsl_matrix_complex_memcpy(&P11.matrix, C);
+	gsl_matrix_complex_memcpy(&P12.matrix, S);
+	gsl_matrix_complex_memcpy(&P22.matrix, C);
+
+	// TM: exp(h [[0, E], [B, 0]]) = [[C(EB), S(EB) E], [S(BE) B, C(BE)]], where E = [[epsilon]] and B = alpha [[1/epsilon]] alpha - k^2_M (see odeFunction()), since the even powers of the system matrix are diag((EB)^k, (BE)^k).  The TE workspace is free again.
+	if(tm_) {
+		gsl_matrix_complex* E = propagatorWork_[4];
+		gsl_matrix_complex* B = propagatorWork_[5];
+		gsl_matrix_complex* K = propagatorWork_[6];
+		const gsl_complex* invEps = layerK2_ + twoNp1_;
+		for(int i=0; i<twoNp1_; ++i) {
+			for(int k=0; k<twoNp1_; ++k) {
+				int diff = i - k;
+				gsl_complex E_nm = gsl_complex_rect(0,0), B_nm = gsl_complex_rect(0,0);
+				if(diff >= -N_ && diff <= N_) {
+					E_nm = gsl_complex_div_real(layerK2_[diff + N_], kM2_);
+					B_nm = gsl_complex_mul_real(invEps[diff + N_], alpha_[i]*alpha_[k]);
+				}
+				if(i == k)
+					B_nm = gsl_complex_sub_real(B_nm, kM2_);
+				gsl_matrix_complex_set(E, i, k, E_nm);
+				gsl_matrix_complex_set(B, i, k, B_nm);
+			}
+		}
+
+		gsl_matrix_complex_view Q11 = gsl_matrix_complex_submatrix(propagatorTM_, 0, 0, twoNp1_, twoNp1_);
+		gsl_matrix_complex_view Q12 = gsl_matrix_complex_submatrix(propagatorTM_, 0, twoNp1_, twoNp1_, twoNp1_);
+		gsl_matrix_complex_view Q21 = gsl_matrix_complex_submatrix(propagatorTM_, twoNp1_, 0, twoNp1_, twoNp1_);
+		gsl_matrix_complex_view Q22 = gsl_matrix_complex_submatrix(propagatorTM_, twoNp1_, twoNp1_, twoNp1_, twoNp1_);
+
+		// K = EB: C(EB) goes straight into the upper-left block, and S(EB) E into the upper-right.  Since (BE)^k = B (EB)^(k-1) E, the lower blocks come from the same series: S(BE) B = B S(EB), and C(BE) = I + B F(EB) E, with F(EB) = (C(EB) - I) / EB, which we keep in the lower-right block until then.
+		gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, gsl_complex_rect(1,0), E, B, gsl_complex_rect(0,0), K);
+		computeCoshSinh(K, h, &Q11.matrix, S, X, Xk, C, &Q22.matrix);
+		gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, gsl_complex_rect(1,0), S, E, gsl_complex_rect(0,0), &Q12.matrix);
+		gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, gsl_complex_rect(1,0), B, S, gsl_complex_rect(0,0), &Q21.matrix);
+		gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, gsl_complex_rect(1,0), B, &Q22.matrix, gsl_complex_rect(0,0), X);
+		gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, gsl_complex_rect(1,0), X, E, gsl_complex_rect(0,0), &Q22.matrix);
+		for(int i=0; i<twoNp1_; ++i)
+			gsl_matrix_complex_set(&Q22.matrix, i, i, gsl_complex_add_real(gsl_matrix_complex_get(&Q22.matrix, i, i), 1.0));
+	}
+
+	propagatorH_ = h;
+	memcpy(propagatorK2_, layerK2_, expansionSize_*sizeof(gsl_complex));
+
+	return PEResult::Success;
+}
+
+void PESolver::computeCoshSinh(const gsl_matrix_complex* K, double h, gsl_matrix_complex* C, gsl_matrix_complex* S, gsl_matrix_complex* X, gsl_matrix_complex* T, gsl_matrix_complex* T2, gsl_matrix_complex* F)
+{
+	int size = K->size1;
+
+	// To keep the series short, we use h' = h/2^s so that |h'^2 K| <= 1/4, and then use the double-angle formulas C(2h) = 2C(h)^2 - I, S(2h) = 2C(h)S(h) s times.  First find the infinity-norm of h^2 K for scaling.
+	double normX = 0;
+	for(int i=0; i<size; ++i) {
+		double rowSum = 0;
+		for(int k=0; k<size; ++k)
+			rowSum += gsl_complex_abs(gsl_matrix_complex_get(K, i, k));
+		normX = std::max(normX, rowSum*h*h);
+	}
+
+	int s = 0;
+	while(normX > 0.25) {
+		normX /= 4;
+		++s;
+	}
+	double hScaled = h / pow(2.0, s);
+	// X = h'^2 K.
+	gsl_matrix_complex_memcpy(X, K);
+	gsl_matrix_complex_scale(X, gsl_complex_rect(hScaled*hScaled, 0));
+
+	// Taylor series: C = sum_k X^k / (2k)!,  S = h' sum_k X^k / (2k+1)!.  With |X| <= 1/4, 10 terms is much more than double precision.
+	// F = h'^2 sum_k X^k / (2k+2)!, which is the series of C without its first term, divided by X.
+	gsl_matrix_complex_set_identity(C);
+	gsl_matrix_complex_set_identity(S);
+	if(F) {
+		gsl_matrix_complex_set_identity(F);
+		gsl_matrix_complex_scale(F, gsl_complex_rect(0.5, 0));
+	}
+	gsl_matrix_complex_memcpy(T, X);	// T = X^k
+	double cC = 1, cS = 1;
+	for(int k=1; k<=10; ++k) {
+		cC /= (2*k-1)*(2*k);
+		cS /= (2*k)*(2*k+1);
+		double cF = cC / ((2*k+1)*(2*k+2));
+		if(k > 1) {
+			gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, gsl_complex_rect(1,0), X, T, gsl_complex_rect(0,0), T2);
+			gsl_matrix_complex_memcpy(T, T2);
+		}
+		for(int i=0; i<size; ++i) {
+			for(int jj=0; jj<size; ++jj) {
+				gsl_complex Tij = gsl_matrix_complex_get(T, i, jj);
+				gsl_matrix_complex_set(C, i, jj, gsl_complex_add(gsl_matrix_complex_get(C, i, jj), gsl_complex_mul_real(Tij, cC)));
+				gsl_matrix_complex_set(S, i, jj, gsl_complex_add(gsl_matrix_complex_get(S, i, jj), gsl_complex_mul_real(Tij, cS)));
+				if(F)
+					gsl_matrix_complex_set(F, i, jj, gsl_complex_add(gsl_matrix_complex_get(F, i, jj), gsl_complex_mul_real(Tij, cF)));
+			}
+		}
+	}
+	gsl_matrix_complex_scale(S, gsl_complex_rect(hScaled, 0));
+	if(F)
+		gsl_matrix_complex_scale(F, gsl_complex_rect(hScaled*hScaled, 0));
+
+	// double-angle formulas, s times. (C and S are both functions of K, so they commute.)
+	for(int k=0; k<s; ++k) {
+		// S = 2 C S
+		gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, gsl_complex_rect(2,0), C, S, gsl_complex_rect(0,0), T);
+		gsl_matrix_complex_memcpy(S, T);
+		// F = 2 F (C + I), since C(2h) - I = 2 (C - I)(C + I).
+		if(F) {
+			gsl_matrix_complex_memcpy(T, F);
+			gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, gsl_complex_rect(2,0), F, C, gsl_complex_rect(2,0), T);
+			gsl_matrix_complex_memcpy(F, T);
+		}
+		// C = 2 C^2 - I
+		gsl_blas_zgemm(CblasNoTrans, CblasNoTrans, gsl_complex_rect(2,0), C, C, gsl_complex_rect(0,0), T);
+		gsl_matrix_complex_memcpy(C, T);
+		for(int i=0; i<size; ++i)
+			gsl_matrix_complex_set(C, i, i, gsl_complex_sub_real(gsl_matrix_complex_get(C, i, i), 1.0));
+	}
+}
+
+void PESolver::fillTMatrixColumn(int j, const double* w)
+{
+	fillTMatrixColumn(te_, j, w, w + fourNp2_);
+	// At the top of the layer, the TM [H, v] are decomposed the same way as [u, u'], since epsilon = 1 in the vacuum above.
+	if(tm_)
+		fillTMatrixColumn(*tm_, j, w + eightNp4_, w + eightNp4_ + fourNp2_);
+}
+
+void PESolver::fillTMatrixColumn(PolarizationMatrices& pm, int j, const double* u, const double* uprime)
+{
+	// Fill T-matrix at this column. If j >= 2*N+1, we're dealing with the right-side blocks T12, T22.
+	if(j >= twoNp1_) {
+		int jj = j - twoNp1_;
+
+		// loop over orders (n). i is the loop index, ranging from [0, 2*N_]
+		for(int i=0; i<twoNp1_; ++i) {
+			const gsl_complex* u_ij = (const gsl_complex*)(u + 2*i);
+			const gsl_complex* uprime_ij = (const gsl_complex*)(uprime + 2*i);
+			gsl_complex temp = gsl_complex_div(*uprime_ij, gsl_complex_mul_imag(betaM_[i], 1)); // = u'_ij / (i*betaM_n)
+
+			// T12_ij = 0.5(u_ij - u'_ij / (i*betaM_n) )
+			// T22_ij = 0.5(u_ij + u'_ij / (i*betaM_n) )
+			gsl_matrix_complex_set(pm.T12, i, jj, gsl_complex_mul_real(gsl_complex_sub(*u_ij, temp), 0.5));
+			gsl_matrix_complex_set(pm.T22, i, jj, gsl_complex_mul_real(gsl_complex_add(*u_ij, temp), 0.5));
+		}
+	}
+	// Otherwise we're filling T11, T21. (left-side blocks).
+	else {
+		// loop over orders (n). i is the loop index, ranging from [0, 2*N_]
+		for(int i=0; i<twoNp1_; ++i) {
+			const gsl_complex* u_ij = (const gsl_complex*)(u + 2*i);
+			const gsl_complex* uprime_ij = (const gsl_complex*)(uprime + 2*i);
+			gsl_complex temp = gsl_complex_div(*uprime_ij, gsl_complex_mul_imag(betaM_[i], 1)); // = u'_ij / (i*betaM_n)
+
+			// T12_ij = 0.5(u_ij - u'_ij / (i*betaM_n) )
+			// T22_ij = 0.5(u_ij + u'_ij / (i*betaM_n) )
+			gsl_matrix_complex_set(pm.T11, i, j, gsl_complex_mul_real(gsl_complex_sub(*u_ij, temp), 0.5));
+			gsl_matrix_complex_set(pm.T21, i, j, gsl_complex_mul_real(gsl_complex_add(*u_ij, temp), 0.5));
+		}
+	}
 }
 
 // computes the fourier expansion of the multistep function given by values stepsK2 at x-axis locations stepsX, and stores in k2.
-void PESolver::computeGratingExpansion(const double *stepsX, const gsl_complex *stepsK2, int numSteps, gsl_complex *k2) const
+void PESolver::computeGratingExpansion(const double *stepsX, const gsl_complex *stepsK2, int numSteps, gsl_complex *k2, const gsl_complex* stepsInvEps, gsl_complex* invEps) const
 {
 	// period:
 	double d = g_.period();
 	double K = 2*M_PI/d;
 
-	/// \warning assumes numSteps is in [1, PEG_MAX_PROFILE_CROSSINGS]
+	// The k^2 expansion, and optionally the 1/epsilon one, which have the same crossings:
+	const gsl_complex* steps[2] = { stepsK2, stepsInvEps };
+	gsl_complex* f[2] = { k2, invEps };
+	int numFunctions = (stepsInvEps && invEps) ? 2 : 1;
 
 	// Optimization for numSteps = 1: f_n = 0 (n!=0).   f_0 = stepsK2[0].
 	if(numSteps == 1) {
-		for(int i=0; i<twoNp1_; ++i)
-			k2[i] = gsl_complex_rect(0,0);
-		k2[N_] = stepsK2[0];
+		for(int j=0; j<numFunctions; ++j) {
+			for(int i=0; i<twoNp1_; ++i)
+				f[j][i] = gsl_complex_rect(0,0);
+			f[j][N_] = steps[j][0];
+		}
 		return;
 	}
 
-	// compute sigma values at crossings:
-	// sigma[p] = stepsK2[p+1] - stepsK2[p] for p<numSteps-1; sigma[numSteps-1]=sigma[0]-sigma[numSteps-1]
-	gsl_complex sigma[PEG_MAX_PROFILE_CROSSINGS];
-	for(int p=0;p<numSteps-1; ++p)
-		sigma[p] = gsl_complex_sub(stepsK2[p+1], stepsK2[p]);
-	sigma[numSteps-1] = gsl_complex_sub(stepsK2[0], stepsK2[numSteps-1]);
+	// sigma values at crossings, computed as needed so that any number of steps works without storage:
+	// sigma_p = stepsK2[p+1] - stepsK2[p] for p<numSteps-1; sigma_(numSteps-1) = stepsK2[0] - stepsK2[numSteps-1]
 
-	// loop over fourier indexes
-	for(int i=0; i<twoNp1_; ++i) {
-		int n = i - N_;
+	for(int j=0; j<numFunctions; ++j) {
+		// n = 0:
+		gsl_complex f0 = gsl_complex_mul_real(steps[j][0], d);
+		for(int p=0; p<numSteps; ++p) {
+			gsl_complex sigma = gsl_complex_sub(steps[j][p == numSteps-1 ? 0 : p+1], steps[j][p]);
+			f0 = gsl_complex_sub(f0, gsl_complex_mul_real(sigma, stepsX[p]));
+		}
+		f[j][N_] = gsl_complex_div_real(f0, d);
+
+		for(int n=1; n<=N_; ++n)
+			f[j][N_+n] = f[j][N_-n] = gsl_complex_rect(0,0);
+	}
 
-		if(n == 0) {
-			gsl_complex f0 = gsl_complex_mul_real(stepsK2[0], d);
-			for(int p=0; p<numSteps; ++p)
-				f0 = gsl_complex_sub(f0, gsl_complex_mul_real(sigma[p], stepsX[p]));
-			k2[i] = gsl_complex_div_real(f0, d);
+	// n != 0: k2_n = sum_p sigma_p (sin(nKx_p) + i cos(nKx_p)) / (-2 pi n).   Since sin(nKx) + i cos(nKx) = i exp(-inKx), we only need one complex exponential z_p = exp(-iKx_p) per crossing, and then get z_p^n by recurrence instead of calling sin() and cos() for every n.  For -n, z_p^-n is the complex conjugate of z_p^n.
+	// The steps only take the values of a few media (vacuum, substrate, coating), so f is a combination of the media's indicator functions.  With the medium of step 0 as reference, the sum becomes f_n = sum_m (f_m - f_ref) T_m,n, where T_m,n = sum_p c_m,p z_p^n, and c_m,p = +1 for crossings into medium m, -1 for crossings out of it.  Since c is real, T_m,-n = conj(T_m,n).  So the loop over crossings only adds up z_p^n, once for both signs of n and for both expansions with TM.  T_m,n for the (at most) two other media is kept in k2[N+n] and k2[N-n] until we combine them.
+	gsl_complex media[2][3];
+	int numMedia = 0;
+	for(int p=0; p<numSteps && numMedia <= 3; ++p) {
+		int m = 0;
+		while(m < numMedia && !GSL_COMPLEX_EQ(media[0][m], stepsK2[p]))
+			++m;
+		if(m == numMedia) {
+			if(m < 3)
+				for(int j=0; j<numFunctions; ++j)
+					media[j][m] = steps[j][p];
+			++numMedia;
 		}
+	}
 
-		else {
-			gsl_complex fn = gsl_complex_rect(0,0);
-			for(int p=0; p<numSteps; ++p) {
-				double nKx = n*K*stepsX[p];
-				fn = gsl_complex_add(fn, gsl_complex_mul(sigma[p], gsl_complex_rect(sin(nKx), cos(nKx))));
+	if(numMedia > 3) {	// not possible with the media of PEGrating, but handled anyway: sum up every crossing on its own.
+		for(int p=0; p<numSteps; ++p) {
+			gsl_complex sigma[2];
+			for(int j=0; j<numFunctions; ++j)
+				sigma[j] = gsl_complex_sub(steps[j][p == numSteps-1 ? 0 : p+1], steps[j][p]);
+			double Kx = K*stepsX[p];
+			gsl_complex z = gsl_complex_rect(cos(Kx), -sin(Kx));
+			gsl_complex zn = gsl_complex_rect(1,0);
+			for(int n=1; n<=N_; ++n) {
+				zn = gsl_complex_mul(zn, z);
+				for(int j=0; j<numFunctions; ++j) {
+					f[j][N_+n] = gsl_complex_add(f[j][N_+n], gsl_complex_mul(sigma[j], zn));
+					f[j][N_-n] = gsl_complex_add(f[j][N_-n], gsl_complex_mul(sigma[j], gsl_complex_conjugate(zn)));
+				}
+			}
+		}
+		for(int j=0; j<numFunctions; ++j) {
+			for(int n=1; n<=N_; ++n) {
+				// multiply by i/(-2 pi n) for +n, and i/(2 pi n) for -n.
+				f[j][N_+n] = gsl_complex_mul_imag(f[j][N_+n], -1.0/(2*M_PI*n));
+				f[j][N_-n] = gsl_complex_mul_imag(f[j][N_-n], 1.0/(2*M_PI*n));
+			}
+		}
+	}
+	else {
+		for(int p=0; p<numSteps; ++p) {
+			// Where T_m,n is kept for the media crossed out of (side 0) and into (side 1): k2[N+n*where], or nowhere (0) for the reference medium.
+			int where[2] = { 0, 0 };
+			for(int side=0; side<2; ++side) {
+				const gsl_complex& value = stepsK2[(side == 1 && p == numSteps-1) ? 0 : p+side];
+				for(int m=1; m<numMedia; ++m)
+					if(GSL_COMPLEX_EQ(media[0][m], value))
+						where[side] = m == 1 ? 1 : -1;
+			}
+			if(where[0] == where[1])	// no change of medium.
+				continue;
+			double Kx = K*stepsX[p];
+			gsl_complex z = gsl_complex_rect(cos(Kx), -sin(Kx));
+			gsl_complex zn = gsl_complex_rect(1,0);
+			for(int n=1; n<=N_; ++n) {
+				zn = gsl_complex_mul(zn, z);
+				if(where[0])
+					k2[N_+n*where[0]] = gsl_complex_sub(k2[N_+n*where[0]], zn);
+				if(where[1])
+					k2[N_+n*where[1]] = gsl_complex_add(k2[N_+n*where[1]], zn);
+			}
+		}
+
+		// combine, with the factor i/(-2 pi n) for +n (and its conjugate i/(2 pi n) for -n) applied once to T instead of to every function.  This runs for every function at every n, so it works on {re, im} directly instead of calling the gsl_complex functions:
+		double df[2][2][2];	// f_m - f_ref for the two other media, of both functions: {re, im}.
+		for(int j=0; j<numFunctions; ++j) {
+			for(int m=1; m<3; ++m) {
+				gsl_complex diff = m < numMedia ? gsl_complex_sub(media[j][m], media[j][0]) : gsl_complex_rect(0,0);
+				df[j][m-1][0] = GSL_REAL(diff);
+				df[j][m-1][1] = GSL_IMAG(diff);
+			}
+		}
+		for(int n=1; n<=N_; ++n) {
+			// T * i/(-2 pi n) = {im, -re} / (2 pi n).  T2 is zero with only two media.
+			double c = 1.0/(2*M_PI*n);
+			double T1re = GSL_IMAG(k2[N_+n])*c, T1im = -GSL_REAL(k2[N_+n])*c;
+			double T2re = 0, T2im = 0;
+			if(numMedia == 3) {
+				T2re = GSL_IMAG(k2[N_-n])*c;
+				T2im = -GSL_REAL(k2[N_-n])*c;
+			}
+			for(int j=0; j<numFunctions; ++j) {
+				const double* d1 = df[j][0];
+				const double* d2 = df[j][1];
+				double* fPlus = (double*)(f[j] + N_+n);
+				double* fMinus = (double*)(f[j] + N_-n);
+				fPlus[0] = (d1[0]*T1re - d1[1]*T1im) + (d2[0]*T2re - d2[1]*T2im);
+				fPlus[1] = (d1[0]*T1im + d1[1]*T1re) + (d2[0]*T2im + d2[1]*T2re);
+				fMinus[0] = (d1[0]*T1re + d1[1]*T1im) + (d2[0]*T2re + d2[1]*T2im);
+				fMinus[1] = (-d1[0]*T1im + d1[1]*T1re) + (-d2[0]*T2im + d2[1]*T2re);
 			}
-			k2[i] = gsl_complex_div_real(fn, -2*M_PI*n);
 		}
 	}
 
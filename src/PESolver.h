@@ -21,12 +21,26 @@ along with PEG.  If not, see <http://www.gnu.org/licenses/>.
 #define PESOLVER_H
 
 #include "PEG.h"
+#include "PELinearAlgebra.h"
+#include "PESolverProfile.h"
 #include <gsl/gsl_complex.h>
 #include <gsl/gsl_matrix_complex_double.h>
 #include <gsl/gsl_linalg.h>
 
+#include <gsl/gsl_odeiv2.h>
+#include <vector>
+
 /// Contains the context (memory structures, etc.) and algorithm for solving the grating efficiency.
+/*! A solver context is tied to one grating, one set of math options, and one number of threads. All of its working memory is allocated once in the constructor, so when calculating many points (for example, over a wavelength or incidence angle scan), create one PESolver and call getEff() repeatedly instead of using PEGrating::getEff(), which creates a new context for every point.
+
+\code
+PESolver solver(grating, PEMathOptions(15), numThreads);
+for(int i=0; i<numPoints; ++i)
+	results.push_back(solver.getEff(incidence, wavelengths[i]));
+\endcode
 
+The \c grating must remain valid for the lifetime of the solver.
+*/
 class PESolver {
 public:
 	/// Construct a solver context for the given \c grating and math options \c mo.  \c numThreads specifies how many threads to use for fine parallelization; ideally it should be <= the number of processor cores on your computer / on a single cluster node.
@@ -34,9 +48,43 @@ public:
 	/// Destroy a solver context
 	~PESolver();
 	
-	/// Calculates the efficiency at incidence angle \c incidenceDeg and wavelength \c wl.  Side effects: sets the refractive index member variable v_1_; modifies the contents of u_, uprime_, alpha_, beta_, etc.
+	/// Calculates the efficiency at incidence angle \c incidenceDeg and wavelength \c wl.  Can be called any number of times; the context's memory is re-used for each calculation.  Side effects: sets the refractive index member variable v_1_; modifies the contents of u_, uprime_, alpha_, beta_, etc.  If the PEResultCache::global() cache is set up, the result is returned from there when possible, and new successful results are stored in it (except with \c printDebugOutput or timing measurement).
 	PEResult getEff(double incidenceDeg, double wl, double rmsRoughnessNm = 0, bool printDebugOutput = false);
-	
+
+	/// Calculates the efficiency at all of the given \c points, and returns the results in the same order.
+	/*! Instead of parallelizing each point on its own (which leaves threads idle for small N, where there are only 4N+2 trial solutions per layer), the threads of this context are shared across points and trial solutions: the points are distributed dynamically over min(numThreads(), points.size()) worker contexts, each of which uses its share of the remaining threads for its trial solutions (numThreads()/workers, and one more for the first numThreads() % workers of them).  The worker contexts are kept for subsequent batches: batches with fewer points use some of them, and only a batch with more points than the largest one so far creates new ones.
+
+	The workers' trial solutions run in parallel regions nested inside the one over points, so they only get their share of the threads if the program has enabled (at least) 2 active levels of parallelism, with omp_set_max_active_levels(2) at startup.  This isn't changed here, since it is process-wide and other parts of the program may be using OpenMP at the same time.  Otherwise, each point is calculated on a single thread.
+
+	Debug output and timing measurement are not available for batch calculations; use getEff() for those.  If \c profiles is given, it is filled with the profile of each point (see lastProfile()).*/
+	std::vector<PEResult> getEffBatch(const std::vector<PEScanPoint>& points, double rmsRoughnessNm = 0, std::vector<PESolverProfile>* profiles = 0);
+
+	/// Returns the profile (phase times and counters) of the last getEff() calculation. With \c measureTiming, it is also printed after each calculation.
+	const PESolverProfile& lastProfile() const { return profile_; }
+
+	/// Returns the grating this solver was created for.
+	const PEGrating& grating() const { return g_; }
+	/// Returns the Fourier truncation index N this solver was created for.
+	int N() const { return N_; }
+	/// Returns true if this solver calculates the TM efficiencies too (PEMathOptions::TEAndTMPolarization).
+	bool withTM() const { return tm_ != 0; }
+	/// Returns the number of complex coefficients in each grating expansion (see computeGratingExpansion()): 2N+1, or 2(2N+1) withTM().
+	int expansionSize() const { return expansionSize_; }
+	/// Returns the number of threads used for fine parallelization.
+	int numThreads() const { return numThreads_; }
+	/// Prepares this context for benchmarks and tests of the individual solver steps (computeGratingExpansion(), odeFunction(), odeJacobian()), without solving anything: sets up a calculation at \c incidenceDeg and \c wl (refractive indices, alpha_n, beta_n, and the layers), and then sets up the ODE functions for layer \c m (2 <= \c m < numLayers() + 2), as computeTMatrixBelowLayer() would. Returns PEResult::Success, or the failure code.
+	PEResult::Code prepareForLayer(double incidenceDeg, double wl, int m);
+	/// Returns the number of layers in the current calculation.
+	int numLayers() const { return numLayers_; }
+	/// Returns the y coordinate of the top of the substrate (\c m = 1), of each layer boundary, and of the top of the grating (\c m = numLayers() + 1), in the current calculation.
+	double layerBoundary(int m) const { return y_[m]; }
+
+	/// Returns how many times the ODE right-hand side (odeFunction()) has been evaluated by this context (including its getEffBatch() workers), since it was created.
+	unsigned long odeFunctionCalls() const;
+	/// Returns how many times the ODE Jacobian (odeJacobian()) has been evaluated by this context (including its getEffBatch() workers), since it was created. Only PEMathOptions::BSimpStepper uses the Jacobian.
+	unsigned long odeJacobianCalls() const;
+	/// Returns how many integration steps this context (including its getEffBatch() workers) has taken, over all trial solutions, since it was created.
+	unsigned long odeSteps() const;
 	
 
 
@@ -48,27 +96,91 @@ public:
 	// Solving implementation functions
 	////////////////////////////////////////
 
+	/// The T matrix blocks of the current layer, the S matrix blocks of the recursion up to it, the workspace for the recursion, and the resulting Rayleigh coefficients, for one polarization.
+	class PolarizationMatrices {
+	public:
+		/// Allocates everything for \c twoNp1 = 2N+1 orders.
+		PolarizationMatrices(int twoNp1);
+		~PolarizationMatrices();
+
+		/// Blocks of T matrix, used in computation of a single layer.
+		gsl_matrix_complex* T11, *T12, *T21, *T22;
+		/// Blocks of S matrix, used in recursive computation of everything up to current layer.
+		gsl_matrix_complex* S12, *S22;
+		/// Inverse of Z-matrix, used in computation of S. (Note: we don't actually compute any inverses; Zinv is directly calculated from Zinv^{q+1} = T11^{q+1} + T12^{q+1} S12^{q}, and then we use its LU decomposition to solve for S12 Zinv = ... and S22 Zinv = ... directly, without computing Z = Zinv^{-1}.)
+		gsl_matrix_complex* Zinv;
+		/// This is a 2*N_+1 x 2*N_+1 matrix used as a workspace matrix.
+		gsl_matrix_complex* work;
+		/// LU factorization (size 2*N + 1) of Zinv, used to solve the linear systems.
+		PELUFactorization* lu;
+		/// B_n^{M} array: outgoing reflected Rayleigh coefficients. (size 2N+1)
+		gsl_complex* BM;
+
+	private:
+		// not copyable.
+		PolarizationMatrices(const PolarizationMatrices&);
+		PolarizationMatrices& operator=(const PolarizationMatrices&);
+	};
+
 	/// Computes alpha_, beta1_, and betaM_ for all n, based on v_1_ (material refractive index) and wl_.  Also calculates
 	void computeAlphaAndBeta(double incidenceDeg);
 
 	/// Calculates how many vertical layers (numLayers_ and M_) are sufficient to keep exponentials from contamination.  Fills y_ with the vertical coordinate at each layer.
 	void computeLayers();
-
-	/// Computes the blocks of the T matrix (T11_, T12_, T21_, T22_) for the layer below \c y_[m].  Since \c m = 1 is the top of the substrate, \c m can range from [2, M-1].
+	/// Implements computeLayers() for PEMathOptions::adaptiveLayers: puts layer boundaries at the grating's featureHeights(), and sizes the layers from the growth of the evanescent orders.
+	void computeAdaptiveLayers();
+	/// For PEMathOptions::warmStart: re-arranges stepSizes_ from the layers of the last calculation (stepSizesY_) to the current layers in y_, so that each new layer starts with the step sizes from the old layer containing its middle. Call after computeLayers().
+	void warmStartStepSizes();
+
+	/// Sets up a calculation at \c incidenceDeg and \c wl: looks up the refractive indices (unless they are still valid for \c wl), and computes the k^2 of the media, alpha_, beta1_, betaM_, and the layers. Returns PEResult::Success, or PEResult::MissingRefractiveDataFailure.
+	PEResult::Code setUpCalculation(double incidenceDeg, double wl);
+	/// Sets up the ODE functions for the layer below \c y_[m]: finds out if it is y-invariant (and if so, computes layerK2_), and computes the expansion table if enabled. Returns PEResult::Success, or PEResult::InvalidGratingFailure.
+	PEResult::Code prepareLayer(int m, bool printDebugOutput = false);
+	/// Computes the blocks of the T matrix (T11, T12, T21, T22 of te_, and tm_ with TM) for the layer below \c y_[m].  Since \c m = 1 is the top of the substrate, \c m can range from [2, M-1].
 	PEResult::Code computeTMatrixBelowLayer(int m, bool printDebugOutput = false);
 
-	/// Calculates the grating fourier expansion for k^2_m at a given \c y value and wavelength \c wl, and stores in \c k2.  \c k2 must have space for 4*N_ + 1 coefficients, since we will be computing from n = -2N_ to 2N.   Reads member variables N_, wavelength wl_, grating refractive index \c v_1_, and grating geometry from \c g_.  Returns PEResult::Success, or PEResult::InvalidGratingFailure if the profile is not supported or \c y is larger than the groove height.
+	/// Used by computeTMatrixBelowLayer() for y-invariant layers: instead of numerically integrating the trial solutions, propagates them all analytically across the layer below \c y_[m], using the matrix exponential from computeLayerPropagator(). Requires layerK2_ to be filled for this layer.
+	PEResult::Code propagateTrialSolutionsAcrossLayer(int m);
+	/// Computes the propagator P = exp(h A) for the first-order system w' = A w, A = [[0, I], [M, 0]], which is equivalent to u'' = M u for a y-invariant layer of thickness \c h (using the expansion in layerK2_). Stores the result in propagator_, where w(y+h) = P w(y). If propagator_ is already valid for the same \c h and layerK2_, does nothing.  With TM, also computes propagatorTM_ for A = [[0, E], [B, 0]] (see odeFunction()): P = [[C(EB), S(EB) E], [S(BE) B, C(BE)]], with C and S as below.
+	/*! The natural method for a constant-coefficient layer would be an eigendecomposition of M.  However, GSL has no eigensolver for general (non-Hermitian) complex matrices, so instead we compute the blocks C = cosh(h sqrt(M)) and S = sinh(h sqrt(M))/sqrt(M) of the propagator directly, as power series in M with scaling and double-angle formulas.  This only uses (2N+1) x (2N+1) matrix products. Returns PEResult::Success.*/
+	PEResult::Code computeLayerPropagator(double h);
+	/// Fills column \c j of the T-matrix blocks (T11, T21 for j < 2N+1; T12, T22 otherwise) from trial solution \c w, integrated to the top of the layer: te_ from the TE part of \c w, and tm_ from the TM part.
+	void fillTMatrixColumn(int j, const double* w);
+	/// Fills column \c j of the T-matrix blocks of \c pm from the field \c u and its derivative \c uprime (2N+1 complex values each) at the top of the layer.
+	void fillTMatrixColumn(PolarizationMatrices& pm, int j, const double* u, const double* uprime);
+
+	/// Calculates the grating fourier expansion for k^2_m at a given \c y value and wavelength \c wl, and stores in \c k2.  \c k2 must have space for expansionSize() coefficients: the 2N+1 coefficients of k^2, from n = -N to N, and withTM(), the 2N+1 coefficients of the inverse relative permittivity 1/epsilon = k^2_M/k^2 after them.   Reads member variables N_, wavelength wl_, grating refractive index \c v_1_, and grating geometry from \c g_.  Returns PEResult::Success, or PEResult::InvalidGratingFailure if the profile is not supported or \c y is larger than the groove height.
 	PEResult::Code computeGratingExpansion(double y, gsl_complex* k2) const;
 
-	/// Computes the Fourier components of the grating expansion k^2_m into \c k2, based on an array of x crossing (step) values \c stepsX and corresponding k^2 values \c stepsK2 immediately to the left of those x values. \c numSteps is the number of steps [usually two or four, if there are interpenetrating coatings)].  Valid only up to PEG_MAX_PROFILE_CROSSINGS (60) to avoid allocating memory, since this function is called repeatedly.
-	void computeGratingExpansion(const double* stepsX, const gsl_complex* stepsK2, int numSteps, gsl_complex* k2) const;
-
-	/// Initializes an 8N+4 array of double [\c u, \c uprime] to contain the starting integration values of the electric field Fourier components. The first half of the array \c w contains \c u, the second half contains \c uprime, with each entry in {re,im} order.  The u value is set to $\delta_{n,p}$ and the u' value is set to $-i \beta_n^{(M)} \delta_{n,p}$ or $i \beta_n^{(M)} \delta_{n,p}$, depending on whether p > 2N_.  (Note n,p here are using numbering from 0, and that for the delta functions, p is aliased back onto [0, 2N] once it reaches 2N_+1.
+	/// Tabulates the grating expansion at PEMathOptions::expansionTablePoints evenly-spaced y values from \c yStart to \c yEnd (ie: over one layer), into k2Table_.  The table is computed in parallel, and is afterwards shared read-only by all threads.  Returns PEResult::Success, or PEResult::InvalidGratingFailure if the expansion could not be computed at one of the points.
+	PEResult::Code computeExpansionTable(double yStart, double yEnd);
+	/// Interpolates the grating expansion at \c y from the table computed by computeExpansionTable(), using cubic (4-point Lagrange) interpolation, and stores in \c k2 (size 2N+1).
+	void interpolateGratingExpansion(double y, gsl_complex* k2) const;
+	/// Accuracy check for the expansion table: returns the largest difference between the interpolated and directly-computed expansion coefficients, sampled half-way between the table points (where the interpolation error is largest), relative to the largest coefficient |k^2_n|.  Must be called after computeExpansionTable().
+	double expansionTableError() const;
+	/// Returns the grating expansion at \c y for the ODE functions (2N+1 coefficients): either the single expansion for the current layer (if it is y-invariant), interpolated from the expansion table (if enabled and accurate enough in the current layer), or computed directly using computeGratingExpansion(). Returns 0 if the expansion could not be computed.
+	const gsl_complex* gratingExpansionForODE(double y) { return gratingExpansionForODE(y, k2ForCurrentThread()); }
+	/// This is an overloaded function, which uses \c k2 (2N+1 coefficients) as the storage for the expansion, if it needs to be computed or interpolated.
+	const gsl_complex* gratingExpansionForODE(double y, gsl_complex* k2);
+
+	/// Computes the Fourier components of the grating expansion k^2_m into \c k2, based on an array of x crossing (step) values \c stepsX and corresponding k^2 values \c stepsK2 immediately to the left of those x values. \c numSteps is the number of steps [usually two or four, if there are interpenetrating coatings)].  Any number of steps is supported, without allocating memory, since this function is called repeatedly.
+	/*! If \c stepsInvEps is given, it has the values of a second step function at the same crossings (the inverse relative permittivity, for TM), and its Fourier components are computed into \c invEps as well, sharing the complex exponentials at the crossings.*/
+	void computeGratingExpansion(const double* stepsX, const gsl_complex* stepsK2, int numSteps, gsl_complex* k2, const gsl_complex* stepsInvEps = 0, gsl_complex* invEps = 0) const;
+
+	/// Computes the product \c Mu = M \c u, where M_nm = -k^2_{n-m} + alpha_n^2 delta_nm is the matrix in the ODE u'' = M u, using the grating expansion \c k2 (2N+1 coefficients).  \c u and \c Mu are arrays of 2N+1 complex values in {re,im} order. M is never formed: it is Toeplitz-plus-diagonal, and only the band |n-m| <= N is non-zero. Uses the fastest implementation in PEKernels for this CPU.
+	void multiplyByM(const gsl_complex* k2, const double* u, double* Mu) const;
+
+	/// Initializes an 8N+4 array of double [\c u, \c uprime] to contain the starting integration values of the electric field Fourier components.  withTM(), the array has 16N+8 doubles, and the second half is initialized the same way for the TM system [\c H, \c v] (see odeFunction()), where v = H'/epsilon is -i beta_n^{(1)} / epsilon_1 in the substrate. The first half of the array \c w contains \c u, the second half contains \c uprime, with each entry in {re,im} order.  The u value is set to $\delta_{n,p}$ and the u' value is set to $-i \beta_n^{(M)} \delta_{n,p}$ or $i \beta_n^{(M)} \delta_{n,p}$, depending on whether p > 2N_.  (Note n,p here are using numbering from 0, and that for the delta functions, p is aliased back onto [0, 2N] once it reaches 2N_+1.
 	/*! If layer \c m = 1, then uses beta1_n instead of betaM_n for the derivative. */
 	void setIntegrationStartingValues(double* w, int p, int m);
 
 	/// Integrates the electric field Fourier component vectors contained in \c w from y = \c yStart to y = \c yEnd, using the differential equation and ______ method.  Array \c w should contain vector \c u followed by \c uprime, with each entry in {re,im} order. Calls computeGratingExpansion() at each y value, so reads member variables N_, v_1_, and g_.  Modifies k2 (for thread) at each step.  Results are returned in-place.
-	PEResult::Code integrateTrialSolutionAlongY(double* w, double yStart, double yEnd);
+	/*! If \c step is given and > 0, the integration starts with that step size instead of (yEnd - yStart)/200. On return, it contains the average step size that was used. */
+	PEResult::Code integrateTrialSolutionAlongY(double* w, double yStart, double yEnd, double* step = 0);
+	/// For PEMathOptions::matrixIntegration: integrates all the trial solutions across layer \c m together, as the matrix ODE U'' = M(y) U, and fills in the T matrix from the results.  The starting values are the same as for separate integration (setIntegrationStartingValues()), and the results are copied back into wVectors_.
+	PEResult::Code integrateTrialSolutionsAsMatrix(int m, bool printDebugOutput);
+	/// Helper for integrateTrialSolutionAlongY(): translates a GSL integration \c status into a PEResult::Code, with a message for failures.
+	static PEResult::Code integrationStatus(int status);
 	/// DEPRECATED. This is an overloaded function. Integrates the electric field Fourier component vectors \c u and \c uprime from y=0 to y=a, using the differential equation and ______ method.  Calls computeGratingExpansion() at each y value, so reads member variables N_, v_1_, and g_.  Modifies k2 (for thread) at each step.  Results are returned in-place.
 	PEResult::Code integrateTrialSolutionAlongY(gsl_vector_complex* u, gsl_vector_complex* uprime, double yStart, double yEnd);
 
@@ -78,7 +190,20 @@ public:
 		return s->odeFunction(y, w, f);
 	}
 	/// called to compute the values for the integration process.
+	/*! withTM(), \c w also contains the TM system after the TE one: the magnetic field Fourier components H_n and v_n = (H'/epsilon)_n, which are continuous across horizontal boundaries, from the Helmholtz equation div(grad(H)/epsilon) + k^2_M H = 0.  As a first-order system: H' = [[epsilon]] v, and v' = (alpha [[1/epsilon]] alpha - k^2_M) H, where [[f]] is the Toeplitz matrix of the Fourier coefficients of f, and alpha is diagonal.  In the vacuum and substrate, this is the same as u'' = M u.  Both Toeplitz matrices are products in the same PEKernels band kernel as the TE system.*/
 	int odeFunction(double y, const double w[], double f[]);
+	/// Computes the derivatives of the TM system \c Hv = [H, v] into \c dHvdy, using the k^2 and 1/epsilon coefficients in \c expansion (see odeFunction()), and the TE product \c Mu = M \c u (see multiplyByM()) with them, since it has the same k^2 band as H'.  Uses this thread's tmWork_.
+	void computeTMDerivatives(const gsl_complex* expansion, const double* Hv, double* dHvdy, const double* u, double* Mu);
+
+	/// The function callback for the matrix integration (PEMathOptions::matrixIntegration).  \c peSolver will be a pointer to a solver (this).
+	static int matrixODEFunctionCB(double y, const double W[], double F[], void* peSolver) {
+		PESolver* s = static_cast<PESolver*>(peSolver);
+		return s->matrixODEFunction(y, W, F);
+	}
+	/// Called to compute the right-hand side of the matrix ODE: \c W contains the (2N+1) x (4N+2) complex matrix U (row-major, with each entry in {re,im} order) followed by U', and \c F receives U' followed by U'' = M(y) U.
+	int matrixODEFunction(double y, const double W[], double F[]);
+	/// Computes Y = A X for the (2N+1) x (4N+2) blocks \c X and \c Y of the matrix integration state (one column per trial solution), divided between our threads. Returns false if the multiplication failed.
+	bool multiplyTrialSolutions(const gsl_matrix_complex* A, const double* X, double* Y);
 
 	/// Static callback function for computing the jacobian for the ODE integration.
 	static int odeJacobianCB(double y, const double w[], double * dfdw, double dfdy[], void * params) {
@@ -86,12 +211,16 @@ public:
 		return s->odeJacobian(y, w, dfdw, dfdy);
 	}
 
-	/// Called to compute the jacobian for the ODE integration. \c y is the independent variable, \c dfdu is the jacobian matrix in row-major order, and \c dfdy is the ODE function f'(u, y).
+	/// Called to compute the jacobian for the ODE integration. \c y is the independent variable, \c dfdu is the jacobian matrix in row-major order, and \c dfdy is the partial derivative of the ODE function f(u, y) with respect to \c y (estimated from the change in the grating expansion).
 	int odeJacobian(double y, const double w[], double * dfdw, double dfdy[]);
 
 
-	/// Computes the \c BM_ outgoing reflected Rayleigh coefficients, based on a finished S matrix (S12_ block).
-	void computeBMFromSMatrix();
+	/// Does the step of the S-matrix recursion for layer \c m in \c pm, from its T matrix blocks: starts the recursion for the first layer (m = 2), and updates S12 and S22 for the others. Returns PEResult::Success, or PEResult::AlgebraFailure.
+	PEResult::Code updateSMatrix(PolarizationMatrices& pm, int m);
+	/// Computes the BM outgoing reflected Rayleigh coefficients of \c pm, based on a finished S matrix (S12 block).
+	void computeBMFromSMatrix(PolarizationMatrices& pm);
+	/// Computes the reflected efficiencies into \c eff (size 2N+1) from the BM coefficients of \c pm, and returns their sum.
+	double computeEfficiencies(const PolarizationMatrices& pm, std::vector<double>& eff) const;
 
 
 
@@ -106,6 +235,9 @@ public:
 	/// Helper function: returns the condition number of a complex square matrix. INCOMPLETE!
 	static double conditionNumber(const gsl_matrix_complex* A);
 
+	/// Computes C = cosh(h sqrt(K)) and S = sinh(h sqrt(K)) / sqrt(K) for the (2N+1) x (2N+1) matrix \c K (see computeLayerPropagator()), using \c X, \c T, and \c T2 as workspace.  If \c F is given, it also computes F = (C - I) / K, from the same powers of K.
+	static void computeCoshSinh(const gsl_matrix_complex* K, double h, gsl_matrix_complex* C, gsl_matrix_complex* S, gsl_matrix_complex* X, gsl_matrix_complex* T, gsl_matrix_complex* T2, gsl_matrix_complex* F = 0);
+
 	/// Solves the linear system AX = B where \c A, \c X, \c B are all \c n x \c n square matrices (\c X is unknown) using the pre-computed LU decomposition of \c A.  Uses gsl_linalg_LU_solve() to do \c n back-substitutions for each column of \c X.
 	static int linalg_LU_complex_solve(const gsl_matrix_complex* LU, const gsl_permutation* P, const gsl_matrix_complex* B, gsl_matrix_complex* X);
 
@@ -116,11 +248,34 @@ protected:
 
 	/// Number of threads to use for this calculation
 	int numThreads_;
+	/// The math options this context was created with
+	PEMathOptions mathOptions_;
+
+	/// Single-point solver contexts used by getEffBatch(), one for each point being calculated concurrently. Created on first use.
+	std::vector<PESolver*> batchWorkers_;
+	/// Deletes all batchWorkers_.
+	void clearBatchWorkers();
+
+	/// With PEMathOptions::adaptiveNTolerance, a solver context for each of the smaller truncation indices to try before N, in increasing order of N.
+	std::vector<PESolver*> adaptiveNSolvers_;
+	/// Does the calculation for getEff() with PEMathOptions::adaptiveNTolerance: goes through adaptiveNSolvers_ and then this context, until the estimate of the truncation error is small enough.
+	PEResult computeEffAdaptiveN(double incidenceDeg, double wl, double rmsRoughnessNm, bool printDebugOutput);
+
+	/// Does the calculation for getEff(), without using the result cache.
+	PEResult computeEff(double incidenceDeg, double wl, double rmsRoughnessNm, bool printDebugOutput);
+	/// Estimates the error in the efficiencies from truncating the Fourier expansion at N, from this calculation alone, once the BM coefficients and the S matrix of \c pm are known: the larger of the efficiency of the outermost two orders on each side, and the amount by which the sum of the reflected (\c reflectedSum) and transmitted efficiencies exceeds 1.  This misses the slow convergence of the efficiencies as N grows, so computeEffAdaptiveN() also uses the change from the last, smaller N.  \c tm selects the TM transmitted efficiencies, which are weighted by Re(beta^{(1)}_n / epsilon_1) instead of Re(beta^{(1)}_n).
+	double estimateTruncationError(const PolarizationMatrices& pm, double reflectedSum, bool tm = false) const;
+	/// Returns the transmitted efficiency of order index \c i (from 0 to 2N) from the S matrix of \c pm; see estimateTruncationError().
+	double transmittedEfficiency(const PolarizationMatrices& pm, int i, bool tm) const;
 	
 	/// The number of Fourier coefficients
 	int N_;
 	/// 2*N_ + 1, 4*N_+2, and 8*N_+4, since these are used a lot
 	int twoNp1_, fourNp2_, eightNp4_;
+	/// Number of doubles in the state of one trial solution: 8N+4 for TE [u, u'], or 16N+8 for TE and TM [u, u', H, v].
+	int stateSize_;
+	/// Number of complex coefficients in each grating expansion array: 2N+1, or 2(2N+1) with TM (see computeGratingExpansion()).
+	int expansionSize_;
 	
 	/// The accuracy to use for numerical integration. Default 1e-8. \todo Get from math options.
 	double integrationTolerance_;
@@ -128,10 +283,14 @@ protected:
 	
 	/// alpha array (size 2N+1)
 	double* alpha_;
+	/// alpha^2 for each order (size 2N+1), as used in multiplyByM().
+	double* alpha2_;
 	/// beta array (size 2N+1).  betaM_ is for the superstrate, beta1_ is for the substrate.
 	gsl_complex* betaM_, * beta1_;
-	/// B_n^{M} array: outgoing reflected Rayleigh coefficients. (size 2N+1)
-	gsl_complex* BM_;
+	/// k^2_M = (2 pi / wl)^2 in the vacuum, for the current calculation.
+	double kM2_;
+	/// k^2 of the media for computeGratingExpansion(): vacuum, substrate, and coating, at wl_.  With TM, also their 1/epsilon = k^2_M/k^2.  Set by setUpCalculation().
+	gsl_complex mediaK2_[3], mediaInvEps_[3];
 
 	/// Number of layers to use in the vertical stack to keep the growing exponentials from numerical contamination.
 	int numLayers_;
@@ -140,14 +299,36 @@ protected:
 	
 	/// pre-allocated storage for the grating k^2 fourier coefficients.  There is one array for each thread to use.  Array size must be 2N+1.
 	gsl_complex** k2_;
+
+	/// Table of the grating expansion at evenly-spaced y values within the current layer, as used by interpolateGratingExpansion(). Contains expansionTablePoints arrays of size 2N+1, one after the other.  0 if the table is not used.
+	gsl_complex* k2Table_;
+	/// Number of y points in k2Table_. 0 if the table is not used.
+	int k2TablePoints_;
+	/// y value of the first point in k2Table_, and spacing between points.
+	double k2TableYStart_, k2TableDy_;
+	/// True if the ODE functions should interpolate from k2Table_ in the current layer. Set by computeTMatrixBelowLayer(), based on expansionTableError().
+	bool k2TableActive_;
+
+	/// The grating expansion for the current layer, if it is y-invariant (see PEGrating::k2StepsAreYInvariant()). Array size is 2N+1; shared read-only by all threads.
+	gsl_complex* layerK2_;
+	/// True if the current layer is y-invariant, and the ODE functions should use layerK2_.
+	bool layerIsYInvariant_;
+
+	/// The (4N+2) x (4N+2) layer propagator computed by computeLayerPropagator(), the one for the TM system (with TM), and (2N+1) x (2N+1) working space for them. 0 until first used.
+	gsl_matrix_complex* propagator_, * propagatorTM_, * propagatorWork_[7];
+	/// The layer thickness and expansion that propagator_ was computed for, so that it can be re-used for identical layers. propagatorH_ is -1 if propagator_ is not valid.
+	double propagatorH_;
+	gsl_complex* propagatorK2_;
+	/// Per-thread workspace for propagateTrialSolutionsAcrossLayer(): one propagated [u, uprime] vector (4N+2 complex values) for each thread. Allocated along with propagator_.
+	gsl_complex* propagatedW_;
 	/// Helper function: returns the k^2 array that should be used by a given thread.
 	gsl_complex* k2ForCurrentThread();
 	
-	/// This block of storage contains the [u, uprime] electric field Fourier component vectors. They are arranged with each value {re,im}, from order [-N to N], the u vector followed by uprime vector... repeated for each trial solution.  Access the [u, uprime] vector for a given trial solution with wVectorForP().   The size of one w vector is (8*N_+4), and there are (4*N_+2) trial solutions.
+	/// This block of storage contains the [u, uprime] electric field Fourier component vectors. They are arranged with each value {re,im}, from order [-N to N], the u vector followed by uprime vector (and with TM, the H and v vectors)... repeated for each trial solution.  Access the [u, uprime] vector for a given trial solution with wVectorForP().   The size of one w vector is stateSize_ (8*N_+4, without TM), and there are (4*N_+2) trial solutions.
 	double* wVectors_;
 
 	/// Returns the wVector for a trial solution \c p at index \c j, where \c j is numbered from [0, 4*N_+1].
-	double* wVectorForP(int j) { return wVectors_ + eightNp4_*j; }
+	double* wVectorForP(int j) { return wVectors_ + stateSize_*j; }
 	/// Returns the electric field Fourier component \c u for order \c n (index \c i) and trial solution \c p (index \c j), out of wVectors_.  i and j are numbered from 0.
 	gsl_complex* u(int i, int j) {
 		return (gsl_complex*)(wVectorForP(j) + 2*i);
@@ -157,18 +338,13 @@ protected:
 		return (gsl_complex*)(wVectorForP(j) + fourNp2_ + 2*i);
 	}
 
-	/// Blocks of T matrix, used in computation of a single layer.
-	gsl_matrix_complex* T11_, *T12_, *T21_, *T22_;
-	/// Blocks of S matrix, used in recursive computation of everything up to current layer.
-	gsl_matrix_complex* S12_, *S22_;
-	/// Inverse of Z-matrix, used in computation of S. (Note: we don't actually compute any inverses; Zinv_ is directly calculated from Zinv^{q+1} = T11^{q+1} + T12^{q+1} S12^{1}, and then we use LU decomp and multiplication to avoid loss of precision in computing Z = Zinv_^{-1}.)
-	gsl_matrix_complex* Zinv_;
-	/// This is a 2*N_+1 x 2*N_+1 matrix used as a workspace matrix.
-	gsl_matrix_complex* Z_, * workMatrix_;
-
-	
-	/// A permutation structure (size 2*N + 1) used to solve the linear system.
-	gsl_permutation* permutation_;
+	/// The matrices of the S-matrix recursion for TE, and for TM (0 without TM).
+	PolarizationMatrices te_;
+	PolarizationMatrices* tm_;
+	/// Per-thread workspace for the TM part of odeFunction() and odeJacobian() (2 (4N+2) doubles each). 0 without TM.
+	double** tmWork_;
+	/// An array of 2N+1 zeros, for the TM products in PEKernels::multiplyByM(), which have no alpha^2 diagonal.
+	double* zeros_;
 	
 		
 	/// wavelength for the current calculation
@@ -177,20 +353,56 @@ protected:
 	gsl_complex v_1_;
 	/// refractive index of the coating material, at wl_
 	gsl_complex v_c_;
+	/// The wavelength that v_1_ and v_c_ were looked up for, so that they don't need to be looked up again when only the incidence angle changes. -1 if they aren't valid.
+	double indexWl_;
+
+	/// Number of odeFunction() and odeJacobian() calls made by each thread.
+	std::vector<unsigned long> odeFunctionCalls_, odeJacobianCalls_;
+
+	/// For PEMathOptions::warmStart: the integration step size for each trial solution in each layer (fourNp2_ values per layer, starting with layer \c m = 2), from the last calculation.  Filled in by computeTMatrixBelowLayer().
+	std::vector<double> stepSizes_;
+	/// The layer boundaries y_[1] ... y_[M_-1] that stepSizes_ is arranged for.
+	std::vector<double> stepSizesY_;
 
 	/// The y-coordinate of the infinitely-thin Rayleigh layer at y_m, with m = [1, M_ - 1].  y_[0] is unused, so that we can take y_m = y_[m].
 	double* y_;
+	/// The allocated size of y_. It is only re-allocated when a calculation needs more layers than any previous one.
+	int yCapacity_;
+
+	/// The ODE system passed to the integration drivers. Its dimension is fixed (8*N_+4), so it is set up once in the constructor.
+	gsl_odeiv2_system odeSystem_;
+	/// Pre-allocated ODE integration drivers, one for each thread. They are reset (rather than re-allocated) for each trial solution.
+	gsl_odeiv2_driver** drivers_;
+	/// For PEMathOptions::matrixIntegration: the ODE system and driver for the whole matrix system, of dimension (8N+4)(4N+2). 0 if not used.
+	gsl_odeiv2_system matrixSystem_;
+	gsl_odeiv2_driver* matrixDriver_;
+	/// For PEMathOptions::matrixIntegration: storage for [U, U'] (see matrixODEFunction()), and the (2N+1) x (2N+1) matrix M(y).  With TM, [H, V] follow in matrixW_, and matrixE_ and matrixB_ hold [[epsilon]] and alpha [[1/epsilon]] alpha - k^2_M (0 otherwise).
+	double* matrixW_;
+	gsl_matrix_complex* matrixM_, * matrixE_, * matrixB_;
 	
 	/// a reference to the grating we're solving
 	const PEGrating& g_;
 	
-	/// A flag that indicates that we should measure the time required for all related blocks of operations
+	/// A flag that indicates that we should print the profile of every calculation.
 	bool measureTiming_;
-
-	/// Stores the timing results:
-	double timing_[12];
-	/// Used for calculating computation times.
-	double time_;
+	/// With measureTiming_, the result of PEKernels::verify() for N_, checked once in the constructor for the timing report.
+	double kernelDifference_;
+
+	/// The profile of the current (or last) calculation.
+	PESolverProfile profile_;
+	/// Time taken to allocate this context in the constructor; added to the profile of the first calculation.
+	double allocationTime_;
+	/// Start times of the current calculation, and of the current phase.
+	double profileStartTime_, phaseStartTime_;
+	/// Number of integration steps taken by each thread, and each thread's busy time in the current trial-solution loop.
+	std::vector<unsigned long> odeSteps_;
+	std::vector<double> threadBusyTime_;
+	/// Starts profile_ for a calculation at \c incidenceDeg and \c wl.
+	void beginProfile(double incidenceDeg, double wl);
+	/// Finishes profile_ for the calculation that gave \c result, and prints it with measureTiming_.
+	void endProfile(const PEResult& result);
+	/// Adds the time since the end of the last phase to \c phase in profile_.
+	void endPhase(PESolverProfile::Phase phase);
 };
 
 
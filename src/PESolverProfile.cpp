@@ -0,0 +1,261 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "PESolverProfile.h"
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+
+void PESolverProfile::clear() {
+	status = 0;
+	wavelength = incidenceDeg = 0;
+	threads = 0;
+	points = failures = cacheHits = 0;
+	for(int i=0; i<NumPhases; ++i)
+		phaseTime[i] = 0;
+	totalTime = 0;
+	odeFunctionCalls = odeJacobianCalls = odeSteps = 0;
+	layers = integratedLayers = propagatedLayers = 0;
+	trialLoopTime = trialMeanThreadTime = trialMaxThreadTime = 0;
+}
+
+void PESolverProfile::add(const PESolverProfile& other) {
+	threads = std::max(threads, other.threads);
+	points += other.points;
+	failures += other.failures;
+	cacheHits += other.cacheHits;
+	for(int i=0; i<NumPhases; ++i)
+		phaseTime[i] += other.phaseTime[i];
+	totalTime += other.totalTime;
+	odeFunctionCalls += other.odeFunctionCalls;
+	odeJacobianCalls += other.odeJacobianCalls;
+	odeSteps += other.odeSteps;
+	layers += other.layers;
+	integratedLayers += other.integratedLayers;
+	propagatedLayers += other.propagatedLayers;
+	trialLoopTime += other.trialLoopTime;
+	trialMeanThreadTime += other.trialMeanThreadTime;
+	trialMaxThreadTime += other.trialMaxThreadTime;
+}
+
+const char* PESolverProfile::phaseName(Phase phase) {
+	static const char* names[NumPhases] = { "allocation", "refractiveIndex", "layers", "integration", "matrix", "efficiency" };
+	return names[phase];
+}
+
+std::vector<std::string> PESolverProfile::valueNames() {
+	std::vector<std::string> names;
+	names.push_back("points");
+	names.push_back("failures");
+	names.push_back("cacheHits");
+	for(int i=0; i<NumPhases; ++i)
+		names.push_back(std::string(phaseName(Phase(i))) + "Time");
+	names.push_back("totalTime");
+	names.push_back("odeFunctionCalls");
+	names.push_back("odeJacobianCalls");
+	names.push_back("odeSteps");
+	names.push_back("layers");
+	names.push_back("integratedLayers");
+	names.push_back("propagatedLayers");
+	names.push_back("trialLoopTime");
+	names.push_back("trialMeanThreadTime");
+	names.push_back("trialMaxThreadTime");
+	names.push_back("loadImbalance");
+	return names;
+}
+
+std::vector<double> PESolverProfile::values() const {
+	std::vector<double> v;
+	v.push_back(points);
+	v.push_back(failures);
+	v.push_back(cacheHits);
+	for(int i=0; i<NumPhases; ++i)
+		v.push_back(phaseTime[i]);
+	v.push_back(totalTime);
+	v.push_back(odeFunctionCalls);
+	v.push_back(odeJacobianCalls);
+	v.push_back(odeSteps);
+	v.push_back(layers);
+	v.push_back(integratedLayers);
+	v.push_back(propagatedLayers);
+	v.push_back(trialLoopTime);
+	v.push_back(trialMeanThreadTime);
+	v.push_back(trialMaxThreadTime);
+	v.push_back(loadImbalance());
+	return v;
+}
+
+int PESolverProfile::arraySize() {
+	return 4 + 3 + NumPhases + 10;
+}
+
+void PESolverProfile::toDoubleArray(double* array) const {
+	*array++ = status;
+	*array++ = wavelength;
+	*array++ = incidenceDeg;
+	*array++ = threads;
+	*array++ = points;
+	*array++ = failures;
+	*array++ = cacheHits;
+	for(int i=0; i<NumPhases; ++i)
+		*array++ = phaseTime[i];
+	*array++ = totalTime;
+	*array++ = odeFunctionCalls;
+	*array++ = odeJacobianCalls;
+	*array++ = odeSteps;
+	*array++ = layers;
+	*array++ = integratedLayers;
+	*array++ = propagatedLayers;
+	*array++ = trialLoopTime;
+	*array++ = trialMeanThreadTime;
+	*array++ = trialMaxThreadTime;
+}
+
+void PESolverProfile::fromDoubleArray(const double* array) {
+	status = int(*array++);
+	wavelength = *array++;
+	incidenceDeg = *array++;
+	threads = int(*array++);
+	points = *array++;
+	failures = *array++;
+	cacheHits = *array++;
+	for(int i=0; i<NumPhases; ++i)
+		phaseTime[i] = *array++;
+	totalTime = *array++;
+	odeFunctionCalls = *array++;
+	odeJacobianCalls = *array++;
+	odeSteps = *array++;
+	layers = *array++;
+	integratedLayers = *array++;
+	propagatedLayers = *array++;
+	trialLoopTime = *array++;
+	trialMeanThreadTime = *array++;
+	trialMaxThreadTime = *array++;
+}
+
+
+void PEProfileLog::record(int step, int rank, const PESolverProfile& profile) {
+	steps_.push_back(step);
+	ranks_.push_back(rank);
+	profiles_.push_back(profile);
+}
+
+PESolverProfile PEProfileLog::total() const {
+	PESolverProfile total;
+	for(int i=0, cc=profiles_.size(); i<cc; ++i)
+		total.add(profiles_[i]);
+	return total;
+}
+
+void PEProfileLog::toDoubleArray(std::vector<double>& array) const {
+	int pointSize = pointArraySize();
+	array.resize(size()*pointSize);
+	for(int i=0, cc=size(); i<cc; ++i) {
+		array[i*pointSize] = steps_[i];
+		array[i*pointSize + 1] = ranks_[i];
+		profiles_[i].toDoubleArray(&array[i*pointSize + 2]);
+	}
+}
+
+void PEProfileLog::recordFromDoubleArray(const double* array, int numPoints) {
+	int pointSize = pointArraySize();
+	for(int i=0; i<numPoints; ++i) {
+		PESolverProfile profile;
+		profile.fromDoubleArray(array + i*pointSize + 2);
+		record(int(array[i*pointSize]), int(array[i*pointSize + 1]), profile);
+	}
+}
+
+void PEProfileLog::writeJSONValues(std::ostream& os, const PESolverProfile& profile) {
+	std::vector<std::string> names = PESolverProfile::valueNames();
+	std::vector<double> values = profile.values();
+	os << "\"threads\": " << profile.threads;
+	for(int i=0, cc=names.size(); i<cc; ++i)
+		os << ", \"" << names[i] << "\": " << values[i];
+}
+
+void PEProfileLog::writeCSVValues(std::ostream& os, const PESolverProfile& profile) {
+	std::vector<double> values = profile.values();
+	os << "," << profile.threads;
+	for(int i=0, cc=values.size(); i<cc; ++i)
+		os << "," << values[i];
+}
+
+bool PEProfileLog::write(const std::string& fileName, Format format, int numProcesses, double runTime) const {
+	std::ofstream of(fileName.c_str(), std::ios::out | std::ios::trunc);
+	if(!of.is_open())
+		return false;
+	of << std::setprecision(9);
+
+	// points in step order, and the total for each process.
+	std::vector<std::pair<int, int> > order;
+	for(int i=0, cc=size(); i<cc; ++i)
+		order.push_back(std::make_pair(steps_[i], i));
+	std::sort(order.begin(), order.end());
+	std::vector<PESolverProfile> processTotals(numProcesses);
+	for(int i=0, cc=size(); i<cc; ++i)
+		if(ranks_[i] >= 0 && ranks_[i] < numProcesses)
+			processTotals[ranks_[i]].add(profiles_[i]);
+
+	if(format == JSONFormat) {
+		of << "{\n\"runTime\": " << runTime << ",\n\"processes\": " << numProcesses << ",\n";
+		of << "\"total\": {";
+		writeJSONValues(of, total());
+		of << "},\n\"processTotals\": [\n";
+		for(int r=0; r<numProcesses; ++r) {
+			of << "  {\"rank\": " << r << ", ";
+			writeJSONValues(of, processTotals[r]);
+			of << (r == numProcesses-1 ? "}\n" : "},\n");
+		}
+		of << "],\n\"points\": [\n";
+		for(int k=0, cc=order.size(); k<cc; ++k) {
+			const PESolverProfile& p = profiles_[order[k].second];
+			of << "  {\"step\": " << order[k].first << ", \"rank\": " << ranks_[order[k].second] << ", \"status\": " << p.status << ", \"wavelength\": " << p.wavelength << ", \"incidenceDeg\": " << p.incidenceDeg << ", ";
+			writeJSONValues(of, p);
+			of << (k == cc-1 ? "}\n" : "},\n");
+		}
+		of << "]\n}\n";
+	}
+	else {
+		// CSV: per-point rows first. The per-process totals and the total have "total" in the step column, and no point identification.
+		std::vector<std::string> names = PESolverProfile::valueNames();
+		of << "step,rank,status,wavelength,incidenceDeg,threads";
+		for(int i=0, cc=names.size(); i<cc; ++i)
+			of << "," << names[i];
+		of << "\n";
+		for(int k=0, cc=order.size(); k<cc; ++k) {
+			const PESolverProfile& p = profiles_[order[k].second];
+			of << order[k].first << "," << ranks_[order[k].second] << "," << p.status << "," << p.wavelength << "," << p.incidenceDeg;
+			writeCSVValues(of, p);
+			of << "\n";
+		}
+		for(int r=0; r<numProcesses; ++r) {
+			of << "total," << r << ",,,";
+			writeCSVValues(of, processTotals[r]);
+			of << "\n";
+		}
+		of << "total,,,,";
+		writeCSVValues(of, total());
+		of << "\n";
+	}
+
+	of.close();
+	return !of.fail();
+}
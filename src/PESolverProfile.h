@@ -0,0 +1,122 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PESOLVERPROFILE_H
+#define PESOLVERPROFILE_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+/// Instrumentation for grating calculations: what a solver context (PESolver) did and how long it took, for one point or added up over many.
+/*! PESolver fills in one profile for every getEff() (see PESolver::lastProfile()), and getEffBatch() can return the profile of each point.  Profiles can be added together with add(), and packed into plain double arrays for MPI communication with toDoubleArray().
+
+The phase times are wall times measured on the thread that runs the calculation; the trial-solution times measure how busy each thread was inside the parallel loops over trial solutions, to show the load imbalance between threads.*/
+class PESolverProfile {
+public:
+	/// Phases of a calculation, as timed in phaseTime.
+	enum Phase {
+		AllocationPhase,	///< Allocating the solver context's memory (only counted for the first calculation of a context).
+		RefractiveIndexPhase,	///< Looking up the refractive indices.
+		LayersPhase,	///< Computing alpha_n, beta_n, and the layers.
+		IntegrationPhase,	///< Computing the T-matrix of every layer: integrating (or propagating) the trial solutions.
+		MatrixPhase,	///< The S-matrix recursion.
+		EfficiencyPhase,	///< Computing the Rayleigh coefficients and efficiencies from the S-matrix.
+		NumPhases
+	};
+
+	/// Constructs an empty profile.
+	PESolverProfile() { clear(); }
+	/// Resets all counters and times to 0.
+	void clear();
+	/// Adds the counters and times of \c other to this profile. The point identification (status, wavelength, incidenceDeg) is kept, and threads becomes the larger of the two.
+	void add(const PESolverProfile& other);
+
+	/// Returns the ratio of the busiest thread's time to the average thread's time in the trial-solution loops (1 means perfectly balanced), or 1 if no trial solutions were integrated.
+	double loadImbalance() const { return trialMeanThreadTime > 0 ? trialMaxThreadTime/trialMeanThreadTime : 1; }
+
+	/// Point identification, for the profile of a single point: the PEResult::Code of the result, the wavelength (um), and the incidence angle (deg).
+	int status;
+	double wavelength, incidenceDeg;
+	/// Number of threads used for the trial solutions.
+	int threads;
+
+	/// Number of points calculated, how many of them failed, and how many were found in the result cache instead.
+	double points, failures, cacheHits;
+	/// Wall time (s) spent in each Phase, and in total.
+	double phaseTime[NumPhases];
+	double totalTime;
+	/// Number of ODE right-hand side evaluations, Jacobian evaluations, and integration steps.
+	double odeFunctionCalls, odeJacobianCalls, odeSteps;
+	/// Number of layers, and how many of them were integrated numerically or crossed with the layer propagator.
+	double layers, integratedLayers, propagatedLayers;
+	/// For the layers that were integrated numerically: the wall time of the parallel loops over trial solutions, the average busy time of a thread within them, and the busy time of the busiest thread (all added up over the layers).
+	double trialLoopTime, trialMeanThreadTime, trialMaxThreadTime;
+
+	/// Returns the name of a \c phase, as used in the output files: "allocation", "refractiveIndex", etc.
+	static const char* phaseName(Phase phase);
+
+	/// Number of doubles used by toDoubleArray().
+	static int arraySize();
+	/// Packs the profile into a plain double \c array, which must have room for arraySize() elements.
+	void toDoubleArray(double* array) const;
+	/// Unpacks the profile from an \c array filled by toDoubleArray().
+	void fromDoubleArray(const double* array);
+
+	/// Returns the names of the counter and time fields (everything but the point identification) in the order of values().
+	static std::vector<std::string> valueNames();
+	/// Returns the counter and time fields, and the loadImbalance(), in the order of valueNames().
+	std::vector<double> values() const;
+};
+
+/// Collects the profiles of the points in a scan, and writes them to a JSON or CSV file.
+class PEProfileLog {
+public:
+	/// Output formats for write().
+	enum Format { JSONFormat, CSVFormat };
+
+	/// Adds the \c profile of calculation step \c step, calculated by MPI process \c rank.
+	void record(int step, int rank, const PESolverProfile& profile);
+	/// Number of recorded points.
+	int size() const { return int(steps_.size()); }
+	/// Returns all recorded profiles added together.
+	PESolverProfile total() const;
+
+	/// Number of doubles used by toDoubleArray() for each point.
+	static int pointArraySize() { return 2 + PESolverProfile::arraySize(); }
+	/// Packs all recorded points into \c array (resized to size()*pointArraySize()).
+	void toDoubleArray(std::vector<double>& array) const;
+	/// Records \c numPoints points from an \c array filled by toDoubleArray().
+	void recordFromDoubleArray(const double* array, int numPoints);
+
+	/// Writes the profiles to \c fileName in \c format. The JSON file contains the total, a total for each of \c numProcesses processes, and each point (in step order); the CSV file contains one row for each point, followed by the per-process totals and the total. \c runTime is the wall time of the whole run. Returns false if the file could not be written.
+	bool write(const std::string& fileName, Format format, int numProcesses, double runTime) const;
+
+protected:
+	std::vector<int> steps_, ranks_;
+	std::vector<PESolverProfile> profiles_;
+
+	/// Writes the values of \c profile as the members of a JSON object (without the braces).
+	static void writeJSONValues(std::ostream& os, const PESolverProfile& profile);
+	/// Writes the values of \c profile as CSV columns, each preceded by a comma.
+	static void writeCSVValues(std::ostream& os, const PESolverProfile& profile);
+};
+
+#endif // PESOLVERPROFILE_H
@@ -0,0 +1,746 @@
+/*
+Copyright 2012 Mark Boots (mark.boots@usask.ca).
+
+This file is part of the Parallel Efficiency of Gratings project ("PEG").
+
+PEG is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+PEG is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with PEG.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "PEG.h"
+#include "PESolver.h"
+#include "PEMainSupport.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <map>
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <omp.h>
+
+/// This program benchmarks the hot paths of the solver, and checks the calculated efficiencies against stored reference results, so that optimizations can be measured and checked for numerical regressions.
+/*!
+<b>Usage</b>
+
+\code
+./pegBenchmark [--run micro,getEff,threads,polarization,reference] [--quick] [--threads <maxThreads>] [--minTime <seconds>] [--reference <file>] [--writeReference] [--tolerance <tolerance>]
+\endcode
+
+Run it from the directory that contains the materialDatabase (normally the top of the repository).  The benchmarks are:
+
+- micro: time per call of PEGrating::computeK2StepsAtY(), PESolver::computeGratingExpansion(), PESolver::odeFunction(), and PESolver::odeJacobian() (N = 15) for each benchmark grating: blazed, rectangular, sinusoidal, trapezoidal (as a custom profile), a coated blazed grating, and custom profiles with 11 and 201 vertices (uncoated and coated).
+- getEff: time per point, ODE function calls, and layers for a full PESolver::getEff() at N = 5, 15, 30, and 60 for each benchmark grating.
+- polarization: time per point of a full getEff() at N = 15 for each benchmark grating, with TE only and with TE and TM (PEMathOptions::TEAndTMPolarization), and where the extra time for TM goes: into integrating the TM trial solutions together with the TE ones, or the TM S-matrix recursion.  The TM shares are the differences between the two calculations, and so are the extra integration steps that the TM fields take under the shared step-size control.
+- threads: OpenMP thread scaling of a single getEff() at N = 30, and of getEffBatch() over 16 points at N = 5, from 1 thread up to --threads (default: the number of processors).
+- reference: calculates each benchmark grating at N = 15 and two wavelengths with the default math options, and compares the efficiencies to the --reference file (default: benchmarkData/reference.txt). The largest difference in any order must be within --tolerance (default 1e-4). With --writeReference, the reference file is written instead.  It also checks that result records (for the output, checkpoint, and MPI messages) round-trip through PEResult::toDoubleArray() and fromDoubleArray(), and through a binary output file, for a failed result and an --adaptiveN result with TM efficiencies.  Finally, it checks the integration step counts of the solver profile over two points, that the step size carried over by --warmStart is the average step that each integration actually took, and that calculating TM too (which shares the step-size control with TE) only changes the TE efficiencies within --tolerance.
+
+By default, everything is run. --quick limits getEff to N = 5 and 15, and the thread scaling to N = 15. Each timed measurement is repeated until it takes at least --minTime seconds (default 0.2).
+
+The program returns 0, or 1 if the reference comparison failed.
+*/
+
+/// A grating used for benchmarking and its name.
+struct PEBenchmarkGrating {
+	std::string name;
+	PEGrating* grating;
+};
+
+/// Options for this program.
+struct PEBenchmarkOptions {
+	bool runMicro, runGetEff, runThreads, runPolarization, runReference;
+	bool quick;
+	int maxThreads;
+	double minTime;
+	std::string referenceFile;
+	bool writeReference;
+	double tolerance;
+};
+
+static bool parseOptions(int argc, char** argv, PEBenchmarkOptions& o);
+static std::vector<PEBenchmarkGrating> createGratings();
+static void benchmarkMicro(const PEBenchmarkOptions& o, const std::vector<PEBenchmarkGrating>& gratings);
+static void benchmarkGetEff(const PEBenchmarkOptions& o, const std::vector<PEBenchmarkGrating>& gratings);
+static void benchmarkThreads(const PEBenchmarkOptions& o, const std::vector<PEBenchmarkGrating>& gratings);
+static void benchmarkPolarization(const PEBenchmarkOptions& o, const std::vector<PEBenchmarkGrating>& gratings);
+static bool checkReference(const PEBenchmarkOptions& o, const std::vector<PEBenchmarkGrating>& gratings);
+static bool checkRecords();
+static bool checkODESteps(const std::vector<PEBenchmarkGrating>& gratings);
+static bool checkWarmStartSteps(const std::vector<PEBenchmarkGrating>& gratings);
+static bool checkTEWithTM(const PEBenchmarkOptions& o, const std::vector<PEBenchmarkGrating>& gratings);
+
+/// The wavelength (um), and incidence angle (deg) that the benchmarks use: 100 eV at 88 deg.
+static const double peBenchmarkWavelength = M_HC / 100;
+static const double peBenchmarkIncidence = 88;
+
+int main(int argc, char** argv) {
+
+	PEBenchmarkOptions o;
+	if(!parseOptions(argc, argv, o))
+		return -1;
+
+	// PESolver::getEffBatch() runs the trial solutions in parallel regions nested inside the one over points.
+	omp_set_max_active_levels(2);
+
+	std::vector<std::string> materials;
+	materials.push_back("Au");
+	materials.push_back("Pt");
+	materials.push_back("Ni");
+	materials.push_back("NiO");
+	if(PEMaterialDatabase::preload(materials) != int(materials.size())) {
+		std::cerr << "Could not find the refractive index data in " << PEG_MATERIALS_DB_PATH << ". Run pegBenchmark from the directory that contains it." << std::endl;
+		return -1;
+	}
+
+	std::vector<PEBenchmarkGrating> gratings = createGratings();
+	std::cout << std::setprecision(4);
+
+	if(o.runMicro)
+		benchmarkMicro(o, gratings);
+	if(o.runGetEff)
+		benchmarkGetEff(o, gratings);
+	if(o.runThreads)
+		benchmarkThreads(o, gratings);
+	if(o.runPolarization)
+		benchmarkPolarization(o, gratings);
+	bool referenceOk = true;
+	if(o.runReference) {
+		referenceOk = checkReference(o, gratings);
+		if(!o.writeReference) {
+			referenceOk = checkRecords() && referenceOk;
+			referenceOk = checkODESteps(gratings) && referenceOk;
+			referenceOk = checkWarmStartSteps(gratings) && referenceOk;
+			referenceOk = checkTEWithTM(o, gratings) && referenceOk;
+		}
+	}
+
+	for(int i=0, cc=gratings.size(); i<cc; ++i)
+		delete gratings[i].grating;
+
+	return referenceOk ? 0 : 1;
+}
+
+static bool parseOptions(int argc, char** argv, PEBenchmarkOptions& o) {
+	o.runMicro = o.runGetEff = o.runThreads = o.runPolarization = o.runReference = true;
+	o.quick = false;
+	o.maxThreads = omp_get_num_procs();
+	o.minTime = 0.2;
+	o.referenceFile = "benchmarkData/reference.txt";
+	o.writeReference = false;
+	o.tolerance = 1e-4;
+
+	static struct option long_options[] = {
+		{"run", required_argument, 0, 1},
+		{"quick", no_argument, 0, 2},
+		{"threads", required_argument, 0, 3},
+		{"minTime", required_argument, 0, 4},
+		{"reference", required_argument, 0, 5},
+		{"writeReference", no_argument, 0, 6},
+		{"tolerance", required_argument, 0, 7},
+		{0, 0, 0, 0}
+	};
+
+	while(true) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "", long_options, &option_index);
+		if(c == -1)
+			break;
+
+		switch(c) {
+		case 1: {
+			std::string run = std::string(",") + optarg + ",";
+			o.runMicro = run.find(",micro,") != std::string::npos;
+			o.runGetEff = run.find(",getEff,") != std::string::npos;
+			o.runThreads = run.find(",threads,") != std::string::npos;
+			o.runPolarization = run.find(",polarization,") != std::string::npos;
+			o.runReference = run.find(",reference,") != std::string::npos;
+			break;
+		}
+		case 2:
+			o.quick = true;
+			break;
+		case 3:
+			o.maxThreads = atoi(optarg);
+			break;
+		case 4:
+			o.minTime = atof(optarg);
+			break;
+		case 5:
+			o.referenceFile = optarg;
+			break;
+		case 6:
+			o.writeReference = true;
+			break;
+		case 7:
+			o.tolerance = atof(optarg);
+			break;
+		default:
+			std::cerr << "Usage: pegBenchmark [--run micro,getEff,threads,polarization,reference] [--quick] [--threads <maxThreads>] [--minTime <seconds>] [--reference <file>] [--writeReference] [--tolerance <tolerance>]" << std::endl;
+			return false;
+		}
+	}
+
+	if(o.maxThreads < 1) {
+		std::cerr << "The maximum number of --threads must be at least 1." << std::endl;
+		return false;
+	}
+	return true;
+}
+
+/// Helper function: returns the geometry for a custom profile with \c numBumps smooth bumps, sampled at \c numPoints + 1 vertices, and \c maxHeight (um).
+static std::vector<double> customGeometry(double maxHeight, int numBumps, int numPoints) {
+	std::vector<double> geometry;
+	geometry.push_back(maxHeight);
+	for(int i=0; i<=numPoints; ++i) {
+		double x = double(i)/numPoints;
+		geometry.push_back(x);
+		geometry.push_back(i == numPoints ? 0 : 0.5*(1 - cos(2*M_PI*numBumps*x)));
+	}
+	return geometry;
+}
+
+/// Helper function: returns the geometry for a custom profile with a trapezoid of height 0.02 um, valley width 0.4 um, and 10 and 30 deg. flanks.
+static std::vector<double> trapezoidGeometry() {
+	double height = 0.02;
+	double xPoints[] = { 0, 0.4, 0.4 + height/tan(10*M_PI/180), 1 - height/tan(30*M_PI/180), 1 };
+	double yPoints[] = { 0, 0, 1, 1, 0 };
+	std::vector<double> geometry;
+	geometry.push_back(height);
+	for(int i=0; i<5; ++i) {
+		geometry.push_back(xPoints[i]);
+		geometry.push_back(yPoints[i]);
+	}
+	return geometry;
+}
+
+static std::vector<PEBenchmarkGrating> createGratings() {
+	std::vector<PEBenchmarkGrating> gratings;
+	PEBenchmarkGrating g;
+
+	g.name = "blazed";
+	g.grating = new PEBlazedGrating(1, 2.5, 30, "Au");
+	gratings.push_back(g);
+	g.name = "rectangular";
+	g.grating = new PERectangularGrating(1, 0.02, 0.5, "Pt");
+	gratings.push_back(g);
+	g.name = "sinusoidal";
+	g.grating = new PESinusoidalGrating(1, 0.02, "Au");
+	gratings.push_back(g);
+	g.name = "trapezoidal";	// PETrapezoidalGrating is not implemented yet, so this is a custom profile: valley width 0.4 um, 10 and 30 deg. flanks, and height 0.02 um.
+	g.grating = new PECustomProfileGrating(1, trapezoidGeometry(), "Au");
+	gratings.push_back(g);
+	g.name = "coatedBlazed";
+	g.grating = new PEBlazedGrating(1, 2.5, 30, "Ni", "NiO", 0.004);
+	gratings.push_back(g);
+	g.name = "custom11";
+	g.grating = new PECustomProfileGrating(1, customGeometry(0.02, 1, 10), "Au");
+	gratings.push_back(g);
+	g.name = "custom201";
+	g.grating = new PECustomProfileGrating(1, customGeometry(0.02, 4, 200), "Au");
+	gratings.push_back(g);
+	g.name = "coatedCustom201";
+	g.grating = new PECustomProfileGrating(1, customGeometry(0.02, 4, 200), "Ni", "NiO", 0.004);
+	gratings.push_back(g);
+
+	return gratings;
+}
+
+/// Helper class for the micro-benchmarks: a function to call repeatedly.
+class PEBenchmarkFunction {
+public:
+	virtual ~PEBenchmarkFunction() {}
+	/// Makes call number \c i.
+	virtual void call(int i) = 0;
+};
+
+/// Calls \c f repeatedly (doubling the number of calls) until it takes at least \c minTime seconds, and returns the time per call in ns.
+static double timePerCall(PEBenchmarkFunction& f, double minTime) {
+	for(int calls=16; ; calls*=2) {
+		double startTime = omp_get_wtime();
+		for(int i=0; i<calls; ++i)
+			f.call(i);
+		double time = omp_get_wtime() - startTime;
+		if(time >= minTime || calls >= (1<<30))
+			return time/calls*1e9;
+	}
+}
+
+/// Calls PEGrating::computeK2StepsAtY() at 16 heights across the grating.
+class PEK2StepsBenchmark : public PEBenchmarkFunction {
+public:
+	PEK2StepsBenchmark(const PEGrating& g) : g_(g), stepsX_(g.maxK2Steps()), stepsK2_(g.maxK2Steps()) {}
+	virtual void call(int i) {
+		double y = g_.totalHeight()*((i%16) + 0.5)/16;
+		numSteps_ += g_.computeK2StepsAtY(y, gsl_complex_rect(1, 0), gsl_complex_rect(0.8, 0.03), gsl_complex_rect(0.9, 0.01), &stepsX_[0], &stepsK2_[0]);
+	}
+	int numSteps_;
+protected:
+	const PEGrating& g_;
+	std::vector<double> stepsX_;
+	std::vector<gsl_complex> stepsK2_;
+};
+
+/// Calls PESolver::computeGratingExpansion() at 16 heights in the current layer.
+class PEExpansionBenchmark : public PEBenchmarkFunction {
+public:
+	PEExpansionBenchmark(PESolver& s, double yStart, double yEnd) : s_(s), yStart_(yStart), yEnd_(yEnd), k2_(2*s.N()+1) {}
+	virtual void call(int i) {
+		s_.computeGratingExpansion(yStart_ + (yEnd_ - yStart_)*((i%16) + 0.5)/16, &k2_[0]);
+	}
+protected:
+	PESolver& s_;
+	double yStart_, yEnd_;
+	std::vector<gsl_complex> k2_;
+};
+
+/// Calls PESolver::odeFunction() or PESolver::odeJacobian() at 16 heights in the current layer.
+class PEODEBenchmark : public PEBenchmarkFunction {
+public:
+	PEODEBenchmark(PESolver& s, double yStart, double yEnd, bool jacobian) : s_(s), yStart_(yStart), yEnd_(yEnd), jacobian_(jacobian) {
+		int size = 8*s.N() + 4;
+		w_.resize(size);
+		f_.resize(size);
+		if(jacobian)
+			dfdw_.resize(size*size);
+		for(int i=0; i<size; ++i)
+			w_[i] = sin(i + 1.0);
+	}
+	virtual void call(int i) {
+		double y = yStart_ + (yEnd_ - yStart_)*((i%16) + 0.5)/16;
+		if(jacobian_)
+			s_.odeJacobian(y, &w_[0], &dfdw_[0], &f_[0]);
+		else
+			s_.odeFunction(y, &w_[0], &f_[0]);
+	}
+protected:
+	PESolver& s_;
+	double yStart_, yEnd_;
+	bool jacobian_;
+	std::vector<double> w_, f_, dfdw_;
+};
+
+static void benchmarkMicro(const PEBenchmarkOptions& o, const std::vector<PEBenchmarkGrating>& gratings) {
+	std::cout << "Micro-benchmarks (ns per call; N = 15, middle layer):" << std::endl;
+	std::cout << std::setw(16) << "grating" << std::setw(18) << "k2StepsAtY" << std::setw(18) << "gratingExpansion" << std::setw(14) << "odeFunction" << std::setw(14) << "odeJacobian" << std::endl;
+
+	for(int i=0, cc=gratings.size(); i<cc; ++i) {
+		const PEGrating& g = *gratings[i].grating;
+
+		PEK2StepsBenchmark k2Steps(g);
+		k2Steps.numSteps_ = 0;
+		double k2StepsTime = timePerCall(k2Steps, o.minTime);
+
+		PESolver solver(g, PEMathOptions(15), 1);
+		if(solver.prepareForLayer(peBenchmarkIncidence, peBenchmarkWavelength, 2) != PEResult::Success) {
+			std::cout << std::setw(16) << gratings[i].name << "   (could not set up the solver)" << std::endl;
+			continue;
+		}
+		int m = 2 + solver.numLayers()/2;
+		solver.prepareForLayer(peBenchmarkIncidence, peBenchmarkWavelength, m);
+		double yStart = solver.layerBoundary(m-1), yEnd = solver.layerBoundary(m);
+
+		PEExpansionBenchmark expansion(solver, yStart, yEnd);
+		PEODEBenchmark function(solver, yStart, yEnd, false);
+		PEODEBenchmark jacobian(solver, yStart, yEnd, true);
+		double expansionTime = timePerCall(expansion, o.minTime);
+		double functionTime = timePerCall(function, o.minTime);
+		double jacobianTime = timePerCall(jacobian, o.minTime);
+
+		std::cout << std::setw(16) << gratings[i].name << std::setw(18) << k2StepsTime << std::setw(18) << expansionTime << std::setw(14) << functionTime << std::setw(14) << jacobianTime << std::endl;
+	}
+	std::cout << std::endl;
+}
+
+/// Calculates the standard benchmark point with \c solver repeatedly for at least \c minTime seconds, and returns the time per point (s). \c profile is set to the profile of the last calculation.
+static double timeGetEff(PESolver& solver, double minTime, PESolverProfile& profile) {
+	int calls = 0;
+	double startTime = omp_get_wtime(), time;
+	do {
+		solver.getEff(peBenchmarkIncidence, peBenchmarkWavelength);
+		++calls;
+		time = omp_get_wtime() - startTime;
+	} while(time < minTime);
+	profile = solver.lastProfile();
+	return time/calls;
+}
+
+static void benchmarkGetEff(const PEBenchmarkOptions& o, const std::vector<PEBenchmarkGrating>& gratings) {
+	std::vector<int> Ns;
+	Ns.push_back(5);
+	Ns.push_back(15);
+	if(!o.quick) {
+		Ns.push_back(30);
+		Ns.push_back(60);
+	}
+
+	std::cout << "Full getEff() (1 thread):" << std::endl;
+	std::cout << std::setw(16) << "grating" << std::setw(6) << "N" << std::setw(14) << "time (s)" << std::setw(14) << "odeCalls" << std::setw(10) << "layers" << std::setw(12) << "status" << std::endl;
+	for(int i=0, cc=gratings.size(); i<cc; ++i) {
+		for(int n=0, cn=Ns.size(); n<cn; ++n) {
+			PESolver solver(*gratings[i].grating, PEMathOptions(Ns[n]), 1);
+			PESolverProfile profile;
+			double time = timeGetEff(solver, o.minTime, profile);
+			std::cout << std::setw(16) << gratings[i].name << std::setw(6) << Ns[n] << std::setw(14) << time << std::setw(14) << long(profile.odeFunctionCalls) << std::setw(10) << profile.layers << std::setw(12) << (profile.status == PEResult::Success ? "ok" : "failed") << std::endl;
+		}
+	}
+	std::cout << std::endl;
+}
+
+static void benchmarkThreads(const PEBenchmarkOptions& o, const std::vector<PEBenchmarkGrating>& gratings) {
+	const PEGrating& g = *gratings[0].grating;
+	int N = o.quick ? 15 : 30;
+
+	std::vector<int> threads;
+	for(int t=1; t<o.maxThreads; t*=2)
+		threads.push_back(t);
+	threads.push_back(o.maxThreads);
+
+	// a batch of points across a wavelength scan:
+	std::vector<PEScanPoint> points;
+	for(int i=0; i<16; ++i)
+		points.push_back(PEScanPoint(peBenchmarkIncidence, M_HC/(100 + 5*i)));
+
+	std::cout << "Thread scaling (" << gratings[0].name << "): getEff() at N = " << N << ", and getEffBatch() of " << points.size() << " points at N = 5:" << std::endl;
+	std::cout << std::setw(8) << "threads" << std::setw(14) << "getEff (s)" << std::setw(10) << "speedup" << std::setw(12) << "imbalance" << std::setw(14) << "batch (s)" << std::setw(10) << "speedup" << std::endl;
+
+	double serialTime = 0, serialBatchTime = 0;
+	for(int t=0, cc=threads.size(); t<cc; ++t) {
+		PESolver solver(g, PEMathOptions(N), threads[t]);
+		PESolverProfile profile;
+		double time = timeGetEff(solver, o.minTime, profile);
+
+		PESolver batchSolver(g, PEMathOptions(5), threads[t]);
+		int batches = 0;
+		double startTime = omp_get_wtime(), batchTime;
+		do {
+			batchSolver.getEffBatch(points);
+			++batches;
+			batchTime = omp_get_wtime() - startTime;
+		} while(batchTime < o.minTime);
+		batchTime /= batches;
+
+		if(t == 0) {
+			serialTime = time;
+			serialBatchTime = batchTime;
+		}
+		std::cout << std::setw(8) << threads[t] << std::setw(14) << time << std::setw(10) << serialTime/time << std::setw(12) << profile.loadImbalance() << std::setw(14) << batchTime << std::setw(10) << serialBatchTime/batchTime << std::endl;
+	}
+	std::cout << std::endl;
+}
+
+static void benchmarkPolarization(const PEBenchmarkOptions& o, const std::vector<PEBenchmarkGrating>& gratings) {
+	const int N = 15;
+	PEMathOptions teOptions(N), bothOptions(N);
+	bothOptions.polarization = PEMathOptions::TEAndTMPolarization;
+
+	std::cout << "TE and TM polarization: getEff() at N = " << N << " (1 thread), and the extra time for TM:" << std::endl;
+	std::cout << std::setw(16) << "grating" << std::setw(12) << "TE (s)" << std::setw(12) << "TE+TM (s)" << std::setw(8) << "ratio" << std::setw(16) << "TM integ. (s)" << std::setw(16) << "TM matrix (s)" << std::setw(12) << "TE steps" << std::setw(12) << "extra steps" << std::endl;
+	for(int i=0, cc=gratings.size(); i<cc; ++i) {
+		PESolver teSolver(*gratings[i].grating, teOptions, 1);
+		PESolver bothSolver(*gratings[i].grating, bothOptions, 1);
+		PESolverProfile teProfile, bothProfile;
+		double teTime = timeGetEff(teSolver, o.minTime, teProfile);
+		double bothTime = timeGetEff(bothSolver, o.minTime, bothProfile);
+		double tmIntegration = bothProfile.phaseTime[PESolverProfile::IntegrationPhase] - teProfile.phaseTime[PESolverProfile::IntegrationPhase];
+		double tmMatrix = bothProfile.phaseTime[PESolverProfile::MatrixPhase] - teProfile.phaseTime[PESolverProfile::MatrixPhase];
+		std::cout << std::setw(16) << gratings[i].name << std::setw(12) << teTime << std::setw(12) << bothTime << std::setw(8) << bothTime/teTime << std::setw(16) << tmIntegration << std::setw(16) << tmMatrix << std::setw(12) << long(teProfile.odeSteps) << std::setw(12) << long(bothProfile.odeSteps - teProfile.odeSteps) << std::endl;
+	}
+	std::cout << std::endl;
+}
+
+/// The reference cases: each benchmark grating at N = 15, at these photon energies (eV).
+static const double peReferenceEnergies[] = { 100, 250 };
+static const int peReferenceN = 15;
+
+static bool checkReference(const PEBenchmarkOptions& o, const std::vector<PEBenchmarkGrating>& gratings) {
+
+	// calculate all the reference cases:
+	std::vector<std::string> names;
+	std::vector<PEResult> results;
+	for(int i=0, cc=gratings.size(); i<cc; ++i) {
+		PESolver solver(*gratings[i].grating, PEMathOptions(peReferenceN), o.maxThreads);
+		for(int e=0; e<2; ++e) {
+			std::ostringstream name;
+			name << gratings[i].name << "@" << peReferenceEnergies[e] << "eV";
+			names.push_back(name.str());
+			results.push_back(solver.getEff(peBenchmarkIncidence, M_HC/peReferenceEnergies[e]));
+		}
+	}
+
+	if(o.writeReference) {
+		std::ofstream of(o.referenceFile.c_str());
+		if(!of.is_open()) {
+			std::cerr << "Could not write the reference file " << o.referenceFile << std::endl;
+			return false;
+		}
+		of << "# pegBenchmark reference efficiencies: N = " << peReferenceN << ", incidence " << peBenchmarkIncidence << " deg, default math options. Regenerate with pegBenchmark --writeReference." << std::endl;
+		of << "# case\tstatus\tefficiencies from order -N to N" << std::endl;
+		of << std::setprecision(14);
+		for(int i=0, cc=names.size(); i<cc; ++i) {
+			of << names[i] << "\t" << results[i].status;
+			for(int j=0, cj=results[i].eff.size(); j<cj; ++j)
+				of << "\t" << results[i].eff[j];
+			of << std::endl;
+		}
+		std::cout << "Wrote " << names.size() << " reference results to " << o.referenceFile << std::endl;
+		return true;
+	}
+
+	// read the reference file:
+	std::ifstream f(o.referenceFile.c_str());
+	if(!f.is_open()) {
+		std::cerr << "Could not read the reference file " << o.referenceFile << std::endl;
+		return false;
+	}
+	std::map<std::string, std::vector<double> > reference;
+	std::string line;
+	while(std::getline(f, line)) {
+		if(line.empty() || line[0] == '#')
+			continue;
+		std::istringstream ss(line);
+		std::string name;
+		ss >> name;
+		std::vector<double> values;
+		double v;
+		while(ss >> v)
+			values.push_back(v);
+		reference[name] = values;
+	}
+
+	std::cout << "Reference comparison (" << o.referenceFile << ", tolerance " << o.tolerance << "):" << std::endl;
+	bool allOk = true;
+	for(int i=0, cc=names.size(); i<cc; ++i) {
+		std::map<std::string, std::vector<double> >::const_iterator it = reference.find(names[i]);
+		std::cout << std::setw(24) << names[i];
+		if(it == reference.end()) {
+			std::cout << "   MISSING (not in the reference file)" << std::endl;
+			allOk = false;
+			continue;
+		}
+		const std::vector<double>& ref = it->second;
+		if(ref.empty() || int(ref[0]) != results[i].status || ref.size() != results[i].eff.size() + 1) {
+			std::cout << "   FAILED: status " << results[i].status << " (reference: " << (ref.empty() ? -1 : int(ref[0])) << ")" << std::endl;
+			allOk = false;
+			continue;
+		}
+		double maxDifference = 0;
+		for(int j=0, cj=results[i].eff.size(); j<cj; ++j)
+			maxDifference = std::max(maxDifference, fabs(results[i].eff[j] - ref[j+1]));
+		bool ok = maxDifference <= o.tolerance;
+		std::cout << "   " << (ok ? "ok" : "FAILED") << ": max. difference " << maxDifference << std::endl;
+		allOk = allOk && ok;
+	}
+	std::cout << (allOk ? "All reference results match." : "Some reference results do NOT match.") << std::endl;
+	return allOk;
+}
+
+// Returns true if \c a and \c b are exactly the same result.
+static bool sameResult(const PEResult& a, const PEResult& b) {
+	return a.status == b.status && a.wavelength == b.wavelength && a.incidenceDeg == b.incidenceDeg && a.eff == b.eff && a.effTM == b.effTM && a.usedN == b.usedN && a.truncationError == b.truncationError;
+}
+
+static bool checkRecords() {
+	const int N = 15;
+	// a failed result, and an --adaptiveN result that stopped at N = 6, both with TM:
+	std::vector<std::string> names;
+	std::vector<PEResult> results;
+	PEResult failed(PEResult::ConvergenceFailure);
+	failed.wavelength = peBenchmarkWavelength;
+	failed.incidenceDeg = peBenchmarkIncidence;
+	names.push_back("failed");
+	results.push_back(failed);
+	PEResult adaptive(N);
+	adaptive.wavelength = M_HC / peReferenceEnergies[1];
+	adaptive.incidenceDeg = peBenchmarkIncidence;
+	adaptive.effTM.resize(2*N+1);
+	adaptive.usedN = 6;
+	adaptive.truncationError = 2e-5;
+	for(int j=N-adaptive.usedN; j<=N+adaptive.usedN; ++j) {
+		adaptive.eff[j] = 0.01*(j+1);
+		adaptive.effTM[j] = 0.02*(j+1);
+	}
+	names.push_back("adaptiveN");
+	results.push_back(adaptive);
+
+	// pack them, starting from garbage to check that every field is written:
+	int length = PEResult::recordLength(N, true);
+	std::vector<double> records(results.size()*length, -99.0);
+	std::cout << "Result records (N = " << N << ", with TM):" << std::endl;
+	bool allOk = true;
+	for(int i=0, cc=results.size(); i<cc; ++i) {
+		const double* record = &records[i*length];
+		results[i].toDoubleArray(&records[i*length], N, true);
+		// usedN and truncationError are always right after the 2N+1 efficiencies, and failures have no N or efficiencies.
+		bool ok = record[4 + 2*N+1] == results[i].usedN && record[5 + 2*N+1] == results[i].truncationError;
+		if(results[i].eff.empty()) {
+			ok = ok && record[3] == 0;
+			for(int j=0; j<2*N+1; ++j)
+				ok = ok && record[4 + j] == 0 && record[6 + 2*N+1 + j] == 0;
+		}
+		PEResult unpacked;
+		unpacked.fromDoubleArray(record, N, true);
+		ok = ok && sameResult(unpacked, results[i]);
+		std::cout << std::setw(24) << names[i] << "   " << (ok ? "ok" : "FAILED") << std::endl;
+		allOk = allOk && ok;
+	}
+
+	// write them to a binary output file, and read them back:
+	std::string fileName = "pegBenchmarkRecords.tmp";
+	std::string args = "pegBenchmark --mode constantIncidence --min 100 --max 250 --increment 150 --incidenceAngle 88 --eV --gratingType blazed --gratingPeriod 1 --gratingMaterial Au --gratingGeometry 2.5,30 --N 15 --polarization both --outputFormat binary --outputFile " + fileName;
+	std::vector<std::string> words;
+	std::istringstream ss(args);
+	std::string word;
+	while(ss >> word)
+		words.push_back(word);
+	std::vector<char*> argv;
+	for(int i=0, cc=words.size(); i<cc; ++i)
+		argv.push_back(&words[i][0]);
+	argv.push_back(0);
+	optind = 0;	// start over, after our own options.
+	PECommandLineOptions io;
+	bool ok = io.parseFromCommandLine(words.size(), &argv[0]) && io.recordLength() == length;
+	if(ok) {
+		PEOutputFileWriter writer(io);
+		ok = writer.open();
+		if(ok) {
+			for(int i=0, cc=results.size(); i<cc; ++i)
+				writer.writeResult(results[i]);
+			writer.close();
+		}
+	}
+	if(ok) {
+		std::ifstream f(fileName.c_str(), std::ios::in | std::ios::binary);
+		uint32_t textLength = 0;
+		f.seekg(12);
+		f.read((char*)&textLength, sizeof(textLength));
+		f.seekg(48 + textLength);
+		std::vector<double> written(records.size());
+		f.read((char*)&written[0], written.size()*sizeof(double));
+		ok = f && written == records;
+		for(int i=0, cc=results.size(); ok && i<cc; ++i) {
+			PEResult unpacked;
+			unpacked.fromDoubleArray(&written[i*length], N, true);
+			ok = sameResult(unpacked, results[i]);
+		}
+	}
+	remove(fileName.c_str());
+	std::cout << std::setw(24) << "binary output file" << "   " << (ok ? "ok" : "FAILED") << std::endl;
+	allOk = allOk && ok;
+
+	std::cout << (allOk ? "All result records round-trip." : "Some result records do NOT round-trip.") << std::endl;
+	return allOk;
+}
+
+static bool checkODESteps(const std::vector<PEBenchmarkGrating>& gratings) {
+	// two neighbouring points of a scan with the first (not y-invariant) grating, so that every layer is integrated:
+	PESolver solver(*gratings[0].grating, PEMathOptions(peReferenceN), 1);
+	std::cout << "ODE step counts (" << gratings[0].name << ", N = " << peReferenceN << "):" << std::endl;
+	bool allOk = true;
+	double totalSteps = 0;
+	for(int e=0; e<2; ++e) {
+		solver.getEff(peBenchmarkIncidence, M_HC/peReferenceEnergies[e]);
+		const PESolverProfile& profile = solver.lastProfile();
+		totalSteps += profile.odeSteps;
+		// every trial solution takes at least one step in every integrated layer, and every step evaluates the ODE function at least once.
+		double minSteps = profile.integratedLayers*(4*peReferenceN + 2);
+		bool ok = profile.status == PEResult::Success && profile.odeSteps >= minSteps && profile.odeSteps <= profile.odeFunctionCalls;
+		std::ostringstream name;
+		name << peReferenceEnergies[e] << "eV";
+		std::cout << std::setw(24) << name.str() << "   " << (ok ? "ok" : "FAILED") << ": " << profile.odeSteps << " steps, " << profile.odeFunctionCalls << " function calls" << std::endl;
+		allOk = allOk && ok;
+	}
+	// the profiles add up to the solver's own count:
+	bool ok = totalSteps > 0 && totalSteps == double(solver.odeSteps());
+	std::cout << std::setw(24) << "total" << "   " << (ok ? "ok" : "FAILED") << ": " << totalSteps << " steps" << std::endl;
+	allOk = allOk && ok;
+
+	std::cout << (allOk ? "All step counts are consistent." : "Some step counts are NOT consistent.") << std::endl;
+	return allOk;
+}
+
+static bool checkWarmStartSteps(const std::vector<PEBenchmarkGrating>& gratings) {
+	PESolver solver(*gratings[0].grating, PEMathOptions(peReferenceN), 1);
+	std::cout << "Warm-start step sizes (" << gratings[0].name << ", N = " << peReferenceN << "):" << std::endl;
+	if(solver.prepareForLayer(peBenchmarkIncidence, peBenchmarkWavelength, 2) != PEResult::Success) {
+		std::cout << "   FAILED: could not set up the solver" << std::endl;
+		return false;
+	}
+	int m = 2 + solver.numLayers()/2;
+	solver.prepareForLayer(peBenchmarkIncidence, peBenchmarkWavelength, m);
+	double yStart = solver.layerBoundary(m-1), yEnd = solver.layerBoundary(m);
+
+	// Integrate a few trial solutions across the layer in turn, each starting with the step the last one returned (as computeTMatrixBelowLayer() does from one scan point to the next).  The first starts cold, so the later ones usually need fewer steps than the one before.
+	std::vector<double> w(8*peReferenceN + 4);
+	double step = 0;
+	bool allOk = true;
+	for(int p=0; p<4; ++p) {
+		solver.setIntegrationStartingValues(&w[0], p, m-1);
+		unsigned long stepsBefore = solver.odeSteps();
+		PEResult::Code status = solver.integrateTrialSolutionAlongY(&w[0], yStart, yEnd, &step);
+		unsigned long steps = solver.odeSteps() - stepsBefore;
+		bool ok = status == PEResult::Success && steps > 0 && fabs(step*steps - (yEnd - yStart)) <= 1e-12*(yEnd - yStart);
+		std::ostringstream name;
+		name << "p = " << p;
+		std::cout << std::setw(24) << name.str() << "   " << (ok ? "ok" : "FAILED") << ": " << steps << " steps, returned step " << step << std::endl;
+		allOk = allOk && ok;
+	}
+
+	std::cout << (allOk ? "All warm-start steps match the steps taken." : "Some warm-start steps do NOT match the steps taken.") << std::endl;
+	return allOk;
+}
+
+static bool checkTEWithTM(const PEBenchmarkOptions& o, const std::vector<PEBenchmarkGrating>& gratings) {
+	// every benchmark grating with the default math options, and the first one also with the expansion table and with matrix integration, which have their own TM paths.
+	std::vector<std::pair<int, PEMathOptions> > cases;
+	for(int i=0, cc=gratings.size(); i<cc; ++i)
+		cases.push_back(std::make_pair(i, PEMathOptions(peReferenceN)));
+	PEMathOptions tableOptions(peReferenceN, 1e-5, 64);
+	cases.push_back(std::make_pair(0, tableOptions));
+	PEMathOptions matrixOptions(peReferenceN);
+	matrixOptions.matrixIntegration = true;
+	cases.push_back(std::make_pair(0, matrixOptions));
+
+	std::cout << "TE efficiencies with TM (N = " << peReferenceN << ", tolerance " << o.tolerance << "):" << std::endl;
+	bool allOk = true;
+	for(int c=0, cc=cases.size(); c<cc; ++c) {
+		const PEBenchmarkGrating& g = gratings[cases[c].first];
+		PEMathOptions bothOptions = cases[c].second;
+		bothOptions.polarization = PEMathOptions::TEAndTMPolarization;
+		PESolver teSolver(*g.grating, cases[c].second, 1);
+		PESolver bothSolver(*g.grating, bothOptions, 1);
+		for(int e=0; e<2; ++e) {
+			PEResult te = teSolver.getEff(peBenchmarkIncidence, M_HC/peReferenceEnergies[e]);
+			PEResult both = bothSolver.getEff(peBenchmarkIncidence, M_HC/peReferenceEnergies[e]);
+			// TE and TM share the step-size control, so the TE efficiencies can change, but no more than the integration error allowed against the reference:
+			double maxDifference = 0;
+			bool ok = te.status == PEResult::Success && both.status == te.status && both.eff.size() == te.eff.size() && both.effTM.size() == te.eff.size();
+			for(int j=0, cj=te.eff.size(); ok && j<cj; ++j)
+				maxDifference = std::max(maxDifference, fabs(both.eff[j] - te.eff[j]));
+			ok = ok && maxDifference <= o.tolerance;
+			std::ostringstream name;
+			name << g.name << "@" << peReferenceEnergies[e] << "eV" << (cases[c].second.expansionTablePoints ? " (table)" : cases[c].second.matrixIntegration ? " (matrix)" : "");
+			std::cout << std::setw(32) << name.str() << "   " << (ok ? "ok" : "FAILED") << ": max. difference " << maxDifference << std::endl;
+			allOk = allOk && ok;
+		}
+	}
+
+	std::cout << (allOk ? "TM only changes the TE efficiencies within the tolerance." : "TM changes the TE efficiencies by MORE than the tolerance.") << std::endl;
+	return allOk;
+}
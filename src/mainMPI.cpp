@@ -1,5 +1,7 @@
 #include "PEG.h"
+#include "PESolver.h"
 #include "PEMainSupport.h"
+#include "PEResultCache.h"
 
 #include <iostream>
 #include <fstream>
@@ -10,8 +12,39 @@
 #include <vector>
 #include <algorithm>
 #include <cmath>
+#include <map>
 
 #include "mpi.h"
+#include <omp.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+/// Message tags used by the dynamic schedule.
+enum PEMPITag { PEWorkTag = 1, PEResultTag = 2, PEResultLayoutTag = 3 };
+
+/// Returns the number of ints in a result layout message for a chunk of \c numSteps steps: the first step, the number of steps, and one for each step (see resultLayout()).
+static int resultLayoutSize(int numSteps) { return 2 + numSteps; }
+
+/// Returns the number of orders on each side whose efficiencies need to be sent, for the result \c record (from PEResult::toDoubleArray() with truncation index \c N). The efficiencies of the orders beyond PEResult::usedN are 0, so with --adaptiveN, only those up to usedN are sent; failures have none (0).
+static int resultLayout(const double* record, int N);
+
+/// Creates (and commits) an MPI datatype that picks the parts of \c numSteps records (with truncation index \c N, and so \c resultSize doubles each, one after the other) described by \c layout (one int per record, from resultLayout()).  The same type is used to send the records from the worker's buffer, and to receive them straight into their place in Process 0's PEResultArena; the parts that aren't sent stay 0.  Free it with MPI_Type_free().
+static MPI_Datatype createResultType(const int* layout, int numSteps, int N, int resultSize, bool withTM);
+
+/// Returns the number of threads this process should use. For --threads auto, the CPUs on each node are divided evenly between the processes running on it, and this process is bound to its share of them, so that its OpenMP threads don't compete with the other processes. (If the MPI launcher has already bound the processes to different CPUs, all of this process's CPUs are used.)  In the dynamic schedule, Process 0 only coordinates, so it uses one thread, and its share of the CPUs goes to the other processes on its node.  Also returns the number of processes on this node in \c ranksOnNode, and the total number of nodes in \c numNodes.
+static int configureThreads(const PECommandLineOptions& io, int rank, int& ranksOnNode, int& numNodes);
+
+/// Process 0 in the dynamic schedule: hands out steps to the other \c commSize-1 processes as soon as they are ready for more (chunkSizes[p] at a time for process p), and collects their results as they arrive. The results are received straight into their place in \c arena, written from there to \c outputWriter in order, and saved in \c checkpoint. Steps that were loaded from \c checkpoint are not handed out.
+static void coordinateDynamicSchedule(const PECommandLineOptions& io, const std::vector<int>& chunkSizes, PEResultArena& arena, PEOutputFileWriter& outputWriter, PECheckpointFile& checkpoint);
+
+/// Processes 1 and up in the dynamic schedule: calculates the steps handed out by Process 0 (up to \c chunkSize at a time) using \c solver, until told to stop. Shows debug output if \c showDebugOutput (and --printDebugOutput).
+static void workForDynamicSchedule(const PECommandLineOptions& io, PESolver& solver, int chunkSize, int resultSize, bool showDebugOutput, PEProfileLog* profileLog, int rank);
+
+/// Collects the profiles in every process's \c profileLog onto Process 0 (for --profile).
+static void gatherProfiles(PEProfileLog& profileLog, int rank, int commSize);
 
 /// This main program provides a command-line interface to run a set of parallel grating efficiency calculations. The results are written to an output file, and (optionally) a second file is written to provide information on the status of the calculation.  [This file is only responsible for input processing and output; all numerical details are structured within PEGrating and PESolver.]
 /*!
@@ -75,12 +108,66 @@ Output:
 --printDebugOutput
 	If this flag is included, each calculation will print intermediate results to standard output.
 
+--threads <number|auto>
+	If provided, the number of threads to use on each process. With auto, the processors on each node are divided evenly between the processes running on it, and each process is bound to its share so that the processes don't compete for the same processors. (In pegMPI's dynamic schedule, Process 0 only coordinates, so it uses one thread, and the processors on its node are divided between the other processes there.) For small N, it is usually better to run many processes with one thread each (one process per core); for large N, it is better to run fewer processes (as few as one per node) with many threads each. Default if not provided is 1.
+
+--checkpointFile <file name>
+	If provided, each completed step is saved in this file (at most every --flushInterval seconds). If the calculation is interrupted (for example, by a cluster job's walltime limit), run it again with the same options and the same --checkpointFile: the steps saved there are not calculated again. The file is only used if it was written for the same input options; otherwise it is started over.
+
+--cacheDir <directory>
+	If provided, each calculated step is stored in a result cache in this directory, and steps that are found in the cache are not calculated again (even in a different scan, as long as the grating, the math options, the roughness, and the incidence angle and wavelength are exactly the same). One cache directory can be shared by any number of runs at once, including on different cluster nodes. The cache can also be set up with the PEG_CACHE_DIR and PEG_CACHE_SIZE_MB environment variables, which the other programs (ex: legFit) use too. See PEResultCache in PEResultCache.h.
+
+--cacheSize <MB>
+	If provided, the size limit of the --cacheDir on disk. When the cache grows past the limit, the least-recently-used results are deleted. Default if not provided is 1024 MB.
+
 --measureTiming
 	If this flag is included, the solver will report the time required for each category of operations to standard output.
 
+--profile <json|csv>
+	If provided, a profile of the calculation is written next to the output file, as <outputFile>.profile.json or <outputFile>.profile.csv. For every step, it contains the time spent in each phase of the calculation (refractive index lookup, layers, integration, matrix operations, efficiencies), the number of ODE function and Jacobian evaluations and integration steps, the number of layers (integrated or propagated), and how evenly the trial solutions were shared between the threads. It also contains the totals for each process and for the whole run. Steps found in the result cache (see --cacheDir) are counted as cache hits.
+
 --integrationTolerance <tolerance>
 	If provided, specifies the error tolerance (eps) required at each step of the numerical integration process. Default if not provided is 1e-5.
 
+--integrationAbsTolerance <tolerance>
+	If provided, specifies a separate absolute error tolerance for the numerical integration; --integrationTolerance is then only the relative tolerance. Default if not provided is to use --integrationTolerance for both.
+
+--odeStepper <msadams|rk8pd|rkck|bsimp|rk4fixed>
+	Chooses the method for the numerical integration: the multistep Adams method (msadams), the explicit Runge-Kutta Prince-Dormand (8,9) (rk8pd) or Cash-Karp (4,5) (rkck) methods, the implicit Bulirsch-Stoer method (bsimp), which uses the Jacobian of the differential equation, or the classic 4th-order Runge-Kutta method with a fixed number of steps in each layer and no error control (rk4fixed; see --fixedSteps). The fastest method that is accurate enough depends on the grating; see --benchmarkSteppers. Default if not provided is msadams.
+
+--fixedSteps <steps>
+	For --odeStepper rk4fixed: the number of integration steps in each layer. Default if not provided is 200.
+
+--expansionTablePoints <points>
+	If provided (and > 0), the Fourier expansion of the grating is tabulated at this many evenly-spaced heights in each layer (minimum 4), and interpolated during the numerical integration instead of being re-computed at every step. This is faster, at the cost of a small interpolation error; layers where the interpolation error would be larger than --integrationTolerance are still computed exactly. Use --printDebugOutput to see the interpolation error in each layer. Default if not provided is 0 (exact expansion at every step).
+
+--adaptiveLayers
+	If provided, the layers used to solve the grating are placed adaptively: layer boundaries fall on the features of the profile (coating interface, apex, custom-profile vertices), and the layer thickness is chosen from the growth of the evanescent orders and the --integrationTolerance, instead of using uniform layers. This usually means fewer layers for shallow or coated gratings. Use --printDebugOutput to see the layers. Default if not provided is uniform layers.
+
+--warmStart
+	If provided, each calculation starts the numerical integration with the step sizes found in the previous calculation, instead of searching for them from scratch. This speeds up scans where neighbouring points are similar, especially with many thin layers. Results can differ from those without --warmStart within the --integrationTolerance, and can depend on the order in which the points are calculated. Default if not provided is to start every calculation from scratch.
+
+--matrixIntegration
+	If provided, all the trial solutions in each layer are integrated together as one matrix differential equation, instead of one at a time. The grating expansion is then computed once per integration step for all of them, and the right-hand side is a single complex matrix-matrix product (BLAS zgemm), which is much faster when linking an optimized BLAS library. All the trial solutions share the same integration steps, so the results differ from those without --matrixIntegration within the --integrationTolerance. Not used with --odeStepper bsimp. Default if not provided is to integrate each trial solution separately.
+
+--adaptiveN <tolerance>
+	If provided, --N is the largest truncation index to use, and each step is calculated with a smaller N first: about N/4, and then increasing by about 1.5 times, until the estimated truncation error is below <tolerance> (in efficiency, ex: 1e-4), or N is reached. The error estimate is the largest change in any order's efficiency from the last, smaller N, or the efficiency still found in the outermost two orders on each side, or the excess of the reflected and transmitted efficiencies over 1, whichever is largest. Each result line then ends with the N used and the error estimate (N=<n> and error=<estimate>, tab-separated), and the efficiencies of the orders beyond the N used are 0. Points that converge at a small N cost much less; points that need the full N cost about 1.5 times as much. Default if not provided is to always use --N.
+
+--polarization <te|both>
+	If provided as both, the Transverse Magnetic (TM) efficiencies (magnetic field parallel to the grooves) are calculated too, in the same pass as the TE ones: the TM fields are integrated together with the TE ones, so they share the refractive indices, the layers, the integration steps, and one grating expansion per step. Since the step-size control covers both, the TE efficiencies can differ from those without it within the --integrationTolerance. This costs roughly 1.3 to 1.8 times the TE-only time for integrated gratings, and more for rectangular ones, whose TM layer propagator needs more matrix products than the TE one (see the polarization benchmark of pegBenchmark). Each result line then has the 2N+1 TM efficiencies, from -N to N, after the TE ones (and before the N= and error= of --adaptiveN), and the binary records have them at the end. The --adaptiveN error estimate covers both polarizations (so it can choose a larger N than for TE alone). Default if not provided is te (TE only).
+
+--flushInterval <seconds>
+	If provided, the output file is flushed to disk (and the progress in the output file and --progressFile is updated) at most this often. Use 0 to flush after every result. Default if not provided is 1 second.
+
+--outputFormat <text|binary>
+	If provided, selects the format of the output file. The text format is described below. The binary format has a fixed 48-byte header (with the number of steps, the record length, and the progress), followed by the text of the # Input section, and then one record of 2N+7 doubles for each step: status code, wavelength (um), incidence angle (deg), N, the efficiencies from -N to N, the N actually used (see --adaptiveN), and the estimated truncation error, followed by the 2N+1 TM efficiencies with --polarization both. It is much faster to write and read for large scans, and can be memory-mapped. See PEOutputFileWriter in PEMainSupport.h for the exact layout. Default if not provided is text.
+
+--schedule <dynamic|cyclic>
+	[pegMPI only] How the calculation steps are distributed over the MPI processes. In the dynamic schedule, Process 0 hands out --chunkSize steps at a time to the other processes as soon as they are ready for more, so that slow steps (for example, near absorption edges) don't hold up everyone else; Process 0 only coordinates and writes the output. In the cyclic schedule, all processes calculate one step per round, in lock-step. In both, Process 0 receives the results straight into one array holding the whole scan, in order, so it needs memory for all of them: 8*(2N+7) bytes per step, or 8*(4N+8) with --polarization both. Default if not provided is dynamic (cyclic when running on only one process).
+
+--chunkSize <steps|auto>
+	[pegMPI only] In the dynamic schedule, the number of steps handed out at a time. Larger chunks mean fewer messages, and let --threads > 1 be shared across several steps; smaller chunks balance the load better. With auto, each process uses 1 for large N (where there are enough trial solutions in one step to keep all of its threads busy), and several steps at once, with fewer threads each, for small N. Default if not provided is auto.
+
 <b>Output</b>
 
 An example of the output file written to --outputFile is shown below. If the file exists already, it will be overwritten.
@@ -103,7 +190,7 @@ N=5
 integrationTolerance=1e-5
 # Progress
 status=succeeded     (inProgress, someFailed, allFailed, succeeded)
-completedSteps=41
+completedSteps=041
 totalSteps=41
 # Output
 100[tab]<e-5>,<e-4>,<e-3>,<e-2>,<e-1>,<e0>,<e1>,<e2>,<e3>,<e4>,<e5>
@@ -112,6 +199,8 @@ totalSteps=41
 ...
 =========================
 
+Each result is appended to the # Output section once, as soon as it is calculated. The # Progress section is updated in place every --flushInterval seconds: to keep its length the same, completedSteps is padded with leading zeros.
+
 If a --progressFile is specified, it is written and re-written during the calculation, containing the # Progress section from the main output file:
 
 =========================
@@ -147,7 +236,7 @@ N=15
 integrationTolerance=1e-5
 # Progress
 status=succeeded
-completedSteps=5
+completedSteps=05
 totalSteps=5
 # Output
 100	1.33437e-08,2.01772e-09,3.14758e-08,1.26258e-07,3.16875e-07,6.42301e-07,1.15956e-06,1.96424e-06,3.60516e-06,4.37926e-06,6.85693e-06,1.07995e-05,1.80188e-05,3.47459e-05,0.000100891,1.0115,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0
@@ -180,6 +269,14 @@ int main(int argc, char** argv) {
 		return -1;
 	}
 
+	// Decide how many threads to use on each process, and how many steps to calculate at once with them. This needs to happen before any OpenMP threads are started.
+	int ranksOnNode, numNodes;
+	io.threads = configureThreads(io, rank, ranksOnNode, numNodes);
+	// PESolver::getEffBatch() runs the trial solutions in parallel regions nested inside the one over points. Enable that once, for the whole program.
+	omp_set_max_active_levels(2);
+	if(io.chunkSize == 0)
+		io.chunkSize = io.autoChunkSize(io.threads);
+
 	if(rank == 0) {
 		if(io.showLegal) {
 			std::cout << "Copyright 2012 Mark Boots (mark.boots@usask.ca).\n\n"
@@ -204,165 +301,459 @@ int main(int argc, char** argv) {
 		}
 	}
 	
-	// On Process 0: Open the output file:
-	std::ofstream outputFile;
-	std::streampos outputFilePosition;
-	if(rank == 0) {
-		outputFile.open(io.outputFile.c_str(), std::ios::out | std::ios::trunc);
-		
-		// if(!outputFile.is_open()) {
-		// 	std::cerr << "Could not open output file " << io.outputFile;
-		// 	return -1;
-		// }
-
-		// Check that we can open the progress file, if provided:
-		// if(!io.progressFile.empty()) {
-		// 	std::ofstream progressFile(io.progressFile.c_str(), std::ios::out | std::ios::trunc);
-		// 	if(!progressFile.is_open()) {
-		// 		std::cerr << "Could not open progress file " << io.progressFile;
-		// 		return -1;
-		// 	}
-		// }
-		
-		// Write the file header:
-		writeOutputFileHeader(outputFile, io);
-		// Remember this position in the output file; it is where we will write the progress and output lines
-		outputFilePosition = outputFile.tellp();
+	// On Process 0: Open the output file (and progress file, if provided), and write the header and initial progress:
+	PEOutputFileWriter outputWriter(io);
+	if(rank == 0 && !outputWriter.open()) {
+		std::cerr << "Could not open output file " << io.outputFile << (io.progressFile.empty() ? "" : " or progress file " + io.progressFile) << std::endl;
+		MPI_Abort(MPI_COMM_WORLD, -1);
 	}
 	
 	// How many steps do we have?
-	int totalSteps = int((io.max - io.min)/io.increment) + 1;
-	
-	// On Process 0: Write the initial progress:
-	if(rank == 0) {
-		writeOutputFileProgress(outputFile, 0, totalSteps, false, false);
-		if(!io.progressFile.empty()) {
-			std::ofstream progressFile(io.progressFile.c_str(), std::ios::out | std::ios::trunc);
-			writeOutputFileProgress(progressFile, 0, totalSteps, false, false);
-		}
-	}
+	int totalSteps = io.totalSteps();
 	
 	// create the grating object.
-	PEGrating* grating;
-	switch(io.profile) {
-	case PEGrating::RectangularProfile:
-		grating = new PERectangularGrating(io.period, io.geometry[0], io.geometry[1], io.material, io.coating, io.coatingThickness);
-		break;
-	case PEGrating::BlazedProfile:
-		grating = new PEBlazedGrating(io.period, io.geometry[0], io.geometry[1], io.material, io.coating, io.coatingThickness);
-		break;
-	case PEGrating::SinusoidalProfile:
-		grating = new PESinusoidalGrating(io.period, io.geometry[0], io.material, io.coating, io.coatingThickness);
-		break;
-	case PEGrating::TrapezoidalProfile:
-		grating = new PETrapezoidalGrating(io.period, io.geometry[0], io.geometry[1], io.geometry[2], io.geometry[3], io.material, io.coating, io.coatingThickness);
-		break;
-	case PEGrating::CustomProfile:
-		grating = new PECustomProfileGrating(io.period, io.geometry, io.material);
-		break;
-	default:
-		grating = 0;	// this will never happen; input validation assures one of the valid grating types.
-		break;
-	}
+	PEGrating* grating = createGrating(io);
 	
+	// Parse the refractive index database files once, up front, so that the calculation loop never has to touch the file system.
+	std::vector<std::string> materials;
+	materials.push_back(io.material);
+	if(io.coatingThickness != 0)
+		materials.push_back(io.coating);
+	int numMaterialsFound = PEMaterialDatabase::preload(materials);
+	if(rank == 0 && numMaterialsFound != int(materials.size()))
+		std::cerr << "Warning: Could not find refractive index data for all materials in " << PEG_MATERIALS_DB_PATH << std::endl;
+
 	// set math options: truncation index from input.
-	PEMathOptions mathOptions(io.N, io.integrationTolerance);
-	
-	// On Process 0: output data will be stored here:
-	bool anyFailures = false;
-	bool anySuccesses = false;
-	std::vector<PEResult> results;
-	// On process 0: create a buffer for receiving results from other processes
-	int resultSize = 2*io.N+1 + 4;
-	double* mpiReceiveBuffer = 0;
-	if(rank == 0)
-		mpiReceiveBuffer = new double[resultSize * commSize];
-	// On all processes, create a send buffer for packing up the results
-	double* mpiSendBuffer = new double[resultSize];
+	PEMathOptions mathOptions = createMathOptions(io);
+
+	// With --cacheDir, results are looked up in (and added to) a result cache, so that steps calculated in earlier runs aren't done again.
+	if(!io.cacheDir.empty()) {
+		PEResultCache::setGlobal(io.cacheDir, (long long)(io.cacheSizeMB*1024*1024));
+		if(!PEResultCache::global()->createDirectory()) {
+			if(rank == 0)
+				std::cerr << "Warning: Could not create the result cache directory " << io.cacheDir << ". Results will not be cached." << std::endl;
+			PEResultCache::setGlobal("");
+		}
+	}
+
+	// On Process 0: report the layout of processes and threads.  All processes need to take part in the reductions.  In the dynamic schedule, only the processes that calculate are counted for the threads.
+	bool coordinatorOnly = (io.schedule == PECommandLineOptions::DynamicSchedule && commSize > 1);
+	int minThreads, maxThreads, maxRanksOnNode;
+	int countedThreads[2] = { io.threads, io.threads };
+	if(coordinatorOnly && rank == 0) {
+		countedThreads[0] = INT_MAX;
+		countedThreads[1] = 0;
+	}
+	MPI_Reduce(&countedThreads[0], &minThreads, 1, MPI_INT, MPI_MIN, 0, MPI_COMM_WORLD);
+	MPI_Reduce(&countedThreads[1], &maxThreads, 1, MPI_INT, MPI_MAX, 0, MPI_COMM_WORLD);
+	MPI_Reduce(&ranksOnNode, &maxRanksOnNode, 1, MPI_INT, MPI_MAX, 0, MPI_COMM_WORLD);
+	if(rank == 0) {
+		std::cout << "Running " << commSize << " processes on " << numNodes << " node(s) (up to " << maxRanksOnNode << " per node), with ";
+		if(minThreads == maxThreads)
+			std::cout << minThreads;
+		else
+			std::cout << minThreads << " to " << maxThreads;
+		std::cout << " thread(s) per process" << (coordinatorOnly ? " (Process 0 only coordinates)." : ".") << std::endl;
+	}
+
+	// create one solver context on each process, and re-use it (and all its allocated memory) for every point this process calculates.
+	PESolver solver(*grating, mathOptions, io.threads);
 	
-	// Loop over calculation steps.  Loop goes up by commSize each round, since we handle that many steps simultaneously.
-	for(int i=0; i<totalSteps; i+=commSize) {
-		
-		double currentValue = io.min + io.increment*(i+rank);	// creates a cyclic partition. i=0 to P0, i=1 to P1, i=2 to P2... 
-		
-		// determine wavelength (um): depends on mode and eV/um setting.
-		double wavelength = (io.mode == PECommandLineOptions::ConstantWavelength) ? io.wavelength : currentValue;
-		if(io.eV)
-			wavelength = M_HC / wavelength;	// interpret input wavelength as eV instead, and convert to actual wavelength.  Formula: wavelength = hc / eV.     hc = 1.23984172 eV * um.
-		
-		// determine incidence angle: depends on mode and possibly wavelength.
-		double incidenceAngle;
-		switch(io.mode) {
-		case PECommandLineOptions::ConstantIncidence:
-			incidenceAngle = io.incidenceAngle;
-			break;
-		case PECommandLineOptions::ConstantIncludedAngle: {
-			double ciaRad = io.includedAngle * M_PI / 180;
-			incidenceAngle = (asin(-io.toOrder*wavelength/2/io.period/cos(ciaRad/2)) + ciaRad/2) * 180 / M_PI;	// formula for constant included angle: satisfies alpha + beta = cia, and grating equation io.toOrder*wavelength/d = sin(beta) - sin(alpha).
-			break;
-			}
-		case PECommandLineOptions::ConstantWavelength:
-			incidenceAngle = currentValue;
-			break;
-		default:
-			incidenceAngle = 0; // never happens: input validation assures valid mode.
-			break;
+	// Each result is packed into a record of this many doubles (see PEResult::toDoubleArray()).
+	int resultSize = io.recordLength();
+
+	// On Process 0: all the results are collected in one arena, in scan order, so that they can be received directly into their place and written to the output from there.
+	PEResultArena arena(resultSize, rank == 0 ? totalSteps : 0);
+
+	// On Process 0: If resuming from a checkpoint file, the steps saved there go straight to the output, and only the others are calculated.
+	PECheckpointFile checkpoint(io);
+	if(rank == 0 && !io.checkpointFile.empty()) {
+		if(!checkpoint.open()) {
+			std::cerr << "Could not open checkpoint file " << io.checkpointFile << std::endl;
+			MPI_Abort(MPI_COMM_WORLD, -1);
+		}
+		if(checkpoint.numLoaded() > 0)
+			std::cout << "Resuming: " << checkpoint.numLoaded() << " of " << totalSteps << " steps were loaded from the checkpoint file." << std::endl;
+		for(std::map<int, std::vector<double> >::const_iterator it = checkpoint.loaded().begin(); it != checkpoint.loaded().end(); ++it) {
+			std::copy(it->second.begin(), it->second.end(), arena.record(it->first));
+			arena.completed(it->first, 1, outputWriter);
 		}
-		
-		// run the calculation, but only if (i+rank) is still in range.  The last processes will have nothing to do on the last round, if the number of steps does not divided evenly by the number of processes.
-		PEResult result = PEResult(PEResult::InactiveCalculation);
-		if(i+rank < totalSteps)
-			result = grating->getEff(incidenceAngle, wavelength, io.rmsRoughnessNm, mathOptions, (io.printDebugOutput && rank == 0), io.threads);	/// Debug output only shown on Process 0?
-		
-		// Pack up result into the send buffer
-		result.toDoubleArray(mpiSendBuffer);
-		
-		// MPI Gather all results for this round onto Process 0.
-		int err = MPI_Gather(mpiSendBuffer, resultSize, MPI_DOUBLE, mpiReceiveBuffer, resultSize, MPI_DOUBLE, 0, MPI_COMM_WORLD); /// \todo Err check
-
-		// On Process 0: collect results and output.
-		if(rank == 0) {
-			
-			for(int j=0; j<commSize; ++j) {
-				PEResult result;
-				result.fromDoubleArray(mpiReceiveBuffer + j*resultSize);
-				
-				if(result.status != PEResult::InactiveCalculation) {	// indicates non-calculation for inactive process on last round
-					results.push_back(result);
-					if(result.status == PEResult::Success)
-						anySuccesses = true;
-					else
-						anyFailures = true;
+	}
+
+	// With --profile, every process collects the profiles of the steps it calculates, for the profile file.
+	PEProfileLog profileLog;
+	bool profiling = (io.profileFormat != PECommandLineOptions::NoProfile);
+
+	if(io.schedule == PECommandLineOptions::DynamicSchedule && commSize > 1) {
+		// Process 0 hands out steps on demand, and the other processes calculate them.  Each process can have a different number of threads, and so a different chunk size.
+		std::vector<int> chunkSizes(commSize);
+		MPI_Gather(&io.chunkSize, 1, MPI_INT, &chunkSizes[0], 1, MPI_INT, 0, MPI_COMM_WORLD);
+		if(rank == 0)
+			coordinateDynamicSchedule(io, chunkSizes, arena, outputWriter, checkpoint);
+		else
+			workForDynamicSchedule(io, solver, io.chunkSize, resultSize, rank == 1, profiling ? &profileLog : 0, rank);
+	}
+
+	else {
+		// Results are gathered as whole records, straight into their place in the arena on Process 0.  (Process 0 packs its own result there too.)  The other processes pack theirs into a send buffer.
+		MPI_Datatype recordType;
+		MPI_Type_contiguous(resultSize, MPI_DOUBLE, &recordType);
+		MPI_Type_commit(&recordType);
+		double* mpiSendBuffer = new double[resultSize];
+		std::vector<int> recvCounts(commSize), displacements(commSize);
+
+		// Process 0 tells everyone which steps still need to be calculated.
+		std::vector<int> steps;
+		if(rank == 0)
+			for(int i=0; i<totalSteps; ++i)
+				if(!checkpoint.isLoaded(i))
+					steps.push_back(i);
+		int numSteps = steps.size();
+		MPI_Bcast(&numSteps, 1, MPI_INT, 0, MPI_COMM_WORLD);
+		steps.resize(numSteps);
+		if(numSteps > 0)
+			MPI_Bcast(&steps[0], numSteps, MPI_INT, 0, MPI_COMM_WORLD);
+
+		// Loop over calculation steps.  Loop goes up by commSize each round, since we handle that many steps simultaneously.
+		for(int i=0; i<numSteps; i+=commSize) {
+
+			// creates a cyclic partition. i=0 to P0, i=1 to P1, i=2 to P2...
+			PEScanPoint point = io.scanPoint(i+rank < numSteps ? steps[i+rank] : 0);
+
+			// run the calculation, but only if (i+rank) is still in range.  The last processes will have nothing to do on the last round, if the number of steps does not divided evenly by the number of processes.
+			PEResult result = PEResult(PEResult::InactiveCalculation);
+			if(i+rank < numSteps) {
+				result = solver.getEff(point.incidenceDeg, point.wavelength, io.rmsRoughnessNm, (io.printDebugOutput && rank == 0));	/// Debug output only shown on Process 0?
+				result.incidenceDeg = point.incidenceDeg;	// failures don't fill in the point they were calculated for.
+				result.wavelength = point.wavelength;
+				if(profiling)
+					profileLog.record(steps[i+rank], rank, solver.lastProfile());
+			}
+
+			// MPI Gather all results for this round onto Process 0, each into the arena record for its step: the displacements are counted in records from this round's first step. On the last round, the last processes may be inactive, so they send nothing.
+			int active = std::min(commSize, numSteps - i);
+			if(rank == 0) {
+				result.toDoubleArray(arena.record(steps[i]), io.N, io.withTM());
+				for(int j=0; j<commSize; ++j) {
+					recvCounts[j] = (j < active) ? 1 : 0;
+					displacements[j] = (j < active) ? steps[i+j] - steps[i] : 0;
 				}
+				MPI_Gatherv(MPI_IN_PLACE, 0, recordType, arena.record(steps[i]), &recvCounts[0], &displacements[0], recordType, 0, MPI_COMM_WORLD); /// \todo Err check
 			}
-		
-			// Print progress and results to output file.
-			outputFile.seekp(outputFilePosition);
-			writeOutputFileProgress(outputFile, std::min(i+commSize, totalSteps), totalSteps, anySuccesses, anyFailures);
-			outputFile << "# Output" << std::endl;
-			for(int j=0, cc=results.size(); j<cc; ++j)	// kinda lame and expensive that we need to do this on each step. Maybe switch to append-only mode, and leave the progress in just progressFile?
-				writeOutputFileResult(outputFile, results.at(j), io);
-			
-			// Update progress in progressFile, if provided.
-			if(!io.progressFile.empty()) {
-				std::ofstream progressFile(io.progressFile.c_str(), std::ios::out | std::ios::trunc);
-				writeOutputFileProgress(progressFile, std::min(i+commSize, totalSteps), totalSteps, anySuccesses, anyFailures);
+			else {
+				result.toDoubleArray(mpiSendBuffer, io.N, io.withTM());
+				MPI_Gatherv(mpiSendBuffer, rank < active ? 1 : 0, recordType, 0, 0, 0, recordType, 0, MPI_COMM_WORLD); /// \todo Err check
 			}
-		}
 
-	} // end of calculation loop.
+			// On Process 0: save the results in the checkpoint file, and write the ones that are next to the output, straight from the arena.
+			if(rank == 0) {
+				for(int j=0; j<active; ++j) {
+					checkpoint.save(steps[i+j], arena.record(steps[i+j]), 1);
+					arena.completed(steps[i+j], 1, outputWriter);
+				}
+				outputWriter.flushIfDue();
+			}
+
+		} // end of calculation loop.
+
+		delete [] mpiSendBuffer;
+		MPI_Type_free(&recordType);
+	}
 	
-	// Timing: We know we're synchronized here because the last MPI_Gather has ensured that we have everyone's results.
+	// Timing: We know we're synchronized here because Process 0 has received everyone's results.
 	double runTime = MPI_Wtime() - startTime;
 	if(rank == 0)
 		std::cout << "Run time (s): " << runTime << std::endl;
 
-	outputFile.close();
+	// Result cache: add up the lookups from all processes. (All processes take part in the reduction, even if some of them couldn't use the cache.)
+	PEResultCache* cache = PEResultCache::global();
+	long long lookups[2] = { cache ? cache->hits() : 0, cache ? cache->misses() : 0 };
+	long long totalLookups[2];
+	MPI_Reduce(lookups, totalLookups, 2, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+	if(rank == 0 && cache)
+		std::cout << "Result cache: " << totalLookups[0] << " of " << totalLookups[0] + totalLookups[1] << " steps were found in " << cache->directory() << std::endl;
+
+	// Profile: collect everyone's step profiles on Process 0, and write them out.
+	if(profiling) {
+		gatherProfiles(profileLog, rank, commSize);
+		if(rank == 0 && !profileLog.write(io.profileFile(), io.profileFormat == PECommandLineOptions::CSVProfile ? PEProfileLog::CSVFormat : PEProfileLog::JSONFormat, commSize, runTime))
+			std::cerr << "Warning: Could not write the profile file " << io.profileFile() << std::endl;
+	}
+
+	if(rank == 0) {
+		outputWriter.close();
+		if(checkpoint.isOpen())
+			checkpoint.flush();
+	}
 	delete grating;
-	delete [] mpiReceiveBuffer;
-	delete [] mpiSendBuffer;
 	
 	// Finalize MPI
 	MPI_Finalize();
 	return 0;
 }
+
+
+// Finds the next chunk of up to \c maxSteps steps to hand out, starting at \c nextStep: a run of consecutive steps that weren't loaded from \c checkpoint.  Fills \c work with the first step and the number of steps (0 if there are none left), and moves \c nextStep past them.
+static void findNextChunk(const PECheckpointFile& checkpoint, int totalSteps, int maxSteps, int& nextStep, int work[2])
+{
+	while(nextStep < totalSteps && checkpoint.isLoaded(nextStep))
+		++nextStep;
+	work[0] = nextStep;
+	work[1] = 0;
+	while(nextStep < totalSteps && work[1] < maxSteps && !checkpoint.isLoaded(nextStep)) {
+		++nextStep;
+		++work[1];
+	}
+}
+
+// Work messages are two ints: {first step, number of steps}. A message with 0 steps tells the worker to stop.  Each chunk of results comes back as two messages: first its layout (ints: the first step, the number of steps, and the resultLayout() of each step), and then the results themselves, sent with the createResultType() for that layout.  Process 0 receives the layout first, so it knows where the results go (and which parts of them are sent), and receives them straight into their place in the arena.
+// Each worker is kept two chunks ahead: one that it is calculating, and one waiting in its queue, so that it never has to wait for Process 0 between chunks.  Since MPI messages between two processes arrive in order, the stop message is only seen once its last queued chunk is done, and the results of a chunk always arrive right after its layout.
+void coordinateDynamicSchedule(const PECommandLineOptions& io, const std::vector<int>& chunkSizes, PEResultArena& arena, PEOutputFileWriter& outputWriter, PECheckpointFile& checkpoint)
+{
+	int commSize = chunkSizes.size();
+	int totalSteps = io.totalSteps();
+	int nextStep = 0;
+	std::vector<bool> stopped(commSize, false);
+	int completedSteps = checkpoint.numLoaded();
+	bool withTM = io.withTM();
+
+	std::vector<int> layout(resultLayoutSize(*std::max_element(chunkSizes.begin() + 1, chunkSizes.end())));
+
+	// hand out the first two chunks to every worker.
+	for(int round=0; round<2; ++round)
+		for(int worker=1; worker<commSize; ++worker)
+			if(!stopped.at(worker)) {
+				int work[2];
+				findNextChunk(checkpoint, totalSteps, chunkSizes.at(worker), nextStep, work);
+				stopped.at(worker) = (work[1] == 0);
+				MPI_Send(work, 2, MPI_INT, worker, PEWorkTag, MPI_COMM_WORLD);
+			}
+
+	while(completedSteps < totalSteps) {
+		MPI_Status status;
+		MPI_Recv(&layout[0], layout.size(), MPI_INT, MPI_ANY_SOURCE, PEResultLayoutTag, MPI_COMM_WORLD, &status);
+		int worker = status.MPI_SOURCE;
+
+		// right away, give this worker another chunk (or tell it to stop), so it stays two chunks ahead.
+		if(!stopped.at(worker)) {
+			int work[2];
+			findNextChunk(checkpoint, totalSteps, chunkSizes.at(worker), nextStep, work);
+			stopped.at(worker) = (work[1] == 0);
+			MPI_Send(work, 2, MPI_INT, worker, PEWorkTag, MPI_COMM_WORLD);
+		}
+
+		// receive the results into their records in the arena.
+		int firstStep = layout[0];
+		int numSteps = layout[1];
+		MPI_Datatype resultType = createResultType(&layout[2], numSteps, io.N, arena.recordLength(), withTM);
+		MPI_Recv(arena.record(firstStep), 1, resultType, worker, PEResultTag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+		MPI_Type_free(&resultType);
+		completedSteps += numSteps;
+
+		// save the results, and add them to the output. The output file always stays in order: if this chunk is next, it is written right away (along with any chunks after it that arrived earlier); otherwise it waits in the arena for the ones before it.
+		checkpoint.save(firstStep, arena.record(firstStep), numSteps);
+		arena.completed(firstStep, numSteps, outputWriter);
+		outputWriter.flushIfDue();
+	}
+}
+
+// Results are sent back with non-blocking sends, so the worker can start on its next chunk right away. Two sets of send buffers (for the layout and the results) are alternated; before re-using one, we wait for its previous sends to complete.
+void workForDynamicSchedule(const PECommandLineOptions& io, PESolver& solver, int chunkSize, int resultSize, bool showDebugOutput, PEProfileLog* profileLog, int rank)
+{
+	int bufferSize = chunkSize*resultSize;
+	double* sendBuffers[2] = { new double[bufferSize], new double[bufferSize] };
+	std::vector<int> layouts[2] = { std::vector<int>(resultLayoutSize(chunkSize)), std::vector<int>(resultLayoutSize(chunkSize)) };
+	MPI_Request sendRequests[2][2] = { { MPI_REQUEST_NULL, MPI_REQUEST_NULL }, { MPI_REQUEST_NULL, MPI_REQUEST_NULL } };
+	int b = 0;
+	bool withTM = io.withTM();
+	// With more than one thread, calculate chunks as a batch so the threads can be shared across steps. With --printDebugOutput, calculate one step at a time to keep the output readable.
+	bool useBatch = (io.threads > 1 && !io.printDebugOutput);
+
+	while(true) {
+		int work[2];
+		MPI_Recv(work, 2, MPI_INT, 0, PEWorkTag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+		if(work[1] == 0)
+			break;
+
+		std::vector<PEScanPoint> points;
+		for(int i=work[0]; i<work[0]+work[1]; ++i)
+			points.push_back(io.scanPoint(i));
+
+		std::vector<PEResult> chunkResults;
+		std::vector<PESolverProfile> chunkProfiles;
+		if(useBatch && points.size() > 1)
+			chunkResults = solver.getEffBatch(points, io.rmsRoughnessNm, &chunkProfiles);
+		else {
+			for(int k=0, cc=points.size(); k<cc; ++k) {
+				PEResult result = solver.getEff(points[k].incidenceDeg, points[k].wavelength, io.rmsRoughnessNm, (io.printDebugOutput && showDebugOutput));
+				result.incidenceDeg = points[k].incidenceDeg;	// failures don't fill in the point they were calculated for.
+				result.wavelength = points[k].wavelength;
+				chunkResults.push_back(result);
+				chunkProfiles.push_back(solver.lastProfile());
+			}
+		}
+		if(profileLog)
+			for(int k=0; k<work[1]; ++k)
+				profileLog->record(work[0]+k, rank, chunkProfiles.at(k));
+
+		// make sure the buffers we're about to fill aren't still being sent, and then pack up the results and their layout.
+		MPI_Waitall(2, sendRequests[b], MPI_STATUSES_IGNORE);
+		double* buffer = sendBuffers[b];
+		std::vector<int>& layout = layouts[b];
+		layout[0] = work[0];
+		layout[1] = work[1];
+		for(int k=0; k<work[1]; ++k) {
+			chunkResults.at(k).toDoubleArray(buffer + k*resultSize, io.N, withTM);
+			layout[2 + k] = resultLayout(buffer + k*resultSize, io.N);
+		}
+		MPI_Isend(&layout[0], resultLayoutSize(work[1]), MPI_INT, 0, PEResultLayoutTag, MPI_COMM_WORLD, &sendRequests[b][0]);
+		// (The type can be freed right away; MPI keeps it until the send is done.)
+		MPI_Datatype resultType = createResultType(&layout[2], work[1], io.N, resultSize, withTM);
+		MPI_Isend(buffer, 1, resultType, 0, PEResultTag, MPI_COMM_WORLD, &sendRequests[b][1]);
+		MPI_Type_free(&resultType);
+		b = 1 - b;
+	}
+
+	MPI_Waitall(2, sendRequests[0], MPI_STATUSES_IGNORE);
+	MPI_Waitall(2, sendRequests[1], MPI_STATUSES_IGNORE);
+	delete [] sendBuffers[0];
+	delete [] sendBuffers[1];
+}
+
+int resultLayout(const double* record, int N)
+{
+	if(PEResult::Code(int(record[0])) != PEResult::Success)
+		return 0;
+	int usedN = int(record[4 + 2*N+1]);
+	return (usedN > 0 && usedN < N) ? usedN : N;
+}
+
+// Adds the block of \c length doubles at \c displacement to an indexed type's \c lengths and \c displacements, merging it with the last block if they are contiguous.
+static void addBlock(std::vector<int>& lengths, std::vector<int>& displacements, int displacement, int length)
+{
+	if(!lengths.empty() && displacements.back() + lengths.back() == displacement)
+		lengths.back() += length;
+	else {
+		lengths.push_back(length);
+		displacements.push_back(displacement);
+	}
+}
+
+MPI_Datatype createResultType(const int* layout, int numSteps, int N, int resultSize, bool withTM)
+{
+	// Each record (see PEResult::toDoubleArray()) is sent as: status, wavelength, incidenceDeg, N; the efficiencies of the orders from -n to n (in the middle of the 2N+1); usedN and truncationError; and the TM efficiencies from -n to n.  Without --adaptiveN, n = N, and the whole record is one block.
+	std::vector<int> lengths, displacements;
+	for(int k=0; k<numSteps; ++k) {
+		int start = k*resultSize;
+		int n = layout[k];
+		addBlock(lengths, displacements, start, 4);
+		addBlock(lengths, displacements, start + 4 + (N-n), 2*n+1);
+		addBlock(lengths, displacements, start + 4 + 2*N+1, 2);
+		if(withTM)
+			addBlock(lengths, displacements, start + 6 + 2*N+1 + (N-n), 2*n+1);
+	}
+
+	MPI_Datatype type;
+	MPI_Type_indexed(lengths.size(), &lengths[0], &displacements[0], MPI_DOUBLE, &type);
+	MPI_Type_commit(&type);
+	return type;
+}
+
+int configureThreads(const PECommandLineOptions& io, int rank, int& ranksOnNode, int& numNodes)
+{
+	// Find the processes that share this node (MPI 3).
+	MPI_Comm nodeComm;
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &nodeComm);
+	int nodeRank;
+	MPI_Comm_rank(nodeComm, &nodeRank);
+	MPI_Comm_size(nodeComm, &ranksOnNode);
+	int firstOnNode = (nodeRank == 0);
+	MPI_Allreduce(&firstOnNode, &numNodes, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+	int threads = io.threads;
+
+	// In the dynamic schedule, Process 0 only hands out work and collects results: it spends nearly all its time waiting for messages, so it doesn't get a share of the CPUs.  The CPUs on its node are divided between the other processes (the workers) there. Process 0 is always the first process on its node, since the node communicator is ordered by rank.
+	int commSize;
+	MPI_Comm_size(MPI_COMM_WORLD, &commSize);
+	int isCoordinator = (io.schedule == PECommandLineOptions::DynamicSchedule && commSize > 1 && rank == 0);
+	int coordinatorOnNode;
+	MPI_Allreduce(&isCoordinator, &coordinatorOnNode, 1, MPI_INT, MPI_MAX, nodeComm);
+	int workersOnNode = ranksOnNode - coordinatorOnNode, workerRank = nodeRank - coordinatorOnNode;
+
+	if(threads == 0) {
+#ifdef __linux__
+		cpu_set_t available;
+		CPU_ZERO(&available);
+		sched_getaffinity(0, sizeof(available), &available);
+
+		// Did the launcher bind the processes on this node to different CPUs?  If all their CPU sets are the same, the bitwise AND and OR over all of them are the same too.
+		cpu_set_t common, all;
+		MPI_Allreduce(&available, &common, sizeof(cpu_set_t), MPI_BYTE, MPI_BAND, nodeComm);
+		MPI_Allreduce(&available, &all, sizeof(cpu_set_t), MPI_BYTE, MPI_BOR, nodeComm);
+
+		if(isCoordinator) {
+			// one thread, not bound: it can wait for messages on any of the node's CPUs.
+			threads = 1;
+		}
+		else if(!CPU_EQUAL(&common, &all)) {
+			threads = CPU_COUNT(&available);
+		}
+		else {
+			// Divide the shared CPUs evenly between the workers: worker i on this node gets CPUs [first, first+threads) from the list of available CPUs.  The first (numCpus % workersOnNode) workers get one extra.
+			std::vector<int> cpus;
+			for(int cpu=0; cpu<CPU_SETSIZE; ++cpu)
+				if(CPU_ISSET(cpu, &available))
+					cpus.push_back(cpu);
+			int numCpus = cpus.size();
+
+			if(workersOnNode >= numCpus) {
+				// more processes than CPUs: one thread each, spread around the CPUs.
+				threads = 1;
+				CPU_ZERO(&available);
+				CPU_SET(cpus.at(workerRank % numCpus), &available);
+			}
+			else {
+				int base = numCpus / workersOnNode, extra = numCpus % workersOnNode;
+				threads = base + (workerRank < extra ? 1 : 0);
+				int first = workerRank*base + std::min(workerRank, extra);
+				CPU_ZERO(&available);
+				for(int i=first; i<first+threads; ++i)
+					CPU_SET(cpus.at(i), &available);
+			}
+			// Bind this process (and so all the OpenMP threads it will start) to its share of the CPUs.
+			sched_setaffinity(0, sizeof(available), &available);
+		}
+#else
+		threads = isCoordinator ? 1 : std::max(1, omp_get_num_procs() / workersOnNode);
+#endif
+	}
+
+	MPI_Comm_free(&nodeComm);
+	return std::max(1, threads);
+}
+
+void gatherProfiles(PEProfileLog& profileLog, int rank, int commSize)
+{
+	std::vector<double> local;
+	profileLog.toDoubleArray(local);
+	int localSize = local.size();
+	std::vector<int> sizes(commSize), offsets(commSize);
+	MPI_Gather(&localSize, 1, MPI_INT, &sizes[0], 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+	std::vector<double> all;
+	if(rank == 0) {
+		int total = 0;
+		for(int r=0; r<commSize; ++r) {
+			offsets[r] = total;
+			total += sizes[r];
+		}
+		all.resize(std::max(total, 1));
+	}
+	MPI_Gatherv(localSize ? &local[0] : 0, localSize, MPI_DOUBLE, rank == 0 ? &all[0] : 0, &sizes[0], &offsets[0], MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+	// Process 0 keeps its own profiles, and adds everyone else's.
+	if(rank == 0)
+		for(int r=1; r<commSize; ++r)
+			if(sizes[r] > 0)
+				profileLog.recordFromDoubleArray(&all[offsets[r]], sizes[r]/PEProfileLog::pointArraySize());
+}
@@ -18,7 +18,19 @@ along with PEG.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "PEG.h"
+#include "PESolver.h"
 #include "PEMainSupport.h"
+#include "PEResultCache.h"
+#include "PEServer.h"
+
+#include <algorithm>
+#include <map>
+#include <iomanip>
+#include <math.h>
+#include <omp.h>
+
+static void benchmarkSteppers(const PECommandLineOptions& io, const PEGrating& grating, const PEMathOptions& mathOptions);
+static void setUpResultCache(const PECommandLineOptions& io);
 
 /// This main program provides a command-line interface to run a series of sequential grating efficiency calculations. The results are written to an output file, and (optionally) a second file is written to provide information on the status of the calculation.  [This file is only responsible for input processing and output; all numerical details are structured within PEGrating and PESolver.]
 /*! 
@@ -82,11 +94,65 @@ Output:
 --printDebugOutput
 	If this flag is included, each calculation will print intermediate results to standard output.
 
+--threads <number|auto>
+	If provided, the number of threads to use. With more than one thread, the trial solutions within each step are calculated in parallel, and several steps are calculated at once. With auto, all the processors on the computer are used. Default if not provided is 1.
+
+--checkpointFile <file name>
+	If provided, each completed step is saved in this file (at most every --flushInterval seconds). If the calculation is interrupted (for example, by a cluster job's walltime limit), run it again with the same options and the same --checkpointFile: the steps saved there are not calculated again. The file is only used if it was written for the same input options; otherwise it is started over.
+
+--cacheDir <directory>
+	If provided, each calculated step is stored in a result cache in this directory, and steps that are found in the cache are not calculated again (even in a different scan, as long as the grating, the math options, the roughness, and the incidence angle and wavelength are exactly the same). One cache directory can be shared by any number of runs at once, including on different cluster nodes. The cache can also be set up with the PEG_CACHE_DIR and PEG_CACHE_SIZE_MB environment variables, which the other programs (ex: legFit) use too. See PEResultCache in PEResultCache.h.
+
+--cacheSize <MB>
+	If provided, the size limit of the --cacheDir on disk. When the cache grows past the limit, the least-recently-used results are deleted. Default if not provided is 1024 MB.
+
 --measureTiming
 	If this flag is included, the solver will report the time required for each category of operations to standard output.
 
+--profile <json|csv>
+	If provided, a profile of the calculation is written next to the output file, as <outputFile>.profile.json or <outputFile>.profile.csv. For every step, it contains the time spent in each phase of the calculation (refractive index lookup, layers, integration, matrix operations, efficiencies), the number of ODE function and Jacobian evaluations and integration steps, the number of layers (integrated or propagated), and how evenly the trial solutions were shared between the threads. It also contains the totals for each process and for the whole run. Steps found in the result cache (see --cacheDir) are counted as cache hits.
+
 --integrationTolerance <tolerance>
 	If provided, specifies the error tolerance (eps) required at each step of the numerical integration process. Default if not provided is 1e-5.
+
+--integrationAbsTolerance <tolerance>
+	If provided, specifies a separate absolute error tolerance for the numerical integration; --integrationTolerance is then only the relative tolerance. Default if not provided is to use --integrationTolerance for both.
+
+--odeStepper <msadams|rk8pd|rkck|bsimp|rk4fixed>
+	Chooses the method for the numerical integration: the multistep Adams method (msadams), the explicit Runge-Kutta Prince-Dormand (8,9) (rk8pd) or Cash-Karp (4,5) (rkck) methods, the implicit Bulirsch-Stoer method (bsimp), which uses the Jacobian of the differential equation, or the classic 4th-order Runge-Kutta method with a fixed number of steps in each layer and no error control (rk4fixed; see --fixedSteps). The fastest method that is accurate enough depends on the grating; see --benchmarkSteppers. Default if not provided is msadams.
+
+--fixedSteps <steps>
+	For --odeStepper rk4fixed: the number of integration steps in each layer. Default if not provided is 200.
+
+--benchmarkSteppers
+	[pegSerial only] Before the calculation, calculates all the steps with each of the --odeStepper methods, and prints the number of right-hand side and Jacobian evaluations, the time taken, and the largest difference in efficiency compared to a reference calculation (rk8pd, with 1000 times smaller tolerances) for each one. The calculation then continues as usual with the selected --odeStepper.
+
+--expansionTablePoints <points>
+	If provided (and > 0), the Fourier expansion of the grating is tabulated at this many evenly-spaced heights in each layer (minimum 4), and interpolated during the numerical integration instead of being re-computed at every step. This is faster, at the cost of a small interpolation error; layers where the interpolation error would be larger than --integrationTolerance are still computed exactly. Use --printDebugOutput to see the interpolation error in each layer. Default if not provided is 0 (exact expansion at every step).
+
+--adaptiveLayers
+	If provided, the layers used to solve the grating are placed adaptively: layer boundaries fall on the features of the profile (coating interface, apex, custom-profile vertices), and the layer thickness is chosen from the growth of the evanescent orders and the --integrationTolerance, instead of using uniform layers. This usually means fewer layers for shallow or coated gratings. Use --printDebugOutput to see the layers. Default if not provided is uniform layers.
+
+--warmStart
+	If provided, each calculation starts the numerical integration with the step sizes found in the previous calculation, instead of searching for them from scratch. This speeds up scans where neighbouring points are similar, especially with many thin layers. Results can differ from those without --warmStart within the --integrationTolerance, and can depend on the order in which the points are calculated. Default if not provided is to start every calculation from scratch.
+
+--matrixIntegration
+	If provided, all the trial solutions in each layer are integrated together as one matrix differential equation, instead of one at a time. The grating expansion is then computed once per integration step for all of them, and the right-hand side is a single complex matrix-matrix product (BLAS zgemm), which is much faster when linking an optimized BLAS library. All the trial solutions share the same integration steps, so the results differ from those without --matrixIntegration within the --integrationTolerance. Not used with --odeStepper bsimp. Default if not provided is to integrate each trial solution separately.
+
+--adaptiveN <tolerance>
+	If provided, --N is the largest truncation index to use, and each step is calculated with a smaller N first: about N/4, and then increasing by about 1.5 times, until the estimated truncation error is below <tolerance> (in efficiency, ex: 1e-4), or N is reached. The error estimate is the largest change in any order's efficiency from the last, smaller N, or the efficiency still found in the outermost two orders on each side, or the excess of the reflected and transmitted efficiencies over 1, whichever is largest. Each result line then ends with the N used and the error estimate (N=<n> and error=<estimate>, tab-separated), and the efficiencies of the orders beyond the N used are 0. Points that converge at a small N cost much less; points that need the full N cost about 1.5 times as much. Default if not provided is to always use --N.
+
+--polarization <te|both>
+	If provided as both, the Transverse Magnetic (TM) efficiencies (magnetic field parallel to the grooves) are calculated too, in the same pass as the TE ones: the TM fields are integrated together with the TE ones, so they share the refractive indices, the layers, the integration steps, and one grating expansion per step. Since the step-size control covers both, the TE efficiencies can differ from those without it within the --integrationTolerance. This costs roughly 1.3 to 1.8 times the TE-only time for integrated gratings, and more for rectangular ones, whose TM layer propagator needs more matrix products than the TE one (see the polarization benchmark of pegBenchmark). Each result line then has the 2N+1 TM efficiencies, from -N to N, after the TE ones (and before the N= and error= of --adaptiveN), and the binary records have them at the end. The --adaptiveN error estimate covers both polarizations (so it can choose a larger N than for TE alone). Default if not provided is te (TE only).
+
+--serve
+	[pegSerial only] Instead of a single calculation, runs as a server that reads calculation requests from the standard input, one per line, and streams the results back over the standard output: each request line is a job id followed by the usual options for one calculation (--outputFile is then optional). The refractive index data and the solver contexts of finished requests are kept for later requests, which saves the start-up time for small scans. Up to --threads requests run at once, each one with its own --threads (default 1). Only --threads, --flushInterval, --cacheDir and --cacheSize are used from the --serve command line itself. See PEServer in PEServer.h for the protocol.
+
+--flushInterval <seconds>
+	If provided, the output file is flushed to disk (and the progress in the output file and --progressFile is updated) at most this often. Use 0 to flush after every result. Default if not provided is 1 second.
+
+--outputFormat <text|binary>
+	If provided, selects the format of the output file. The text format is described below. The binary format has a fixed 48-byte header (with the number of steps, the record length, and the progress), followed by the text of the # Input section, and then one record of 2N+7 doubles for each step: status code, wavelength (um), incidence angle (deg), N, the efficiencies from -N to N, the N actually used (see --adaptiveN), and the estimated truncation error, followed by the 2N+1 TM efficiencies with --polarization both. It is much faster to write and read for large scans, and can be memory-mapped. See PEOutputFileWriter in PEMainSupport.h for the exact layout. Default if not provided is text.
 	
 <b>Output</b>
 
@@ -108,7 +174,7 @@ N=5
 integrationTolerance=1e-5
 # Progress
 status=succeeded     (inProgress, someFailed, allFailed, succeeded)
-completedSteps=41
+completedSteps=041
 totalSteps=41
 # Output
 100[tab]<e-5>,<e-4>,<e-3>,<e-2>,<e-1>,<e0>,<e1>,<e2>,<e3>,<e4>,<e5>
@@ -117,6 +183,8 @@ totalSteps=41
 ...
 \endcode
 
+Each result is appended to the # Output section once, as soon as it is calculated. The # Progress section is updated in place every --flushInterval seconds: to keep its length the same, completedSteps is padded with leading zeros.
+
 If a --progressFile is specified, it is written and re-written during the calculation, containing the # Progress section from the main output file:
 
 
@@ -156,7 +224,7 @@ N=15
 integrationTolerance=1e-5
 # Progress
 status=succeeded
-completedSteps=5
+completedSteps=05
 totalSteps=5
 # Output
 100	1.33437e-08,2.01772e-09,3.14758e-08,1.26258e-07,3.16875e-07,6.42301e-07,1.15956e-06,1.96424e-06,3.60516e-06,4.37926e-06,6.85693e-06,1.07995e-05,1.80188e-05,3.47459e-05,0.000100891,1.0115,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0
@@ -168,6 +236,8 @@ totalSteps=5
 
 */
 int main(int argc, char** argv) {
+
+	double startTime = omp_get_wtime();
 	
 	PECommandLineOptions io;
 	if(!io.parseFromCommandLine(argc, argv)) {
@@ -175,8 +245,18 @@ int main(int argc, char** argv) {
 		return -1;
 	}
 
+	// --threads auto: use all the processors.
+	if(io.threads == 0)
+		io.threads = omp_get_num_procs();
+
+	// PESolver::getEffBatch() runs the trial solutions in parallel regions nested inside the one over points, and with --serve, those are inside the server's own parallel region over requests. Enable those levels once, for the whole program.
+	omp_set_max_active_levels(3);
+
+	// In --serve mode, the standard output is only for the results, so messages go to the standard error.
+	std::ostream& messages = io.serve ? std::cerr : std::cout;
+
 	if(io.showLegal) {
-		std::cout << "Copyright 2012 Mark Boots (mark.boots@usask.ca).\n\n"
+		messages << "Copyright 2012 Mark Boots (mark.boots@usask.ca).\n\n"
 
 					 "This program is part of the Parallel Efficiency of Gratings project (\"PEG\").\n\n"
 
@@ -194,131 +274,178 @@ int main(int argc, char** argv) {
 					 "along with PEG.  If not, see <http://www.gnu.org/licenses/>.\n\n";
 	}
 	else {
-		std::cout << "PEG  Copyright (C) 2012  Mark Boots (mark.boots@usask.ca)\nThis program comes with ABSOLUTELY NO WARRANTY.\nThis is free software, and you are welcome to redistribute it under certain\nconditions; run with --showLegal for details.\n\n";
+		messages << "PEG  Copyright (C) 2012  Mark Boots (mark.boots@usask.ca)\nThis program comes with ABSOLUTELY NO WARRANTY.\nThis is free software, and you are welcome to redistribute it under certain\nconditions; run with --showLegal for details.\n\n";
 	}
 	
-	// Open the output file:
-	std::ofstream outputFile(io.outputFile.c_str(), std::ios::out | std::ios::trunc);
-	if(!outputFile.is_open()) {
-		std::cerr << "Could not open output file " << io.outputFile;
-		return -1;
+	// With --serve, run requests until the end of the input instead.
+	if(io.serve) {
+		setUpResultCache(io);
+		PEServer server(io, std::cin, std::cout);
+		int numRequests = server.run();
+		PEResultCache* cache = PEResultCache::global();
+		messages << "Served " << numRequests << " requests." << std::endl;
+		if(cache)
+			messages << "Result cache: " << cache->hits() << " of " << cache->hits() + cache->misses() << " steps were found in " << cache->directory() << std::endl;
+		return 0;
 	}
-	
-	// Check that we can open the progress file, if provided:
-	if(!io.progressFile.empty()) {
-		std::ofstream progressFile(io.progressFile.c_str(), std::ios::out | std::ios::trunc);
-		if(!progressFile.is_open()) {
-			std::cerr << "Could not open progress file " << io.progressFile;
-			return -1;
-		}
+
+	// Open the output file (and progress file, if provided), and write the header and initial progress:
+	PEOutputFileWriter outputWriter(io);
+	if(!outputWriter.open()) {
+		std::cerr << "Could not open output file " << io.outputFile << (io.progressFile.empty() ? "" : " or progress file " + io.progressFile);
+		return -1;
 	}
 	
-	// Write the file header:
-	writeOutputFileHeader(outputFile, io);
-	// Remember this position in the output file; it is where we will write the progress and output lines
-	std::streampos outputFilePosition = outputFile.tellp();
-	
 	// How many steps do we have?
-	int totalSteps = int((io.max - io.min)/io.increment) + 1;
-	
-	// Write the initial progress:
-	writeOutputFileProgress(outputFile, 0, totalSteps, false, false);
-	if(!io.progressFile.empty()) {
-		std::ofstream progressFile(io.progressFile.c_str(), std::ios::out | std::ios::trunc);
-		writeOutputFileProgress(progressFile, 0, totalSteps, false, false);
-	}
+	int totalSteps = io.totalSteps();
 	
 	// create the grating object.
-	PEGrating* grating;
-	switch(io.profile) {
-	case PEGrating::RectangularProfile:
-		grating = new PERectangularGrating(io.period, io.geometry[0], io.geometry[1], io.material, io.coating, io.coatingThickness);
-		break;
-	case PEGrating::BlazedProfile:
-		grating = new PEBlazedGrating(io.period, io.geometry[0], io.geometry[1], io.material, io.coating, io.coatingThickness);
-		break;
-	case PEGrating::SinusoidalProfile:
-		grating = new PESinusoidalGrating(io.period, io.geometry[0], io.material, io.coating, io.coatingThickness);
-		break;
-	case PEGrating::TrapezoidalProfile:
-		grating = new PETrapezoidalGrating(io.period, io.geometry[0], io.geometry[1], io.geometry[2], io.geometry[3], io.material, io.coating, io.coatingThickness);
-		break;
-	case PEGrating::CustomProfile:
-		grating = new PECustomProfileGrating(io.period, io.geometry, io.material);
-		break;
-	default:
-		grating = 0;	// this will never happen; input validation assures one of the valid grating types.
-		break;
-	}
+	PEGrating* grating = createGrating(io);
 	
+	// Parse the refractive index database files once, up front, so that the calculation loop never has to touch the file system.
+	std::vector<std::string> materials;
+	materials.push_back(io.material);
+	if(io.coatingThickness != 0)
+		materials.push_back(io.coating);
+	if(PEMaterialDatabase::preload(materials) != int(materials.size()))
+		std::cerr << "Warning: Could not find refractive index data for all materials in " << PEG_MATERIALS_DB_PATH << std::endl;
+
 	// set math options: truncation index from input.
-	PEMathOptions mathOptions(io.N, io.integrationTolerance);
-	
-	// output data stored here:
-	bool anyFailures = false;
-	bool anySuccesses = false;
-	std::vector<PEResult> results;
+	PEMathOptions mathOptions = createMathOptions(io);
+
+	// With --benchmarkSteppers, compare the integration methods on this calculation first. (Before setting up the cache, so that every method really calculates every step.)
+	if(io.benchmarkSteppers)
+		benchmarkSteppers(io, *grating, mathOptions);
+
+	// With --cacheDir, results are looked up in (and added to) a result cache, so that steps calculated in earlier runs aren't done again.
+	setUpResultCache(io);
+
+	// create one solver context, and re-use it (and all its allocated memory) for every point in the scan.
+	PESolver solver(*grating, mathOptions, io.threads, io.measureTiming);
 	
-	// sequential loop over calculation steps
-	for(int i=0; i<totalSteps; ++i) {
-		
-		double currentValue = io.min + io.increment*i;
-		
-		// determine wavelength (um): depends on mode and eV/um setting.
-		double wavelength = (io.mode == PECommandLineOptions::ConstantWavelength) ? io.wavelength : currentValue;
-		if(io.eV)
-			wavelength = M_HC / wavelength;	// interpret input wavelength as eV instead, and convert to actual wavelength.  Formula: wavelength = hc / eV.     hc = 1.23984172 eV * um.
-		
-		// determine incidence angle: depends on mode and possibly wavelength.
-		double incidenceAngle;
-		switch(io.mode) {
-		case PECommandLineOptions::ConstantIncidence:
-			incidenceAngle = io.incidenceAngle;
-			break;
-		case PECommandLineOptions::ConstantIncludedAngle: {
-			double ciaRad = io.includedAngle * M_PI / 180;
-			incidenceAngle = (asin(-io.toOrder*wavelength/2/io.period/cos(ciaRad/2)) + ciaRad/2) * 180 / M_PI;	// formula for constant included angle: satisfies alpha + beta = cia, and grating equation io.toOrder*wavelength/d = sin(beta) - sin(alpha).
-			break;
-			}
-		case PECommandLineOptions::ConstantWavelength:
-			incidenceAngle = currentValue;
-			break;
-		default:
-			incidenceAngle = 0; // never happens: input validation assures valid mode.
-			break;
+	// If resuming from a checkpoint file, the steps saved there go straight to the output, and we only calculate the others.
+	PECheckpointFile checkpoint(io);
+	if(!io.checkpointFile.empty()) {
+		if(!checkpoint.open()) {
+			std::cerr << "Could not open checkpoint file " << io.checkpointFile;
+			return -1;
 		}
-		
+		if(checkpoint.numLoaded() > 0)
+			std::cout << "Resuming: " << checkpoint.numLoaded() << " of " << totalSteps << " steps were loaded from the checkpoint file." << std::endl;
+	}
+	std::vector<int> steps;
+	for(int i=0; i<totalSteps; ++i)
+		if(!checkpoint.isLoaded(i))
+			steps.push_back(i);
+	for(std::map<int, std::vector<double> >::const_iterator it = checkpoint.loaded().begin(); it != checkpoint.loaded().end(); ++it)
+		outputWriter.writeRecordsAt(it->first, &(it->second[0]), 1);
+
+	// With --profile, the profile of every step is collected for the profile file.
+	PEProfileLog profileLog;
+	std::vector<PESolverProfile> batchProfiles;
+	bool profiling = (io.profileFormat != PECommandLineOptions::NoProfile);
+
+	// Each result is packed into a record (see PEResult::toDoubleArray()) for the output and checkpoint files.
+	std::vector<double> record(io.recordLength());
+
+	// Loop over calculation steps. With more than one thread, the points are calculated in batches, so that the threads can be shared across several points at once instead of only the trial solutions within one point. With --printDebugOutput or --measureTiming, calculate one point at a time to keep the output readable.
+	int batchSize = (io.threads == 1 || io.printDebugOutput || io.measureTiming) ? 1 : 4*io.threads;
+	for(int i=0, numSteps=steps.size(); i<numSteps; i+=batchSize) {
+
+		std::vector<PEScanPoint> points;
+		for(int j=i; j<std::min(i+batchSize, numSteps); ++j)
+			points.push_back(io.scanPoint(steps[j]));
+
 		// run calculation
-		PEResult result = grating->getEff(incidenceAngle, wavelength, io.rmsRoughnessNm, mathOptions, io.printDebugOutput, io.threads, io.measureTiming);
-		if(result.status == PEResult::Success)
-			anySuccesses = true;
+		std::vector<PEResult> batchResults;
+		if(batchSize == 1) {
+			PEResult result = solver.getEff(points[0].incidenceDeg, points[0].wavelength, io.rmsRoughnessNm, io.printDebugOutput);
+			result.incidenceDeg = points[0].incidenceDeg;	// failures don't fill in the point they were calculated for.
+			result.wavelength = points[0].wavelength;
+			batchResults.push_back(result);
+			batchProfiles.assign(1, solver.lastProfile());
+		}
 		else
-			anyFailures = true;
-		results.push_back(result);
-		
-		// Print progress and results to output file.
-		outputFile.seekp(outputFilePosition);
-		writeOutputFileProgress(outputFile, i+1, totalSteps, anySuccesses, anyFailures);
-		outputFile << "# Output" << std::endl;
-		for(int j=0, cc=results.size(); j<cc; ++j)
-			writeOutputFileResult(outputFile, results.at(j), io);
-			
-		// Update progress in progressFile, if provided.
-		if(!io.progressFile.empty()) {
-			std::ofstream progressFile(io.progressFile.c_str(), std::ios::out | std::ios::trunc);
-			writeOutputFileProgress(progressFile, i+1, totalSteps, anySuccesses, anyFailures);
+			batchResults = solver.getEffBatch(points, io.rmsRoughnessNm, &batchProfiles);
+
+		// Append the new results to the output file, and save them in the checkpoint file. The progress is updated every --flushInterval seconds.
+		for(int j=0, cc=batchResults.size(); j<cc; ++j) {
+			batchResults.at(j).toDoubleArray(&record[0], io.N, io.withTM());
+			checkpoint.save(steps[i+j], &record[0], 1);
+			outputWriter.writeRecordsAt(steps[i+j], &record[0], 1);
+			if(profiling)
+				profileLog.record(steps[i+j], 0, batchProfiles.at(j));
 		}
+		outputWriter.flushIfDue();
 
 	} // end of calculation loop.
 
-	outputFile.close();
+	outputWriter.close();
+	if(checkpoint.isOpen())
+		checkpoint.flush();
+	PEResultCache* cache = PEResultCache::global();
+	if(cache)
+		std::cout << "Result cache: " << cache->hits() << " of " << cache->hits() + cache->misses() << " steps were found in " << cache->directory() << std::endl;
+	if(profiling && !profileLog.write(io.profileFile(), io.profileFormat == PECommandLineOptions::CSVProfile ? PEProfileLog::CSVFormat : PEProfileLog::JSONFormat, 1, omp_get_wtime() - startTime))
+		std::cerr << "Warning: Could not write the profile file " << io.profileFile() << std::endl;
 	delete grating;
 	return 0;
 }
 
+/// Sets up the global result cache in the --cacheDir, if one was provided.
+static void setUpResultCache(const PECommandLineOptions& io) {
+	if(!io.cacheDir.empty()) {
+		PEResultCache::setGlobal(io.cacheDir, (long long)(io.cacheSizeMB*1024*1024));
+		if(!PEResultCache::global()->createDirectory()) {
+			std::cerr << "Warning: Could not create the result cache directory " << io.cacheDir << ". Results will not be cached." << std::endl;
+			PEResultCache::setGlobal("");
+		}
+	}
+}
 
+/// Implements --benchmarkSteppers: calculates all the steps of the scan with each integration method, and prints the number of ODE right-hand side and Jacobian evaluations, the wall time, and the largest difference in efficiency from a reference calculation (rk8pd, with 1000 times smaller tolerances).
+static void benchmarkSteppers(const PECommandLineOptions& io, const PEGrating& grating, const PEMathOptions& mathOptions) {
+
+	std::vector<PEScanPoint> points;
+	for(int i=0, cc=io.totalSteps(); i<cc; ++i)
+		points.push_back(io.scanPoint(i));
+
+	PEMathOptions referenceOptions = mathOptions;
+	referenceOptions.stepper = PEMathOptions::RK8PDStepper;
+	referenceOptions.integrationTolerance *= 1e-3;
+	if(referenceOptions.integrationAbsTolerance > 0)
+		referenceOptions.integrationAbsTolerance *= 1e-3;
+	referenceOptions.warmStart = false;
+	referenceOptions.matrixIntegration = false;
+	referenceOptions.adaptiveNTolerance = 0;
+	PESolver referenceSolver(grating, referenceOptions, io.threads);
+	std::vector<PEResult> reference = referenceSolver.getEffBatch(points, io.rmsRoughnessNm);
+
+	std::cout << "Stepper benchmark over " << points.size() << " steps:" << std::endl;
+	std::cout << std::setw(10) << "stepper" << std::setw(14) << "rhsCalls" << std::setw(14) << "jacobianCalls" << std::setw(12) << "time (s)" << std::setw(16) << "maxEffError" << std::setw(10) << "failures" << std::endl;
+
+	for(int s=0; s<=PEMathOptions::FixedRK4Stepper; ++s) {
+		PEMathOptions mo = mathOptions;
+		mo.stepper = PEMathOptions::Stepper(s);
+		PESolver solver(grating, mo, io.threads);
+
+		double startTime = omp_get_wtime();
+		std::vector<PEResult> results = solver.getEffBatch(points, io.rmsRoughnessNm);
+		double time = omp_get_wtime() - startTime;
+
+		double maxError = 0;
+		int failures = 0;
+		for(int i=0, cc=results.size(); i<cc; ++i) {
+			if(results[i].status != PEResult::Success || reference[i].status != PEResult::Success) {
+				if(results[i].status != PEResult::Success)
+					++failures;
+				continue;
+			}
+			for(int j=0, cj=results[i].eff.size(); j<cj; ++j)
+				maxError = std::max(maxError, fabs(results[i].eff[j] - reference[i].eff[j]));
+		}
 
-
-
-
-
+		std::cout << std::setw(10) << PEMathOptions::stepperName(mo.stepper) << std::setw(14) << solver.odeFunctionCalls() << std::setw(14) << solver.odeJacobianCalls() << std::setw(12) << time << std::setw(16) << maxError << std::setw(10) << failures << std::endl;
+	}
+	std::cout << std::endl;
+}